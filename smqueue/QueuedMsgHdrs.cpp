@@ -25,6 +25,10 @@
 #include "QueuedMsgHdrs.h"
 
 
+// Used messages of the types sent often, for reuse.
+SMqueue::SmqFreeList<SIPAckMessage> SIPAckMessage::pool;
+SMqueue::SmqFreeList<ProcessIncommingMsg> ProcessIncommingMsg::pool;
+
 
 void * QueuedMsgHdrs::getpData()
 {
@@ -25,6 +25,8 @@
 #ifndef HEADERFORMSGS_H_
 #define HEADERFORMSGS_H_
 
+#include "SmqMpscQueue.h"
+
 
 class QueuedMsgHdrs {
 public:
@@ -62,6 +64,11 @@ public:
 		LOG(DEBUG) << "Process message QueuedMsgHdrs DID NOTHING";
 		return 0;
 	}
+	// Called by the receiver when it's done with the message.
+	// Pooled message types put themselves back in their pool.
+	virtual void release() {
+		delete this;
+	}
 
 private:
 	MessageType msgType;
@@ -73,6 +80,17 @@ private:
 
 class SIPAckMessage : public QueuedMsgHdrs {
 public:
+	static SMqueue::SmqFreeList<SIPAckMessage> pool;
+
+	SIPAckMessage() {
+		setMsgType(QueuedMsgHdrs::SIPAckMsg);
+		setSmp(0);
+		setpData(0);
+		this->errcode = 0;
+		this->netaddr = 0;
+		this->netaddrlen = 0;
+		setMessageSize(sizeof(SIPAckMessage));
+	}
 
 	SIPAckMessage(int err, SMqueue::short_msg_pending * smp, char * netaddr, size_t netaddrlen) {
 		setMsgType(QueuedMsgHdrs::SIPAckMsg);
@@ -127,6 +145,11 @@ public:
 		return 0;
 	}
 
+	virtual void release() {
+		setSmp(0);
+		pool.put(this);
+	}
+
 private:
 	int errcode;
 	char* netaddr;
@@ -161,7 +184,9 @@ private:
 
 class ProcessIncommingMsg : public QueuedMsgHdrs {
 public:
-	// Message will be sent to the writer thread so that msgs will be processed
+	static SMqueue::SmqFreeList<ProcessIncommingMsg> pool;
+
+	// Message will be sent to the writer thread, which wakes the queue shards
 	ProcessIncommingMsg() {
 		setMsgType(QueuedMsgHdrs::ProcessIncommingMsg);
 		setSmp(0);
@@ -177,10 +202,14 @@ public:
 	virtual int ProcessMessage() {
 		// Got a message in the queue go handle it
 		LOG(DEBUG) << "Process message ProcessIncommingMsg";
-		smq.process_timeout();
+		smq.wake_shards();
 		return 0;
 	}
 
+	virtual void release() {
+		pool.put(this);
+	}
+
 };
 
 
@@ -0,0 +1,251 @@
+/*
+* Copyright 2014 Range Networks, Inc.
+*
+* This software is distributed under multiple licenses;
+* see the COPYING file in the main directory for licensing
+* information for this specific distribuion.
+*
+* This use of this software may be subject to additional restrictions.
+* See the LEGAL file in the main directory for details.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+/*
+ * SmqArena.cpp
+ *
+ * Arenas for osip parse trees.  See SmqArena.h.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <osipparser2/osip_message.h>
+
+#include "SmqArena.h"
+
+namespace SMqueue {
+
+/* In front of every block the hooks hand out.  The magic is mixed with
+   the block's address, so that the bytes in front of a block malloc'd
+   before install() (or by someone else) can't pass for a header.  */
+struct block_header {
+	uint64_t magic;
+	uint64_t size;
+};
+
+static const uint64_t ARENA_MAGIC = 0x536d714172656e61ULL;	// "SmqArena"
+static const uint64_t HEAP_MAGIC = 0x536d714865617021ULL;	// "SmqHeap!"
+
+static inline uint64_t
+magic_for(uint64_t magic, const block_header *h)
+{
+	return magic ^ (uint64_t) (uintptr_t) h;
+}
+
+static bool hooksInstalled = false;
+static SmqArena::counters totals;
+
+/* The arena being parsed into on this thread, and the spares. */
+static __thread SmqArena *current = NULL;
+static __thread SmqArena *spares = NULL;
+static __thread int nspares = 0;
+
+static inline size_t
+round16(size_t n)
+{
+	return (n + 15) & ~(size_t) 15;
+}
+
+SmqArena::SmqArena() :
+	chunks (NULL),
+	nallocs (0),
+	nbytes (0),
+	nextSpare (NULL)
+{
+	add_chunk(CHUNK);
+	__sync_fetch_and_add(&totals.arenas, 1);
+}
+
+SmqArena::~SmqArena()
+{
+	while (chunks) {
+		chunk *c = chunks;
+		chunks = c->next;
+		free(c);
+	}
+}
+
+SmqArena::chunk *SmqArena::add_chunk(size_t size)
+{
+	chunk *c = (chunk *) malloc(sizeof(chunk) + size);
+	if (!c)
+		return NULL;
+	c->next = chunks;
+	c->size = size;
+	c->used = 0;
+	chunks = c;
+	return c;
+}
+
+void *SmqArena::alloc(size_t size)
+{
+	size_t need = sizeof(block_header) + round16(size);
+	chunk *c = chunks;
+	if (c->size - c->used < need) {
+		// A block too big for a chunk gets a chunk of its own.
+		c = add_chunk(need > CHUNK ? need : CHUNK);
+		if (!c)
+			return NULL;
+	}
+	block_header *h = (block_header *) ((char *) (c + 1) + c->used);
+	c->used += need;
+	h->magic = magic_for(ARENA_MAGIC, h);
+	h->size = size;
+	nallocs++;
+	nbytes += size;
+	return h + 1;
+}
+
+/* Keep only the first chunk, empty. */
+void SmqArena::reset()
+{
+	while (chunks->next) {
+		chunk *c = chunks;
+		chunks = c->next;
+		free(c);
+		__sync_fetch_and_add(&totals.chunks, 1);
+	}
+	chunks->used = 0;
+	nallocs = 0;
+	nbytes = 0;
+}
+
+SmqArena *SmqArena::get()
+{
+	SmqArena *a = spares;
+	if (a) {
+		spares = a->nextSpare;
+		nspares--;
+		a->nextSpare = NULL;
+		__sync_fetch_and_add(&totals.reused, 1);
+		return a;
+	}
+	return new SmqArena();
+}
+
+void SmqArena::put(SmqArena *a)
+{
+	if (!a)
+		return;
+	__sync_fetch_and_add(&totals.released, 1);
+	__sync_fetch_and_add(&totals.allocations, a->nallocs);
+	__sync_fetch_and_add(&totals.bytes, a->nbytes);
+	// Messages are often deleted on another thread than the one that
+	// parsed them; each thread just keeps what it's given, up to a point.
+	if (nspares >= FREE_LIST_MAX) {
+		delete a;
+		return;
+	}
+	a->reset();
+	a->nextSpare = spares;
+	spares = a;
+	nspares++;
+}
+
+void SmqArena::drop_spares()
+{
+	while (spares) {
+		SmqArena *a = spares;
+		spares = a->nextSpare;
+		delete a;
+	}
+	nspares = 0;
+}
+
+SmqArena::counters SmqArena::stats()
+{
+	return totals;
+}
+
+void SmqArena::walk_skipped()
+{
+	__sync_fetch_and_add(&totals.walks_skipped, 1);
+}
+
+void *SmqArena::hook_malloc(size_t size)
+{
+	if (current)
+		return current->alloc(size);
+	block_header *h = (block_header *) malloc(sizeof(block_header) + size);
+	if (!h)
+		return NULL;
+	h->magic = magic_for(HEAP_MAGIC, h);
+	h->size = size;
+	__sync_fetch_and_add(&totals.heap_allocations, 1);
+	return h + 1;
+}
+
+void *SmqArena::hook_realloc(void *p, size_t size)
+{
+	if (!p)
+		return hook_malloc(size);
+	block_header *h = (block_header *) p - 1;
+	if (h->magic == magic_for(HEAP_MAGIC, h)) {
+		h = (block_header *) realloc(h, sizeof(block_header) + size);
+		if (!h)
+			return NULL;
+		h->magic = magic_for(HEAP_MAGIC, h);
+		h->size = size;
+		return h + 1;
+	}
+	if (h->magic == magic_for(ARENA_MAGIC, h)) {
+		// Arena blocks can't grow; move it.
+		void *q = hook_malloc(size);
+		if (q)
+			memcpy(q, p, h->size < size ? h->size : size);
+		return q;
+	}
+	return realloc(p, size);	// Not one of ours
+}
+
+void SmqArena::hook_free(void *p)
+{
+	if (!p)
+		return;
+	block_header *h = (block_header *) p - 1;
+	if (h->magic == magic_for(ARENA_MAGIC, h))
+		return;		// Goes with its arena
+	if (h->magic == magic_for(HEAP_MAGIC, h)) {
+		h->magic = 0;
+		free(h);
+		return;
+	}
+	free(p);	// Not one of ours
+}
+
+void SmqArena::install()
+{
+	osip_set_allocators(hook_malloc, hook_realloc, hook_free);
+	hooksInstalled = true;
+}
+
+bool SmqArena::installed()
+{
+	return hooksInstalled;
+}
+
+SmqArenaScope::SmqArenaScope(SmqArena *a) :
+	previous (current)
+{
+	current = a;
+}
+
+SmqArenaScope::~SmqArenaScope()
+{
+	current = previous;
+}
+
+} // namespace SMqueue
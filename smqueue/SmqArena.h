@@ -0,0 +1,131 @@
+/*
+* Copyright 2014 Range Networks, Inc.
+*
+* This software is distributed under multiple licenses;
+* see the COPYING file in the main directory for licensing
+* information for this specific distribuion.
+*
+* This use of this software may be subject to additional restrictions.
+* See the LEGAL file in the main directory for details.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+/*
+ * SmqArena.h
+ *
+ * Where osip puts a queued message's parse tree.
+ *
+ * Parsing a MESSAGE with osip makes a few hundred small blocks (every
+ * header, URI, parameter and string is its own malloc), and unparsing
+ * it walks the tree freeing each one again.  Instead, while a message
+ * is being parsed, osip's allocator hooks take the blocks from that
+ * message's arena: a few chunks that blocks are cut from one after
+ * another and never given back singly.  When the message is unparsed
+ * or deleted the whole arena goes at once, and back on a per-thread
+ * list of spare arenas for the next message to use.
+ *
+ * Blocks allocated outside an arena (anything osip makes when no
+ * message is being parsed: changes to a parsed tree, responses, acks)
+ * come from the heap as before.  Every block has a small header saying
+ * which it is, so osip_free can tell: freeing an arena block does
+ * nothing, freeing a heap block frees it.  A tree with heap blocks in
+ * it, which is any tree that's been changed since it was parsed, must
+ * still be walked with osip_message_free before its arena goes.
+ *
+ * install() sets the hooks, and must be called before anything is
+ * allocated by osip.
+ */
+
+#ifndef SMQARENA_H_
+#define SMQARENA_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace SMqueue {
+
+class SmqArena {
+	public:
+	const static size_t CHUNK = 8192;	// Enough for most MESSAGEs
+	const static int FREE_LIST_MAX = 64;	// Spare arenas kept per thread
+
+	/* An empty arena, from this thread's spares if there are any. */
+	static SmqArena *get();
+	/* Done with everything in a; keep it for reuse.  */
+	static void put(SmqArena *a);
+	/* Free this thread's spares, before a thread exits. */
+	static void drop_spares();
+
+	/* Make osip allocate through here. */
+	static void install();
+	static bool installed();
+
+	/* Blocks allocated and bytes asked for since the arena was got. */
+	unsigned allocations() const { return nallocs; }
+	size_t bytes() const { return nbytes; }
+
+	struct counters {
+		unsigned long arenas;		// Made
+		unsigned long reused;		// Got from the spares
+		unsigned long released;		// Put back
+		unsigned long allocations;	// In released arenas
+		unsigned long bytes;		// ...
+		unsigned long chunks;		// Chunks beyond the first
+		unsigned long heap_allocations;	// Made outside any arena
+		unsigned long walks_skipped;	// Trees freed with their arena
+
+		counters() : arenas(0), reused(0), released(0), allocations(0),
+			bytes(0), chunks(0), heap_allocations(0), walks_skipped(0) {}
+	};
+	static counters stats();
+	static void walk_skipped();
+
+	private:
+	struct chunk {
+		chunk *next;
+		size_t size;		// Usable bytes after the header
+		size_t used;
+		size_t pad;		// Keep the data 16-aligned
+	};
+
+	SmqArena();
+	~SmqArena();
+
+	void *alloc(size_t size);
+	void reset();
+	chunk *add_chunk(size_t size);
+
+	chunk *chunks;		// Newest first; the last is the first made
+	unsigned nallocs;
+	size_t nbytes;
+	SmqArena *nextSpare;
+
+	/* The hooks osip calls. */
+	static void *hook_malloc(size_t size);
+	static void *hook_realloc(void *p, size_t size);
+	static void hook_free(void *p);
+
+	friend class SmqArenaScope;
+
+	// No copying.
+	SmqArena(const SmqArena &);
+	SmqArena & operator= (const SmqArena &);
+};
+
+/* While one of these is in scope, everything osip allocates on this
+   thread comes from a. */
+class SmqArenaScope {
+	public:
+	SmqArenaScope(SmqArena *a);
+	~SmqArenaScope();
+
+	private:
+	SmqArena *previous;
+};
+
+} // namespace SMqueue
+
+#endif /* SMQARENA_H_ */
@@ -0,0 +1,239 @@
+/*
+* Copyright 2014 Range Networks, Inc.
+*
+* This software is distributed under multiple licenses;
+* see the COPYING file in the main directory for licensing
+* information for this specific distribuion.
+*
+* This use of this software may be subject to additional restrictions.
+* See the LEGAL file in the main directory for details.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+/*
+ * SmqCheckpoint.cpp
+ *
+ * The binary save file.  See SmqCheckpoint.h.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <Logger.h>
+
+#include "SmqCheckpoint.h"
+#include "SmqJournal.h"
+
+namespace SMqueue {
+
+static const char MAGIC[8] = { 'S', 'M', 'Q', 'C', 'K', 'P', 'T', '\n' };
+
+SmqCheckpoint::SmqCheckpoint() :
+	base (NULL),
+	length (0),
+	index (NULL),
+	path (),
+	tmpPath (),
+	out (NULL),
+	offset (0),
+	entries (),
+	failed (false)
+{
+	memset(&head, 0, sizeof(head));
+}
+
+SmqCheckpoint::~SmqCheckpoint()
+{
+	close();
+	if (out) {
+		fclose(out);
+		unlink(tmpPath.c_str());
+	}
+}
+
+bool SmqCheckpoint::is_binary(const std::string &path)
+{
+	char magic[sizeof(MAGIC)];
+	FILE *f = fopen(path.c_str(), "rb");
+	if (!f)
+		return false;
+	bool binary = fread(magic, 1, sizeof(magic), f) == sizeof(magic)
+		&& 0 == memcmp(magic, MAGIC, sizeof(magic));
+	fclose(f);
+	return binary;
+}
+
+bool SmqCheckpoint::open(const std::string &file)
+{
+	close();
+	int fd = ::open(file.c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat st;
+	if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(header)) {
+		::close(fd);
+		LOG(ERR) << "Save file " << file << " is too short";
+		return false;
+	}
+	void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd);
+	if (p == MAP_FAILED) {
+		LOG(ERR) << "Can't map save file " << file << ": " << strerror(errno);
+		return false;
+	}
+	base = (const char *) p;
+	length = st.st_size;
+
+	const header *h = hdr();
+	const char *why = NULL;
+	if (memcmp(h->magic, MAGIC, sizeof(MAGIC)))
+		why = "not a binary save file";
+	else if ((h->version != VERSION && h->version != 1) || h->entry_size != sizeof(entry))
+		why = "a version we can't read";
+	else if (h->file_size != length || h->index_offset > length
+	      || h->count > (length - h->index_offset) / sizeof(entry))
+		why = "cut short";
+	else if (SmqJournal::crc32(base + h->index_offset, h->count * sizeof(entry)) != h->index_crc)
+		why = "damaged";
+	if (why) {
+		LOG(ERR) << "Save file " << file << " is " << why;
+		close();
+		return false;
+	}
+	index = (const entry *) (base + h->index_offset);
+	// Check every entry points inside the file, once, here.
+	for (size_t i = 0; i < h->count; i++) {
+		const entry &e = index[i];
+		if (e.text_offset + e.text_length > h->index_offset
+		 || e.qtag_offset + e.qtag_length > h->index_offset
+		 || e.imsi_offset + e.imsi_length > h->index_offset
+		 || e.srcaddrlen > sizeof(e.srcaddr)) {
+			LOG(ERR) << "Save file " << file << " has a bad entry " << i;
+			close();
+			return false;
+		}
+	}
+	// Texts are copied out in index order, which is the file's.
+	madvise((void *) base, length, MADV_SEQUENTIAL);
+	return true;
+}
+
+bool SmqCheckpoint::intact(const entry &e) const
+{
+	if (hdr()->version < 2)
+		return true;		// Nothing to check it by
+	uint32_t crc = SmqJournal::crc32(bytes(e.text_offset), e.text_length);
+	crc = SmqJournal::crc32(bytes(e.qtag_offset), e.qtag_length, crc);
+	crc = SmqJournal::crc32(bytes(e.imsi_offset), e.imsi_length, crc);
+	return crc == e.crc;
+}
+
+void SmqCheckpoint::close()
+{
+	if (base)
+		munmap((void *) base, length);
+	base = NULL;
+	length = 0;
+	index = NULL;
+}
+
+bool SmqCheckpoint::write(const void *p, size_t len)
+{
+	if (failed)
+		return false;
+	if (len && fwrite(p, 1, len, out) != len)
+		failed = true;
+	offset += len;
+	return !failed;
+}
+
+bool SmqCheckpoint::begin(const std::string &file, uint32_t journalSegment, uint32_t nshards)
+{
+	path = file;
+	tmpPath = file + ".tmp";
+	out = fopen(tmpPath.c_str(), "wb");
+	if (!out)
+		return false;
+	offset = 0;
+	failed = false;
+	entries.clear();
+	memset(&head, 0, sizeof(head));
+	memcpy(head.magic, MAGIC, sizeof(MAGIC));
+	head.version = VERSION;
+	head.entry_size = sizeof(entry);
+	head.journal_segment = journalSegment;
+	head.shards = nshards;
+	// Filled in by finish().
+	return write(&head, sizeof(head));
+}
+
+bool SmqCheckpoint::add(entry e, const char *text, const char *qtag, const char *imsi)
+{
+	size_t qlen = qtag ? strlen(qtag) : 0;
+	size_t ilen = imsi ? strlen(imsi) : 0;
+	if (qlen > 0xffff || ilen > 0xffff)
+		return false;
+	e.text_offset = offset;
+	write(text, e.text_length);
+	e.qtag_offset = offset;
+	e.qtag_length = qlen;
+	write(qtag, qlen);
+	e.imsi_offset = offset;
+	e.imsi_length = ilen;
+	write(imsi, ilen);
+	e.crc = SmqJournal::crc32(text, e.text_length);
+	e.crc = SmqJournal::crc32(qtag, qlen, e.crc);
+	e.crc = SmqJournal::crc32(imsi, ilen, e.crc);
+	entries.push_back(e);
+	return !failed;
+}
+
+bool SmqCheckpoint::sync_dir(const std::string &file)
+{
+	std::vector<char> name(file.begin(), file.end());
+	name.push_back('\0');
+	int dirfd = ::open(dirname(&name[0]), O_RDONLY);
+	bool ok = dirfd >= 0 && fsync(dirfd) == 0;
+	if (!ok)
+		LOG(ERR) << "Can't sync the directory of " << file << ": " << strerror(errno);
+	if (dirfd >= 0)
+		::close(dirfd);
+	return ok;
+}
+
+bool SmqCheckpoint::finish()
+{
+	head.count = entries.size();
+	head.index_offset = offset;
+	size_t indexBytes = entries.size() * sizeof(entry);
+	if (indexBytes) {
+		head.index_crc = SmqJournal::crc32((const char *) &entries[0], indexBytes);
+		write(&entries[0], indexBytes);
+	} else
+		head.index_crc = SmqJournal::crc32("", 0);
+	head.file_size = offset;
+
+	bool ok = !failed && fseek(out, 0, SEEK_SET) == 0
+		&& fwrite(&head, 1, sizeof(head), out) == sizeof(head)
+		&& fflush(out) == 0 && fsync(fileno(out)) == 0;
+	ok = (fclose(out) == 0) && ok;
+	out = NULL;
+	entries.clear();
+	if (ok)
+		ok = rename(tmpPath.c_str(), path.c_str()) == 0;
+	if (!ok)
+		unlink(tmpPath.c_str());
+	else
+		ok = sync_dir(path);
+	return ok;
+}
+
+} // namespace SMqueue
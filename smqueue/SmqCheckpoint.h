@@ -0,0 +1,144 @@
+/*
+* Copyright 2014 Range Networks, Inc.
+*
+* This software is distributed under multiple licenses;
+* see the COPYING file in the main directory for licensing
+* information for this specific distribuion.
+*
+* This use of this software may be subject to additional restrictions.
+* See the LEGAL file in the main directory for details.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+/*
+ * SmqCheckpoint.h
+ *
+ * The binary save file.
+ *
+ * Reading the text save file back means an osip parse and a full
+ * validate_short_msg for every queued message before smqueue can do
+ * anything, which for a big queue takes a while.  The binary one has,
+ * after a fixed header, the SIP text of each message one after another,
+ * then an index with an entry per message holding what the queue needs
+ * to file it: state, next action time, source address, flags, shard,
+ * qtag and its hash, destination IMSI, and where its text is.  At
+ * startup the file is mmap'd and the messages are queued straight from
+ * the index; each one is validated (and so parsed) only when it comes
+ * due.
+ *
+ * The index is at the end so the texts can be written out as the queue
+ * is walked; the header, written last, says where it is.  The header
+ * has a CRC of the index, and each entry one of its strings, which is
+ * checked when they're copied out.  The file is synced, renamed into
+ * place, and its directory synced, before the journal it replaces is
+ * dropped.  Numbers are
+ * in this machine's byte order.  The text format is still read, and
+ * written if Queue.Checkpoint.Format says so; reading tells them apart
+ * by the magic at the start.
+ */
+
+#ifndef SMQCHECKPOINT_H_
+#define SMQCHECKPOINT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+namespace SMqueue {
+
+class SmqCheckpoint {
+	public:
+	const static uint32_t VERSION = 2;	// 1 had no string CRCs
+
+	struct header {
+		char magic[8];			// "SMQCKPT\n"
+		uint32_t version;
+		uint32_t entry_size;		// sizeof(entry)
+		uint32_t journal_segment;	// First not in here, or 0
+		uint32_t shards;		// How many there were
+		uint64_t count;			// Entries
+		uint64_t index_offset;
+		uint64_t file_size;
+		uint32_t index_crc;		// CRC-32 of the index
+		uint32_t pad;
+	};
+
+	/* Offsets are from the start of the file. */
+	struct entry {
+		uint64_t journal_id;
+		uint64_t qtaghash;
+		int64_t next_action_time;	// ms
+		uint64_t text_offset;
+		uint64_t qtag_offset;
+		uint64_t imsi_offset;
+		uint32_t text_length;
+		uint16_t qtag_length;		// 0 if none
+		uint16_t imsi_length;		// 0 if none
+		int32_t state;
+		int32_t shard;
+		uint16_t flags;
+		uint16_t srcaddrlen;
+		char srcaddr[16];
+		uint32_t crc;			// CRC-32 of text, qtag, imsi
+	};
+	enum { MS_TO_SC = 1, NEED_REPACK = 2 };
+
+	SmqCheckpoint();
+	~SmqCheckpoint();
+
+	/* Does path start like a binary save file? */
+	static bool is_binary(const std::string &path);
+
+	/* Map in a binary save file, checking its header and index. */
+	bool open(const std::string &path);
+	void close();
+
+	uint32_t journal_segment() const { return hdr()->journal_segment; }
+	uint32_t shards() const { return hdr()->shards; }
+	size_t size() const { return hdr()->count; }
+	const entry &at(size_t i) const { return index[i]; }
+	const char *bytes(uint64_t offset) const { return base + offset; }
+	/* Do e's strings match its CRC?  */
+	bool intact(const entry &e) const;
+
+	/* Writing one: begin(), add() each message, then finish(), which
+	   syncs the file.  Nothing is at path until finish() renames it
+	   there, and syncs the directory so the new name is on disk.  */
+	bool begin(const std::string &path, uint32_t journalSegment, uint32_t nshards);
+	bool add(entry e, const char *text, const char *qtag, const char *imsi);
+	bool finish();
+
+	/* fsync the directory file is in, after renaming something there.  */
+	static bool sync_dir(const std::string &file);
+
+	private:
+	const header *hdr() const { return (const header *) base; }
+	bool write(const void *p, size_t len);
+
+	// Reading
+	const char *base;
+	size_t length;
+	const entry *index;
+
+	// Writing
+	std::string path;
+	std::string tmpPath;
+	FILE *out;
+	uint64_t offset;
+	header head;
+	std::vector<entry> entries;
+	bool failed;
+
+	// No copying.
+	SmqCheckpoint(const SmqCheckpoint &);
+	SmqCheckpoint & operator= (const SmqCheckpoint &);
+};
+
+} // namespace SMqueue
+
+#endif /* SMQCHECKPOINT_H_ */
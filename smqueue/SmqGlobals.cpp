@@ -23,7 +23,11 @@
  */
 
 
+#include <errno.h>
+#include <stdio.h>
+
 #include "SmqGlobals.h"
+#include "SmqRouteCache.h"
 #include "Sockets.h"
 #include <Logger.h>
 
@@ -98,34 +102,40 @@ time_t msgettime() {
 
 
 
+/*
+ * Addresses for WriteUDPMessage, and the socket each thread sends them on
+ * (one per address family), so a message costs a sendto and not a
+ * resolve and a socket() and close() as well.
+ */
+static SMqueue::SmqRouteCache udpRoutes;
+static __thread int udpSockets[2] = { -1, -1 };	// IPv4, IPv6
+
 int WriteUDPMessage(char* Buffer, int BufferSize, std::string IPAddress, int portNum) {
-	int sfd;
-	bool okay = false;
-	struct sockaddr_in saddr;
-	socklen_t addrlen;
+	SMqueue::SmqRouteCache::route r;
+	char port[12];
 
 	LOG(DEBUG) << "Send message to: " << IPAddress << ":" << portNum;
 	LOG(DEBUG) << "Message being sent: " << Buffer;
 
-	sfd = socket(AF_INET, SOCK_DGRAM, 0);
-	if (sfd == -1) {
-		LOG(DEBUG) "Failed to create socket error: " << errno;
+	snprintf(port, sizeof(port), "%d", portNum);
+	if (!udpRoutes.get(IPAddress.c_str(), port, r)) {
+		LOG(DEBUG) << "Can't resolve " << IPAddress;
 		return -1;
 	}
 
-	bzero(&saddr, sizeof(saddr));
-	saddr.sin_family = AF_INET;
-	inet_pton(AF_INET, IPAddress.c_str(), &saddr.sin_addr);
-	saddr.sin_port = htons(portNum);
-	addrlen=sizeof(saddr);
-	okay = resolveAddress(&saddr, (const char*) IPAddress.c_str(), portNum);
-
-	int retlen = sendto(sfd, Buffer, BufferSize, 0, (struct sockaddr *) &saddr, addrlen);
-	if (retlen == 0) {
-		LOG(DEBUG) "sendto failed";
+	int *sfd = &udpSockets[r.family == AF_INET6 ? 1 : 0];
+	if (*sfd < 0) {
+		*sfd = socket(r.family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+		if (*sfd == -1) {
+			LOG(DEBUG) << "Failed to create socket error: " << errno;
+			return -1;
+		}
 	}
 
-	close(sfd);
+	int retlen = sendto(*sfd, Buffer, BufferSize, 0, (struct sockaddr *) &r.addr, r.addrlen);
+	if (retlen < 0) {
+		LOG(DEBUG) << "sendto failed error: " << errno;
+		udpRoutes.failed(IPAddress.c_str(), port);
+	}
 	return retlen;
 }
-
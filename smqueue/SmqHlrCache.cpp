@@ -0,0 +1,171 @@
+/*
+* Copyright 2014 Range Networks, Inc.
+*
+* This software is distributed under multiple licenses;
+* see the COPYING file in the main directory for licensing
+* information for this specific distribuion.
+*
+* This use of this software may be subject to additional restrictions.
+* See the LEGAL file in the main directory for details.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+/*
+ * SmqHlrCache.cpp
+ *
+ * The subscriber registry answer cache.  See SmqHlrCache.h.
+ */
+
+#include "SmqHlrCache.h"
+#include "SmqGlobals.h"
+
+#include <stdint.h>
+
+namespace SMqueue {
+
+SmqHlrCache::SmqHlrCache() :
+	shardSize (0),
+	ttl (0),
+	negativeTtl (0)
+{
+}
+
+SmqHlrCache::~SmqHlrCache()
+{
+}
+
+void SmqHlrCache::set_limits(size_t size, int ttlMs, int negativeTtlMs)
+{
+	// Written without the shard locks; readers see the old or the
+	// new value, either of which is fine.
+	shardSize = size ? (size + NSHARDS - 1) / NSHARDS : 0;
+	ttl = ttlMs;
+	negativeTtl = negativeTtlMs;
+}
+
+std::string SmqHlrCache::cache_key(int kind, const std::string &key)
+{
+	std::string k(1, (char)('0' + kind));
+	k += key;
+	return k;
+}
+
+SmqHlrCache::Shard &SmqHlrCache::shard_of(const std::string &ckey)
+{
+	// FNV-1a
+	uint32_t h = 2166136261u;
+	for (size_t i = 0; i < ckey.size(); i++) {
+		h ^= (unsigned char) ckey[i];
+		h *= 16777619u;
+	}
+	return shards[h % NSHARDS];
+}
+
+bool SmqHlrCache::get(int kind, const std::string &key, bool &found, std::string &value)
+{
+	if (!shardSize)
+		return false;
+
+	std::string ckey = cache_key(kind, key);
+	Shard &sh = shard_of(ckey);
+	bool hit = false;
+
+	pthread_mutex_lock(&sh.mutex);
+	node_map::iterator x = sh.index.find(ckey);
+	if (x == sh.index.end()) {
+		sh.stats.misses++;
+	} else if (x->second->expires <= msgettime()) {
+		sh.stats.misses++;
+		sh.stats.expired++;
+		sh.lru.erase(x->second);
+		sh.index.erase(x);
+	} else {
+		// Move to the front of the LRU list.
+		sh.lru.splice(sh.lru.begin(), sh.lru, x->second);
+		found = x->second->found;
+		value = x->second->value;
+		sh.stats.hits++;
+		if (!found)
+			sh.stats.negative_hits++;
+		hit = true;
+	}
+	pthread_mutex_unlock(&sh.mutex);
+	return hit;
+}
+
+void SmqHlrCache::put(int kind, const std::string &key, bool found,
+		      const std::string &value, int maxTtlMs)
+{
+	size_t limit = shardSize;
+	if (!limit)
+		return;
+	int ttlMs = found ? ttl : negativeTtl;
+	if (maxTtlMs >= 0 && maxTtlMs < ttlMs)
+		ttlMs = maxTtlMs;
+	if (ttlMs <= 0)
+		return;
+
+	std::string ckey = cache_key(kind, key);
+	Shard &sh = shard_of(ckey);
+
+	pthread_mutex_lock(&sh.mutex);
+	node_map::iterator x = sh.index.find(ckey);
+	if (x == sh.index.end()) {
+		Node n;
+		n.key = ckey;
+		sh.lru.push_front(n);
+		x = sh.index.insert(node_map::value_type(ckey, sh.lru.begin())).first;
+	} else {
+		sh.lru.splice(sh.lru.begin(), sh.lru, x->second);
+	}
+	x->second->found = found;
+	x->second->value = value;
+	x->second->expires = msgettime() + ttlMs;
+
+	// Make room, least recently used first.
+	while (sh.index.size() > limit) {
+		sh.index.erase(sh.lru.back().key);
+		sh.lru.pop_back();
+		sh.stats.evictions++;
+	}
+	pthread_mutex_unlock(&sh.mutex);
+}
+
+void SmqHlrCache::invalidate(int kind, const std::string &key)
+{
+	std::string ckey = cache_key(kind, key);
+	Shard &sh = shard_of(ckey);
+
+	pthread_mutex_lock(&sh.mutex);
+	node_map::iterator x = sh.index.find(ckey);
+	if (x != sh.index.end()) {
+		sh.lru.erase(x->second);
+		sh.index.erase(x);
+		sh.stats.invalidations++;
+	}
+	pthread_mutex_unlock(&sh.mutex);
+}
+
+SmqHlrCache::counters SmqHlrCache::stats()
+{
+	counters total;
+
+	for (int i = 0; i < NSHARDS; i++) {
+		Shard &sh = shards[i];
+		pthread_mutex_lock(&sh.mutex);
+		total.hits += sh.stats.hits;
+		total.negative_hits += sh.stats.negative_hits;
+		total.misses += sh.stats.misses;
+		total.expired += sh.stats.expired;
+		total.evictions += sh.stats.evictions;
+		total.invalidations += sh.stats.invalidations;
+		total.entries += sh.index.size();
+		pthread_mutex_unlock(&sh.mutex);
+	}
+	return total;
+}
+
+} // namespace SMqueue
@@ -0,0 +1,115 @@
+/*
+* Copyright 2014 Range Networks, Inc.
+*
+* This software is distributed under multiple licenses;
+* see the COPYING file in the main directory for licensing
+* information for this specific distribuion.
+*
+* This use of this software may be subject to additional restrictions.
+* See the LEGAL file in the main directory for details.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+/*
+ * SmqHlrCache.h
+ *
+ * A cache of subscriber registry answers, so that the same IMSI and
+ * phone number lookups aren't repeated for every step, retry and bounce
+ * of every message.
+ *
+ * Entries are keyed by the kind of lookup (an SmqLookup::Kind) and its
+ * key.  "Not found" is cached too, for a shorter time.  The cache is
+ * split into NSHARDS parts, each with its own lock and LRU list, so the
+ * lookup callers don't all wait on one lock; each part holds up to
+ * 1/NSHARDS of the configured size.
+ */
+
+#ifndef SMQHLRCACHE_H_
+#define SMQHLRCACHE_H_
+
+#include <pthread.h>
+#include <time.h>
+#include <list>
+#include <string>
+#include <tr1/unordered_map>
+
+namespace SMqueue {
+
+class SmqHlrCache {
+	public:
+	const static int NSHARDS = 16;
+
+	SmqHlrCache();
+	~SmqHlrCache();
+
+	/* Size in entries (0 turns the cache off), and how long found
+	   and not-found answers are good for, in ms.  */
+	void set_limits(size_t size, int ttlMs, int negativeTtlMs);
+
+	/* Look up a cached answer.  Result is true on a hit, with found
+	   and value set.  */
+	bool get(int kind, const std::string &key, bool &found, std::string &value);
+
+	/* Remember an answer, good for the TTL for found or not-found
+	   answers, or for maxTtlMs if that's shorter.  */
+	void put(int kind, const std::string &key, bool found,
+		 const std::string &value, int maxTtlMs = -1);
+
+	/* Forget an answer, because the registry has changed. */
+	void invalidate(int kind, const std::string &key);
+
+	struct counters {
+		unsigned long hits;
+		unsigned long negative_hits;	// Hits that were "not found"
+		unsigned long misses;
+		unsigned long expired;		// Misses on a stale entry
+		unsigned long evictions;	// Dropped to make room
+		unsigned long invalidations;
+		unsigned long entries;
+
+		counters() : hits(0), negative_hits(0), misses(0), expired(0),
+			evictions(0), invalidations(0), entries(0) {}
+	};
+
+	/* The counters, summed over the shards. */
+	counters stats();
+
+	private:
+	struct Node {
+		std::string key;
+		bool found;
+		std::string value;
+		time_t expires;		// ms
+	};
+	typedef std::list<Node> lru_list;	// Most recently used first
+	typedef std::tr1::unordered_map<std::string, lru_list::iterator> node_map;
+
+	struct Shard {
+		pthread_mutex_t mutex;
+		lru_list lru;
+		node_map index;
+		counters stats;
+
+		Shard() : lru(), index(), stats() { pthread_mutex_init(&mutex, NULL); }
+		~Shard() { pthread_mutex_destroy(&mutex); }
+	};
+
+	static std::string cache_key(int kind, const std::string &key);
+	Shard &shard_of(const std::string &ckey);
+
+	Shard shards[NSHARDS];
+	size_t shardSize;	// Entries per shard; 0 if off
+	int ttl;
+	int negativeTtl;
+
+	// No copying.
+	SmqHlrCache(const SmqHlrCache &);
+	SmqHlrCache & operator= (const SmqHlrCache &);
+};
+
+} // namespace SMqueue
+
+#endif /* SMQHLRCACHE_H_ */
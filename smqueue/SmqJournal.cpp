@@ -0,0 +1,541 @@
+/*
+* Copyright 2014 Range Networks, Inc.
+*
+* This software is distributed under multiple licenses;
+* see the COPYING file in the main directory for licensing
+* information for this specific distribuion.
+*
+* This use of this software may be subject to additional restrictions.
+* See the LEGAL file in the main directory for details.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+/*
+ * SmqJournal.cpp
+ *
+ * The queue's write-ahead journal.  See SmqJournal.h.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+
+#include <Logger.h>
+
+#include "SmqJournal.h"
+#include "SmqGlobals.h"
+
+namespace SMqueue {
+
+/* The sequence number of the last record this thread appended. */
+static __thread uint64_t lastAppended = 0;
+
+/*
+ * Each record is its length and CRC-32, then that many bytes:
+ *	type (1), id (8)
+ * and for a PUT,
+ *	state (4), next_action_time (8), flags (1),
+ *	address length (2), address, text length (4), text
+ * all in this machine's byte order.
+ */
+const static size_t RECORD_HEADER = 8;
+
+template <class T> static inline void
+put_value(std::string &s, T v)
+{
+	s.append((const char *) &v, sizeof(v));
+}
+
+template <class T> static inline bool
+get_value(const char *&p, const char *end, T &v)
+{
+	if ((size_t)(end - p) < sizeof(v))
+		return false;
+	memcpy(&v, p, sizeof(v));
+	p += sizeof(v);
+	return true;
+}
+
+SmqJournal::SmqJournal() :
+	base (),
+	fd (-1),
+	segment (0),
+	syncMs (0),
+	nextId (1),
+	buffer (),
+	appended (0),
+	taken (0),
+	settled (0),
+	durable (0),
+	lost (),
+	written (0),
+	segBytes (0),
+	stopping (false),
+	threadRunning (false),
+	counts ()
+{
+	pthread_mutex_init(&mutex, NULL);
+	pthread_mutex_init(&ioMutex, NULL);
+	pthread_cond_init(&durableCond, NULL);
+	pthread_cond_init(&syncCond, NULL);
+}
+
+SmqJournal::~SmqJournal()
+{
+	close();
+	pthread_cond_destroy(&syncCond);
+	pthread_cond_destroy(&durableCond);
+	pthread_mutex_destroy(&ioMutex);
+	pthread_mutex_destroy(&mutex);
+}
+
+std::string SmqJournal::segment_name(const std::string &savefile, unsigned n)
+{
+	char suffix[32];
+	snprintf(suffix, sizeof(suffix), ".journal.%06u", n);
+	return savefile + suffix;
+}
+
+/* The numbers of savefile's segments, lowest first. */
+std::vector<unsigned> SmqJournal::segments(const std::string &savefile)
+{
+	std::vector<unsigned> found;
+	std::vector<char> path(savefile.begin(), savefile.end());
+	path.push_back('\0');
+	std::string dir = dirname(&path[0]);
+	path.assign(savefile.begin(), savefile.end());
+	path.push_back('\0');
+	std::string prefix = std::string(basename(&path[0])) + ".journal.";
+
+	DIR *d = opendir(dir.c_str());
+	if (!d)
+		return found;
+	struct dirent *e;
+	while ((e = readdir(d)) != NULL) {
+		const char *name = e->d_name;
+		if (strncmp(name, prefix.c_str(), prefix.size()))
+			continue;
+		const char *num = name + prefix.size();
+		char *end;
+		unsigned long n = strtoul(num, &end, 10);
+		if (end != num && *end == '\0' && n > 0)
+			found.push_back(n);
+	}
+	closedir(d);
+	std::sort(found.begin(), found.end());
+	return found;
+}
+
+static uint32_t crcTable[256];
+static pthread_once_t crcTableOnce = PTHREAD_ONCE_INIT;
+
+static void make_crc_table()
+{
+	for (uint32_t i = 0; i < 256; i++) {
+		uint32_t c = i;
+		for (int k = 0; k < 8; k++)
+			c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+		crcTable[i] = c;
+	}
+}
+
+uint32_t SmqJournal::crc32(const char *p, size_t len, uint32_t crc)
+{
+	pthread_once(&crcTableOnce, make_crc_table);
+	crc ^= 0xffffffffu;
+	for (size_t i = 0; i < len; i++)
+		crc = crcTable[(crc ^ (unsigned char) p[i]) & 0xff] ^ (crc >> 8);
+	return crc ^ 0xffffffffu;
+}
+
+bool SmqJournal::open_segment(unsigned n)
+{
+	std::string name = segment_name(base, n);
+	int newfd = ::open(name.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+	if (newfd < 0) {
+		LOG(ALERT) << "Can't make journal segment " << name << ": " << strerror(errno);
+		return false;
+	}
+	// Make sure the new file's name is on disk too.
+	std::vector<char> path(base.begin(), base.end());
+	path.push_back('\0');
+	int dirfd = ::open(dirname(&path[0]), O_RDONLY);
+	if (dirfd >= 0) {
+		fsync(dirfd);
+		::close(dirfd);
+	}
+	if (fd >= 0)
+		::close(fd);
+	fd = newfd;
+	segment = n;
+	written = 0;
+	counts.segments++;
+	LOG(INFO) << "Journal segment " << name << " started";
+	return true;
+}
+
+bool SmqJournal::open(const std::string &savefile, uint64_t firstId, int ms)
+{
+	if (is_open())
+		return true;
+	base = savefile;
+	std::vector<unsigned> segs = segments(base);
+	if (!open_segment(segs.empty() ? 1 : segs.back() + 1))
+		return false;
+
+	nextId = firstId > 0 ? firstId : 1;
+	syncMs = ms;
+	stopping = false;
+	int status = pthread_create(&thread, NULL, sync_thread, this);
+	if (status != 0) {
+		LOG(ALERT) << "Can't start journal thread, error " << status;
+		::close(fd);
+		fd = -1;
+		return false;
+	}
+	threadRunning = true;
+	return true;
+}
+
+void SmqJournal::close()
+{
+	if (!threadRunning)
+		return;
+	pthread_mutex_lock(&mutex);
+	stopping = true;
+	pthread_cond_signal(&syncCond);
+	pthread_mutex_unlock(&mutex);
+	pthread_join(thread, NULL);
+	threadRunning = false;
+
+	pthread_mutex_lock(&ioMutex);
+	if (fd >= 0)
+		::close(fd);
+	fd = -1;
+	pthread_mutex_unlock(&ioMutex);
+}
+
+uint64_t SmqJournal::append(const std::string &rec)
+{
+	uint32_t len = rec.size() - RECORD_HEADER;
+	uint32_t crc = crc32(rec.data() + RECORD_HEADER, len);
+	uint64_t lsn;
+
+	pthread_mutex_lock(&mutex);
+	bool wasEmpty = buffer.empty();
+	size_t at = buffer.size();
+	buffer += rec;
+	memcpy(&buffer[at], &len, sizeof(len));
+	memcpy(&buffer[at + sizeof(len)], &crc, sizeof(crc));
+	lsn = ++appended;
+	segBytes += rec.size();
+	counts.records++;
+	counts.bytes += rec.size();
+	if (wasEmpty)
+		pthread_cond_signal(&syncCond);
+	pthread_mutex_unlock(&mutex);
+
+	lastAppended = lsn;
+	return lsn;
+}
+
+uint64_t SmqJournal::put(uint64_t id, int state, int64_t next_action_time,
+			 bool ms_to_sc, bool need_repack, const std::string &addr,
+			 const char *text, size_t textlen)
+{
+	if (!is_open())
+		return 0;
+	std::string rec;
+	rec.reserve(RECORD_HEADER + 32 + addr.size() + textlen);
+	rec.append(RECORD_HEADER, '\0');
+	put_value(rec, (uint8_t) PUT);
+	put_value(rec, id);
+	put_value(rec, (int32_t) state);
+	put_value(rec, next_action_time);
+	put_value(rec, (uint8_t) ((ms_to_sc ? 1 : 0) | (need_repack ? 2 : 0)));
+	put_value(rec, (uint16_t) addr.size());
+	rec += addr;
+	put_value(rec, (uint32_t) textlen);
+	rec.append(text, textlen);
+	return append(rec);
+}
+
+uint64_t SmqJournal::put_state(uint64_t id, int state, int64_t next_action_time)
+{
+	if (!is_open())
+		return 0;
+	std::string rec(RECORD_HEADER, '\0');
+	put_value(rec, (uint8_t) STATE);
+	put_value(rec, id);
+	put_value(rec, (int32_t) state);
+	put_value(rec, next_action_time);
+	return append(rec);
+}
+
+uint64_t SmqJournal::remove(uint64_t id)
+{
+	if (!is_open())
+		return 0;
+	std::string rec(RECORD_HEADER, '\0');
+	put_value(rec, (uint8_t) DELETE);
+	put_value(rec, id);
+	return append(rec);
+}
+
+uint64_t SmqJournal::last_appended()
+{
+	return lastAppended;
+}
+
+bool SmqJournal::wait_durable(uint64_t lsn)
+{
+	pthread_mutex_lock(&mutex);
+	if (settled < lsn)
+		counts.waits++;
+	while (settled < lsn && threadRunning)
+		pthread_cond_wait(&durableCond, &mutex);
+	bool ok = settled >= lsn;
+	for (size_t i = 0; ok && i < lost.size(); i++)
+		ok = lsn < lost[i].first || lsn > lost[i].second;
+	pthread_mutex_unlock(&mutex);
+	return ok;
+}
+
+/* Write out all of out, and sync it if asked.  Caller holds ioMutex. */
+bool SmqJournal::write_all(const std::string &out, bool sync)
+{
+	const char *p = out.data();
+	size_t left = out.size();
+	while (left > 0) {
+		ssize_t n = write(fd, p, left);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		p += n;
+		left -= n;
+	}
+	return !(sync && !out.empty() && fdatasync(fd) != 0);
+}
+
+/* Write out the buffer, and sync it if asked.  Caller holds ioMutex. */
+bool SmqJournal::flush(bool sync)
+{
+	std::string out;
+	pthread_mutex_lock(&mutex);
+	out.swap(buffer);
+	uint64_t from = taken + 1;
+	uint64_t upto = taken = appended;
+	pthread_mutex_unlock(&mutex);
+
+	bool ok = write_all(out, sync);
+	if (!ok) {
+		LOG(ALERT) << "Journal write to " << segment_name(base, segment)
+			<< " failed: " << strerror(errno) << "; starting another segment";
+		// Whatever of it got there is a torn record, and replay
+		// stops at one, so cut it off and write it all again after.
+		if (ftruncate(fd, written) != 0)
+			LOG(WARNING) << "Can't cut the torn record off " << segment_name(base, segment)
+				<< ": " << strerror(errno);
+		ok = open_segment(segment + 1) && write_all(out, sync);
+	}
+	if (ok)
+		written += out.size();
+
+	pthread_mutex_lock(&mutex);
+	if (sync && !out.empty())
+		counts.syncs++;
+	if (ok)
+		durable = upto;
+	else if (from <= upto) {
+		counts.errors++;
+		LOG(ALERT) << "Journal records " << from << " to " << upto << " aren't on disk";
+		if (!lost.empty() && lost.back().second + 1 == from)
+			lost.back().second = upto;
+		else
+			lost.push_back(std::make_pair(from, upto));
+		if (lost.size() > MAX_LOST)
+			lost.erase(lost.begin());
+	}
+	// Either way, nobody should wait forever for the disk;
+	// wait_durable tells them which it was.
+	settled = upto;
+	pthread_cond_broadcast(&durableCond);
+	pthread_mutex_unlock(&mutex);
+	return ok;
+}
+
+void *SmqJournal::sync_thread(void *arg)
+{
+	((SmqJournal *) arg)->sync_loop();
+	return NULL;
+}
+
+void SmqJournal::sync_loop()
+{
+	pthread_mutex_lock(&mutex);
+	for (;;) {
+		while (!stopping && buffer.empty())
+			pthread_cond_wait(&syncCond, &mutex);
+		if (stopping && buffer.empty())
+			break;
+		if (syncMs > 0 && !stopping) {
+			// Let more records gather, to go in the same sync.
+			struct timespec until;
+			clock_gettime(CLOCK_REALTIME, &until);
+			until.tv_nsec += (long) syncMs * 1000000L;
+			until.tv_sec += until.tv_nsec / NS_IN_SEC;
+			until.tv_nsec %= NS_IN_SEC;
+			pthread_cond_timedwait(&syncCond, &mutex, &until);
+		}
+		pthread_mutex_unlock(&mutex);
+
+		pthread_mutex_lock(&ioMutex);
+		flush(true);
+		pthread_mutex_unlock(&ioMutex);
+
+		pthread_mutex_lock(&mutex);
+	}
+	pthread_mutex_unlock(&mutex);
+}
+
+unsigned SmqJournal::rotate()
+{
+	if (!is_open())
+		return 0;
+	pthread_mutex_lock(&ioMutex);
+	flush(true);
+	unsigned n = 0;
+	if (open_segment(segment + 1)) {
+		n = segment;
+		pthread_mutex_lock(&mutex);
+		segBytes = 0;
+		pthread_mutex_unlock(&mutex);
+	}
+	pthread_mutex_unlock(&ioMutex);
+	return n;
+}
+
+void SmqJournal::drop_before(const std::string &savefile, unsigned n)
+{
+	std::vector<unsigned> segs = segments(savefile);
+	for (size_t i = 0; i < segs.size() && segs[i] < n; i++) {
+		std::string name = segment_name(savefile, segs[i]);
+		if (unlink(name.c_str()) != 0)
+			LOG(WARNING) << "Can't remove journal segment " << name << ": " << strerror(errno);
+	}
+}
+
+uint64_t SmqJournal::replay(const std::string &savefile, unsigned first,
+			    record_map &msgs)
+{
+	uint64_t maxId = 0;
+	std::vector<unsigned> segs = segments(savefile);
+
+	for (size_t i = 0; i < segs.size(); i++) {
+		if (segs[i] < first)
+			continue;
+		std::string name = segment_name(savefile, segs[i]);
+		int in = ::open(name.c_str(), O_RDONLY);
+		if (in < 0) {
+			LOG(WARNING) << "Can't read journal segment " << name << ": " << strerror(errno);
+			continue;
+		}
+		std::string data;
+		char chunk[65536];
+		ssize_t n;
+		while ((n = read(in, chunk, sizeof(chunk))) > 0)
+			data.append(chunk, n);
+		::close(in);
+
+		unsigned puts = 0, states = 0, deletes = 0;
+		const char *p = data.data();
+		const char *end = p + data.size();
+		while (p < end) {
+			const char *start = p;
+			uint32_t len, crc;
+			if (!get_value(p, end, len) || !get_value(p, end, crc)
+			 || (size_t)(end - p) < len || crc32(p, len) != crc) {
+				// A crash while writing leaves a torn record at
+				// the end; nothing after it can be trusted.
+				LOG(WARNING) << "Journal segment " << name << " ends with a bad record at "
+					<< (start - data.data()) << " of " << data.size() << " bytes";
+				break;
+			}
+			const char *rend = p + len;
+			uint8_t type;
+			record r;
+			bool ok = get_value(p, rend, type) && get_value(p, rend, r.id);
+			if (ok && type == PUT) {
+				int32_t state;
+				uint8_t flags;
+				uint16_t addrlen;
+				uint32_t textlen;
+				ok = get_value(p, rend, state) && get_value(p, rend, r.next_action_time)
+				  && get_value(p, rend, flags) && get_value(p, rend, addrlen)
+				  && (size_t)(rend - p) >= addrlen;
+				if (ok) {
+					r.addr.assign(p, addrlen);
+					p += addrlen;
+					ok = get_value(p, rend, textlen) && (size_t)(rend - p) >= textlen;
+				}
+				if (ok) {
+					r.text.assign(p, textlen);
+					r.state = state;
+					r.ms_to_sc = flags & 1;
+					r.need_repack = flags & 2;
+					msgs[r.id] = r;
+					puts++;
+				}
+			} else if (ok && type == STATE) {
+				int32_t state;
+				int64_t when;
+				ok = get_value(p, rend, state) && get_value(p, rend, when);
+				// Not there if it's been deleted since.
+				record_map::iterator x = msgs.find(r.id);
+				if (ok && x != msgs.end()) {
+					x->second.state = state;
+					x->second.next_action_time = when;
+					x->second.restated = true;
+				}
+				if (ok)
+					states++;
+			} else if (ok && type == DELETE) {
+				msgs.erase(r.id);
+				deletes++;
+			} else
+				ok = false;
+			if (!ok) {
+				LOG(WARNING) << "Journal segment " << name << " has a record we can't read at "
+					<< (start - data.data());
+				break;
+			}
+			if (r.id > maxId)
+				maxId = r.id;
+			p = rend;
+		}
+		LOG(INFO) << "Replayed journal segment " << name << ": " << puts << " puts, "
+			<< states << " state changes, " << deletes << " deletes";
+	}
+	return maxId;
+}
+
+SmqJournal::counters SmqJournal::stats()
+{
+	pthread_mutex_lock(&mutex);
+	counters c = counts;
+	pthread_mutex_unlock(&mutex);
+	return c;
+}
+
+} // namespace SMqueue
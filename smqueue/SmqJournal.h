@@ -0,0 +1,187 @@
+/*
+* Copyright 2014 Range Networks, Inc.
+*
+* This software is distributed under multiple licenses;
+* see the COPYING file in the main directory for licensing
+* information for this specific distribuion.
+*
+* This use of this software may be subject to additional restrictions.
+* See the LEGAL file in the main directory for details.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+/*
+ * SmqJournal.h
+ *
+ * The write-ahead journal of the message queue.
+ *
+ * The queue used to be saved only by writing all of it to the save file
+ * once a minute, so a crash lost what had been taken (and answered 202
+ * Queued) since.  Now every change to a queued message is appended to
+ * the journal as it happens: a PUT record, with all of the message that
+ * the save file has, when it's queued or its text changes; a STATE
+ * record, with only its state and when it's next due, when it moves on
+ * otherwise; and a DELETE record when it leaves.
+ *
+ * Appending only copies the record into a buffer.  A thread writes out
+ * what has gathered and fdatasync()s it every syncMs (group commit: one
+ * sync for however many records came in meanwhile).  Whoever must know
+ * a record is on disk, such as a receiver that acks only durable
+ * messages, waits for its sequence number with wait_durable().
+ *
+ * The journal is a series of segment files next to the save file,
+ * savefile.journal.N.  The save file is the checkpoint: SMq starts a new
+ * segment, saves the queue, noting the segment number in the save
+ * file, and then removes the older segments.  Records are absolute (the
+ * whole message, where it's got to, or gone), so replaying a segment
+ * written while the save was in progress does no harm.  At startup the save file is read
+ * and the segments from its number on are replayed over it; a record
+ * that's cut short or fails its CRC ends its segment.
+ */
+
+#ifndef SMQJOURNAL_H_
+#define SMQJOURNAL_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace SMqueue {
+
+class SmqJournal {
+	public:
+	SmqJournal();
+	~SmqJournal();
+
+	/* What the journal (and the save file) knows of a message. */
+	struct record {
+		uint64_t id;
+		int state;
+		int64_t next_action_time;	// ms
+		bool ms_to_sc;
+		bool need_repack;
+		std::string addr;		// As SMnet::string_addr makes it
+		std::string text;
+		long saved;			// If >= 0, all that's here is
+						// its id: the rest is entry
+						// saved of a binary save file,
+		bool restated;			// but for state and
+						// next_action_time, if set.
+
+		record() : id(0), state(0), next_action_time(0),
+			ms_to_sc(false), need_repack(false), saved(-1),
+			restated(false) {}
+	};
+	/* The queue as recovered, in the order messages were first put. */
+	typedef std::map<uint64_t, record> record_map;
+
+	/* Start a new segment after any for savefile, and the thread that
+	   writes it.  Message ids are given out from firstId.  */
+	bool open(const std::string &savefile, uint64_t firstId, int syncMs);
+	/* Write out what's left and stop. */
+	void close();
+	bool is_open() const { return fd >= 0; }
+
+	/* An id for a message that isn't in the journal yet. */
+	uint64_t new_id() { return __sync_fetch_and_add(&nextId, 1); }
+
+	/* Append a record.  Result is its sequence number, which is also
+	   remembered as last_appended() for this thread.  */
+	uint64_t put(uint64_t id, int state, int64_t next_action_time,
+		     bool ms_to_sc, bool need_repack, const std::string &addr,
+		     const char *text, size_t textlen);
+	uint64_t put_state(uint64_t id, int state, int64_t next_action_time);
+	uint64_t remove(uint64_t id);
+	static uint64_t last_appended();
+
+	/* Wait until record lsn is on disk.  False if it couldn't be
+	   written: then the journal has gone on in a new segment, but
+	   that record isn't in it.  */
+	bool wait_durable(uint64_t lsn);
+
+	/* Start a new segment, once everything before it is on disk;
+	   result is its number (0 if it couldn't be made).  Then the
+	   segments before segment can be dropped.  */
+	unsigned rotate();
+	static void drop_before(const std::string &savefile, unsigned segment);
+	const std::string &save_file() const { return base; }
+	/* Bytes appended since the last rotate(). */
+	uint64_t segment_bytes() const { return segBytes; }
+
+	/* Apply savefile's segments from first on to msgs.  Result is the
+	   highest id seen.  */
+	static uint64_t replay(const std::string &savefile, unsigned first,
+			       record_map &msgs);
+
+	struct counters {
+		unsigned long records;
+		unsigned long bytes;
+		unsigned long syncs;
+		unsigned long waits;		// For wait_durable
+		unsigned long segments;		// Made
+		unsigned long errors;		// Writes or syncs that failed
+
+		counters() : records(0), bytes(0), syncs(0), waits(0),
+			segments(0), errors(0) {}
+	};
+	counters stats();
+
+	/* CRC-32 (as in zlib) of len bytes at p, carrying on from crc
+	   if they follow bytes whose CRC that was.  */
+	static uint32_t crc32(const char *p, size_t len, uint32_t crc = 0);
+
+	private:
+	enum { PUT = 1, DELETE = 2, STATE = 3 };
+
+	uint64_t append(const std::string &rec);
+	bool open_segment(unsigned n);
+	bool flush(bool sync);
+	bool write_all(const std::string &out, bool sync);
+	static void *sync_thread(void *arg);
+	void sync_loop();
+
+	static std::string segment_name(const std::string &savefile, unsigned n);
+	static std::vector<unsigned> segments(const std::string &savefile);
+
+	std::string base;		// The save file
+	int fd;				// Current segment
+	unsigned segment;
+	int syncMs;
+	uint64_t nextId;
+
+	/* mutex covers the buffer and the sequence numbers; ioMutex the
+	   segment file, and is taken first.  */
+	pthread_mutex_t mutex;
+	pthread_mutex_t ioMutex;
+	pthread_cond_t durableCond;	// durable moved on
+	pthread_cond_t syncCond;	// There's something to write
+	std::string buffer;		// Appended, not yet written
+	uint64_t appended;		// Sequence number of the last record
+	uint64_t taken;			// ... taken from buffer to write
+	uint64_t settled;		// ... written, or given up on
+	uint64_t durable;		// ... on disk
+	/* Records that couldn't be written, as ranges of sequence
+	   numbers; only the latest few, for wait_durable.  */
+	std::vector<std::pair<uint64_t, uint64_t> > lost;
+	enum { MAX_LOST = 64 };
+	uint64_t written;		// Bytes of the segment on disk
+	uint64_t segBytes;
+	bool stopping;
+	bool threadRunning;
+	pthread_t thread;
+	counters counts;
+
+	// No copying.
+	SmqJournal(const SmqJournal &);
+	SmqJournal & operator= (const SmqJournal &);
+};
+
+} // namespace SMqueue
+
+#endif /* SMQJOURNAL_H_ */
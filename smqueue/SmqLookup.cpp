@@ -0,0 +1,379 @@
+/*
+* Copyright 2014 Range Networks, Inc.
+*
+* This software is distributed under multiple licenses;
+* see the COPYING file in the main directory for licensing
+* information for this specific distribuion.
+*
+* This use of this software may be subject to additional restrictions.
+* See the LEGAL file in the main directory for details.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+/*
+ * SmqLookup.cpp
+ *
+ * The subscriber registry lookup threads.  See SmqLookup.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "smqueue.h"
+#include "SmqLookup.h"
+
+#include <Logger.h>
+#include <SubscriberRegistry.h>
+
+extern SMqueue::SMq smq;
+extern FILE *gCDRFile;
+
+namespace SMqueue {
+
+SmqLookup::SmqLookup() :
+	entries (),
+	jobs (),
+	threads (),
+	stopping (false),
+	lastExpire (0),
+	invalidations (0),
+	cache (),
+	asked (0),
+	answered (0),
+	cached (0),
+	queries (0),
+	coalesced (0),
+	stale (0),
+	cdrs (0),
+	busyMs (0)
+{
+	pthread_mutex_init(&mutex, NULL);
+	pthread_cond_init(&cond, NULL);
+	pthread_mutex_init(&cdrMutex, NULL);
+}
+
+SmqLookup::~SmqLookup()
+{
+	stop();
+	pthread_mutex_destroy(&cdrMutex);
+	pthread_cond_destroy(&cond);
+	pthread_mutex_destroy(&mutex);
+}
+
+bool SmqLookup::start(int nthreads)
+{
+	pthread_mutex_lock(&mutex);
+	stopping = false;
+	pthread_mutex_unlock(&mutex);
+
+	for (int i = 0; i < nthreads; i++) {
+		pthread_t thread;
+		int status = pthread_create(&thread, NULL, worker_thread, this);
+		if (status != 0) {
+			LOG(ALERT) << "Can't start lookup thread, error " << status;
+			break;
+		}
+		threads.push_back(thread);
+	}
+	LOG(INFO) << "Started " << threads.size() << " registry lookup threads";
+	return !threads.empty();
+}
+
+void SmqLookup::stop()
+{
+	pthread_mutex_lock(&mutex);
+	stopping = true;
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&mutex);
+
+	for (size_t i = 0; i < threads.size(); i++)
+		pthread_join(threads[i], NULL);
+	threads.clear();
+}
+
+std::string SmqLookup::entry_key(Kind kind, const char *key)
+{
+	std::string k(1, (char)('0' + kind));
+	k += key;
+	return k;
+}
+
+bool SmqLookup::lookup(Kind kind, const char *key, int maxAgeMs,
+		       int shard, const char *qtag,
+		       bool &found, std::string &value)
+{
+	time_t now = msgettime();
+	bool useCache = maxAgeMs < 0;
+
+	if (maxAgeMs < 0)
+		maxAgeMs = HOLDMS;
+
+	// The cache has its own locks; most lookups end here, without
+	// taking ours.  Anything held below went into the cache too.
+	if (useCache && cache.get(kind, key, found, value)) {
+		__sync_fetch_and_add(&asked, 1);
+		__sync_fetch_and_add(&answered, 1);
+		__sync_fetch_and_add(&cached, 1);
+		return true;
+	}
+
+	pthread_mutex_lock(&mutex);
+	__sync_fetch_and_add(&asked, 1);
+	expire(now);
+
+	Entry &e = entries[entry_key(kind, key)];
+	if (e.done && now - e.when <= maxAgeMs) {
+		found = e.found;
+		value = e.value;
+		__sync_fetch_and_add(&answered, 1);
+		pthread_mutex_unlock(&mutex);
+		return true;
+	}
+
+	if (qtag) {
+		Waiter w;
+		w.shard = shard;
+		w.qtag = qtag;
+		e.waiters.push_back(w);
+	}
+	if (e.queued) {
+		coalesced++;
+	} else {
+		Job job;
+		job.kind = kind;
+		job.key = key;
+		e.queued = true;
+		jobs.push_back(job);
+		pthread_cond_signal(&cond);
+	}
+	pthread_mutex_unlock(&mutex);
+	return false;
+}
+
+void SmqLookup::queue_cdr(const char *from, const char *dest)
+{
+	Job job;
+	job.cdr = true;
+	job.key = from ? from : "";
+	job.dest = dest ? dest : "";
+
+	pthread_mutex_lock(&mutex);
+	jobs.push_back(job);
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&mutex);
+}
+
+/*
+ * The keys a subscriber's answers may be held under: lookups are keyed
+ * by the username as it was in the message, so an IMSI may be there
+ * with either prefix or none, and a number with or without its "+".
+ */
+static void
+subscriber_keys(const char *imsi, const char *number, std::vector<std::string> &keys)
+{
+	if (imsi && *imsi) {
+		const char *digits = imsi;
+		if (0 == strncmp("IMSI", imsi, 4) || 0 == strncmp("imsi", imsi, 4))
+			digits = imsi + 4;
+		keys.push_back(std::string("IMSI") + digits);
+		keys.push_back(std::string("imsi") + digits);
+		keys.push_back(digits);
+	}
+	if (number && *number) {
+		const char *bare = number[0] == '+' ? number + 1 : number;
+		keys.push_back(bare);
+		keys.push_back(std::string("+") + bare);
+	}
+}
+
+void SmqLookup::invalidate_subscriber(const char *imsi, const char *number)
+{
+	std::vector<std::string> keys;
+	subscriber_keys(imsi, number, keys);
+
+	pthread_mutex_lock(&mutex);
+	invalidations++;
+	for (size_t i = 0; i < keys.size(); i++) {
+		for (int kind = CLID_LOCAL; kind <= CLID_GLOBAL; kind++) {
+			cache.invalidate(kind, keys[i]);
+			// A query already running may have read the old
+			// entry; the new generation tells run_job not to keep
+			// its answer.
+			entry_map::iterator x = entries.find(entry_key((Kind)kind, keys[i].c_str()));
+			if (x != entries.end()) {
+				x->second.done = false;
+				x->second.generation++;
+			}
+		}
+	}
+	pthread_mutex_unlock(&mutex);
+	LOG(DEBUG) << "Invalidated registry lookups for "
+		<< (imsi ? imsi : "-") << " " << (number ? number : "-");
+}
+
+/* Forget answers nobody has come for.  Caller holds the mutex.  */
+void SmqLookup::expire(time_t now)
+{
+	if (now - lastExpire < 1000)
+		return;
+	lastExpire = now;
+	for (entry_map::iterator x = entries.begin(); x != entries.end(); ) {
+		if (!x->second.queued && now - x->second.when > HOLDMS)
+			x = entries.erase(x);
+		else
+			++x;
+	}
+}
+
+bool SmqLookup::query(SubscriberRegistry *hlr, Kind kind,
+		      const std::string &key, std::string &value)
+{
+	char *result = NULL;
+
+	switch (kind) {
+	case CLID_LOCAL:
+		result = hlr->getCLIDLocal(key.c_str());
+		break;
+	case IMSI_OF_NUMBER:
+		result = hlr->getIMSI2(key.c_str());
+		break;
+	case REGISTRATION_IP:
+		result = hlr->getRegistrationIP(key.c_str());
+		break;
+	case CLID_GLOBAL:
+		result = hlr->mapCLIDGlobal(key.c_str());
+		break;
+	}
+	if (!result)
+		return false;
+	value = result;
+	free(result);		// C interface uses free() not delete
+	return true;
+}
+
+void SmqLookup::run_job(SubscriberRegistry *hlr, const Job &job)
+{
+	std::string value;
+	time_t start = msgettime();
+
+	if (job.cdr) {
+		// source, sourceIMSI, dest, date
+		bool found;
+		if (!cache.get(IMSI_OF_NUMBER, job.key, found, value)) {
+			found = query(hlr, IMSI_OF_NUMBER, job.key, value);
+			// Not if anything was invalidated meanwhile; a CDR
+			// has no entry to keep a generation in.
+			pthread_mutex_lock(&mutex);
+			if (invalidations == job.generation)
+				cache.put(IMSI_OF_NUMBER, job.key, found, value);
+			pthread_mutex_unlock(&mutex);
+		}
+		time_t now = time(NULL);  // Need real time for CDR
+		char timebuf[26+/*slop*/4];
+		ctime_r(&now, timebuf);
+		pthread_mutex_lock(&cdrMutex);
+		if (gCDRFile) {
+			fprintf(gCDRFile, "%s,%s,%s,%s", job.key.c_str(),
+				found ? value.c_str() : "(null)", job.dest.c_str(), timebuf);
+			fflush(gCDRFile);
+		}
+		pthread_mutex_unlock(&cdrMutex);
+		pthread_mutex_lock(&mutex);
+		cdrs++;
+		busyMs += msgettime() - start;
+		pthread_mutex_unlock(&mutex);
+		return;
+	}
+
+	bool found = query(hlr, job.kind, job.key, value);
+	time_t now = msgettime();
+	std::vector<Waiter> waiters;
+
+	pthread_mutex_lock(&mutex);
+	queries++;
+	busyMs += now - start;
+	Entry &e = entries[entry_key(job.kind, job.key.c_str())];
+	if (e.generation == job.generation) {
+		if (job.kind == REGISTRATION_IP && found)
+			cache.put(job.kind, job.key, found, value, REGISTRATION_TTLMS);
+		else
+			cache.put(job.kind, job.key, found, value);
+		e.done = true;
+		e.found = found;
+		e.value = value;
+		e.when = now;
+	} else {
+		// Invalidated while we asked: the waiters look again, and
+		// that queries again.
+		stale++;
+	}
+	e.queued = false;
+	waiters.swap(e.waiters);
+	pthread_mutex_unlock(&mutex);
+
+	LOG(DEBUG) << "Lookup " << job.kind << " '" << job.key << "' "
+		<< (found ? value : std::string("not found")) << " in "
+		<< now - start << " ms, " << waiters.size() << " waiting";
+	for (size_t i = 0; i < waiters.size(); i++)
+		smq.lookup_done(waiters[i].shard, waiters[i].qtag);
+}
+
+void *SmqLookup::worker_thread(void *arg)
+{
+	((SmqLookup *) arg)->worker();
+	return NULL;
+}
+
+void SmqLookup::worker()
+{
+	SubscriberRegistry hlr;
+
+	hlr.init();
+	pthread_mutex_lock(&mutex);
+	while (!stopping) {
+		if (jobs.empty()) {
+			pthread_cond_wait(&cond, &mutex);
+			continue;
+		}
+		Job job = jobs.front();
+		jobs.pop_front();
+		// What the answer has to match to be kept.
+		if (job.cdr)
+			job.generation = invalidations;
+		else
+			job.generation = entries[entry_key(job.kind, job.key.c_str())].generation;
+		pthread_mutex_unlock(&mutex);
+		run_job(&hlr, job);
+		pthread_mutex_lock(&mutex);
+	}
+	pthread_mutex_unlock(&mutex);
+}
+
+void SmqLookup::report_stats()
+{
+	pthread_mutex_lock(&mutex);
+	LOG(INFO) << "Registry lookups: " << asked
+		<< " answered at once: " << answered
+		<< " (from cache: " << cached << ")"
+		<< " queries: " << queries
+		<< " coalesced: " << coalesced
+		<< " stale: " << stale
+		<< " CDRs: " << cdrs
+		<< " busy ms: " << busyMs
+		<< " queued: " << jobs.size();
+	pthread_mutex_unlock(&mutex);
+
+	SmqHlrCache::counters c = cache.stats();
+	LOG(INFO) << "Registry cache: " << c.entries << " entries"
+		<< " hits: " << c.hits
+		<< " (not found: " << c.negative_hits << ")"
+		<< " misses: " << c.misses
+		<< " (expired: " << c.expired << ")"
+		<< " evictions: " << c.evictions
+		<< " invalidations: " << c.invalidations;
+}
+
+} // namespace SMqueue
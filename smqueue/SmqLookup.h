@@ -0,0 +1,167 @@
+/*
+* Copyright 2014 Range Networks, Inc.
+*
+* This software is distributed under multiple licenses;
+* see the COPYING file in the main directory for licensing
+* information for this specific distribuion.
+*
+* This use of this software may be subject to additional restrictions.
+* See the LEGAL file in the main directory for details.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+/*
+ * SmqLookup.h
+ *
+ * Subscriber registry lookups, done on a pool of threads so that the
+ * queue never waits for the database.
+ *
+ * A message that needs a lookup asks for it with lookup().  If a recent
+ * enough answer is on hand it gets it straight away; otherwise the query
+ * is queued (or joined, if the same query is already queued or running)
+ * and the message waits in one of the ASKED_FOR_* states.  When the query
+ * finishes, every message that asked is told through
+ * SMq::lookup_done(shard, qtag), which moves it back to the state that
+ * asked, where it finds the answer waiting.
+ *
+ * Answers are kept for HOLDMS so that everybody who asked can pick them
+ * up.  After that, lookups that don't insist on a fresh answer are served
+ * from an SmqHlrCache, until its TTL runs out or the subscriber's entry is
+ * changed and invalidate_subscriber() is called.
+ */
+
+#ifndef SMQLOOKUP_H_
+#define SMQLOOKUP_H_
+
+#include <pthread.h>
+#include <time.h>
+#include <deque>
+#include <string>
+#include <vector>
+#include <tr1/unordered_map>
+
+#include "SmqHlrCache.h"
+
+class SubscriberRegistry;
+
+namespace SMqueue {
+
+class SmqLookup {
+	public:
+	enum Kind {
+		CLID_LOCAL,		// IMSI to local phone number
+		IMSI_OF_NUMBER,		// Phone number to IMSI
+		REGISTRATION_IP,	// IMSI to its cell's host:port
+		CLID_GLOBAL		// Local phone number to global one
+	};
+
+	const static int HOLDMS = 10000;	// How long answers are kept
+	const static int REGISTRATION_TTLMS = 30000;	// Handsets move; don't
+							// cache their cell long
+
+	SmqLookup();
+	~SmqLookup();
+
+	/* Start (or stop and wait for) the lookup threads.  Each thread
+	   has its own connection to the registry.  */
+	bool start(int nthreads);
+	void stop();
+
+	/* Look key up.  If there's an answer no older than maxAgeMs (or,
+	   if maxAgeMs is negative, one held or in the cache), set found and
+	   value and return true.  Otherwise queue the query, note that the message with
+	   this qtag on this shard is waiting for it, and return false.  */
+	bool lookup(Kind kind, const char *key, int maxAgeMs,
+		    int shard, const char *qtag,
+		    bool &found, std::string &value);
+
+	/* Forget everything known about this IMSI and phone number (either
+	   may be NULL), because the registry entry has just changed.  */
+	void invalidate_subscriber(const char *imsi, const char *number);
+
+	/* Set the cache size (0 for none) and TTLs, in ms. */
+	void set_cache_limits(size_t size, int ttlMs, int negativeTtlMs)
+		{ cache.set_limits(size, ttlMs, negativeTtlMs); }
+
+	/* Write a CDR line for a delivered message.  The sender's IMSI is
+	   looked up, and the line written, on a lookup thread.  */
+	void queue_cdr(const char *from, const char *dest);
+
+	/* Log the counters. */
+	void report_stats();
+
+	private:
+	struct Waiter {
+		int shard;
+		std::string qtag;
+	};
+
+	struct Entry {
+		bool done;		// found and value are valid
+		bool found;
+		std::string value;
+		time_t when;		// When it was answered, in ms
+		bool queued;		// A query is queued or running
+		std::vector<Waiter> waiters;
+		unsigned long generation;	// invalidate_subscriber() calls
+
+		Entry() : done(false), found(false), value(), when(0),
+			queued(false), waiters(), generation(0) {}
+	};
+
+	/* Something for a lookup thread to do.  A lookup is keyed by kind
+	   and key; a CDR carries the from and dest usernames.  */
+	struct Job {
+		bool cdr;
+		Kind kind;
+		std::string key;
+		std::string dest;
+		unsigned long generation;	// Of the entry (or invalidations,
+						// for a CDR) when it started
+
+		Job() : cdr(false), kind(CLID_LOCAL), key(), dest(), generation(0) {}
+	};
+
+	typedef std::tr1::unordered_map<std::string, Entry> entry_map;
+
+	static std::string entry_key(Kind kind, const char *key);
+	static bool query(SubscriberRegistry *hlr, Kind kind,
+			  const std::string &key, std::string &value);
+	static void *worker_thread(void *arg);
+	void worker();
+	void run_job(SubscriberRegistry *hlr, const Job &job);
+	void expire(time_t now);
+
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	pthread_mutex_t cdrMutex;
+	entry_map entries;
+	std::deque<Job> jobs;
+	std::vector<pthread_t> threads;
+	bool stopping;
+	time_t lastExpire;
+	unsigned long invalidations;	// invalidate_subscriber() calls
+	SmqHlrCache cache;		// Has its own locks
+
+	// Counters, under mutex, but for the first three, which lookup()
+	// counts without it when the cache answers.
+	unsigned long asked;		// Calls to lookup()
+	unsigned long answered;		// ... answered straight away
+	unsigned long cached;		// ... from the cache
+	unsigned long queries;		// Registry queries run
+	unsigned long coalesced;	// Lookups that joined a queued query
+	unsigned long stale;		// Answers dropped, invalidated meanwhile
+	unsigned long cdrs;		// CDR lines written
+	time_t busyMs;			// Time spent in the registry
+
+	// No copying.
+	SmqLookup(const SmqLookup &);
+	SmqLookup & operator= (const SmqLookup &);
+};
+
+} // namespace SMqueue
+
+#endif /* SMQLOOKUP_H_ */
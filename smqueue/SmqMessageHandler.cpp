@@ -33,16 +33,34 @@
 SmqReader* smqReader;
 SmqWriter* smqWriter;
 
+SmqMessageHandler::Backend SmqMessageHandler::backend = SmqMessageHandler::RingBackend;
+
 
 // Static function to start the threads
 void SmqMessageHandler::StartThreads() {
-	LOG(INFO) << "Start reader and writer threads";
+	if (gConfig.defines("Queue.Handoff") && gConfig.getStr("Queue.Handoff") == "mqueue")
+		backend = MqueueBackend;
+	else
+		backend = RingBackend;
+	LOG(INFO) << "Start reader and writer threads, passing messages through "
+		<< (backend == RingBackend ? "a ring" : "POSIX message queues");
 	smqReader = new SmqReader();
 	smqWriter = new SmqWriter();
 }
 
 
+// Wait for the reader thread, which runs the queue, to finish
+void SmqMessageHandler::WaitForThreads() {
+	smqReader->join();
+}
+
+
 SmqMessageHandler::~SmqMessageHandler() {
+	if (ring) {
+		// Messages still in the ring are dropped with it.
+		delete ring;
+		return;
+	}
 	/* Close the message queue */
 	int ret = mq_close(mqdes);
 	if (ret)
@@ -52,6 +70,23 @@ SmqMessageHandler::~SmqMessageHandler() {
 }
 
 
+/*
+ * Pass a message to the thread reading this queue, which calls
+ * ProcessMessage() and then release() on it.
+returns
+	0 = sent okay
+	-1 failed
+ */
+int SmqMessageHandler::SmqSendMessage(QueuedMsgHdrs * pMsg) {
+	if (ring) {
+		ring->push(pMsg);	// Waits, if the ring is full
+		return 0;
+	}
+	SimpleWrapper sWrap(pMsg);
+	return SmqSendMessage(&sWrap);
+}
+
+
 /*
 returns
 	0 = sent okay
@@ -92,6 +127,16 @@ int SmqMessageHandler::SmqSendMessage(SimpleWrapper * pMsg) {
 }
 
 
+/*
+ * Make SmqWaitforMessage return early, without a message.  With the
+ * message queue backend there's no way to, so it waits out its timeout.
+ */
+void SmqMessageHandler::SmqInterrupt() {
+	if (ring)
+		ring->interrupt();
+}
+
+
 int SmqMessageHandler::SmqDeleteMessage() {
 	return 0;
 }
@@ -120,6 +165,18 @@ int SmqMessageHandler::SmqWaitforMessage(int TimeoutMS, char * MsgBuffer, int Ms
 
 	//LOG(DEBUG) << "Waiting for message in queue:" << getQueueName() << " tmo:" << TimeoutMS << " bufsize:" << MsgBufferSize;
 
+	if (ring) {
+		// Hand back the same SimpleWrapper the message queue would.
+		QueuedMsgHdrs *pMsg;
+		if (MsgBufferSize < (int) sizeof(SimpleWrapper))
+			return -1;
+		if (!ring->pop(pMsg) && !(ring->wait(TimeoutMS) && ring->pop(pMsg)))
+			return 0;	// Timeout
+		SimpleWrapper sWrap(pMsg);
+		memcpy(MsgBuffer, &sWrap, sizeof(sWrap));
+		return sizeof(sWrap);
+	}
+
 	// Wait for queue to open.  This may not be needed
 	while (!queueOpened()) {
 		LOG(DEBUG) << "Try to open queue:" << getQueueName() << " in SmqWaitforMessage";
@@ -224,6 +281,9 @@ long SmqMessageHandler::getMessageQueueSize() {
 	long count = -1;
 	struct mq_attr localAttr;
 
+	if (ring)
+		return ring->size();
+
 	error = mq_getattr(mqdes, &localAttr);
 	if (!error)
 		count = localAttr.mq_curmsgs;
@@ -234,13 +294,10 @@ long SmqMessageHandler::getMessageQueueSize() {
 
 /*
  * Send a QueuedMsgHdrs to writer queue
- * Deleted SimpleWrapper receiver deletes attached message
+ * Receiver releases the message
  */
-int SendWriterMsg(SimpleWrapper* pMsg) {
-	int iret;
-	iret = smqWriter->getqueHan()->SmqSendMessage(pMsg);
-	delete pMsg;  // Delete SimpleWrapper
-	return iret;
+int SendWriterMsg(QueuedMsgHdrs* pMsg) {
+	return smqWriter->getqueHan()->SmqSendMessage(pMsg);
 }
 
 
@@ -249,26 +306,32 @@ int SendWriterMsg(SimpleWrapper* pMsg) {
  */
 void queue_respond_sip_ack(int errcode, SMqueue::short_msg_pending *shortmsg, char * netaddr, size_t netaddrlen) {
 	LOG(DEBUG) << "Send SIP ACK queue request";
-	QueuedMsgHdrs* pMsg = new SIPAckMessage(errcode, shortmsg, netaddr, netaddrlen);
-	SimpleWrapper* sWrap = new SimpleWrapper(pMsg);
-	SendWriterMsg(sWrap);  // Message gets deleted in here
+	SIPAckMessage* pMsg = SIPAckMessage::pool.get();
+	pMsg->setErrcode(errcode);
+	pMsg->setSmp(shortmsg);
+	pMsg->setNetaddr(netaddr);
+	pMsg->setNetaddrlen(netaddrlen);
+	SendWriterMsg(pMsg);  // Receiver releases it
 }
 
 
 // Signal writer thread to process incoming message
 void ProcessReceivedMsg() {
 	LOG(DEBUG) << "Signal writer thread ProcessReceivedMsg";
-	QueuedMsgHdrs* pMsg = new ProcessIncommingMsg();
-	SimpleWrapper* sWrap = new SimpleWrapper(pMsg);
-	SendWriterMsg(sWrap);
+	SendWriterMsg(ProcessIncommingMsg::pool.get());
+}
+
+
+// Wake the writer thread, e.g. to notice that we're stopping
+void WakeWriterThread() {
+	if (smqWriter)
+		smqWriter->getqueHan()->SmqInterrupt();
 }
 
 
 // Only used for testing
 void SendTestMessage() {
-	QueuedMsgHdrs* pMsg = new TestMessage("Test message from reader thread");
-	SimpleWrapper* sWrap = new SimpleWrapper(pMsg);
-	SendWriterMsg(sWrap);  // Message gets deleted in here
+	SendWriterMsg(new TestMessage("Test message from reader thread"));  // Receiver releases it
 }
 
 
@@ -36,8 +36,11 @@ extern ConfigurationTable gConfig;
 
 #include <string>
 #include "SmqGlobals.h"
+#include "SmqMpscQueue.h"
 #include <unistd.h>
 
+class QueuedMsgHdrs;
+
 void queue_respond_sip_ack(int errcode, SMqueue::short_msg_pending *shortmsg, char * netaddr, size_t netaddrlen);
 void ProcessReceivedMsg();
 void SendTestMessage();
@@ -54,6 +57,7 @@ These are the upper limit on queue sizes
 #define MQ_MESSAGE_MAX_SIZE 1100
 #define MQ_MAX_NUM_OF_MESSAGES 100
 #define MQ_MODE (S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)
+#define RING_NUM_OF_MESSAGES 4096
 
 /*
 errno
@@ -65,9 +69,22 @@ errno
  */
 class SmqMessageHandler {
 public:
+	// How messages get from one thread to another.  The ring passes
+	// the message pointers in memory; the POSIX message queue is the
+	// original way, kept for compatibility.
+	enum Backend {
+		RingBackend,
+		MqueueBackend
+	};
+	static Backend backend;
+
 	static void StartThreads();
+	static void WaitForThreads();
 
 	SmqMessageHandler(string queueName) {
+		ring = (backend == RingBackend)
+			? new SMqueue::SmqMpscQueue<QueuedMsgHdrs*>(RING_NUM_OF_MESSAGES)
+			: NULL;
 		/* Form the queue attributes */
 		attr.mq_flags = 0; /* i.e mq_send will be block if message queue is full */
 		attr.mq_maxmsg = MQ_MAX_NUM_OF_MESSAGES;
@@ -90,6 +107,8 @@ public:
 
 	// Send functions
 	int SmqSendMessage(SimpleWrapper * pMsg);
+	int SmqSendMessage(QueuedMsgHdrs * pMsg);
+	void SmqInterrupt();
 
 private:
 	// Message queue
@@ -102,6 +121,9 @@ private:
 
 	string mqueueName; // Name used with this message queue
 	bool mqueueOpened;
+
+	// Ring, if that's the backend
+	SMqueue::SmqMpscQueue<QueuedMsgHdrs*> *ring;
 };
 
 #endif /* SMQMESSAGEHANDLER_H_ */
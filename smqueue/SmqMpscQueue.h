@@ -0,0 +1,280 @@
+/*
+* Copyright 2014 Range Networks, Inc.
+*
+* This software is distributed under multiple licenses;
+* see the COPYING file in the main directory for licensing
+* information for this specific distribuion.
+*
+* This use of this software may be subject to additional restrictions.
+* See the LEGAL file in the main directory for details.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+/*
+ * SmqMpscQueue.h
+ *
+ * Passing messages between threads of smqueue without a trip through
+ * the kernel for each one.
+ *
+ * SmqMpscQueue is a bounded ring that any number of threads may push to
+ * and one thread pops from.  Pushing and popping take no locks: each slot
+ * carries a sequence number that says whether it is free for the producer
+ * whose ticket is that number, or full for the consumer.  A sleeping
+ * consumer is woken through an eventfd, which is written at most once
+ * per sleep no matter how many messages arrive, so a busy consumer costs
+ * no syscalls at all.
+ *
+ * SmqFreeList keeps objects that have been used, so the messages passed
+ * through the ring aren't new'ed and deleted every time.
+ *
+ * Both only depend on pthreads and the gcc __sync builtins, so the
+ * benchmark in testing/ can use them without the rest of smqueue.
+ */
+
+#ifndef SMQMPSCQUEUE_H_
+#define SMQMPSCQUEUE_H_
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <vector>
+
+namespace SMqueue {
+
+template <class T>
+class SmqMpscQueue {
+public:
+	/* capacity is rounded up to a power of two.  Without wakeable,
+	   there's no eventfd: the consumer sleeps on something of its own,
+	   and wait() just naps.  */
+	SmqMpscQueue(size_t capacity = 4096, bool wakeable = true) :
+		mask (0),
+		cells (NULL),
+		head (0),
+		tail (0),
+		pending (0),
+		fullWaits (0)
+	{
+		size_t size = 2;
+		while (size < capacity)
+			size <<= 1;
+		mask = size - 1;
+		cells = new Cell[size];
+		for (size_t i = 0; i < size; i++)
+			cells[i].seq = i;
+		efd = wakeable ? eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC) : -1;
+		epfd = wakeable ? epoll_create(1) : -1;
+		if (efd >= 0 && epfd >= 0) {
+			struct epoll_event ev;
+			ev.events = EPOLLIN;
+			ev.data.fd = efd;
+			epoll_ctl(epfd, EPOLL_CTL_ADD, efd, &ev);
+		}
+	}
+
+	~SmqMpscQueue() {
+		if (epfd >= 0)
+			close(epfd);
+		if (efd >= 0)
+			close(efd);
+		delete [] cells;
+	}
+
+	/* Add an item, from any thread.  If the ring is full, wait for the
+	   consumer to make room, as mq_send does.  */
+	void push(const T &item) {
+		while (!try_push(item)) {
+			__sync_fetch_and_add(&fullWaits, 1);
+			wake();
+			sched_yield();
+		}
+		wake();
+	}
+
+	/* Add an item if there's room.  Doesn't wake the consumer.  */
+	bool try_push(const T &item) {
+		size_t pos = tail;
+		Cell *cell;
+		for (;;) {
+			cell = &cells[pos & mask];
+			size_t seq = cell->seq;
+			__sync_synchronize();
+			intptr_t dif = (intptr_t) seq - (intptr_t) pos;
+			if (dif == 0) {
+				if (__sync_bool_compare_and_swap(&tail, pos, pos + 1))
+					break;
+				pos = tail;
+			} else if (dif < 0) {
+				return false;	// Full
+			} else {
+				pos = tail;	// Another producer got this slot
+			}
+		}
+		cell->item = item;
+		__sync_synchronize();
+		cell->seq = pos + 1;
+		return true;
+	}
+
+	/* Take the oldest item, from the consumer thread only.  */
+	bool pop(T &item) {
+		Cell *cell = &cells[head & mask];
+		size_t seq = cell->seq;
+		__sync_synchronize();
+		if ((intptr_t) seq - (intptr_t) (head + 1) != 0)
+			return false;	// Empty, or a producer is still writing
+		item = cell->item;
+		__sync_synchronize();
+		cell->seq = head + mask + 1;
+		head++;
+		return true;
+	}
+
+	/* Wait up to timeoutMs for pop() to have something, from the
+	   consumer thread only.  Result is false on timeout.  */
+	bool wait(int timeoutMs) {
+		// Let the next producer wake us, then look again in case one
+		// pushed before it could see that.
+		__sync_lock_release(&pending);
+		__sync_synchronize();
+		if (!empty())
+			return true;
+		if (efd < 0 || epfd < 0) {
+			usleep(1000);
+			return !empty();
+		}
+		struct epoll_event ev;
+		int n = epoll_wait(epfd, &ev, 1, timeoutMs);
+		if (n > 0) {
+			uint64_t count;
+			ssize_t ignored = read(efd, &count, sizeof(count));
+			(void) ignored;
+		}
+		return !empty();
+	}
+
+	/* A snapshot; only exact on the consumer thread.  */
+	bool empty() const {
+		const Cell *cell = &cells[head & mask];
+		return cell->seq != head + 1;
+	}
+
+	size_t size() const { return tail - head; }
+	size_t capacity() const { return mask + 1; }
+
+	/* Wake the consumer even though nothing was pushed. */
+	void interrupt() {
+		uint64_t one = 1;
+		ssize_t ignored = write(efd, &one, sizeof(one));
+		(void) ignored;
+	}
+
+	/* How many times a producer found the ring full. */
+	unsigned long full_waits() const { return fullWaits; }
+
+private:
+	struct Cell {
+		volatile size_t seq;
+		T item;
+	};
+
+	void wake() {
+		__sync_synchronize();
+		if (efd >= 0 && !__sync_lock_test_and_set(&pending, 1)) {
+			uint64_t one = 1;
+			ssize_t ignored = write(efd, &one, sizeof(one));
+			(void) ignored;
+		}
+	}
+
+	size_t mask;
+	Cell *cells;
+	int efd;
+	int epfd;			// Just efd, so wait() can have a timeout
+	// Consumer and producer ends on separate cache lines.
+	char pad0[64];
+	volatile size_t head;
+	char pad1[64];
+	volatile size_t tail;
+	char pad2[64];
+	volatile int pending;		// The eventfd has been written
+	volatile unsigned long fullWaits;
+
+	// No copying.
+	SmqMpscQueue(const SmqMpscQueue &);
+	SmqMpscQueue & operator= (const SmqMpscQueue &);
+};
+
+
+/*
+ * Used objects of type T, for reuse.  get() hands back a used one if
+ * there is one, or a new one.  put() keeps up to maxFree of them and
+ * deletes the rest.  The lock is held for a push_back or pop_back.
+ */
+template <class T>
+class SmqFreeList {
+public:
+	SmqFreeList(size_t maxFree = 1024) :
+		objects (),
+		maxFree (maxFree),
+		reused (0),
+		allocated (0)
+	{
+		pthread_mutex_init(&mutex, NULL);
+	}
+
+	~SmqFreeList() {
+		for (size_t i = 0; i < objects.size(); i++)
+			delete objects[i];
+		pthread_mutex_destroy(&mutex);
+	}
+
+	T *get() {
+		T *obj = NULL;
+		pthread_mutex_lock(&mutex);
+		if (!objects.empty()) {
+			obj = objects.back();
+			objects.pop_back();
+			reused++;
+		} else {
+			allocated++;
+		}
+		pthread_mutex_unlock(&mutex);
+		return obj ? obj : new T();
+	}
+
+	void put(T *obj) {
+		pthread_mutex_lock(&mutex);
+		if (objects.size() < maxFree) {
+			objects.push_back(obj);
+			obj = NULL;
+		}
+		pthread_mutex_unlock(&mutex);
+		delete obj;
+	}
+
+	unsigned long reuse_count() const { return reused; }
+	unsigned long alloc_count() const { return allocated; }
+
+private:
+	pthread_mutex_t mutex;
+	std::vector<T *> objects;
+	size_t maxFree;
+	unsigned long reused;
+	unsigned long allocated;
+
+	// No copying.
+	SmqFreeList(const SmqFreeList &);
+	SmqFreeList & operator= (const SmqFreeList &);
+};
+
+} // namespace SMqueue
+
+#endif /* SMQMPSCQUEUE_H_ */
@@ -0,0 +1,173 @@
+/*
+* Copyright 2014 Range Networks, Inc.
+*
+* This software is distributed under multiple licenses;
+* see the COPYING file in the main directory for licensing
+* information for this specific distribuion.
+*
+* This use of this software may be subject to additional restrictions.
+* See the LEGAL file in the main directory for details.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+/*
+ * SmqReactor.cpp
+ *
+ * epoll, timerfd and eventfd for a waiting thread.  See SmqReactor.h.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+#include "SmqReactor.h"
+
+#include <Logger.h>
+
+namespace SMqueue {
+
+SmqReactor::SmqReactor() :
+	epfd (-1),
+	timerfd (-1),
+	eventfd (-1),
+	armedFor (NEVER),
+	ioWakeups (0),
+	timerWakeups (0),
+	wokenWakeups (0)
+{
+}
+
+SmqReactor::~SmqReactor()
+{
+	if (eventfd >= 0)
+		close(eventfd);
+	if (timerfd >= 0)
+		close(timerfd);
+	if (epfd >= 0)
+		close(epfd);
+}
+
+bool SmqReactor::open()
+{
+	if (epfd >= 0)
+		return true;
+
+	epfd = epoll_create(16);
+	// msgettime() is CLOCK_REALTIME, so deadlines are too.
+	timerfd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+	eventfd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (epfd < 0 || timerfd < 0 || eventfd < 0) {
+		LOG(ALERT) << "Can't make epoll, timer or event fd: " << strerror(errno);
+		int *fds[3] = { &epfd, &timerfd, &eventfd };
+		for (int i = 0; i < 3; i++) {
+			if (*fds[i] >= 0)
+				close(*fds[i]);
+			*fds[i] = -1;
+		}
+		return false;
+	}
+	(void) fcntl(epfd, F_SETFD, FD_CLOEXEC);
+
+	// The timer and wakeup fds are told apart from watched fds by
+	// their fd numbers.
+	return watch(timerfd, EPOLLIN) && watch(eventfd, EPOLLIN);
+}
+
+bool SmqReactor::watch(int fd, uint32_t events)
+{
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.fd = fd;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		LOG(ERR) << "Can't watch fd " << fd << ": " << strerror(errno);
+		return false;
+	}
+	return true;
+}
+
+bool SmqReactor::modify(int fd, uint32_t events)
+{
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.fd = fd;
+	return epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev) == 0;
+}
+
+void SmqReactor::unwatch(int fd)
+{
+	struct epoll_event ev;		// Ignored, but old kernels want one
+	(void) epoll_ctl(epfd, EPOLL_CTL_DEL, fd, &ev);
+}
+
+void SmqReactor::set_deadline(time_t whenMs)
+{
+	if (whenMs == armedFor || timerfd < 0)
+		return;
+
+	struct itimerspec its;
+	memset(&its, 0, sizeof(its));
+	if (whenMs != NEVER) {
+		its.it_value.tv_sec = whenMs / 1000;
+		its.it_value.tv_nsec = (whenMs % 1000) * 1000000L;
+		if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0)
+			its.it_value.tv_nsec = 1;	// All zero would disarm it
+	}
+	if (timerfd_settime(timerfd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+		LOG(ERR) << "Can't set timer: " << strerror(errno);
+		return;
+	}
+	armedFor = whenMs;
+}
+
+void SmqReactor::wake()
+{
+	uint64_t one = 1;
+	ssize_t ignored = write(eventfd, &one, sizeof(one));
+	(void) ignored;
+}
+
+int SmqReactor::wait(int timeoutMs, std::vector<struct epoll_event> &ready)
+{
+	struct epoll_event events[16];
+	uint64_t count;
+	ssize_t ignored;
+
+	ready.clear();
+	if (epfd < 0) {
+		// No epoll; don't spin.
+		usleep((timeoutMs < 0 || timeoutMs > 1000 ? 1000 : timeoutMs) * 1000);
+		return 0;
+	}
+
+	int n = epoll_wait(epfd, events, 16, timeoutMs < 0 ? -1 : timeoutMs);
+	if (n < 0)
+		return errno == EINTR ? 0 : -1;
+
+	for (int i = 0; i < n; i++) {
+		int fd = events[i].data.fd;
+		if (fd == timerfd) {
+			ignored = read(timerfd, &count, sizeof(count));
+			armedFor = NEVER;
+			timerWakeups++;
+		} else if (fd == eventfd) {
+			ignored = read(eventfd, &count, sizeof(count));
+			wokenWakeups++;
+		} else {
+			ready.push_back(events[i]);
+		}
+	}
+	(void) ignored;
+	if (!ready.empty())
+		ioWakeups++;
+	return ready.size();
+}
+
+} // namespace SMqueue
@@ -0,0 +1,94 @@
+/*
+* Copyright 2014 Range Networks, Inc.
+*
+* This software is distributed under multiple licenses;
+* see the COPYING file in the main directory for licensing
+* information for this specific distribuion.
+*
+* This use of this software may be subject to additional restrictions.
+* See the LEGAL file in the main directory for details.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+/*
+ * SmqReactor.h
+ *
+ * What a smqueue thread sleeps on: an epoll set holding the file
+ * descriptors the thread reads, a timerfd armed to the thread's next
+ * deadline, and an eventfd that other threads write to wake it.
+ *
+ * A thread with nothing to do and no deadline sleeps until somebody
+ * wakes it, so an idle smqueue doesn't keep waking up to look around;
+ * one with a deadline is woken by the kernel when it passes, to the
+ * millisecond, rather than at the next poll interval.
+ *
+ * One thread waits on a reactor; wake() may be called from any thread.
+ */
+
+#ifndef SMQREACTOR_H_
+#define SMQREACTOR_H_
+
+#include <stdint.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <vector>
+
+namespace SMqueue {
+
+class SmqReactor {
+	public:
+	const static time_t NEVER = 0;	// No deadline
+
+	SmqReactor();
+	~SmqReactor();
+
+	/* Make the epoll set, timer and wakeup fd.  Result is false if the
+	   kernel won't give us one of them.  */
+	bool open();
+	bool is_open() const { return epfd >= 0; }
+
+	/* Add, change or remove a file descriptor to wait for.  events are
+	   EPOLLIN etc.  */
+	bool watch(int fd, uint32_t events);
+	bool modify(int fd, uint32_t events);
+	void unwatch(int fd);
+
+	/* Wake the waiter when msgettime() reaches whenMs; NEVER disarms.
+	   Only the waiting thread sets its deadline.  */
+	void set_deadline(time_t whenMs);
+
+	/* Wake the waiter now, from any thread. */
+	void wake();
+
+	/* Wait up to timeoutMs (-1 for no limit) for a watched fd, the
+	   deadline, or wake().  The ready watched fds are left in ready.
+	   Result is how many there are; 0 if woken or timed out; < 0 on
+	   error.  */
+	int wait(int timeoutMs, std::vector<struct epoll_event> &ready);
+
+	/* How many times wait() returned for each reason. */
+	unsigned long io_wakeups() const { return ioWakeups; }
+	unsigned long timer_wakeups() const { return timerWakeups; }
+	unsigned long woken_wakeups() const { return wokenWakeups; }
+
+	private:
+	int epfd;
+	int timerfd;
+	int eventfd;
+	time_t armedFor;		// What timerfd is set to, ms
+
+	unsigned long ioWakeups;
+	unsigned long timerWakeups;
+	unsigned long wokenWakeups;
+
+	// No copying.
+	SmqReactor(const SmqReactor &);
+	SmqReactor & operator= (const SmqReactor &);
+};
+
+} // namespace SMqueue
+
+#endif /* SMQREACTOR_H_ */
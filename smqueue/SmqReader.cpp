@@ -53,7 +53,8 @@ void* SmqReader::SmqReaderThread(void* ptr) {
 	LOG(DEBUG) << "Enter reader thread loop";
 	while (!smq.stop_main_loop) {
 
-		smq.main_loop(60000);
+		// No timeout: request_stop() wakes us.
+		smq.main_loop(-1);
 
 #if 0
 		// Put this back in if process messages in reader thread
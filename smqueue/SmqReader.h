@@ -39,6 +39,11 @@ public:
 	~SmqReader();
 	static void* SmqReaderThread(void * ptr);
 
+	// Wait for the thread to finish
+	void join() {
+		pthread_join(mthread_ID, NULL);
+	}
+
 	// get handle to message queue
 	SmqMessageHandler * getqueHan() {
 		return mqueHan;
@@ -0,0 +1,264 @@
+/*
+* Copyright 2014 Range Networks, Inc.
+*
+* This software is distributed under multiple licenses;
+* see the COPYING file in the main directory for licensing
+* information for this specific distribuion.
+*
+* This use of this software may be subject to additional restrictions.
+* See the LEGAL file in the main directory for details.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+/*
+ * SmqRouteCache.cpp
+ *
+ * The destination address cache.  See SmqRouteCache.h.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <netdb.h>
+
+#include "SmqRouteCache.h"
+#include "SmqGlobals.h"
+
+#include <Logger.h>
+
+namespace SMqueue {
+
+SmqRouteCache::SmqRouteCache() :
+	lru (),
+	index (),
+	retired (),
+	counts (),
+	maxEntries (1024),
+	ttl (60000),
+	negativeTtl (5000),
+	connect (false)
+{
+	pthread_mutex_init(&mutex, NULL);
+}
+
+SmqRouteCache::~SmqRouteCache()
+{
+	for (lru_list::iterator x = lru.begin(); x != lru.end(); ++x)
+		for (size_t i = 0; i < x->routes.size(); i++)
+			if (x->routes[i].connfd >= 0)
+				close(x->routes[i].connfd);
+	close_retired(0, true);
+	pthread_mutex_destroy(&mutex);
+}
+
+void SmqRouteCache::set_limits(size_t size, int ttlMs, int negativeTtlMs, bool connectThem)
+{
+	pthread_mutex_lock(&mutex);
+	maxEntries = size;
+	ttl = ttlMs;
+	negativeTtl = negativeTtlMs;
+	connect = connectThem;
+	while (index.size() > maxEntries) {
+		drop(--lru.end());
+		counts.evictions++;
+	}
+	pthread_mutex_unlock(&mutex);
+}
+
+std::string SmqRouteCache::route_key(const char *host, const char *port)
+{
+	std::string k(host);
+	k += ':';
+	k += port;
+	return k;
+}
+
+bool SmqRouteCache::resolve(const char *host, const char *port, std::vector<route> &routes)
+{
+	struct addrinfo myhints;
+	struct addrinfo *myaddrs, *ap;
+	int s;
+
+	memset(&myhints, 0, sizeof(myhints));
+	myhints.ai_family = AF_UNSPEC;		// Any address family eg v4/6
+	myhints.ai_socktype = SOCK_DGRAM;	// Datagrams for now FIXME
+#ifdef AI_IDN
+	myhints.ai_flags = AI_IDN;		// Int'l dom names OK.
+#endif
+	s = getaddrinfo(host, port, &myhints, &myaddrs);
+	if (s != 0) {
+		LOG(ERR) << "Can't lookup addr/port: " << host << ":" << port
+			<< ", error " << s;
+		return false;
+	}
+	for (ap = myaddrs; ap != NULL; ap = ap->ai_next) {
+		route r;
+		if (ap->ai_addrlen > sizeof(r.addr))
+			continue;
+		memset(&r, 0, sizeof(r));
+		memcpy(&r.addr, ap->ai_addr, ap->ai_addrlen);
+		r.addrlen = ap->ai_addrlen;
+		r.family = ap->ai_family;
+		r.socktype = ap->ai_socktype;
+		r.protocol = ap->ai_protocol;
+		r.fd = -1;
+		r.connfd = -1;
+		routes.push_back(r);
+	}
+	freeaddrinfo(myaddrs);		// Don't leak memory.
+	return !routes.empty();
+}
+
+bool SmqRouteCache::get(const char *host, const char *port, route &r)
+{
+	std::string key = route_key(host, port);
+	time_t now = msgettime();
+
+	pthread_mutex_lock(&mutex);
+	close_retired(now, false);
+	node_map::iterator x = index.find(key);
+	if (x != index.end() && x->second->expires > now) {
+		lru.splice(lru.begin(), lru, x->second);
+		counts.hits++;
+		Node &n = *x->second;
+		if (n.routes.empty()) {
+			counts.negative_hits++;
+			pthread_mutex_unlock(&mutex);
+			return false;
+		}
+		r = n.routes[n.current];
+		if (!connect)
+			r.connfd = -1;
+		pthread_mutex_unlock(&mutex);
+		return true;
+	}
+	if (x != index.end()) {
+		counts.expired++;
+		drop(x->second);
+	}
+	counts.misses++;
+	pthread_mutex_unlock(&mutex);
+
+	// Resolve without holding the lock; the resolver can take a while.
+	std::vector<route> routes;
+	bool ok = resolve(host, port, routes);
+
+	pthread_mutex_lock(&mutex);
+	counts.resolves++;
+	if (!ok)
+		counts.resolve_failures++;
+	int ttlMs = ok ? ttl : negativeTtl;
+	if (maxEntries && ttlMs > 0) {
+		// Another thread may have resolved it meanwhile; ours is newer.
+		x = index.find(key);
+		if (x != index.end())
+			drop(x->second);
+		Node n;
+		n.key = key;
+		n.routes = routes;
+		n.current = 0;
+		n.expires = now + ttlMs;
+		lru.push_front(n);
+		index.insert(node_map::value_type(key, lru.begin()));
+		while (index.size() > maxEntries) {
+			drop(--lru.end());
+			counts.evictions++;
+		}
+	}
+	pthread_mutex_unlock(&mutex);
+
+	if (!ok)
+		return false;
+	r = routes[0];
+	return true;
+}
+
+int SmqRouteCache::set_socket(const char *host, const char *port, int fd)
+{
+	int connfd = -1;
+
+	pthread_mutex_lock(&mutex);
+	node_map::iterator x = index.find(route_key(host, port));
+	if (x != index.end() && !x->second->routes.empty()) {
+		route &rt = x->second->routes[x->second->current];
+		rt.fd = fd;
+		if (connect && rt.connfd < 0) {
+			int s = socket(rt.family, rt.socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+				       rt.protocol);
+			if (s >= 0 && ::connect(s, (struct sockaddr *) &rt.addr, rt.addrlen) == 0) {
+				rt.connfd = s;
+				counts.connected++;
+			} else {
+				LOG(WARNING) << "Can't connect a socket to " << host << ":"
+					<< port << ": " << strerror(errno);
+				if (s >= 0)
+					close(s);
+			}
+		}
+		if (connect)
+			connfd = rt.connfd;
+	}
+	pthread_mutex_unlock(&mutex);
+	return connfd;
+}
+
+void SmqRouteCache::failed(const char *host, const char *port)
+{
+	pthread_mutex_lock(&mutex);
+	node_map::iterator x = index.find(route_key(host, port));
+	if (x != index.end()) {
+		Node &n = *x->second;
+		counts.failovers++;
+		if (n.current < n.routes.size()) {
+			retire(n.routes[n.current].connfd);
+			n.routes[n.current].connfd = -1;
+		}
+		if (++n.current >= n.routes.size())
+			drop(x->second);	// Out of addresses; resolve again
+	}
+	pthread_mutex_unlock(&mutex);
+}
+
+/* Called with the lock held. */
+void SmqRouteCache::drop(lru_list::iterator x)
+{
+	for (size_t i = 0; i < x->routes.size(); i++)
+		retire(x->routes[i].connfd);
+	index.erase(x->key);
+	lru.erase(x);
+}
+
+/* Called with the lock held. */
+void SmqRouteCache::retire(int fd)
+{
+	if (fd < 0)
+		return;
+	retired.push_back(std::make_pair(fd, msgettime()));
+	counts.connected--;
+}
+
+/* Called with the lock held, or from the destructor. */
+void SmqRouteCache::close_retired(time_t now, bool all)
+{
+	size_t i = 0;
+	while (i < retired.size() && (all || retired[i].second + RETIRE_MS <= now)) {
+		close(retired[i].first);
+		i++;
+	}
+	if (i)
+		retired.erase(retired.begin(), retired.begin() + i);
+}
+
+SmqRouteCache::counters SmqRouteCache::stats()
+{
+	pthread_mutex_lock(&mutex);
+	counters c = counts;
+	c.entries = index.size();
+	pthread_mutex_unlock(&mutex);
+	return c;
+}
+
+} // namespace SMqueue
@@ -0,0 +1,138 @@
+/*
+* Copyright 2014 Range Networks, Inc.
+*
+* This software is distributed under multiple licenses;
+* see the COPYING file in the main directory for licensing
+* information for this specific distribuion.
+*
+* This use of this software may be subject to additional restrictions.
+* See the LEGAL file in the main directory for details.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+/*
+ * SmqRouteCache.h
+ *
+ * Where to send datagrams for a host and port, so that delivering a
+ * message doesn't call getaddrinfo and hunt for a matching socket every
+ * time.  Messages go to a handful of BTSs, over and over.
+ *
+ * Each entry holds the addresses getaddrinfo gave for the host and
+ * port, which of them we're using, and the socket its owner chose to
+ * send to it on.  A host that doesn't resolve is remembered too, for a
+ * shorter time, so a bad request URI doesn't hit the resolver on every
+ * retry.  When a send fails, failed() moves the entry on to the next
+ * address, as deliver_msg_datagram used to do within one delivery.
+ *
+ * Optionally, each entry gets its own UDP socket connect()ed to the
+ * address, so the kernel doesn't look up the route for each datagram.
+ * These sockets only send: they're on an ephemeral port, and replies
+ * come back to the port named in our Via.
+ */
+
+#ifndef SMQROUTECACHE_H_
+#define SMQROUTECACHE_H_
+
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <list>
+#include <string>
+#include <vector>
+#include <tr1/unordered_map>
+
+namespace SMqueue {
+
+class SmqRouteCache {
+	public:
+	struct route {
+		struct sockaddr_storage addr;
+		socklen_t addrlen;
+		int family;
+		int socktype;
+		int protocol;
+		int fd;		// Socket to send to addr on; -1 until set_socket()
+		int connfd;	// Socket connected to addr, or -1
+	};
+
+	SmqRouteCache();
+	~SmqRouteCache();
+
+	/* Size in entries (0 turns the cache off, so every get() resolves),
+	   how long resolved and unresolvable hosts are remembered, in ms,
+	   and whether to make connected sockets.  */
+	void set_limits(size_t size, int ttlMs, int negativeTtlMs, bool connect);
+
+	/* The route to host:port, resolving it if it isn't cached.  Result
+	   is false if it doesn't resolve.  */
+	bool get(const char *host, const char *port, route &r);
+
+	/* Remember the socket to send to host:port on, and connect a
+	   socket of our own if we're doing that.  Result is the connected
+	   socket, or -1.  */
+	int set_socket(const char *host, const char *port, int fd);
+
+	/* Sending to the current address for host:port didn't work; use
+	   the next one, or resolve again if that was the last.  */
+	void failed(const char *host, const char *port);
+
+	struct counters {
+		unsigned long hits;
+		unsigned long negative_hits;	// Hits on "doesn't resolve"
+		unsigned long misses;
+		unsigned long expired;		// Misses on a stale entry
+		unsigned long resolves;		// getaddrinfo calls
+		unsigned long resolve_failures;
+		unsigned long failovers;	// failed() calls
+		unsigned long evictions;	// Dropped to make room
+		unsigned long entries;
+		unsigned long connected;	// Connected sockets open
+
+		counters() : hits(0), negative_hits(0), misses(0), expired(0),
+			resolves(0), resolve_failures(0), failovers(0),
+			evictions(0), entries(0), connected(0) {}
+	};
+
+	counters stats();
+
+	private:
+	struct Node {
+		std::string key;
+		std::vector<route> routes;	// Empty if it doesn't resolve
+		size_t current;			// Index into routes
+		time_t expires;			// ms
+	};
+	typedef std::list<Node> lru_list;	// Most recently used first
+	typedef std::tr1::unordered_map<std::string, lru_list::iterator> node_map;
+
+	// Closed connected sockets wait this long, in case another thread
+	// got a copy of the route just before and is still sending on it.
+	const static int RETIRE_MS = 5000;
+
+	static std::string route_key(const char *host, const char *port);
+	bool resolve(const char *host, const char *port, std::vector<route> &routes);
+	void drop(lru_list::iterator x);
+	void retire(int fd);
+	void close_retired(time_t now, bool all);
+
+	pthread_mutex_t mutex;
+	lru_list lru;
+	node_map index;
+	std::vector<std::pair<int, time_t> > retired;	// fd, when
+	counters counts;
+	size_t maxEntries;
+	int ttl;
+	int negativeTtl;
+	bool connect;
+
+	// No copying.
+	SmqRouteCache(const SmqRouteCache &);
+	SmqRouteCache & operator= (const SmqRouteCache &);
+};
+
+} // namespace SMqueue
+
+#endif /* SMQROUTECACHE_H_ */
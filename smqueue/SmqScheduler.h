@@ -0,0 +1,530 @@
+/*
+* Copyright 2014 Range Networks, Inc.
+*
+* This software is distributed under multiple licenses;
+* see the COPYING file in the main directory for licensing
+* information for this specific distribuion.
+*
+* This use of this software may be subject to additional restrictions.
+* See the LEGAL file in the main directory for details.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+/*
+ * SmqScheduler.h
+ *
+ * Schedulers that decide which queued message is due next.
+ *
+ * The messages themselves live in an ordinary std::list (so that iterators
+ * to them stay valid while they are processed); a scheduler only keeps an
+ * index of list iterators ordered by each message's next_action_time.
+ * The scheduled item must provide two public members:
+ *
+ *	time_t next_action_time;	// When it is due, in ms.
+ *	int sched_slot;			// Owned by the scheduler; -1 if not scheduled.
+ *
+ * Two implementations are provided.  SmqListScheduler is the original
+ * sorted list with a linear insert, kept for comparison and as a fallback.
+ * SmqTimerWheel is a hierarchical timer wheel with 1 ms resolution and a
+ * min-heap for anything too far in the future for the wheel; it reschedules
+ * in O(1) (O(log n) for far-future timeouts).
+ *
+ * Neither class does any locking; the caller holds the queue lock.
+ */
+
+#ifndef SMQSCHEDULER_H_
+#define SMQSCHEDULER_H_
+
+#include <time.h>
+#include <vector>
+
+namespace SMqueue {
+
+template <class Iter>
+class SmqScheduler {
+public:
+	virtual ~SmqScheduler() {}
+
+	/* Add an item, using its current next_action_time. */
+	virtual void insert(Iter it) = 0;
+
+	/* Take an item out of the scheduler.  Harmless if it isn't in. */
+	virtual void remove(Iter it) = 0;
+
+	/* The item's next_action_time changed; move it. */
+	virtual void reschedule(Iter it) {
+		remove(it);
+		insert(it);
+	}
+
+	/* Schedule the item for when, not its next_action_time; nextDue
+	   will return it then, and the caller has to see that it isn't
+	   really due yet.  Until the next reschedule().  */
+	virtual void rescheduleAt(Iter it, time_t when) = 0;
+
+	/* Find an item whose next_action_time is <= now, without
+	   removing it.  Result is false if nothing is due yet. */
+	virtual bool nextDue(time_t now, Iter &it) = 0;
+
+	/* The time at which the next item will be due.  Result is false
+	   if nothing is scheduled at all. */
+	virtual bool earliestTime(time_t &when) = 0;
+
+	virtual size_t size() const = 0;
+	virtual const char *name() const = 0;
+};
+
+
+/*
+ * Node storage shared by the implementations.  Nodes are linked by index
+ * rather than by pointer so the pool can grow without invalidating links,
+ * and so the scheduled item only has to carry a plain int.
+ */
+template <class Iter>
+class SmqSchedulerNodes {
+protected:
+	struct Node {
+		Iter it;
+		time_t when;
+		int prev;
+		int next;
+		int where;	// Which list (or heap) the node is on; -1 if free.
+		int heapPos;
+	};
+
+	std::vector<Node> mNodes;
+	std::vector<int> mFreeNodes;
+	size_t mCount;
+
+	SmqSchedulerNodes() : mCount(0) {}
+
+	int allocNode(Iter it) {
+		int n;
+		if (mFreeNodes.empty()) {
+			n = mNodes.size();
+			mNodes.resize(n + 1);
+		} else {
+			n = mFreeNodes.back();
+			mFreeNodes.pop_back();
+		}
+		mNodes[n].it = it;
+		mNodes[n].when = it->next_action_time;
+		mNodes[n].prev = mNodes[n].next = -1;
+		mNodes[n].where = -1;
+		mNodes[n].heapPos = -1;
+		it->sched_slot = n;
+		mCount++;
+		return n;
+	}
+
+	void freeNode(int n) {
+		mNodes[n].it->sched_slot = -1;
+		mNodes[n].where = -1;
+		mFreeNodes.push_back(n);
+		mCount--;
+	}
+
+	// Doubly-linked lists of nodes, one per head/tail pair.
+	void listAppend(int *head, int *tail, int n) {
+		mNodes[n].next = -1;
+		mNodes[n].prev = *tail;
+		if (*tail >= 0)
+			mNodes[*tail].next = n;
+		else
+			*head = n;
+		*tail = n;
+	}
+
+	void listInsertBefore(int *head, int before, int n) {
+		int prev = mNodes[before].prev;
+		mNodes[n].prev = prev;
+		mNodes[n].next = before;
+		mNodes[before].prev = n;
+		if (prev >= 0)
+			mNodes[prev].next = n;
+		else
+			*head = n;
+	}
+
+	void listUnlink(int *head, int *tail, int n) {
+		int prev = mNodes[n].prev, next = mNodes[n].next;
+		if (prev >= 0)
+			mNodes[prev].next = next;
+		else
+			*head = next;
+		if (next >= 0)
+			mNodes[next].prev = prev;
+		else
+			*tail = prev;
+		mNodes[n].prev = mNodes[n].next = -1;
+	}
+};
+
+
+/*
+ * The original algorithm: one list sorted by time, with a linear search
+ * for the insertion point.  O(n) per reschedule.
+ */
+template <class Iter>
+class SmqListScheduler : public SmqScheduler<Iter>, protected SmqSchedulerNodes<Iter> {
+	typedef SmqSchedulerNodes<Iter> Nodes;
+	int mHead, mTail;
+
+public:
+	SmqListScheduler() : mHead(-1), mTail(-1) {}
+
+	void insert(Iter it) {
+		insertAt(it, it->next_action_time);
+	}
+
+	void insertAt(Iter it, time_t when) {
+		int n = Nodes::allocNode(it);
+		Nodes::mNodes[n].when = when;
+		Nodes::mNodes[n].where = 0;
+		// Note: if list is empty, or all are too early, insert at end.
+		for (int x = mHead; x >= 0; x = Nodes::mNodes[x].next) {
+			if (Nodes::mNodes[x].when >= when) {
+				Nodes::listInsertBefore(&mHead, x, n);
+				return;
+			}
+		}
+		Nodes::listAppend(&mHead, &mTail, n);
+	}
+
+	void remove(Iter it) {
+		int n = it->sched_slot;
+		if (n < 0)
+			return;
+		Nodes::listUnlink(&mHead, &mTail, n);
+		Nodes::freeNode(n);
+	}
+
+	void rescheduleAt(Iter it, time_t when) {
+		remove(it);
+		insertAt(it, when);
+	}
+
+	bool nextDue(time_t now, Iter &it) {
+		if (mHead < 0 || Nodes::mNodes[mHead].when > now)
+			return false;
+		it = Nodes::mNodes[mHead].it;
+		return true;
+	}
+
+	bool earliestTime(time_t &when) {
+		if (mHead < 0)
+			return false;
+		when = Nodes::mNodes[mHead].when;
+		return true;
+	}
+
+	size_t size() const { return Nodes::mCount; }
+	const char *name() const { return "list"; }
+};
+
+
+/*
+ * Hierarchical timer wheel, 1 ms per tick.
+ *
+ *	level 0: 256 slots of 1 ms		(covers 256 ms)
+ *	level 1:  64 slots of 256 ms		(covers ~16 s)
+ *	level 2:  64 slots of ~16 s		(covers ~17 min)
+ *	level 3:  64 slots of ~17 min		(covers ~18 h)
+ *
+ * Anything further out sits in a min-heap until it comes within range.
+ * Slots are chosen from the absolute time bits, so an item is cascaded
+ * into a lower level exactly when the wheel reaches the block it is due in.
+ * Items that are already due go on a FIFO ready list.
+ */
+template <class Iter>
+class SmqTimerWheel : public SmqScheduler<Iter>, protected SmqSchedulerNodes<Iter> {
+	typedef SmqSchedulerNodes<Iter> Nodes;
+
+	enum {
+		L0_BITS = 8,
+		LN_BITS = 6,
+		LEVELS = 4,
+		L0_SLOTS = 1 << L0_BITS,
+		LN_SLOTS = 1 << LN_BITS,
+		WHERE_READY = 0,		// List numbers: ready, then
+		WHERE_SLOTS = 1,		// level 0 slots, then levels 1..3.
+		NUM_LISTS = WHERE_SLOTS + L0_SLOTS + (LEVELS - 1) * LN_SLOTS,
+		WHERE_HEAP = NUM_LISTS
+	};
+
+	int mHead[NUM_LISTS];
+	int mTail[NUM_LISTS];
+	size_t mLevelCount[LEVELS];
+	std::vector<int> mHeap;		// Far-future overflow, min-heap by when.
+	time_t mNow;			// Everything up to here has been expired.
+	bool mStarted;
+
+	static int levelShift(int level) {
+		return level == 0 ? 0 : L0_BITS + (level - 1) * LN_BITS;
+	}
+	static time_t levelSpan(int level) {	// Max distance a level holds.
+		return (time_t)1 << (L0_BITS + level * LN_BITS);
+	}
+	static int listOf(int level, time_t when) {
+		if (level == 0)
+			return WHERE_SLOTS + (int)(when & (L0_SLOTS - 1));
+		return WHERE_SLOTS + L0_SLOTS + (level - 1) * LN_SLOTS
+			+ (int)((when >> levelShift(level)) & (LN_SLOTS - 1));
+	}
+	static int levelOfList(int list) {
+		if (list < WHERE_SLOTS + L0_SLOTS)
+			return 0;
+		return 1 + (list - WHERE_SLOTS - L0_SLOTS) / LN_SLOTS;
+	}
+
+	// Heap helpers; each node remembers its heap position.
+	bool heapLess(int a, int b) const {
+		return Nodes::mNodes[mHeap[a]].when < Nodes::mNodes[mHeap[b]].when;
+	}
+	void heapSwap(int a, int b) {
+		int t = mHeap[a];
+		mHeap[a] = mHeap[b];
+		mHeap[b] = t;
+		Nodes::mNodes[mHeap[a]].heapPos = a;
+		Nodes::mNodes[mHeap[b]].heapPos = b;
+	}
+	void heapUp(int i) {
+		while (i > 0 && heapLess(i, (i - 1) / 2)) {
+			heapSwap(i, (i - 1) / 2);
+			i = (i - 1) / 2;
+		}
+	}
+	void heapDown(int i) {
+		int size = mHeap.size();
+		for (;;) {
+			int smallest = i, l = 2 * i + 1, r = l + 1;
+			if (l < size && heapLess(l, smallest))
+				smallest = l;
+			if (r < size && heapLess(r, smallest))
+				smallest = r;
+			if (smallest == i)
+				return;
+			heapSwap(i, smallest);
+			i = smallest;
+		}
+	}
+	void heapPush(int n) {
+		Nodes::mNodes[n].where = WHERE_HEAP;
+		Nodes::mNodes[n].heapPos = mHeap.size();
+		mHeap.push_back(n);
+		heapUp(mHeap.size() - 1);
+	}
+	void heapErase(int n) {
+		int i = Nodes::mNodes[n].heapPos;
+		int last = mHeap.size() - 1;
+		if (i != last) {
+			heapSwap(i, last);
+			mHeap.pop_back();
+			heapDown(i);
+			heapUp(i);
+		} else {
+			mHeap.pop_back();
+		}
+		Nodes::mNodes[n].heapPos = -1;
+	}
+
+	// File a node in the right place relative to mNow.
+	void place(int n) {
+		time_t when = Nodes::mNodes[n].when;
+		if (!mStarted) {
+			heapPush(n);
+			return;
+		}
+		if (when <= mNow) {
+			Nodes::mNodes[n].where = WHERE_READY;
+			Nodes::listAppend(&mHead[WHERE_READY], &mTail[WHERE_READY], n);
+			return;
+		}
+		time_t delta = when - mNow;
+		for (int level = 0; level < LEVELS; level++) {
+			if (delta < levelSpan(level)) {
+				int list = listOf(level, when);
+				Nodes::mNodes[n].where = list;
+				Nodes::listAppend(&mHead[list], &mTail[list], n);
+				mLevelCount[level]++;
+				return;
+			}
+		}
+		heapPush(n);
+	}
+
+	void unplace(int n) {
+		int where = Nodes::mNodes[n].where;
+		if (where == WHERE_HEAP) {
+			heapErase(n);
+			return;
+		}
+		Nodes::listUnlink(&mHead[where], &mTail[where], n);
+		if (where != WHERE_READY)
+			mLevelCount[levelOfList(where)]--;
+	}
+
+	// Re-file everything on one list, now that mNow has moved.
+	void cascade(int list) {
+		int n = mHead[list];
+		int level = levelOfList(list);
+		mHead[list] = mTail[list] = -1;
+		while (n >= 0) {
+			int next = Nodes::mNodes[n].next;
+			mLevelCount[level]--;
+			place(n);
+			n = next;
+		}
+	}
+
+	// Bring far-future items that are now within range into the wheel.
+	void migrateFromHeap() {
+		while (!mHeap.empty()
+		    && Nodes::mNodes[mHeap[0]].when - mNow < levelSpan(LEVELS - 1)) {
+			int n = mHeap[0];
+			heapErase(n);
+			place(n);
+		}
+	}
+
+	// Move the wheel forward one ms.
+	void tick() {
+		mNow++;
+		if ((mNow & (L0_SLOTS - 1)) == 0) {
+			// Level 0 wrapped.  Find how many higher levels also
+			// wrapped, and cascade from the top down.
+			int top = 1;
+			while (top < LEVELS - 1
+			    && ((mNow >> levelShift(top + 1)) << levelShift(top + 1)) == mNow)
+				top++;
+			for (int level = top; level >= 1; level--)
+				cascade(listOf(level, mNow));
+			migrateFromHeap();
+		}
+		int list = listOf(0, mNow);
+		if (mHead[list] >= 0)
+			cascade(list);	// Everything here is due now.
+	}
+
+	void advance(time_t now) {
+		if (!mStarted) {
+			mNow = now;
+			mStarted = true;
+			std::vector<int> pending;
+			pending.swap(mHeap);
+			for (size_t i = 0; i < pending.size(); i++) {
+				Nodes::mNodes[pending[i]].heapPos = -1;
+				place(pending[i]);
+			}
+			return;
+		}
+		while (mNow < now) {
+			if (mLevelCount[0] == 0) {
+				// Nothing in level 0; skip to the end of
+				// this 256 ms block.
+				time_t blockEnd = mNow | (L0_SLOTS - 1);
+				if (blockEnd >= now) {
+					mNow = now;
+					return;
+				}
+				mNow = blockEnd;
+			}
+			tick();
+		}
+	}
+
+	// Earliest time on a list, by looking at every node on it.
+	bool listEarliest(int list, time_t &when) const {
+		bool found = false;
+		for (int n = mHead[list]; n >= 0; n = Nodes::mNodes[n].next) {
+			if (!found || Nodes::mNodes[n].when < when)
+				when = Nodes::mNodes[n].when;
+			found = true;
+		}
+		return found;
+	}
+
+public:
+	SmqTimerWheel() : mNow(0), mStarted(false) {
+		for (int i = 0; i < NUM_LISTS; i++)
+			mHead[i] = mTail[i] = -1;
+		for (int i = 0; i < LEVELS; i++)
+			mLevelCount[i] = 0;
+	}
+
+	void insert(Iter it) {
+		place(Nodes::allocNode(it));
+	}
+
+	void remove(Iter it) {
+		int n = it->sched_slot;
+		if (n < 0)
+			return;
+		unplace(n);
+		Nodes::freeNode(n);
+	}
+
+	void reschedule(Iter it) {
+		rescheduleAt(it, it->next_action_time);
+	}
+
+	void rescheduleAt(Iter it, time_t when) {
+		int n = it->sched_slot;
+		if (n < 0)
+			n = Nodes::allocNode(it);
+		else
+			unplace(n);
+		Nodes::mNodes[n].when = when;
+		place(n);
+	}
+
+	bool nextDue(time_t now, Iter &it) {
+		advance(now);
+		int n = mHead[WHERE_READY];
+		if (n < 0)
+			return false;
+		it = Nodes::mNodes[n].it;
+		return true;
+	}
+
+	bool earliestTime(time_t &when) {
+		if (mHead[WHERE_READY] >= 0)
+			return listEarliest(WHERE_READY, when);
+		bool found = false;
+		// Within a level, slots are visited in time order, so the first
+		// non-empty one holds that level's earliest item.  An item can
+		// sit in a higher level than a later one until it is cascaded,
+		// so every level has to be looked at.
+		for (int level = 0; mStarted && level < LEVELS; level++) {
+			if (mLevelCount[level] == 0)
+				continue;
+			int slots = level == 0 ? L0_SLOTS : LN_SLOTS;
+			for (int i = 1; i <= slots; i++) {
+				time_t t = level == 0 ? mNow + i
+					: ((mNow >> levelShift(level)) + i) << levelShift(level);
+				time_t slotWhen;
+				if (listEarliest(listOf(level, t), slotWhen)) {
+					if (!found || slotWhen < when)
+						when = slotWhen;
+					found = true;
+					break;
+				}
+			}
+		}
+		if (!mHeap.empty() && (!found || Nodes::mNodes[mHeap[0]].when < when)) {
+			when = Nodes::mNodes[mHeap[0]].when;
+			found = true;
+		}
+		return found;
+	}
+
+	size_t size() const { return Nodes::mCount; }
+	const char *name() const { return "wheel"; }
+};
+
+} // namespace SMqueue
+
+#endif /* SMQSCHEDULER_H_ */
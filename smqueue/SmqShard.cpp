@@ -0,0 +1,323 @@
+/*
+* Copyright 2014 Range Networks, Inc.
+*
+* This software is distributed under multiple licenses;
+* see the COPYING file in the main directory for licensing
+* information for this specific distribuion.
+*
+* This use of this software may be subject to additional restrictions.
+* See the LEGAL file in the main directory for details.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+/*
+ * SmqShard.cpp
+ *
+ * A shard of the message queue and its worker thread.  The message
+ * handling itself is in SMq (smqueue.cpp); this is the locking, the
+ * inbox other threads post work to, and the thread.
+ */
+
+#include <errno.h>
+#include <sys/time.h>
+#include "smqueue.h"
+
+#include <Logger.h>
+
+extern SMqueue::SMq smq;
+
+namespace SMqueue {
+
+// Which shard the calling thread is the worker for.
+static __thread SmqShard *currentShard = NULL;
+
+SmqShard::SmqShard(int n, short_msg_scheduler *sched) :
+	number (n),
+	message_list (),
+	scheduler (sched),
+	imsi_index (),
+	running (false),
+	running_moved (false),
+	running_gone (false),
+	running_msg (),
+	batch_stats (),
+	next_balance (0),
+	bytes_queued (0),
+	bytes_parsed (0),
+	msgs_parsed (0),
+	idle_head (NULL),
+	idle_tail (NULL),
+	inbox (INBOX_SIZE, false),
+	spare_work (),
+	overflow (),
+	overflowing (false),
+	woken (0),
+	sleeping (0),
+	reactor (),
+	no_events (),
+	started (false),
+	thread ()
+{
+	// A message's handler calls back into set_state and friends, so
+	// the shard lock has to be recursive.
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&mutex, &attr);
+	pthread_mutexattr_destroy(&attr);
+
+	pthread_mutex_init(&overflowMutex, NULL);
+}
+
+SmqShard::~SmqShard()
+{
+	// Whatever was posted and never taken goes with the shard.
+	posted_work *w;
+	while (inbox.pop(w))
+		delete w;
+	for (size_t i = 0; i < overflow.size(); i++)
+		delete overflow[i];
+	delete scheduler;
+	pthread_mutex_destroy(&overflowMutex);
+	pthread_mutex_destroy(&mutex);
+}
+
+SmqShard *SmqShard::current()
+{
+	return currentShard;
+}
+
+void SmqShard::adopt(short_msg_p_list::iterator sm)
+{
+	lock();
+	sm->owner = this;
+	if (!sm->idle)
+		sm->idle = new idle_link(sm);
+	sm->idle->msg = sm;
+	account(&*sm);
+	unlock();
+}
+
+void SmqShard::disown(short_msg_pending *smp)
+{
+	lock();
+	if (smp->owner == this) {
+		if (smp->idle && smp->idle->linked)
+			unlink_idle(smp->idle);
+		bytes_queued -= smp->charged_bytes;
+		bytes_parsed -= smp->charged_parsed;
+		if (smp->charged_parsed)
+			msgs_parsed--;
+		smp->charged_bytes = 0;
+		smp->charged_parsed = 0;
+		smp->owner = NULL;
+	}
+	unlock();
+}
+
+void SmqShard::account(short_msg_pending *smp)
+{
+	lock();
+	size_t bytes = smp->footprint();
+	size_t tree = smp->parsed_bytes();
+	bytes_queued += bytes - smp->charged_bytes;
+	bytes_parsed += tree - smp->charged_parsed;
+	if (tree && !smp->charged_parsed)
+		msgs_parsed++;
+	else if (!tree && smp->charged_parsed)
+		msgs_parsed--;
+	smp->charged_bytes = bytes;
+	smp->charged_parsed = tree;
+
+	idle_link *l = smp->idle;
+	if (l && smp->is_idle() && !l->linked) {
+		l->prev = idle_tail;
+		l->next = NULL;
+		if (idle_tail)
+			idle_tail->next = l;
+		else
+			idle_head = l;
+		idle_tail = l;
+		l->linked = true;
+	} else if (l && !smp->is_idle() && l->linked)
+		unlink_idle(l);
+	unlock();
+}
+
+void SmqShard::touch(short_msg_pending *smp)
+{
+	lock();
+	if (smp->owner == this) {
+		if (smp->idle->linked)
+			unlink_idle(smp->idle);
+		account(smp);
+	}
+	unlock();
+}
+
+void SmqShard::unlink_idle(idle_link *l)
+{
+	if (l->prev)
+		l->prev->next = l->next;
+	else
+		idle_head = l->next;
+	if (l->next)
+		l->next->prev = l->prev;
+	else
+		idle_tail = l->prev;
+	l->prev = l->next = NULL;
+	l->linked = false;
+}
+
+void SmqShard::push_work(posted_work *w)
+{
+	// Once something has gone to the overflow list, the rest follows
+	// it there till the worker takes it, to keep them in order.
+	if (overflowing || !inbox.try_push(w)) {
+		pthread_mutex_lock(&overflowMutex);
+		overflow.push_back(w);
+		overflowing = true;
+		pthread_mutex_unlock(&overflowMutex);
+	}
+	wake();
+}
+
+void SmqShard::post(short_msg_p_list &smp)
+{
+	if (smp.empty())
+		return;
+	posted_work *w = spare_work.get();
+	w->kind = posted_work::MESSAGES;
+	w->msgs.splice(w->msgs.end(), smp);
+	push_work(w);
+}
+
+void SmqShard::post_release(const char *imsi)
+{
+	posted_work *w = spare_work.get();
+	w->kind = posted_work::RELEASE;
+	w->key = imsi;
+	push_work(w);
+}
+
+void SmqShard::post_lookup_done(const std::string &qtag)
+{
+	posted_work *w = spare_work.get();
+	w->kind = posted_work::LOOKUP_DONE;
+	w->key = qtag;
+	push_work(w);
+}
+
+void SmqShard::post_response(const posted_response &response)
+{
+	posted_work *w = spare_work.get();
+	w->kind = posted_work::RESPONSE;
+	w->response = response;
+	push_work(w);
+}
+
+void SmqShard::take_inbox(short_msg_p_list &msgs, std::vector<std::string> &releases,
+			  std::vector<std::string> &lookups,
+			  std::vector<posted_response> &responses)
+{
+	std::vector<posted_work *> taken;
+	posted_work *w;
+
+	while (inbox.pop(w))
+		taken.push_back(w);
+	if (overflowing) {
+		if (inbox.size() == 0) {
+			pthread_mutex_lock(&overflowMutex);
+			taken.insert(taken.end(), overflow.begin(), overflow.end());
+			overflow.clear();
+			overflowing = false;
+			pthread_mutex_unlock(&overflowMutex);
+		} else {
+			// A post to the ring is still being written; the
+			// overflow has to wait till it's been taken.
+			woken = 1;
+		}
+	}
+
+	for (size_t i = 0; i < taken.size(); i++) {
+		w = taken[i];
+		switch (w->kind) {
+		case posted_work::MESSAGES:
+			msgs.splice(msgs.end(), w->msgs);
+			break;
+		case posted_work::RELEASE:
+			releases.push_back(w->key);
+			break;
+		case posted_work::LOOKUP_DONE:
+			lookups.push_back(w->key);
+			break;
+		case posted_work::RESPONSE:
+			responses.push_back(w->response);
+			break;
+		}
+		spare_work.put(w);
+	}
+}
+
+void SmqShard::wake()
+{
+	woken = 1;
+	__sync_synchronize();
+	if (__sync_bool_compare_and_swap(&sleeping, 1, 0))
+		reactor.wake();
+}
+
+void SmqShard::wait_for_work(time_t deadline)
+{
+	if (__sync_lock_test_and_set(&woken, 0))
+		return;
+	// Anyone waking us from here on writes the reactor's wakeup fd;
+	// anyone who did just before, we see in woken.
+	sleeping = 1;
+	__sync_synchronize();
+	if (!woken) {
+		reactor.set_deadline(deadline);
+		reactor.wait(-1, no_events);
+	}
+	sleeping = 0;
+	__sync_lock_test_and_set(&woken, 0);
+}
+
+void *SmqShard::worker_thread(void *arg)
+{
+	SmqShard *sh = (SmqShard *) arg;
+
+	currentShard = sh;
+	LOG(DEBUG) << "Start queue shard " << sh->number << " thread";
+	smq.run_shard(sh);
+	LOG(DEBUG) << "End queue shard " << sh->number << " thread";
+	currentShard = NULL;
+	return NULL;
+}
+
+bool SmqShard::start()
+{
+	// Without the reactor, the worker polls once a second.
+	(void) reactor.open();
+	int status = pthread_create(&thread, NULL, worker_thread, this);
+	if (status != 0) {
+		LOG(ALERT) << "Can't start queue shard " << number << " thread, error " << status;
+		return false;
+	}
+	started = true;
+	return true;
+}
+
+void SmqShard::join()
+{
+	if (!started)
+		return;
+	wake();
+	pthread_join(thread, NULL);
+	started = false;
+}
+
+} // namespace SMqueue
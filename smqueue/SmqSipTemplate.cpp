@@ -0,0 +1,97 @@
+/*
+* Copyright 2014 Range Networks, Inc.
+*
+* This software is distributed under multiple licenses;
+* see the COPYING file in the main directory for licensing
+* information for this specific distribuion.
+*
+* This use of this software may be subject to additional restrictions.
+* See the LEGAL file in the main directory for details.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+/*
+ * SmqSipTemplate.cpp
+ *
+ * Templates for the SIP messages we make.  See SmqSipTemplate.h.
+ */
+
+#include <string.h>
+
+#include "SmqSipTemplate.h"
+
+namespace SMqueue {
+
+void SmqSipBuffer::append(const char *p, size_t n)
+{
+	if (len + n > cap) {
+		size_t newcap = cap ? cap : 512;
+		while (newcap < len + n)
+			newcap *= 2;
+		char *newbuf = new char [newcap];
+		if (len)
+			memcpy(newbuf, buf, len);
+		delete [] buf;
+		buf = newbuf;
+		cap = newcap;
+	}
+	memcpy(buf + len, p, n);
+	len += n;
+}
+
+bool SmqSipTemplate::compile(const char *text, size_t length,
+			     const std::vector<std::string> &samples)
+{
+	std::string t(text, length);
+	std::vector<bool> seen(samples.size(), false);
+	size_t pos = 0;
+
+	clear();
+	for (size_t i = 0; i < samples.size(); i++)
+		if (samples[i].empty())
+			return false;
+
+	for (;;) {
+		size_t best = std::string::npos;
+		int slot = -1;
+		for (size_t i = 0; i < samples.size(); i++) {
+			size_t at = t.find(samples[i], pos);
+			if (at == std::string::npos)
+				continue;
+			if (at < best || (at == best && samples[i].size() > samples[slot].size())) {
+				best = at;
+				slot = i;
+			}
+		}
+		if (slot < 0)
+			break;
+		literals.push_back(t.substr(pos, best - pos));
+		order.push_back(slot);
+		seen[slot] = true;
+		pos = best + samples[slot].size();
+	}
+	literals.push_back(t.substr(pos));
+
+	for (size_t i = 0; i < seen.size(); i++) {
+		if (!seen[i]) {
+			clear();
+			return false;
+		}
+	}
+	return true;
+}
+
+void SmqSipTemplate::expand(const std::string *values, SmqSipBuffer &out) const
+{
+	out.clear();
+	for (size_t i = 0; i < order.size(); i++) {
+		out.append(literals[i]);
+		out.append(values[order[i]]);
+	}
+	out.append(literals.back());
+}
+
+} // namespace SMqueue
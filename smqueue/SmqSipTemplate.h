@@ -0,0 +1,96 @@
+/*
+* Copyright 2014 Range Networks, Inc.
+*
+* This software is distributed under multiple licenses;
+* see the COPYING file in the main directory for licensing
+* information for this specific distribuion.
+*
+* This use of this software may be subject to additional restrictions.
+* See the LEGAL file in the main directory for details.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+/*
+ * SmqSipTemplate.h
+ *
+ * Messages made by splicing values into fixed text, instead of building
+ * an osip tree and serializing it.
+ *
+ * A template is compiled from a message osip made: given the values
+ * that were put in each slot (the samples), compile() finds them in the
+ * text and keeps what's between them.  expand() writes the same text
+ * with other values in the slots.  So the output is what osip would
+ * have made, as long as osip would have written the new values the
+ * same way as the samples; compiling twice with samples of different
+ * lengths and comparing (same_as) catches any padding or reordering
+ * that depends on the values.
+ *
+ * This doesn't depend on osip or the rest of smqueue, so the benchmark
+ * in testing/ can use it.
+ */
+
+#ifndef SMQSIPTEMPLATE_H_
+#define SMQSIPTEMPLATE_H_
+
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+namespace SMqueue {
+
+/* An output buffer that keeps its memory from one message to the next. */
+class SmqSipBuffer {
+	public:
+	SmqSipBuffer() : buf(NULL), len(0), cap(0) {}
+	~SmqSipBuffer() { delete [] buf; }
+
+	void clear() { len = 0; }
+	void append(const char *p, size_t n);
+	void append(const std::string &s) { append(s.data(), s.size()); }
+
+	const char *data() const { return buf; }
+	size_t size() const { return len; }
+
+	private:
+	char *buf;
+	size_t len;
+	size_t cap;
+
+	// No copying.
+	SmqSipBuffer(const SmqSipBuffer &);
+	SmqSipBuffer & operator= (const SmqSipBuffer &);
+};
+
+class SmqSipTemplate {
+	public:
+	SmqSipTemplate() : literals(), order() {}
+
+	/* Learn the layout of text, a message made with slot i set to
+	   samples[i].  Where samples overlap, the one that starts first
+	   wins, then the longest.  Result is false if a sample is empty
+	   or doesn't appear.  */
+	bool compile(const char *text, size_t length,
+		     const std::vector<std::string> &samples);
+
+	/* Is this template compiled, and to the same layout as other? */
+	bool ready() const { return !literals.empty(); }
+	bool same_as(const SmqSipTemplate &other) const {
+		return literals == other.literals && order == other.order;
+	}
+
+	/* Write the message with values[i] in slot i into out. */
+	void expand(const std::string *values, SmqSipBuffer &out) const;
+
+	void clear() { literals.clear(); order.clear(); }
+
+	private:
+	std::vector<std::string> literals;	// One more than order
+	std::vector<int> order;			// Slot after each literal
+};
+
+} // namespace SMqueue
+
+#endif /* SMQSIPTEMPLATE_H_ */
@@ -0,0 +1,323 @@
+/*
+* Copyright 2014 Range Networks, Inc.
+*
+* This software is distributed under multiple licenses;
+* see the COPYING file in the main directory for licensing
+* information for this specific distribuion.
+*
+* This use of this software may be subject to additional restrictions.
+* See the LEGAL file in the main directory for details.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+/*
+ * SmqSipView.cpp
+ *
+ * Scanning SIP message text in place.  See SmqSipView.h.
+ */
+
+#include <ctype.h>
+#include <string.h>
+#include <strings.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "SmqSipView.h"
+
+namespace SMqueue {
+
+static inline bool
+is_ws(char c)
+{
+	return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+const char *SmqSipView::find_cr(const char *p, const char *end)
+{
+#ifdef __SSE2__
+	// Sixteen bytes at a time; SIP lines are mostly longer than that.
+	const __m128i cr = _mm_set1_epi8('\r');
+	while (end - p >= 16) {
+		__m128i chunk = _mm_loadu_si128((const __m128i *) p);
+		int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, cr));
+		if (mask)
+			return p + __builtin_ctz(mask);
+		p += 16;
+	}
+#endif
+	while (p < end && *p != '\r')
+		p++;
+	return p;
+}
+
+bool SmqSipView::scan(const char *t, size_t len)
+{
+	text = t;
+	length = len;
+	nheaders = 0;
+	status = 0;
+	methodSpan = uriSpan = reasonSpan = bodySpan = nowhere();
+	if (len == 0 || len >= NOWHERE)
+		return false;
+
+	const char *p = t;
+	const char *end = t + len;
+	const char *eol = find_cr(p, end);
+	if (eol + 1 >= end || eol[1] != '\n')
+		return false;
+
+	// Start line: "SIP/2.0 202 Queued" or "MESSAGE sip:... SIP/2.0"
+	if (eol - p > 8 && 0 == memcmp(p, "SIP/2.0 ", 8)) {
+		const char *c = p + 8;
+		int digits = 0;
+		while (c < eol && isdigit(*c) && digits < 4) {
+			status = status * 10 + (*c++ - '0');
+			digits++;
+		}
+		if (digits != 3 || (c < eol && *c != ' '))
+			return false;
+		reasonSpan = make_span(c < eol ? c + 1 : eol, eol);
+	} else {
+		const char *sp = (const char *) memchr(p, ' ', eol - p);
+		if (!sp || sp == p)
+			return false;
+		methodSpan = make_span(p, sp);
+		const char *uri = sp + 1;
+		const char *sp2 = (const char *) memchr(uri, ' ', eol - uri);
+		if (!sp2 || sp2 == uri)
+			return false;
+		uriSpan = make_span(uri, sp2);
+		if (eol - (sp2 + 1) != 7 || 0 != memcmp(sp2 + 1, "SIP/2.0", 7))
+			return false;
+	}
+
+	// Headers, to the blank line.
+	p = eol + 2;
+	for (;;) {
+		if (p >= end) {
+			bodySpan = make_span(end, end);
+			return true;
+		}
+		if (*p == '\r') {
+			if (p + 1 >= end || p[1] != '\n')
+				return false;
+			bodySpan = make_span(p + 2, end);
+			return true;
+		}
+
+		const char *line = p;
+		eol = find_cr(p, end);
+		// A line starting with white space continues the header.
+		while (eol + 2 < end && eol[1] == '\n' && (eol[2] == ' ' || eol[2] == '\t'))
+			eol = find_cr(eol + 2, end);
+		if (eol < end && (eol + 1 >= end || eol[1] != '\n'))
+			return false;
+
+		const char *colon = (const char *) memchr(line, ':', eol - line);
+		if (!colon || nheaders == MAX_HEADERS)
+			return false;
+		const char *nend = colon;
+		while (nend > line && is_ws(nend[-1]))
+			nend--;
+		if (nend == line)
+			return false;
+		const char *v = colon + 1;
+		while (v < eol && is_ws(*v))
+			v++;
+		const char *vend = eol;
+		while (vend > v && is_ws(vend[-1]))
+			vend--;
+		headers[nheaders].name = make_span(line, nend);
+		headers[nheaders].value = make_span(v, vend);
+		nheaders++;
+
+		p = eol < end ? eol + 2 : end;
+	}
+}
+
+SmqSipView::span SmqSipView::header(const char *name, char compact) const
+{
+	size_t nlen = strlen(name);
+	for (int i = 0; i < nheaders; i++) {
+		const span &n = headers[i].name;
+		if ((n.len == nlen && 0 == strncasecmp(text + n.off, name, nlen))
+		 || (compact && n.len == 1 && tolower(text[n.off]) == compact))
+			return headers[i].value;
+	}
+	return nowhere();
+}
+
+SmqSipView::span SmqSipView::uri_user(span uri) const
+{
+	if (!uri.found())
+		return nowhere();
+	const char *p = text + uri.off;
+	const char *end = p + uri.len;
+	const char *colon = (const char *) memchr(p, ':', end - p);
+	if (!colon)
+		return nowhere();
+	for (const char *c = colon + 1; c < end; c++) {
+		if (*c == '@')
+			return make_span(colon + 1, c);
+		if (*c == ';' || *c == '?' || *c == '>')
+			break;
+	}
+	return nowhere();
+}
+
+SmqSipView::span SmqSipView::uri_hostport(span uri) const
+{
+	if (!uri.found())
+		return nowhere();
+	const char *p = text + uri.off;
+	const char *end = p + uri.len;
+	span user = uri_user(uri);
+	const char *host;
+	if (user.found()) {
+		host = text + user.off + user.len + 1;
+	} else {
+		const char *colon = (const char *) memchr(p, ':', end - p);
+		if (!colon)
+			return nowhere();
+		host = colon + 1;
+	}
+	const char *hend = host;
+	while (hend < end && *hend != ';' && *hend != '?' && *hend != '>')
+		hend++;
+	return make_span(host, hend);
+}
+
+SmqSipView::span SmqSipView::addr_display(span value) const
+{
+	if (!value.found())
+		return nowhere();
+	const char *p = text + value.off;
+	const char *end = p + value.len;
+	bool quoted = false;
+	for (const char *c = p; c < end; c++) {
+		if (*c == '"' && (c == p || c[-1] != '\\'))
+			quoted = !quoted;
+		else if (*c == '<' && !quoted) {
+			const char *dend = c;
+			while (dend > p && is_ws(dend[-1]))
+				dend--;
+			return dend > p ? make_span(p, dend) : nowhere();
+		}
+	}
+	return nowhere();
+}
+
+SmqSipView::span SmqSipView::addr_uri(span value) const
+{
+	if (!value.found())
+		return nowhere();
+	const char *p = text + value.off;
+	const char *end = p + value.len;
+	span display = addr_display(value);
+	const char *lt = display.found() ? text + display.off + display.len : p;
+	while (lt < end && *lt != '<')
+		lt++;
+	if (lt < end) {
+		const char *gt = (const char *) memchr(lt, '>', end - lt);
+		return gt ? make_span(lt + 1, gt) : nowhere();
+	}
+	// No <>: the URI runs to the first header parameter.
+	const char *uend = p;
+	while (uend < end && *uend != ';')
+		uend++;
+	return make_span(p, uend);
+}
+
+SmqSipView::span SmqSipView::param(span value, const char *name) const
+{
+	if (!value.found())
+		return nowhere();
+	const char *p = text + value.off;
+	const char *end = p + value.len;
+	size_t nlen = strlen(name);
+	bool quoted = false;
+	bool bracketed = false;
+
+	for (const char *c = p; c < end; c++) {
+		if (*c == '"')
+			quoted = !quoted;
+		if (quoted)
+			continue;
+		if (*c == '<')
+			bracketed = true;
+		else if (*c == '>')
+			bracketed = false;
+		if (bracketed)
+			continue;
+		if (*c == ',')
+			break;		// Only the first value of a list
+		if (*c != ';')
+			continue;
+
+		const char *n = c + 1;
+		while (n < end && is_ws(*n))
+			n++;
+		const char *nend = n;
+		while (nend < end && *nend != '=' && *nend != ';' && *nend != ','
+		       && !is_ws(*nend))
+			nend++;
+		if ((size_t)(nend - n) != nlen || 0 != strncasecmp(n, name, nlen))
+			continue;
+		while (nend < end && is_ws(*nend))
+			nend++;
+		if (nend >= end || *nend != '=')
+			return make_span(nend, nend);	// No value
+		const char *v = nend + 1;
+		while (v < end && is_ws(*v))
+			v++;
+		const char *vend = v;
+		while (vend < end && *vend != ';' && *vend != ',' && !is_ws(*vend))
+			vend++;
+		return make_span(v, vend);
+	}
+	return nowhere();
+}
+
+bool SmqSipView::equals(span s, const char *str) const
+{
+	size_t n = strlen(str);
+	return s.found() && s.len == n && 0 == strncasecmp(text + s.off, str, n);
+}
+
+std::string SmqSipView::transaction_key() const
+{
+	std::string key;
+	span callid = header("Call-ID", 'i');
+	span cseq = header("CSeq");
+	if (!callid.found() || !callid.len || !cseq.found() || !cseq.len)
+		return key;
+
+	// Same as SmqServerTransactions::key_of makes from osip's parse.
+	span branch = param(header("Via", 'v'), "branch");
+	if (branch.found())
+		key.append(text + branch.off, branch.len);
+	key += '|';
+	key.append(text + callid.off, callid.len);
+	key += '|';
+	const char *c = text + cseq.off;
+	const char *cend = c + cseq.len;
+	const char *num = c;
+	while (c < cend && !is_ws(*c))
+		c++;
+	key.append(num, c - num);
+	key += ' ';
+	while (c < cend && is_ws(*c))
+		c++;
+	key.append(c, cend - c);
+	key += '|';
+	span tag = param(header("From", 'f'), "tag");
+	if (tag.found())
+		key.append(text + tag.off, tag.len);
+	return key;
+}
+
+} // namespace SMqueue
@@ -0,0 +1,140 @@
+/*
+* Copyright 2014 Range Networks, Inc.
+*
+* This software is distributed under multiple licenses;
+* see the COPYING file in the main directory for licensing
+* information for this specific distribuion.
+*
+* This use of this software may be subject to additional restrictions.
+* See the LEGAL file in the main directory for details.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+/*
+ * SmqSipView.h
+ *
+ * A quick look at a SIP message's text, without parsing it with osip.
+ *
+ * scan() finds the start line, each header's name and value, and the
+ * body, and records them as offsets into the text; it allocates
+ * nothing and copies nothing.  That's enough to get at the headers
+ * smqueue routes by (Via branch, Call-ID, CSeq, From tag, Content-*),
+ * and to find the bytes to replace when the Request-URI, To or Call-ID
+ * of a queued message changes, so the text can be edited in place
+ * instead of being rebuilt by osip.
+ *
+ * It only understands what smqueue sends and gets: MESSAGE, REGISTER
+ * and responses, with CRLF line ends and up to MAX_HEADERS headers.
+ * For anything else scan() fails, and the caller uses osip.
+ *
+ * This doesn't depend on the rest of smqueue, so the benchmark in
+ * testing/ can use it.
+ */
+
+#ifndef SMQSIPVIEW_H_
+#define SMQSIPVIEW_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+namespace SMqueue {
+
+class SmqSipView {
+	public:
+	const static int MAX_HEADERS = 48;
+
+	/* Part of the text. */
+	struct span {
+		uint16_t off;
+		uint16_t len;
+		bool found() const { return off != NOWHERE; }
+	};
+	const static uint16_t NOWHERE = 0xffff;
+
+	SmqSipView() : text(NULL), length(0), nheaders(0), status(0) {}
+
+	/* Look over a message.  Result is false if it isn't one we can
+	   handle; then nothing else here is meaningful.  */
+	bool scan(const char *text, size_t length);
+
+	bool is_request() const { return status == 0; }
+	int status_code() const { return status; }
+	span reason_phrase() const { return reasonSpan; }
+
+	/* The first header called name, or with the compact form
+	   compact (0 if none).  Names are matched without case.  */
+	span header(const char *name, char compact = 0) const;
+
+	/* Parts of the start line of a request. */
+	span method() const { return methodSpan; }
+	span request_uri() const { return uriSpan; }
+
+	/* The body, which runs to the end of the text. */
+	span body() const { return bodySpan; }
+
+	/* Within the URI at uri: the user part (not found if there's
+	   no '@'), and the host and port.  */
+	span uri_user(span uri) const;
+	span uri_hostport(span uri) const;
+
+	/* Within a From or To value: the display name (not found if
+	   none), and the URI.  */
+	span addr_display(span value) const;
+	span addr_uri(span value) const;
+
+	/* The value of the ;name= parameter in value (before any
+	   comma), or not found.  Parameters inside <> are skipped.  */
+	span param(span value, const char *name) const;
+
+	/* Does s hold exactly str, ignoring case? */
+	bool equals(span s, const char *str) const;
+
+	std::string str(span s) const {
+		return s.found() ? std::string(text + s.off, s.len) : std::string();
+	}
+
+	/* The key SmqServerTransactions matches requests on: top Via
+	   branch, Call-ID, CSeq and From tag.  Empty if there's no
+	   Call-ID or CSeq.  */
+	std::string transaction_key() const;
+
+	/* Where the first CR at or after p is, or end. */
+	static const char *find_cr(const char *p, const char *end);
+
+	private:
+	struct header_loc {
+		span name;
+		span value;
+	};
+
+	span make_span(const char *from, const char *to) const {
+		span s;
+		s.off = from - text;
+		s.len = to - from;
+		return s;
+	}
+	static span nowhere() {
+		span s;
+		s.off = NOWHERE;
+		s.len = 0;
+		return s;
+	}
+
+	const char *text;
+	size_t length;
+	header_loc headers[MAX_HEADERS];
+	int nheaders;
+	int status;		// 0 for a request
+	span methodSpan;
+	span uriSpan;
+	span reasonSpan;
+	span bodySpan;
+};
+
+} // namespace SMqueue
+
+#endif /* SMQSIPVIEW_H_ */
@@ -0,0 +1,109 @@
+/*
+* Copyright 2014 Range Networks, Inc.
+*
+* This software is distributed under multiple licenses;
+* see the COPYING file in the main directory for licensing
+* information for this specific distribuion.
+*
+* This use of this software may be subject to additional restrictions.
+* See the LEGAL file in the main directory for details.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+
+/*
+ * SmqSnapshot.cpp
+ *
+ * Copies of the queue.  See SmqSnapshot.h.
+ */
+
+#include <string.h>
+
+#include "SmqSnapshot.h"
+#include "SmqSpill.h"
+
+namespace SMqueue {
+
+SmqSnapshot::SmqSnapshot() :
+	epoch (0),
+	taken (0),
+	entries (),
+	strings (),
+	store (NULL)
+{
+}
+
+SmqSnapshot::~SmqSnapshot()
+{
+	clear();
+}
+
+void SmqSnapshot::clear()
+{
+	for (size_t i = 0; store && i < entries.size(); i++) {
+		if (entries[i].spill_key)
+			store->release(entries[i].spill_key);
+	}
+	store = NULL;
+	entries.clear();
+	strings.clear();
+	epoch = 0;
+	taken = 0;
+}
+
+/* Put len bytes of s, and a NUL, on the end of strings; where they went. */
+size_t SmqSnapshot::keep(const char *s, size_t len)
+{
+	size_t off = strings.size();
+	strings.insert(strings.end(), s, s + len);
+	strings.push_back('\0');
+	return off;
+}
+
+void SmqSnapshot::add(const entry &e, const char *text, unsigned textLength,
+		      const char *qtag, const char *imsi)
+{
+	entry copy = e;
+
+	copy.spilled = false;
+	copy.spill_key = 0;
+	copy.has_text = text != NULL;
+	copy.text_length = text ? textLength : 0;
+	copy.text_offset = text ? keep(text, textLength) : 0;
+	copy.has_qtag = qtag != NULL;
+	copy.qtag_length = qtag ? strlen(qtag) : 0;
+	copy.qtag_offset = qtag ? keep(qtag, copy.qtag_length) : 0;
+	copy.has_imsi = imsi != NULL;
+	copy.imsi_length = imsi ? strlen(imsi) : 0;
+	copy.imsi_offset = imsi ? keep(imsi, copy.imsi_length) : 0;
+	entries.push_back(copy);
+}
+
+bool SmqSnapshot::add_spilled(const entry &e, SmqSpillStore *spillStore, uint64_t spillKey,
+			      const char *qtag, const char *imsi)
+{
+	bool kept = spillStore->retain(spillKey);
+	if (kept)
+		store = spillStore;
+	add(e, NULL, 0, qtag, imsi);
+	entries.back().spilled = true;
+	entries.back().spill_key = kept ? spillKey : 0;
+	return kept;
+}
+
+const char *SmqSnapshot::text(const entry &e, std::string &buf, size_t &length) const
+{
+	if (e.has_text) {
+		length = e.text_length;
+		return &strings[e.text_offset];
+	}
+	if (!e.spill_key || !store || !store->get(e.spill_key, buf))
+		return NULL;
+	length = buf.size();
+	return buf.c_str();
+}
+
+} // namespace SMqueue
@@ -0,0 +1,134 @@
+/*
+* Copyright 2014 Range Networks, Inc.
+*
+* This software is distributed under multiple licenses;
+* see the COPYING file in the main directory for licensing
+* information for this specific distribuion.
+*
+* This use of this software may be subject to additional restrictions.
+* See the LEGAL file in the main directory for details.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+
+/*
+ * SmqSnapshot.h
+ *
+ * A point-in-time copy of the queue, to look through without holding
+ * any lock.
+ *
+ * Saving the queue, dumping it, and the shortcodes that count what's
+ * in it used to walk the shards' message lists under the lock, doing
+ * their file writes, logging and parsing with the state machine held
+ * up.  Now they take a snapshot instead: SMq::snapshot() locks each
+ * shard just long enough to copy out what's queued on it -- a fixed
+ * size entry per message, and, if asked for, its text, qtag and
+ * destination IMSI -- and the rest is done on the copy.
+ *
+ * Each shard is copied at one point in time, one shard after another.
+ * A message never moves to another shard, so none is missed or seen
+ * twice; and each snapshot has an epoch number, so what was done with
+ * one can be told apart in the log from what was done with the next.
+ * The strings all go end to end in one buffer, so copying a shard is
+ * a few big allocations at most, however many messages it has.
+ *
+ * The text of a message spilled to disk (SmqSpill.h) isn't copied: the
+ * snapshot holds on to it in the store instead, and text() reads it
+ * from there, one message at a time, so that saving a queue that's
+ * mostly on disk doesn't bring it all back into memory at once.
+ */
+
+#ifndef SMQSNAPSHOT_H_
+#define SMQSNAPSHOT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <string>
+#include <vector>
+
+namespace SMqueue {
+
+class SmqSpillStore;
+
+class SmqSnapshot {
+	public:
+	/* A queued message.  Its strings are got through the snapshot. */
+	struct entry {
+		uint64_t journal_id;
+		uint64_t qtaghash;
+		time_t next_action_time;	// ms
+		int state;
+		int shard;
+		bool ms_to_sc;
+		bool need_repack;
+		bool response;			// Known to be a response
+		bool unvalidated;		// Not parsed since it was read back
+		unsigned srcaddrlen;
+		char srcaddr[16];
+		size_t text_offset;
+		size_t qtag_offset;
+		size_t imsi_offset;
+		unsigned text_length;
+		unsigned qtag_length;
+		unsigned imsi_length;
+		bool has_text;
+		bool has_qtag;
+		bool has_imsi;
+		bool spilled;			// Text is in the spill store,
+		uint64_t spill_key;		// ... here, retained (0 if lost)
+	};
+
+	SmqSnapshot();
+	~SmqSnapshot();
+
+	uint64_t epoch;			// Numbered by SMq::snapshot()
+	time_t taken;			// ms
+
+	/* Empty it, keeping the room it had. */
+	void clear();
+
+	/* Copy a message in.  Any of the strings may be NULL.  */
+	void add(const entry &e, const char *text, unsigned textLength,
+		 const char *qtag, const char *imsi);
+	/* The same for one whose text is in store under spillKey, which
+	   this retains till it's cleared.  False if the key's gone; the
+	   entry is added anyway, with its text lost.  */
+	bool add_spilled(const entry &e, SmqSpillStore *store, uint64_t spillKey,
+			 const char *qtag, const char *imsi);
+
+	size_t size() const { return entries.size(); }
+	const entry &at(size_t i) const { return entries[i]; }
+
+	/* A message's strings, NUL-terminated, or NULL if it had none
+	   (or the snapshot was taken without them).  */
+	const char *text(const entry &e) const { return e.has_text ? &strings[e.text_offset] : NULL; }
+	const char *qtag(const entry &e) const { return e.has_qtag ? &strings[e.qtag_offset] : NULL; }
+	const char *imsi(const entry &e) const { return e.has_imsi ? &strings[e.imsi_offset] : NULL; }
+
+	/* Like text(), but for a spilled message reads it from the store
+	   into buf, and sets length.  NULL if it had none, or if a spilled
+	   one can't be read (then e.spilled is set).  */
+	const char *text(const entry &e, std::string &buf, size_t &length) const;
+
+	/* Bytes copied for the strings. */
+	size_t string_bytes() const { return strings.size(); }
+
+	private:
+	size_t keep(const char *s, size_t len);
+
+	std::vector<entry> entries;
+	std::vector<char> strings;
+	SmqSpillStore *store;		// Where spilled entries' text is
+
+	// No copying.
+	SmqSnapshot(const SmqSnapshot &);
+	SmqSnapshot & operator= (const SmqSnapshot &);
+};
+
+} // namespace SMqueue
+
+#endif /* SMQSNAPSHOT_H_ */
@@ -0,0 +1,317 @@
+/*
+* Copyright 2014 Range Networks, Inc.
+*
+* This software is distributed under multiple licenses;
+* see the COPYING file in the main directory for licensing
+* information for this specific distribuion.
+*
+* This use of this software may be subject to additional restrictions.
+* See the LEGAL file in the main directory for details.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+
+/*
+ * SmqSpill.cpp
+ *
+ * The store for the text of spilled messages.  See SmqSpill.h.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <set>
+#include <vector>
+
+#include <Logger.h>
+
+#include "SmqSpill.h"
+
+namespace SMqueue {
+
+SmqSpillStore::SmqSpillStore() :
+	base (),
+	slots (),
+	segments (),
+	current (0),
+	lastSegment (0),
+	nextKey (1),
+	counts ()
+{
+	pthread_mutex_init(&mutex, NULL);
+}
+
+SmqSpillStore::~SmqSpillStore()
+{
+	close();
+	pthread_mutex_destroy(&mutex);
+}
+
+void SmqSpillStore::open(const std::string &savefile)
+{
+	pthread_mutex_lock(&mutex);
+	base = savefile + ".spill.";
+	pthread_mutex_unlock(&mutex);
+}
+
+void SmqSpillStore::close()
+{
+	pthread_mutex_lock(&mutex);
+	for (segment_map::iterator x = segments.begin(); x != segments.end(); ++x)
+		::close(x->second.fd);
+	segments.clear();
+	slots.clear();
+	current = 0;
+	counts.live = 0;
+	counts.live_bytes = 0;
+	counts.segments = 0;
+	pthread_mutex_unlock(&mutex);
+}
+
+bool SmqSpillStore::start_segment()
+{
+	if (base.empty())
+		return false;
+	unsigned n = lastSegment + 1;
+	char suffix[32];
+	snprintf(suffix, sizeof(suffix), "%06u", n);
+	std::string path = base + suffix;
+	int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		LOG(ERR) << "Can't make spill segment " << path << ": " << strerror(errno);
+		return false;
+	}
+	// Only we use it, and only while we're running.
+	unlink(path.c_str());
+	segment s;
+	s.fd = fd;
+	s.size = 0;
+	s.live = 0;
+	s.live_bytes = 0;
+	s.readers = 0;
+	segments[n] = s;
+	counts.segments++;
+	unsigned previous = current;
+	current = lastSegment = n;
+	if (previous)
+		drop_if_dead(segments.find(previous));
+	return true;
+}
+
+/* Close a segment nothing is wanted from any more.  Mutex held. */
+bool SmqSpillStore::drop_if_dead(segment_map::iterator seg)
+{
+	if (seg == segments.end() || seg->second.live || seg->second.readers
+	 || seg->first == current)
+		return false;
+	::close(seg->second.fd);
+	segments.erase(seg);
+	counts.segments--;
+	return true;
+}
+
+bool SmqSpillStore::append(const char *data, size_t len, slot &s)
+{
+	pthread_mutex_lock(&mutex);
+	if ((!current || segments[current].size >= SEGMENT_BYTES) && !start_segment()) {
+		counts.errors++;
+		pthread_mutex_unlock(&mutex);
+		return false;
+	}
+	segment &seg = segments[current];
+	s.segment = current;
+	s.offset = seg.size;
+	s.length = len;
+	s.refs = 1;
+	seg.size += len;
+	seg.live++;		// So it stays open while we write
+	seg.live_bytes += len;
+	int fd = seg.fd;
+	pthread_mutex_unlock(&mutex);
+
+	if (pwrite(fd, data, len, s.offset) == (ssize_t) len)
+		return true;
+
+	LOG(ERR) << "Can't write to spill segment " << s.segment << ": " << strerror(errno);
+	pthread_mutex_lock(&mutex);
+	counts.errors++;
+	segment_map::iterator x = segments.find(s.segment);
+	x->second.live--;
+	x->second.live_bytes -= len;
+	drop_if_dead(x);
+	pthread_mutex_unlock(&mutex);
+	return false;
+}
+
+uint64_t SmqSpillStore::put(const char *data, size_t len)
+{
+	slot s;
+	if (!append(data, len, s))
+		return 0;
+
+	pthread_mutex_lock(&mutex);
+	uint64_t key = nextKey++;
+	slots[key] = s;
+	counts.puts++;
+	counts.live++;
+	counts.live_bytes += len;
+	pthread_mutex_unlock(&mutex);
+	return key;
+}
+
+bool SmqSpillStore::read(const slot &s, std::string &out)
+{
+	// Its segment can't be closed, by a release() or compact(), till
+	// we're done.
+	segment_map::iterator seg = segments.find(s.segment);
+	seg->second.readers++;
+	int fd = seg->second.fd;
+	pthread_mutex_unlock(&mutex);
+
+	out.resize(s.length);
+	bool ok = s.length == 0
+		|| pread(fd, &out[0], s.length, s.offset) == (ssize_t) s.length;
+	if (!ok)
+		LOG(ERR) << "Can't read spill segment " << s.segment << ": " << strerror(errno);
+
+	pthread_mutex_lock(&mutex);
+	seg->second.readers--;
+	drop_if_dead(seg);
+	if (!ok)
+		counts.errors++;
+	return ok;
+}
+
+bool SmqSpillStore::get(uint64_t key, std::string &out)
+{
+	pthread_mutex_lock(&mutex);
+	slot_map::iterator x = slots.find(key);
+	if (x == slots.end()) {
+		counts.errors++;
+		pthread_mutex_unlock(&mutex);
+		return false;
+	}
+	slot s = x->second;
+	bool ok = read(s, out);
+	if (ok)
+		counts.gets++;
+	pthread_mutex_unlock(&mutex);
+	return ok;
+}
+
+void SmqSpillStore::release(uint64_t key)
+{
+	pthread_mutex_lock(&mutex);
+	slot_map::iterator x = slots.find(key);
+	if (x != slots.end() && --x->second.refs == 0) {
+		segment_map::iterator seg = segments.find(x->second.segment);
+		counts.releases++;
+		counts.live--;
+		counts.live_bytes -= x->second.length;
+		if (seg != segments.end()) {
+			seg->second.live--;
+			seg->second.live_bytes -= x->second.length;
+			drop_if_dead(seg);
+		}
+		slots.erase(x);
+	}
+	pthread_mutex_unlock(&mutex);
+}
+
+bool SmqSpillStore::retain(uint64_t key)
+{
+	pthread_mutex_lock(&mutex);
+	slot_map::iterator x = slots.find(key);
+	bool found = x != slots.end();
+	if (found)
+		x->second.refs++;
+	pthread_mutex_unlock(&mutex);
+	return found;
+}
+
+unsigned SmqSpillStore::compact()
+{
+	std::vector<uint64_t> keys;
+	unsigned emptied = 0;
+	unsigned long moved = 0;
+
+	// What's left in the segments that are mostly dead.
+	pthread_mutex_lock(&mutex);
+	std::set<unsigned> sparse;
+	for (segment_map::iterator x = segments.begin(); x != segments.end(); ++x) {
+		if (x->first != current
+		 && x->second.live_bytes * 100 <= x->second.size * COMPACT_PERCENT)
+			sparse.insert(x->first);
+	}
+	if (!sparse.empty()) {
+		for (slot_map::iterator x = slots.begin(); x != slots.end(); ++x) {
+			if (sparse.count(x->second.segment))
+				keys.push_back(x->first);
+		}
+	}
+	pthread_mutex_unlock(&mutex);
+
+	// One at a time, so the owners aren't held up long.
+	std::string bytes;
+	for (size_t i = 0; i < keys.size(); i++) {
+		pthread_mutex_lock(&mutex);
+		slot_map::iterator x = slots.find(keys[i]);
+		if (x == slots.end()) {
+			pthread_mutex_unlock(&mutex);
+			continue;	// Released meanwhile
+		}
+		slot from = x->second;
+		bool ok = read(from, bytes);
+		pthread_mutex_unlock(&mutex);
+		slot to;
+		if (!ok || !append(bytes.data(), bytes.size(), to))
+			break;		// Logged; try again next time
+
+		pthread_mutex_lock(&mutex);
+		x = slots.find(keys[i]);
+		if (x != slots.end()) {
+			segment_map::iterator old = segments.find(from.segment);
+			x->second.segment = to.segment;
+			x->second.offset = to.offset;
+			old->second.live--;
+			old->second.live_bytes -= from.length;
+			moved++;
+			if (drop_if_dead(old))
+				emptied++;
+		} else {
+			// Released while we copied it, so the copy's dead too.
+			segment_map::iterator now = segments.find(to.segment);
+			now->second.live--;
+			now->second.live_bytes -= to.length;
+			drop_if_dead(now);
+		}
+		pthread_mutex_unlock(&mutex);
+	}
+
+	pthread_mutex_lock(&mutex);
+	counts.compacted += emptied;
+	counts.moved += moved;
+	pthread_mutex_unlock(&mutex);
+	if (emptied)
+		LOG(INFO) << "Spill: compacted " << emptied << " segments, moving "
+			<< moved << " keys";
+	return emptied;
+}
+
+SmqSpillStore::counters SmqSpillStore::stats()
+{
+	pthread_mutex_lock(&mutex);
+	counters c = counts;
+	c.dead_bytes = 0;
+	for (segment_map::iterator x = segments.begin(); x != segments.end(); ++x)
+		c.dead_bytes += x->second.size - x->second.live_bytes;
+	pthread_mutex_unlock(&mutex);
+	return c;
+}
+
+} // namespace SMqueue
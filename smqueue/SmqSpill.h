@@ -0,0 +1,150 @@
+/*
+* Copyright 2014 Range Networks, Inc.
+*
+* This software is distributed under multiple licenses;
+* see the COPYING file in the main directory for licensing
+* information for this specific distribuion.
+*
+* This use of this software may be subject to additional restrictions.
+* See the LEGAL file in the main directory for details.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+
+/*
+ * SmqSpill.h
+ *
+ * Where the text of queued messages goes when the queue is over its
+ * memory budget.
+ *
+ * During a long outage of a cell its messages sit in the queue for
+ * hours between retries, each holding its text and often a parse tree
+ * and decoded TPDU, and the queue grows till the OOM killer takes
+ * smqueue.  With Queue.Memory.Budget set, SMq::balance_memory() takes
+ * the messages with the longest wait ahead of them, puts their text
+ * here, and frees it and everything made from it, keeping only what
+ * the scheduler and indexes need.  Each one is paged back in a little
+ * before it's due.
+ *
+ * The store is a series of append-only segment files beside the save
+ * file, savefile.spill.N, each unlinked as soon as it's made, so nothing
+ * is left behind by a crash; the journal and the save file, not this,
+ * are what keep the queue.  A map from key to segment, offset and length
+ * is all that's kept in memory.  A segment is closed, and so its space
+ * freed, once nothing in it is still wanted and it isn't the one being
+ * written.  Reads and writes are pread/pwrite, done outside the lock.
+ *
+ * One long-lived message keeps a whole segment open, so compact() copies
+ * what's left in mostly dead segments into the current one, letting
+ * them go.
+ */
+
+#ifndef SMQSPILL_H_
+#define SMQSPILL_H_
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <map>
+#include <string>
+#include <tr1/unordered_map>
+
+namespace SMqueue {
+
+class SmqSpillStore {
+	public:
+	const static uint64_t SEGMENT_BYTES = 16 << 20;	// Then start another
+	const static unsigned COMPACT_PERCENT = 25;	// Live, or less, to compact
+
+	SmqSpillStore();
+	~SmqSpillStore();
+
+	/* Where to make the segments: beside savefile.  Nothing is made
+	   till something is put.  */
+	void open(const std::string &savefile);
+	void close();
+
+	/* Store len bytes at data.  Result is the key to get them back
+	   with, or 0 if they couldn't be written.  */
+	uint64_t put(const char *data, size_t len);
+
+	/* The bytes stored under key.  */
+	bool get(uint64_t key, std::string &out);
+
+	/* Done with key.  A key is kept till it's been released once
+	   more than it's been retained.  */
+	void release(uint64_t key);
+
+	/* Keep key's bytes for someone besides its owner, who releases
+	   it when done (SmqSnapshot does).  False if there's no such key.  */
+	bool retain(uint64_t key);
+
+	/* Copy the live bytes of segments that are at most COMPACT_PERCENT
+	   live into the current one, so the old ones can be closed.
+	   Result is how many segments were emptied.  */
+	unsigned compact();
+
+	struct counters {
+		unsigned long puts;
+		unsigned long gets;
+		unsigned long releases;
+		unsigned long errors;
+		unsigned long live;		// Keys not released
+		uint64_t live_bytes;
+		uint64_t dead_bytes;		// Released, in segments still open
+		unsigned long segments;		// Open now
+		unsigned long compacted;	// Segments emptied by compact()
+		unsigned long moved;		// Keys copied by compact()
+
+		counters() : puts(0), gets(0), releases(0), errors(0), live(0),
+			live_bytes(0), dead_bytes(0), segments(0), compacted(0),
+			moved(0) {}
+	};
+	counters stats();
+
+	private:
+	struct slot {
+		unsigned segment;
+		uint32_t length;
+		uint64_t offset;
+		unsigned refs;		// Owner, plus retain() calls
+	};
+	struct segment {
+		int fd;
+		uint64_t size;		// Written, or being written
+		unsigned long live;	// Slots in it not released
+		uint64_t live_bytes;
+		unsigned readers;	// Reads going on outside the mutex
+	};
+	typedef std::tr1::unordered_map<uint64_t, slot> slot_map;
+	typedef std::map<unsigned, segment> segment_map;
+
+	bool start_segment();		// With mutex held
+	bool drop_if_dead(segment_map::iterator seg);
+	/* Write len bytes at data to the current segment, and say where
+	   in s.  Without the mutex.  */
+	bool append(const char *data, size_t len, slot &s);
+	/* Read a slot's bytes.  With the mutex held, which is let go for
+	   the read.  */
+	bool read(const slot &s, std::string &out);
+
+	pthread_mutex_t mutex;
+	std::string base;		// savefile.spill.
+	slot_map slots;
+	segment_map segments;
+	unsigned current;		// The segment being written; 0 if none
+	unsigned lastSegment;
+	uint64_t nextKey;
+	counters counts;
+
+	// No copying.
+	SmqSpillStore(const SmqSpillStore &);
+	SmqSpillStore & operator= (const SmqSpillStore &);
+};
+
+} // namespace SMqueue
+
+#endif /* SMQSPILL_H_ */
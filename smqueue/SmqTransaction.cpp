@@ -0,0 +1,221 @@
+/*
+* Copyright 2014 Range Networks, Inc.
+*
+* This software is distributed under multiple licenses;
+* see the COPYING file in the main directory for licensing
+* information for this specific distribuion.
+*
+* This use of this software may be subject to additional restrictions.
+* See the LEGAL file in the main directory for details.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+/*
+ * SmqTransaction.cpp
+ *
+ * SIP transaction tables.  See SmqTransaction.h.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "SmqTransaction.h"
+#include "SmqGlobals.h"
+
+namespace SMqueue {
+
+/* The value of the parameter called name, or NULL. */
+static const char *
+param_value(const osip_list_t *params, const char *name)
+{
+	__node_t *plist = (__node_t *) params->node;
+	for (; plist; plist = (__node_t *) plist->next) {
+		osip_generic_param_t *param = (osip_generic_param_t *) plist->element;
+		if (param && param->gname && !strcmp(name, param->gname))
+			return param->gvalue ? param->gvalue : "";
+	}
+	return NULL;
+}
+
+SmqServerTransactions::SmqServerTransactions() :
+	timerJ (64 * T1)
+{
+}
+
+SmqServerTransactions::~SmqServerTransactions()
+{
+}
+
+void SmqServerTransactions::set_timer_j(int ms)
+{
+	timerJ = ms;
+}
+
+std::string SmqServerTransactions::key_of(osip_message_t *request)
+{
+	std::string key;
+
+	if (!request->call_id || !request->call_id->number
+	 || !request->cseq || !request->cseq->number)
+		return key;
+
+	osip_via_t *via = (osip_via_t *) osip_list_get(&request->vias, 0);
+	const char *branch = via ? param_value(&via->via_params, "branch") : NULL;
+	if (branch)
+		key += branch;
+	key += '|';
+	key += request->call_id->number;
+	if (request->call_id->host) {
+		key += '@';
+		key += request->call_id->host;
+	}
+	key += '|';
+	key += request->cseq->number;
+	key += ' ';
+	if (request->cseq->method)
+		key += request->cseq->method;
+	key += '|';
+	const char *fromtag = request->from
+		? param_value(&request->from->gen_params, "tag") : NULL;
+	if (fromtag)
+		key += fromtag;
+	return key;
+}
+
+SmqServerTransactions::Shard &SmqServerTransactions::shard_of(const std::string &key)
+{
+	// FNV-1a
+	uint32_t h = 2166136261u;
+	for (size_t i = 0; i < key.size(); i++) {
+		h ^= (unsigned char) key[i];
+		h *= 16777619u;
+	}
+	return shards[h % NSHARDS];
+}
+
+/* Called with the shard's lock held. */
+void SmqServerTransactions::expire(Shard &sh, time_t now)
+{
+	while (!sh.expiries.empty() && sh.expiries.front().first <= now) {
+		entry_map::iterator x = sh.entries.find(sh.expiries.front().second);
+		// A later respond() may have pushed the time back.
+		if (x != sh.entries.end() && x->second.expires <= now) {
+			sh.entries.erase(x);
+			sh.stats.expired++;
+		}
+		sh.expiries.pop_front();
+	}
+}
+
+bool SmqServerTransactions::receive(const std::string &key, std::string &response)
+{
+	int j = timerJ;
+	if (j <= 0 || key.empty())
+		return false;
+
+	Shard &sh = shard_of(key);
+	time_t now = msgettime();
+	bool again = false;
+
+	pthread_mutex_lock(&sh.mutex);
+	expire(sh, now);
+	entry_map::iterator x = sh.entries.find(key);
+	if (x != sh.entries.end()) {
+		response = x->second.response;
+		sh.stats.retransmissions++;
+		if (!response.empty())
+			sh.stats.answered++;
+		again = true;
+	} else {
+		// If we never answer, it goes away after timer J anyway.
+		Entry e;
+		e.expires = now + j;
+		sh.entries.insert(entry_map::value_type(key, e));
+		sh.expiries.push_back(std::make_pair(e.expires, key));
+		sh.stats.transactions++;
+	}
+	pthread_mutex_unlock(&sh.mutex);
+	return again;
+}
+
+void SmqServerTransactions::respond(const std::string &key, const std::string &response)
+{
+	if (key.empty())
+		return;
+
+	Shard &sh = shard_of(key);
+	time_t now = msgettime();
+
+	pthread_mutex_lock(&sh.mutex);
+	entry_map::iterator x = sh.entries.find(key);
+	if (x != sh.entries.end()) {
+		if (response.empty()) {
+			sh.entries.erase(x);
+		} else {
+			x->second.response = response;
+			x->second.expires = now + timerJ;
+			sh.expiries.push_back(std::make_pair(x->second.expires, key));
+		}
+	}
+	pthread_mutex_unlock(&sh.mutex);
+}
+
+SmqServerTransactions::counters SmqServerTransactions::stats()
+{
+	counters total;
+	time_t now = msgettime();
+
+	for (int i = 0; i < NSHARDS; i++) {
+		Shard &sh = shards[i];
+		pthread_mutex_lock(&sh.mutex);
+		expire(sh, now);
+		total.transactions += sh.stats.transactions;
+		total.retransmissions += sh.stats.retransmissions;
+		total.answered += sh.stats.answered;
+		total.expired += sh.stats.expired;
+		total.entries += sh.entries.size();
+		pthread_mutex_unlock(&sh.mutex);
+	}
+	return total;
+}
+
+
+SmqClientTransactions::SmqClientTransactions() :
+	t1 (T1),
+	t2 (T2),
+	timerF (64 * T1),
+	counts ()
+{
+}
+
+void SmqClientTransactions::set_timers(int newT1, int newT2, int newTimerF)
+{
+	t1 = newT1 > 0 ? newT1 : T1;
+	t2 = newT2 > t1 ? newT2 : t1;
+	timerF = newTimerF;
+}
+
+time_t SmqClientTransactions::next_action(time_t start, int sends, bool proceeding) const
+{
+	time_t due;
+
+	if (proceeding) {
+		// Every T2 from now on.
+		due = msgettime() + t2;
+	} else {
+		// The n'th send is followed by a wait of min(2^(n-1)*T1, T2).
+		int wait = t1;
+		due = start;
+		for (int i = 0; i < sends; i++) {
+			due += wait;
+			wait = wait * 2 < t2 ? wait * 2 : t2;
+		}
+	}
+	time_t giveUp = start + timerF;
+	return due < giveUp ? due : giveUp;
+}
+
+} // namespace SMqueue
@@ -0,0 +1,178 @@
+/*
+* Copyright 2014 Range Networks, Inc.
+*
+* This software is distributed under multiple licenses;
+* see the COPYING file in the main directory for licensing
+* information for this specific distribuion.
+*
+* This use of this software may be subject to additional restrictions.
+* See the LEGAL file in the main directory for details.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+/*
+ * SmqTransaction.h
+ *
+ * SIP transactions (RFC 3261 section 17) for the MESSAGEs smqueue
+ * takes in and sends out.
+ *
+ * SmqServerTransactions remembers each request we've answered, and the
+ * answer, for timer J (64*T1) after the final response.  A BTS that
+ * didn't hear our 202 sends the MESSAGE again; that's a retransmission
+ * of the same transaction, and it gets the same response again rather
+ * than being queued and delivered a second time.  A retransmission that
+ * arrives before we've answered the first copy is dropped, as in the
+ * Trying state.
+ *
+ * Requests are matched on the top Via branch, Call-ID, CSeq and From
+ * tag, so this works for peers that don't make RFC 3261 branches too.
+ * The table is split into NSHARDS parts, each with its own lock, since
+ * every receiver thread uses it.
+ */
+
+#ifndef SMQTRANSACTION_H_
+#define SMQTRANSACTION_H_
+
+#include <pthread.h>
+#include <time.h>
+#include <deque>
+#include <string>
+#include <tr1/unordered_map>
+
+#include <osipparser2/osip_message.h>
+
+namespace SMqueue {
+
+class SmqServerTransactions {
+	public:
+	const static int NSHARDS = 16;
+	const static int T1 = 500;		// ms, RFC 3261 round trip estimate
+
+	SmqServerTransactions();
+	~SmqServerTransactions();
+
+	/* How long to keep answered transactions, in ms; 0 turns the
+	   table off.  */
+	void set_timer_j(int ms);
+
+	/* The key for a request; empty if it lacks a Call-ID or CSeq. */
+	static std::string key_of(osip_message_t *request);
+
+	/* A request has arrived.  Result is true if it's a retransmission,
+	   with response set to what we answered (empty if we haven't yet).
+	   Otherwise a new transaction is started for it.  */
+	bool receive(const std::string &key, std::string &response);
+
+	/* We've sent the final response for key's transaction; start
+	   timer J.  An empty response forgets the transaction, so the
+	   next copy of the request is taken as new.  */
+	void respond(const std::string &key, const std::string &response);
+
+	struct counters {
+		unsigned long transactions;	// New requests
+		unsigned long retransmissions;	// Absorbed
+		unsigned long answered;		// ... with the cached response
+		unsigned long expired;		// Timer J fired
+		unsigned long entries;
+
+		counters() : transactions(0), retransmissions(0), answered(0),
+			expired(0), entries(0) {}
+	};
+
+	/* The counters, summed over the shards. */
+	counters stats();
+
+	private:
+	struct Entry {
+		std::string response;	// Empty while Trying
+		time_t expires;		// ms
+	};
+	typedef std::tr1::unordered_map<std::string, Entry> entry_map;
+	typedef std::deque<std::pair<time_t, std::string> > expiry_queue;
+
+	struct Shard {
+		pthread_mutex_t mutex;
+		entry_map entries;
+		expiry_queue expiries;	// In time order, since timer J is fixed
+		counters stats;
+
+		Shard() : entries(), expiries(), stats() { pthread_mutex_init(&mutex, NULL); }
+		~Shard() { pthread_mutex_destroy(&mutex); }
+	};
+
+	Shard &shard_of(const std::string &key);
+	void expire(Shard &sh, time_t now);
+
+	Shard shards[NSHARDS];
+	int timerJ;		// ms
+
+	// No copying.
+	SmqServerTransactions(const SmqServerTransactions &);
+	SmqServerTransactions & operator= (const SmqServerTransactions &);
+};
+
+
+/*
+ * The timers for the MESSAGEs we send (RFC 3261 17.1.2, the non-INVITE
+ * client transaction).  Over UDP the request is sent again T1 after the
+ * first send, then 2*T1, 4*T1 ... but never more than T2 apart (timer
+ * E); once a provisional response has come, every T2.  If no final
+ * response has come by timer F, 64*T1 after the first send, the
+ * delivery has failed.
+ *
+ * The transaction's state lives on the message (txn_start, txn_sends,
+ * txn_proceeding in short_msg_pending), whose next_action_time is set
+ * to the next send; this only does the arithmetic and the counting.
+ */
+class SmqClientTransactions {
+	public:
+	const static int T1 = 500;		// ms
+	const static int T2 = 4000;		// ms
+
+	SmqClientTransactions();
+
+	/* The timer values, in ms.  timerF 0 turns retransmission off:
+	   a request is sent once and waited for as it used to be.  */
+	void set_timers(int t1, int t2, int timerF);
+	bool enabled() const { return timerF > 0; }
+
+	/* When to send again, or to give up, for a transaction that began
+	   at start and has sent sends times.  */
+	time_t next_action(time_t start, int sends, bool proceeding) const;
+
+	/* Is timer F up for a transaction that began at start? */
+	bool timed_out(time_t start, time_t now) const {
+		return now >= start + timerF;
+	}
+
+	/* Count what happened. */
+	void started() { __sync_fetch_and_add(&counts.transactions, 1); }
+	void resent() { __sync_fetch_and_add(&counts.retransmissions, 1); }
+	void answered() { __sync_fetch_and_add(&counts.answered, 1); }
+	void timer_f() { __sync_fetch_and_add(&counts.timeouts, 1); }
+
+	struct counters {
+		unsigned long transactions;
+		unsigned long retransmissions;
+		unsigned long answered;		// Final response came
+		unsigned long timeouts;		// Timer F fired
+
+		counters() : transactions(0), retransmissions(0), answered(0),
+			timeouts(0) {}
+	};
+
+	counters stats() const { return counts; }
+
+	private:
+	int t1;
+	int t2;
+	int timerF;
+	counters counts;
+};
+
+} // namespace SMqueue
+
+#endif /* SMQTRANSACTION_H_ */
@@ -63,7 +63,10 @@ void* SmqWriter::SmqWriterThread(void * ptr) {
 	while (!smq.stop_main_loop) {
 
 		//LOG(DEBUG) <<"Start SMQ writer thread loop";
-		bytesRead = smqWriter->getqueHan()->SmqWaitforMessage(200, msgBuffer, (int) sizeof(msgBuffer));
+		// Sleep until a message comes or the once a minute stuff is due.
+		int waitMS = (61 - (int)(currentSeconds - lastRunSeconds)) * 1000;
+		if (waitMS < 0) waitMS = 0;
+		bytesRead = smqWriter->getqueHan()->SmqWaitforMessage(waitMS, msgBuffer, (int) sizeof(msgBuffer));
 		currentSeconds = getCurrentSeconds();
 		//LOG(DEBUG) << "Got return from SmqWaitforMessage in writer status:" << bytesRead;
 		if (bytesRead < 0) {
@@ -73,19 +76,31 @@ void* SmqWriter::SmqWriterThread(void * ptr) {
 			// ******** Got timeout ***************
 			//LOG(DEBUG) << "Got timeout in writer thread";
 
-			smq.process_timeout();  // Process entries in queue
-			//LOG(DEBUG) << "Return from process_timeout";
+			// The queue itself is processed by the shard threads.
 
 			if ((currentSeconds - lastRunSeconds ) > 60) {
 				LOG(DEBUG) << "Run once a minute stuff";
 				smq.InitInsideReaderLoop(); // Updates configuration
 
-				int queueSize = smq.time_sorted_list.size();
+				int queueSize = smq.queue_size();
 				if (queueSize > 0) { LOG(DEBUG) << "Queue size " << queueSize;}
-				// Save queue to file on timeout
+				smq.report_batch_stats();
+				smq.lookups.report_stats();
+				smq.report_io_stats();
+				smq.report_transaction_stats();
+				smq.spill.compact();
+				smq.report_memory_stats();
+				smq.report_journal_stats();
+				// Save queue to file on timeout, unless the journal
+				// has it; then only when the journal gets long.
+				// Recovery saves it when it's done.
 				//LOG(DEBUG) << "Enter save_queue_to_file";
-				if (!smq.save_queue_to_file(smq.savefile)) {  // Save queue file each timeout  may want to slow this down
-					LOG(WARNING) << "Failed to read queue file on timeout file:" << smq.savefile;
+				if (!smq.recovery.running
+				 && (!smq.journal.is_open()
+				  || smq.journal.segment_bytes() >= (uint64_t) smq.journal_compact_bytes)) {
+					if (!smq.checkpoint_queue()) {
+						LOG(WARNING) << "Failed to save queue file on timeout file:" << smq.savefile;
+					}
 				}
 				lastRunSeconds = currentSeconds;
 			}
@@ -99,7 +114,7 @@ void* SmqWriter::SmqWriterThread(void * ptr) {
 			// PROCESS MESSAGES HERE
 			pMsg->ProcessMessage();
 
-			delete pMsg;
+			pMsg->release();
 		} // Got message
 	} // while
 
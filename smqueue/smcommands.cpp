@@ -93,7 +93,14 @@ shortcode_quick_chk (const char *imsi, const char *msgtext,
 {
 	ostringstream answer;
 	
-	answer << scp->scp_smq->time_sorted_list.size() << " queued.";  // No lock okay
+	SmqSnapshot snap;
+	scp->scp_smq->snapshot(snap, false);
+	int due = 0;
+	for (size_t i = 0; i < snap.size(); i++) {
+		if (snap.at(i).next_action_time <= snap.taken)
+			due++;
+	}
+	answer << snap.size() << " queued, " << due << " due.";
 	scp->scp_reply = new_strdup(answer.str().c_str());
 	return SCA_REPLY;
 }
@@ -109,27 +116,43 @@ shortcode_four_one_one (const char *imsi, const char *msgtext,
 	ostringstream answer;
 	
         int n = 0, missing = 0, registering = 0, bouncing = 0;
-        
-        smq.lockSortedList();
-        short_msg_p_list::iterator x;
-        for (x = scp->scp_smq->time_sorted_list.begin();   // locked
-             x != scp->scp_smq->time_sorted_list.end(); x++) {
+        std::string registerCode = gConfig.getStr("SC.Register.Code");
+        std::string infoCode = gConfig.getStr("SC.Info.Code");
+
+        // Count from a copy of the queue, looking at the text of each
+        // message without parsing it, so the queue isn't held up.
+        SmqSnapshot snap;
+        scp->scp_smq->snapshot(snap, true);
+        std::string spilled;
+        for (size_t i = 0; i < snap.size(); i++) {
+	    const SmqSnapshot::entry &e = snap.at(i);
 	    n++;
-	    switch (x->state) {
+	    switch (e.state) {
 		case REQUEST_DESTINATION_SIPURL:
 		case REQUEST_MSG_DELIVERY:
 		case ASKED_FOR_MSG_DELIVERY:
-		case AWAITING_TRY_MSG_DELIVERY:
-		    x->make_text_valid();
-		    if (0 == strcmp ("127.0.0.1", x->parsed->req_uri->host))
+		case AWAITING_TRY_MSG_DELIVERY: {
+		    SmqSipView view;
+		    size_t length;
+		    const char *text = snap.text(e, spilled, length);
+		    if (!text || !view.scan(text, length)
+		     || !view.is_request())
+			break;
+		    SmqSipView::span uri = view.request_uri();
+		    std::string host = view.str(view.uri_hostport(uri));
+		    host = host.substr(0, host.find(':'));
+		    std::string to = view.str(view.uri_user(uri));
+		    std::string from = view.str(view.uri_user(view.addr_uri(view.header("From", 'f'))));
+		    if (host == "127.0.0.1")
 			missing++;
-		    if (0 == strcmp (gConfig.getStr("SC.Register.Code").c_str(),x->parsed->from->url->username))
+		    if (from == registerCode)
 			registering++;
-		    if (0 == strcmp (gConfig.getStr("SC.Register.Code").c_str(), x->parsed->req_uri->username))
+		    if (to == registerCode)
 		    	registering++;
-		    if (0 == strcmp (gConfig.getStr("SC.Info.Code").c_str(), x->parsed->from->url->username))
+		    if (from == infoCode)
 			bouncing++;
 		    break;
+		}
 
 		case AWAITING_REGISTER_HANDSET:
 		case REGISTER_HANDSET:
@@ -142,7 +165,6 @@ shortcode_four_one_one (const char *imsi, const char *msgtext,
 
             } //switch
         }  // for
-        smq.unlockSortedList();
 
         answer <<  n << " queued";
 	if (missing)
@@ -209,16 +231,20 @@ shortcode_zap_queued (const char *imsi, const char *msgtext,
         int n = 0;
         short_msg_p_list::iterator x;
         time_t toolate = SMq::LONGDELETMS // 83 minutes
-                        + scp->scp_smq->time_sorted_list.begin()->msgettime();
-        for (x = scp->scp_smq->time_sorted_list.begin();
-             x != scp->scp_smq->time_sorted_list.end(); x++) {
+                        + scp->scp_qmsg_it->msgettime();
+        for (size_t i = 0; i < scp->scp_smq->shards.size(); i++) {
+        short_msg_p_list &msgs = scp->scp_smq->shards[i]->message_list;
+        for (x = msgs.begin(); x != msgs.end(); ) {
+            short_msg_p_list::iterator next = x;
+            next++;
             if (x->state == NO_STATE || toolate <= x->next_action_time) {
                 n++;
-                resplist.splice(resplist.begin(),
-                                scp->scp_smq->time_sorted_list, x);
+                scp->scp_smq->extract_message(x, resplist);
                 resplist.pop_front();   // pop and delete the sent_msg.
             }
+            x = next;
         }
+        }  // for shards
         answer <<  "Removed " << n << " messages.";
     } else {
         // figure out what message we're deleting, by tag
@@ -231,8 +257,7 @@ shortcode_zap_queued (const char *imsi, const char *msgtext,
                    << " in state " << sent_msg->state
                    << " and timeout " 
                    << sent_msg->next_action_time - sent_msg->msgettime();
-           resplist.splice(resplist.begin(),
-                           scp->scp_smq->time_sorted_list, sent_msg);
+           scp->scp_smq->extract_message(sent_msg, resplist);
            resplist.pop_front();   // pop and delete the sent_msg.
         }
     }
@@ -347,6 +372,11 @@ shortcode_register (const char *imsi, const char *msgtext,
 			// Book 'em, danno!
 
 			did = smq->my_hlr.addUser(imsi, phonenum);
+			if (did == SubscriberRegistry::SUCCESS ||
+			    did == SubscriberRegistry::DELAYED) {
+				// Cached "not found" answers are now wrong.
+				smq->lookups.invalidate_subscriber(imsi, phonenum);
+			}
 			switch (did) {
 			case SubscriberRegistry::SUCCESS:
 				// Phone#<->IMSI is set up; now register
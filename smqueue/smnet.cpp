@@ -30,8 +30,11 @@
 #include <netdb.h>			// getaddrinfo
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>			// new_call_number
 #include <cstdlib>			// l64a
 #include <arpa/inet.h>			// inet_ntop
+#include <netinet/in.h>			// IPPROTO_UDP
+#include <linux/filter.h>		// Reuseport steering
 
 
 #include "smnet.h"
@@ -50,6 +53,340 @@ SMnet::abfuckingort()
 	*((char *)0) = -1;
 }
 
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT	103		// linux/udp.h, Linux 4.18 and later
+#endif
+
+#ifndef SO_REUSEPORT
+#define SO_REUSEPORT	15		// Linux 3.9 and later
+#endif
+#ifndef SO_ATTACH_REUSEPORT_CBPF
+#define SO_ATTACH_REUSEPORT_CBPF 51	// Linux 4.5 and later
+#endif
+#ifndef BPF_MOD
+#define BPF_MOD		0x90
+#endif
+#ifndef BPF_XOR
+#define BPF_XOR		0xa0
+#endif
+
+#define RX_BUFFER_SIZE	5000		// Biggest datagram we take
+#define GSO_MAX_SEGS	64		// Kernel limit on segments per send
+#define GSO_MAX_BYTES	65000		// ... and bytes
+#define MAX_ROUTE_TRIES	8		// Addresses tried per delivery
+
+/*
+ * The datagrams this thread is collecting between begin_sends() and
+ * flush_sends().  The bytes are copied, since callers free their
+ * buffers as soon as send_dgram returns.
+ */
+struct pending_send {
+	int fd;
+	size_t off;			// Into bytes
+	size_t len;
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	// For a delivery, the route it took, so a failed send can
+	// move the route on; empty otherwise.
+	std::string host;
+	std::string port;
+};
+struct send_batch {
+	int depth;
+	std::vector<char> bytes;
+	std::vector<pending_send> sends;
+	send_batch() : depth(0), bytes(), sends() {}
+};
+static __thread send_batch *tx_batch = NULL;
+
+/* If this thread is collecting sends, add one.  Result is false if
+   it isn't, and the caller should send it now.  */
+static bool
+queue_send(int fd, const char *buffer, size_t len,
+	   const struct sockaddr *to, socklen_t tolen,
+	   const char *host = NULL, const char *port = NULL)
+{
+	send_batch *b = tx_batch;
+	if (!b || b->depth == 0 || tolen > sizeof(struct sockaddr_storage))
+		return false;
+
+	pending_send ps;
+	ps.fd = fd;
+	ps.off = b->bytes.size();
+	ps.len = len;
+	memcpy(&ps.addr, to, tolen);
+	ps.addrlen = tolen;
+	if (host && port) {
+		ps.host = host;
+		ps.port = port;
+	}
+	b->bytes.insert(b->bytes.end(), buffer, buffer + len);
+	b->sends.push_back(ps);
+	return true;
+}
+
+void
+SMnet::set_batching(int count, bool gso)
+{
+	if (count < 1)
+		count = 1;
+	delete [] rx;
+	delete [] rx_msgs;
+	delete [] rx_iovs;
+	delete [] rx_buffers;
+	rx = new dgram[count];
+	rx_msgs = new struct mmsghdr[count];
+	rx_iovs = new struct iovec[count];
+	rx_buffers = new char[count * RX_BUFFER_SIZE];
+	rx_alloc = count;
+	rx_count = 0;
+	use_gso = gso ? 1 : 0;
+	LOG(INFO) << "Receiving up to " << count << " datagrams per call"
+		<< (gso ? ", sending with UDP_SEGMENT" : "");
+}
+
+/*
+ * Wait up to mstimeout for datagrams, then read as many as we have room
+ * for from each socket that has some, one recvmmsg per socket.
+ */
+int
+SMnet::recv_batch(int mstimeout)
+{
+	int i;
+	nfds_t j;
+
+	if (!rx_alloc)
+		set_batching(1, false);
+	rx_count = 0;
+
+	i = poll_sockets(mstimeout);
+	if (i <= 0)
+		return i;
+
+	for (j = 0; j < numsockets && rx_count < rx_alloc; j++) {
+		short revents = sockets[j].revents;
+
+		if (revents & (POLLIN|POLLPRI)) {
+			int room = rx_alloc - rx_count;
+			for (int k = 0; k < room; k++) {
+				struct mmsghdr *m = &rx_msgs[k];
+				dgram *d = &rx[rx_count + k];
+				d->data = rx_buffers + (rx_count + k) * RX_BUFFER_SIZE;
+				rx_iovs[k].iov_base = d->data;
+				rx_iovs[k].iov_len = RX_BUFFER_SIZE;
+				memset(m, 0, sizeof(*m));
+				m->msg_hdr.msg_name = &d->addr;
+				m->msg_hdr.msg_namelen = sizeof(d->addr);
+				m->msg_hdr.msg_iov = &rx_iovs[k];
+				m->msg_hdr.msg_iovlen = 1;
+			}
+			int n = recvmmsg(sockets[j].fd, rx_msgs, room, MSG_DONTWAIT, NULL);
+			__sync_fetch_and_add(&io_stats.rx_calls, 1);
+			if (n < 0) {
+				if (errno != EAGAIN && errno != EWOULDBLOCK)
+					LOG(ERR) << "Error " << strerror(errno) << " on recvmmsg";
+				continue;
+			}
+			int base = rx_count;	// Where this call's datagrams went
+			for (int k = 0; k < n; k++) {
+				if (rx_msgs[k].msg_hdr.msg_flags & MSG_TRUNC) {
+					LOG(ERR) << "recvmmsg data packet truncated, "
+						"buffer has " << RX_BUFFER_SIZE << " bytes";
+					continue;
+				}
+				dgram *d = &rx[rx_count];
+				if (rx_count != base + k) {
+					// Close up the gap a truncated one left.
+					memmove(d->data, rx[base + k].data, rx_msgs[k].msg_len);
+					d->addr = rx[base + k].addr;
+				}
+				d->len = rx_msgs[k].msg_len;
+				d->addrlen = rx_msgs[k].msg_hdr.msg_namelen;
+				rx_count++;
+			}
+			__sync_fetch_and_add(&io_stats.rx_dgrams, n);
+		} else if (revents & (POLLERR|POLLHUP|POLLNVAL)) {
+			LOG(ERR) << "Poll error on fd " << sockets[j].fd;
+		}
+	}
+	return rx_count;
+}
+
+void
+SMnet::begin_sends()
+{
+	if (!tx_batch)
+		tx_batch = new send_batch;	// Kept for the thread's life
+	tx_batch->depth++;
+}
+
+void
+SMnet::discard_sends()
+{
+	send_batch *b = tx_batch;
+	if (!b)
+		return;
+	b->bytes.clear();
+	b->sends.clear();
+}
+
+/*
+ * Send what this thread collected.  Consecutive datagrams for the same
+ * address and socket, all the same size but the last, go as one
+ * UDP_SEGMENT message that the kernel splits up; then each socket's
+ * messages go in one sendmmsg.
+ */
+void
+SMnet::flush_sends()
+{
+	send_batch *b = tx_batch;
+	if (!b || b->depth == 0 || --b->depth > 0)
+		return;
+
+	size_t n = b->sends.size();
+	if (n == 0)
+		return;
+
+	const size_t cspace = CMSG_SPACE(sizeof(uint16_t));
+	std::vector<struct mmsghdr> msgs;
+	std::vector<int> fds;
+	std::vector<size_t> firsts;	// Each message's first pending_send
+	std::vector<struct iovec> iovs(n);
+	std::vector<char> ctrl(n * cspace, 0);
+	msgs.reserve(n);
+
+	for (size_t i = 0; i < n; ) {
+		pending_send &first = b->sends[i];
+		size_t k = i + 1;
+		size_t bytes = first.len;
+		if (use_gso) {
+			while (k < n && k - i < GSO_MAX_SEGS
+			    && b->sends[k].fd == first.fd
+			    && b->sends[k].addrlen == first.addrlen
+			    && 0 == memcmp(&b->sends[k].addr, &first.addr, first.addrlen)
+			    && b->sends[k-1].len == first.len
+			    && b->sends[k].len <= first.len
+			    && bytes + b->sends[k].len <= GSO_MAX_BYTES) {
+				bytes += b->sends[k].len;
+				k++;
+			}
+		}
+
+		struct mmsghdr m;
+		memset(&m, 0, sizeof(m));
+		m.msg_hdr.msg_name = &first.addr;
+		m.msg_hdr.msg_namelen = first.addrlen;
+		m.msg_hdr.msg_iov = &iovs[i];
+		m.msg_hdr.msg_iovlen = k - i;
+		for (size_t x = i; x < k; x++) {
+			iovs[x].iov_base = &b->bytes[b->sends[x].off];
+			iovs[x].iov_len = b->sends[x].len;
+		}
+		if (k - i > 1) {
+			m.msg_hdr.msg_control = &ctrl[i * cspace];
+			m.msg_hdr.msg_controllen = cspace;
+			struct cmsghdr *cm = CMSG_FIRSTHDR(&m.msg_hdr);
+			cm->cmsg_level = IPPROTO_UDP;
+			cm->cmsg_type = UDP_SEGMENT;
+			cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+			uint16_t seg = first.len;
+			memcpy(CMSG_DATA(cm), &seg, sizeof(seg));
+		}
+		msgs.push_back(m);
+		fds.push_back(first.fd);
+		firsts.push_back(i);
+		i = k;
+	}
+
+	for (size_t i = 0; i < msgs.size(); ) {
+		size_t k = i + 1;
+		while (k < msgs.size() && fds[k] == fds[i])
+			k++;
+		int sent = sendmmsg(fds[i], &msgs[i], k - i, MSG_DONTWAIT);
+		__sync_fetch_and_add(&io_stats.tx_calls, 1);
+		if (sent <= 0) {
+			struct msghdr *h = &msgs[i].msg_hdr;
+			if (h->msg_controllen && (errno == EIO || errno == EINVAL
+						  || errno == ENOPROTOOPT)) {
+				// No GSO here; send the pieces one by one.  Only
+				// the sender that turns it off says so.
+				int err = errno;
+				if (__sync_bool_compare_and_swap(&use_gso, 1, 0))
+					LOG(WARNING) << "UDP_SEGMENT send failed (" << strerror(err)
+						<< "), not using it any more";
+				bool failed = false;
+				for (size_t x = 0; x < h->msg_iovlen; x++) {
+					if (sendto(fds[i], h->msg_iov[x].iov_base, h->msg_iov[x].iov_len,
+						   MSG_DONTWAIT, (struct sockaddr *) h->msg_name,
+						   h->msg_namelen) >= 0)
+						__sync_fetch_and_add(&io_stats.tx_dgrams, 1);
+					else
+						failed = true;
+					__sync_fetch_and_add(&io_stats.tx_calls, 1);
+				}
+				if (failed)
+					send_failed(b->sends[firsts[i]]);
+			} else {
+				LOG(ERR) << "Error " << strerror(errno) << " on sendmmsg";
+				send_failed(b->sends[firsts[i]]);
+			}
+			sent = 1;	// Drop it and go on with the rest
+		} else {
+			for (int x = 0; x < sent; x++) {
+				size_t segs = msgs[i + x].msg_hdr.msg_iovlen;
+				__sync_fetch_and_add(&io_stats.tx_dgrams, segs);
+				if (segs > 1) {
+					__sync_fetch_and_add(&io_stats.gso_sends, 1);
+					__sync_fetch_and_add(&io_stats.gso_dgrams, segs);
+				}
+			}
+		}
+		i += sent;
+	}
+
+	b->sends.clear();
+	b->bytes.clear();
+}
+
+/* A delivery flush_sends() sent couldn't go: the next one to its host
+   and port tries the next address, as deliver_msg_datagram does when
+   it sends right away.  The client transaction's retransmission (or
+   the next retry) is what goes there.  */
+void
+SMnet::send_failed(const pending_send &ps)
+{
+	if (ps.host.empty())
+		return;
+	LOG(DEBUG) << "Send to " << ps.host << ":" << ps.port << " failed: "
+		<< strerror(errno);
+	routes.failed(ps.host.c_str(), ps.port.c_str());
+}
+
+void
+SMnet::report_io_stats(const char *name)
+{
+	io_counters c = io_stats;
+	LOG(INFO) << name << ": " << c.rx_dgrams << " datagrams in " << c.rx_calls
+		<< " receives (" << (c.rx_dgrams ? (double) c.rx_calls / c.rx_dgrams : 0)
+		<< " per datagram), " << c.tx_dgrams << " out in " << c.tx_calls
+		<< " sends (" << (c.tx_dgrams ? (double) c.tx_calls / c.tx_dgrams : 0)
+		<< " per datagram), " << c.gso_dgrams << " of them in "
+		<< c.gso_sends << " UDP_SEGMENT sends";
+}
+
+
+void
+SMnet::report_route_stats()
+{
+	SmqRouteCache::counters c = routes.stats();
+	LOG(INFO) << "Route cache: " << c.entries << " entries, " << c.hits
+		<< " hits (" << c.negative_hits << " unresolvable), " << c.misses
+		<< " misses (" << c.expired << " expired), " << c.resolves
+		<< " lookups (" << c.resolve_failures << " failed), " << c.failovers
+		<< " failovers, " << c.evictions << " evictions, " << c.connected
+		<< " connected sockets";
+}
+
 
 /*
  * Send a datagram on a handy socket
@@ -74,10 +411,15 @@ SMnet::send_dgram(char *buffer, size_t buffsize, char *toaddr,
 		if (
 		    sockinfo[j].socktype == SOCK_DGRAM &&
 		    sockinfo[j].addrlen == toaddrsize) {
+			if (queue_send(sockets[j].fd, buffer, buffsize,
+				       (struct sockaddr *)toaddr, toaddrsize))
+				return true;	// Sent at flush_sends()
 			i = sendto (sockets[j].fd, buffer, buffsize,
 				flags, (struct sockaddr *)toaddr, toaddrsize);
+			__sync_fetch_and_add(&io_stats.tx_calls, 1);
 			if (i < 0)
 				continue;
+			__sync_fetch_and_add(&io_stats.tx_dgrams, 1);
 			if (i != (ssize_t) buffsize) {
 				errno = EPIPE;		// We could do better...
 				return false;
@@ -99,7 +441,7 @@ bool
 SMnet::deliver_msg_datagram(SMqueue::short_msg_pending *smp)
 {
 	char *scheme, *host, *port;
-	int s, i;
+	ssize_t i;
 	// Make sure the text is valid before writing it for debug,
 	// or delivering it to a handset.
 	smp->make_text_valid();
@@ -120,61 +462,66 @@ SMnet::deliver_msg_datagram(SMqueue::short_msg_pending *smp)
 	host   = smp->parsed->req_uri->host;
 	port   = smp->parsed->req_uri->port;
 	
-	struct addrinfo myhints;
-	struct addrinfo *myaddrs, *ap;
-
-	memset(&myhints, 0, sizeof(myhints));
-	myhints.ai_family = AF_UNSPEC;		// Any address family eg v4/6
-	myhints.ai_socktype = SOCK_DGRAM;	// Datagrams for now FIXME
-#ifdef AI_IDN
-	myhints.ai_flags = AI_IDN;		// Int'l dom names OK.
-#endif
 	if (!scheme)
 		scheme = (char * const)"sip";
 	if (!port)
 		port = scheme;	// More specific port is better
 
-	s = getaddrinfo(host, port, &myhints, &myaddrs);
-	if (s != 0) {
-		LOG(ERR) << "deliver_msg_datagram() can't lookup addr/port: " 
-		     << host << ":" << port << ", error " << s;
-		return false;
-	}
-	
-	// Now deliver to some working address we got back.
-	// For each address, find an open socket that has the right
-	// kind of protocol and return address...
-	// FIXME, do we need to match the bound address with the packet's
-	// "return address"?  Maybe...
-	for (ap = myaddrs; ap != NULL; ap = ap->ai_next) {
-		int flags = MSG_DONTWAIT;
-		nfds_t j;
-		i = 0;
-		for (j = 0; j < numsockets; j++) {
-			if (sockinfo[j].addrfam == ap->ai_family &&
-			    sockinfo[j].socktype == ap->ai_socktype &&
-			    sockinfo[j].protofam == ap->ai_protocol &&
-			    sockinfo[j].addrlen == ap->ai_addrlen) {
-				i = sendto (sockets[j].fd, 
-					smp->text, smp->text_length,
-					flags, ap->ai_addr, ap->ai_addrlen);
-				if (i < 0) {
-					break;	// Try another address
-				}
+	// Deliver to the address the route cache has for host and port,
+	// which resolves it if need be.  If that address won't take the
+	// datagram, the cache moves on to the next one.
+	for (int tries = 0; tries < MAX_ROUTE_TRIES; tries++) {
+		SmqRouteCache::route r;
+		if (!routes.get(host, port, r)) {
+			LOG(ERR) << "deliver_msg_datagram() can't lookup addr/port: " 
+			     << host << ":" << port;
+			return false;
+		}
+		int fd = r.connfd >= 0 ? r.connfd : r.fd;
+		if (r.fd < 0) {
+			// First time for this address: find an open socket
+			// that has the right kind of protocol and address.
+			// FIXME, do we need to match the bound address with
+			// the packet's "return address"?  Maybe...
+			nfds_t j;
+			for (j = 0; j < numsockets; j++) {
+				if (sockinfo[j].addrfam == r.family &&
+				    sockinfo[j].socktype == r.socktype &&
+				    sockinfo[j].protofam == r.protocol &&
+				    sockinfo[j].addrlen == r.addrlen)
+					break;
+			}
+			if (j == numsockets) {
+				routes.failed(host, port);	// No match, try another address
+				continue;
 			}
+			r.fd = sockets[j].fd;
+			r.connfd = routes.set_socket(host, port, r.fd);
+			fd = r.connfd >= 0 ? r.connfd : r.fd;
 		}
-		if (i < 0) continue;		// Errored, try another address
-		if (i == 0) continue;		// No match, try another address.
-		
-		break;				// sent -- stop trying!
-	}
-	freeaddrinfo(myaddrs);		// Don't leak memory.
-	if (ap == NULL) {		// If we walked off bottom of list,
-		LOG(ERR) << "Couldn't send datagram to " << host << ":" 
-		     << port << " on any socket";
-		return false;		// we failed to send
+
+		// A connected socket already knows where it's sending.
+		socklen_t tolen = (fd == r.connfd) ? 0 : r.addrlen;
+		if (queue_send(fd, smp->text, smp->text_length,
+			       (struct sockaddr *) &r.addr, tolen, host, port)) {
+			// Sent at flush_sends(), which moves the route on to
+			// the next address if that fails.
+			return true;
+		}
+		i = sendto (fd, smp->text, smp->text_length, MSG_DONTWAIT,
+			    tolen ? (struct sockaddr *) &r.addr : NULL, tolen);
+		__sync_fetch_and_add(&io_stats.tx_calls, 1);
+		if (i >= 0) {
+			__sync_fetch_and_add(&io_stats.tx_dgrams, 1);
+			return true;	// Hey, we sent the message onward!
+		}
+		LOG(DEBUG) << "Send to " << host << ":" << port << " failed: "
+			<< strerror(errno);
+		routes.failed(host, port);	// Errored, try another address
 	}
-	return true;			// Hey, we sent the message onward!
+	LOG(ERR) << "Couldn't send datagram to " << host << ":" 
+	     << port << " on any socket";
+	return false;		// we failed to send
 }
 
 
@@ -231,6 +578,7 @@ SMnet::get_next_dgram (char *buffer, size_t bufferlen, int mstimeout)
 // Read from socket
 			recvlength = recvfrom(fd, buffer, bufferlen, flags,
 					(sockaddr *)&src_addr, &addrlen);
+			__sync_fetch_and_add(&io_stats.rx_calls, 1);
 			if (recvlength < 0) {
 				// Error on receive.
 				LOG(ERR) << "Error " << strerror(errno)
@@ -246,6 +594,7 @@ SMnet::get_next_dgram (char *buffer, size_t bufferlen, int mstimeout)
 				abfuckingort();
 			}
 			recvaddrlen = addrlen;		// Save for later
+			__sync_fetch_and_add(&io_stats.rx_dgrams, 1);
 			if (recvlength > bufferlen) {
 				// Received packet itself truncated.
 				LOG(ERR) << "recvfrom data packet truncated, "
@@ -290,7 +639,7 @@ SMnet::get_next_dgram (char *buffer, size_t bufferlen, int mstimeout)
  * 		false no socket
  */
 bool
-SMnet::listen_on_port(std::string port)
+SMnet::listen_on_port(std::string port, bool reuseport)
 {
 	int s;
 	int gotasocket = 0;
@@ -317,6 +666,13 @@ SMnet::listen_on_port(std::string port)
 		fd = socket(ap->ai_family, ap->ai_socktype, ap->ai_protocol);
 		if (fd < 0)
 			continue;		// Try another
+		if (reuseport) {
+			// Share the port with the other receivers.
+			int on = 1;
+			if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0)
+				LOG(ERR) << "listen_on_port(" << port
+				     << ") can't set SO_REUSEPORT: " << strerror(errno);
+		}
 		// Set our port number & address.
 		i = bind(fd, ap->ai_addr, ap->ai_addrlen);
 		if (i < 0) {
@@ -350,6 +706,45 @@ SMnet::listen_on_port(std::string port)
 	return true;
 }
 
+/*
+ * A classic BPF program for the SO_REUSEPORT group: the result is the
+ * index of the socket to receive the datagram.  It runs with the UDP
+ * header pulled off, so the source address is read relative to the
+ * network header.  For IPv6 we hash the last word of the address, which
+ * is the IPv4 address for a mapped one.
+ */
+bool
+SMnet::attach_steering(int nreceivers)
+{
+	bool ok = true;
+	nfds_t j;
+
+	for (j = 0; j < numsockets; j++) {
+		int srcoff = sockinfo[j].addrfam == AF_INET6 ? 20 : 12;
+		struct sock_filter code[] = {
+			// A = X = source address
+			BPF_STMT(BPF_LD | BPF_W | BPF_ABS, (uint32_t) (SKF_NET_OFF + srcoff)),
+			BPF_STMT(BPF_MISC | BPF_TAX, 0),
+			// A = (A >> 16) ^ X
+			BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 16),
+			BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+			// return A % nreceivers
+			BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, (uint32_t) nreceivers),
+			BPF_STMT(BPF_RET | BPF_A, 0),
+		};
+		struct sock_fprog prog;
+		prog.len = sizeof(code) / sizeof(code[0]);
+		prog.filter = code;
+		if (setsockopt(sockets[j].fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+			       &prog, sizeof(prog)) < 0) {
+			LOG(ERR) << "Can't steer datagrams on fd " << sockets[j].fd
+			     << " by source address: " << strerror(errno);
+			ok = false;
+		}
+	}
+	return ok;
+}
+
 /*
  * My hostname as known to the global network.
  *
@@ -578,23 +973,23 @@ SMnet::new_random_number()
 /*
  * Return a different random string (a "call number" for a Call-ID in
  * SIP, RFC 3261) each time we are called.  That string is good until the
- * next call, but may need to be copied if needed beyond that.
+ * calling thread's next call, but may need to be copied if needed beyond
+ * that.  Queue shards call this from their own threads.
  */
 char *
 SMnet::new_call_number()
 {
-	char *p;
+	static __thread char callnum[6+1];
+	static pthread_mutex_t callnumMutex = PTHREAD_MUTEX_INITIALIZER;
 	long randnum;
 
+	// Neither l64a's buffer nor new_random_number is thread-safe.
+	pthread_mutex_lock(&callnumMutex);
 	randnum = new_random_number();
-	
-	p = l64a (randnum);
-	if (!random_string) {
-		random_string = new char[6+1];
-	}
-	strncpy(random_string, p, 6);
-	random_string[6] = '\0';
-	return random_string;
+	strncpy(callnum, l64a (randnum), 6);
+	pthread_mutex_unlock(&callnumMutex);
+	callnum[6] = '\0';
+	return callnum;
 }
 
 
@@ -29,12 +29,17 @@
 #include <iostream>
 #include "poll.h"
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
+#include <vector>
 #include <Logger.h>
+#include "SmqReactor.h"
+#include "SmqRouteCache.h"
 
 namespace SMqueue {
 
 class short_msg_pending;		// Forward declaration
+struct pending_send;			// In smnet.cpp
 
 class SMnet {
 	public:
@@ -58,11 +63,47 @@ class SMnet {
 
 	// My global hostname, based on my network address.
 	char *my_network_hostname;
-	// The last string of random characters returned.
-	char *random_string;
 	// The file descriptor we read random numbers from.
 	int random_fd;
 
+	// What poll_sockets sleeps on: the sockets, and a wakeup fd so
+	// another thread can interrupt it.  If it can't be opened, we
+	// fall back to poll().
+	SmqReactor reactor;
+	std::vector<struct epoll_event> ready_events;
+
+	// Datagrams read by recv_batch(), rx_count of them.
+	struct dgram {
+		char *data;
+		size_t len;
+		struct sockaddr_storage addr;
+		socklen_t addrlen;
+	};
+	struct dgram *rx;
+	int rx_count;
+	int rx_alloc;
+	struct mmsghdr *rx_msgs;
+	struct iovec *rx_iovs;
+	char *rx_buffers;
+	volatile int use_gso;	// Try UDP_SEGMENT for runs of equal
+				// datagrams; any sending thread may clear it
+
+	// Syscall and datagram counts, for the stats.
+	struct io_counters {
+		unsigned long rx_calls;		// recvmmsg/recvfrom
+		unsigned long rx_dgrams;
+		unsigned long tx_calls;		// sendmmsg/sendto
+		unsigned long tx_dgrams;
+		unsigned long gso_sends;	// Messages sent with UDP_SEGMENT
+		unsigned long gso_dgrams;	// ... and the datagrams in them
+
+		io_counters() : rx_calls(0), rx_dgrams(0), tx_calls(0),
+			tx_dgrams(0), gso_sends(0), gso_dgrams(0) {}
+	} io_stats;
+
+	// Where deliver_msg_datagram sends to, by host and port.
+	SmqRouteCache routes;
+
 	void abfuckingort();	// where did C library abort() go?
 
 	/* Constructor */
@@ -74,8 +115,18 @@ class SMnet {
 		sockinfo (NULL),
 		recvaddrlen (0),
 		my_network_hostname (0),
-		random_string (0),
-		random_fd (0)
+		random_fd (0),
+		reactor (),
+		ready_events (),
+		rx (NULL),
+		rx_count (0),
+		rx_alloc (0),
+		rx_msgs (NULL),
+		rx_iovs (NULL),
+		rx_buffers (NULL),
+		use_gso (0),
+		io_stats (),
+		routes ()
 	{
 	}
 
@@ -90,7 +141,6 @@ class SMnet {
 		sockinfo (NULL),
 		recvaddrlen (0),
 		my_network_hostname (0),
-		random_string (0),
 		random_fd (0)
 	{
 		abfuckingort();
@@ -112,7 +162,10 @@ class SMnet {
 		delete [] sockets;
 		delete [] sockinfo;
 		delete [] my_network_hostname;
-		delete [] random_string;
+		delete [] rx;
+		delete [] rx_msgs;
+		delete [] rx_iovs;
+		delete [] rx_buffers;
 	}
 
 	/* Add a file/network socket to the set to be polled */
@@ -136,6 +189,8 @@ class SMnet {
 			delete [] sockinfo;
 			sockinfo = si;
 		}
+		if (reactor.is_open() || reactor.open())
+			reactor.watch(socket, epoll_events(events));
 		sockets[numsockets].fd = socket;
 		sockets[numsockets].events = events;
 		sockets[numsockets].revents = 0;
@@ -156,6 +211,9 @@ class SMnet {
 	remove_socket(int socket) {
 		nfds_t i, j;
 
+		if (reactor.is_open())
+			reactor.unwatch(socket);
+
 		// Walk down the array, squeezing out all entries with socket
 		// Note, there may be several; get rid of all.
 		for (i = 0, j = 0; i < numsockets; i++) {
@@ -184,30 +242,76 @@ class SMnet {
 					sockets[i].events |= POLLOUT;
 				else
 					sockets[i].events &= ~POLLOUT;
+				if (reactor.is_open())
+					reactor.modify(socket, epoll_events(sockets[i].events));
 				return true;
 			}
 		}
 		return false;
 	}
 
-	// Poll (wait for I/O or a timeout).
+	// Poll (wait for I/O, a timeout, or wake()).
 	// Timeout is in milliseconds; -1 for infinite.
+	// Sets revents in sockets[] just as poll() does.
 	int
 	poll_sockets(int mstimeout)
 	{
 		int i;
+		nfds_t j;
 
 		if (mstimeout<0) mstimeout=-1;
-		i = poll (sockets, numsockets, mstimeout);
+		if (!reactor.is_open()) {
+			i = poll (sockets, numsockets, mstimeout);
+			return i;
+		}
+		for (j = 0; j < numsockets; j++)
+			sockets[j].revents = 0;
+		i = reactor.wait(mstimeout, ready_events);
+		for (size_t k = 0; k < ready_events.size(); k++) {
+			uint32_t ev = ready_events[k].events;
+			for (j = 0; j < numsockets; j++) {
+				if (sockets[j].fd != ready_events[k].data.fd)
+					continue;
+				sockets[j].revents =
+					  ((ev & EPOLLIN) ? POLLIN : 0)
+					| ((ev & EPOLLPRI) ? POLLPRI : 0)
+					| ((ev & EPOLLOUT) ? POLLOUT : 0)
+					| ((ev & EPOLLERR) ? POLLERR : 0)
+					| ((ev & EPOLLHUP) ? POLLHUP : 0);
+			}
+		}
 		return i;
 	}
 
+	// Make poll_sockets return now, from another thread.
+	void
+	wake()
+	{
+		reactor.wake();
+	}
+
+	static uint32_t
+	epoll_events(short events)
+	{
+		return ((events & POLLIN) ? EPOLLIN : 0)
+		     | ((events & POLLPRI) ? EPOLLPRI : 0)
+		     | ((events & POLLOUT) ? EPOLLOUT : 0);
+	}
+
 	/*
 	 * Initialize short-message handling. 
 	 * Make one or more sockets and set up to listen on them.
 	 * This function is ipv6-agnostic, and even almost UDP/TCP-agnostic.
 	 */
-	bool listen_on_port(std::string port);
+	bool listen_on_port(std::string port, bool reuseport = false);
+
+	/*
+	 * When several SMnets listen on one port with SO_REUSEPORT, steer
+	 * each sender's datagrams to the nreceivers'th SMnet by a hash of
+	 * its IP address, so one BTS's traffic always lands on the same
+	 * receiver.  Call on any one of them once they're all listening.
+	 */
+	bool attach_steering(int nreceivers);
 
 	/* 
 	 * Get the next datagram from any socket of interest.
@@ -218,6 +322,33 @@ class SMnet {
 	 */
 	int get_next_dgram (char *buffer, size_t buffsize, int mstimeout);
 
+	/*
+	 * Batched I/O.  set_batching() says how many datagrams recv_batch()
+	 * reads per system call (into rx[0..rx_count)), and whether to
+	 * send runs of same-sized datagrams to one address as a single
+	 * UDP_SEGMENT send.  recv_batch's result is like get_next_dgram's,
+	 * except that > 0 is the number of datagrams.
+	 */
+	void set_batching(int count, bool gso);
+	int recv_batch(int mstimeout);
+
+	/*
+	 * Between begin_sends() and flush_sends(), datagrams this thread
+	 * sends are collected and then sent with one sendmmsg per socket.
+	 * The calls nest; the outermost flush sends.  discard_sends()
+	 * forgets what has been collected so far, unsent.
+	 */
+	void begin_sends();
+	void flush_sends();
+	void discard_sends();
+	void send_failed(const pending_send &ps);
+
+	/* Log the syscall counts. */
+	void report_io_stats(const char *name);
+
+	/* Log the route cache counters. */
+	void report_route_stats();
+
 	/*
 	 * Send a datagram on a handy socket
 	 * FIXME:  Make the source host/port match the one in the SIP dgram!
@@ -32,8 +32,11 @@
 #include <sys/types.h>          // open
 #include <sys/stat.h>           // open
 #include <fcntl.h>          // open
+#include <unistd.h>		// sysconf
+#include <limits.h>		// UINT_MAX
 #include <ctype.h>		// isdigit
 #include <string>
+#include <algorithm>		// sort
 #include <stdlib.h>
 
 #undef WARNING
@@ -68,6 +71,10 @@ NodeManager gNodeManager;
 
 /** rate limiting timer */
 Timeval spacingTimer;
+static pthread_mutex_t spacingTimerMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* How many times this thread has lockSortedList()ed the whole queue. */
+static __thread int worldLockDepth = 0;
 
 /* We try to centralize most of the timeout values into this table.
    Occasionally the code might do something different where it knows
@@ -86,6 +93,9 @@ Timeval spacingTimer;
 			   scratch due to some error. Changed to MS */
 #define TT	60*1000      /*  60 seconds the amount of time we add to a transaction
 			    when we get a 100 TRYING message  Changed to MS */
+#define LT	5*1000	/* msseconds = 5 seconds - "Lookup Timeout" - how long
+			   to wait for a registry lookup thread to answer before
+			   asking again.  Usually it answers much sooner. */
 
 /* Timeout when moving from this state to new state:
  NS  IS  RF  AF   WD  RD  AD   WS  RS  AS   WM  RM  AM   DM   WR  RH  AR  */
@@ -94,21 +104,21 @@ int timeouts_NO_STATE[STATE_MAX_PLUS_ONE] = {
 int timeouts_INITIAL_STATE[STATE_MAX_PLUS_ONE] = {
   0,  0,  0, NT,  NT, NT, NT,  NT, NT, NT,  NT,  0, NT,   0,  NT, NT, NT,};
 int timeouts_REQUEST_FROM_ADDRESS_LOOKUP[STATE_MAX_PLUS_ONE] = {
-  0, NT, 10, 10,  NT,  0, NT,  NT, NT, NT,  NT, NT, NT,   0,   1,  0, NT,};
+  0, NT, 10, LT,  NT,  0, NT,  NT, NT, NT,  NT, NT, NT,   0,   1,  0, NT,};
 int timeouts_ASKED_FOR_FROM_ADDRESS_LOOKUP[STATE_MAX_PLUS_ONE] = {
-  0, NT, 60, NT,  NT, NT, NT,  NT, NT, NT,  NT, NT, NT,   0,  NT, NT, NT,};
+  0, NT,  0, NT,  NT, NT, NT,  NT, NT, NT,  NT, NT, NT,   0,  NT, NT, NT,};
 int timeouts_AWAITING_TRY_DESTINATION_IMSI[STATE_MAX_PLUS_ONE] = {
   0, NT, RT, NT,  RT, NT, NT,  NT, NT, NT,  NT, NT, NT,   0,  NT, NT, NT,};
 int timeouts_REQUEST_DESTINATION_IMSI[STATE_MAX_PLUS_ONE] = {  // 5
-  0, NT, RT, NT,  RT, NT, NT,  NT,  0, NT,  NT, NT, NT,   0,  NT, NT, NT,};
+  0, NT, RT, NT,  RT, NT, LT,  NT,  0, NT,  NT, NT, NT,   0,  NT, NT, NT,};
 int timeouts_ASKED_FOR_DESTINATION_IMSI[STATE_MAX_PLUS_ONE] = {
-  0, NT, RT, NT,  RT, NT, NT,  NT, NT, NT,  NT, NT, NT,   0,  NT, NT, NT,};
+  0, NT, RT, NT,  RT,  0, NT,  NT, NT, NT,  NT, NT, NT,   0,  NT, NT, NT,};
 int timeouts_AWAITING_TRY_DESTINATION_SIPURL[STATE_MAX_PLUS_ONE] = {
   0, NT, RT, NT,  RT, NT, NT,  NT, NT, NT,  NT, NT, NT,   0,  NT, NT, NT,};
 int timeouts_REQUEST_DESTINATION_SIPURL[STATE_MAX_PLUS_ONE] = {
-  0, NT, RT, NT,  RT, NT, NT,  NT, NT, NT,  NT, 0, NT,  0,  NT, NT, NT,};
+  0, NT, RT, NT,  RT, NT, NT,  NT, NT, LT,  NT, 0, NT,  0,  NT, NT, NT,};
 int timeouts_ASKED_FOR_DESTINATION_SIPURL[STATE_MAX_PLUS_ONE] = {  // 8
-  0, NT, RT, NT,  RT, NT, NT,  NT, NT, NT,  NT, NT, NT,   0,  NT, NT, NT,};
+  0, NT, RT, NT,  RT, NT, NT,  NT,  0, NT,  NT, NT, NT,   0,  NT, NT, NT,};
 int timeouts_AWAITING_TRY_MSG_DELIVERY[STATE_MAX_PLUS_ONE] = {
   0, NT, RT, NT,  RT, NT, NT,  NT, NT, NT,  75*1000,  0, NT,   0,  NT, NT, NT,};
 int timeouts_REQUEST_MSG_DELIVERY[STATE_MAX_PLUS_ONE] = { // 10
@@ -129,6 +139,7 @@ int timeouts_ASKED_TO_REGISTER_HANDSET[STATE_MAX_PLUS_ONE] = {
 
 #undef NT	/* No longer needed */
 #undef RT
+#undef LT
 
 /* Index to all timeouts.  Keep in order!  */
 int (*SMqueue::timeouts[STATE_MAX_PLUS_ONE])[STATE_MAX_PLUS_ONE] = {
@@ -259,7 +270,8 @@ SMqueue::new_strdup(const char *orig)
 
 
 void
-increase_acked_msg_timeout(short_msg_pending *msg)
+increase_acked_msg_timeout(SMq &manager, short_msg_p_list::iterator msg,
+			   enum sm_state newstate)
 {
 	time_t timeout = SMq::INCREASEACKEDMSGTMOMS;
 
@@ -267,7 +279,7 @@ increase_acked_msg_timeout(short_msg_pending *msg)
 		timeout = gConfig.getNum("SIP.Timeout.ACKedMessageResend");
 	}
 
-	msg->set_state(msg->state, msg->msgettime() + timeout);
+	manager.set_state(msg, newstate, msg->msgettime() + timeout);
 }
 
 
@@ -281,41 +293,67 @@ increase_acked_msg_timeout(short_msg_pending *msg)
  * and the message.
  *
  * In general, delete the response so it won't stay at the front of the
- * queue.
+ * queue.  (Most responses don't get that far; see take_response.)
  */
 void
 SMq::handle_response(short_msg_p_list::iterator qmsgit)
 {
 	short_msg_pending *qmsg = &*qmsgit;
-	short_msg_p_list::iterator sent_msg;
+	SmqShard *sh = shards[qmsg->shard];
 	short_msg_p_list resplist;
 
 	// First, remove this response message from the queue.  That way,
 	// when we search the queue, we won't find OURSELF.  We also don't
 	// want the response hanging around in the queue anyway.
+	// shard_for() put the response on the same shard as the message
+	// it answers, so that shard's lock covers both.
 
 // Lock
-	lockSortedList();
-	resplist.splice(resplist.begin(), time_sorted_list, qmsgit);
+	sh->lock();
+	extract_message(qmsgit, resplist);
 	// We'll delete the list element on our way out of this function as
 	// resplist goes out of scope.
 
-	// figure out what message we're responding to.
-	if (!find_queued_msg_by_tag(sent_msg, qmsg->qtag, qmsg->qtaghash)) {
+	if (!apply_response(sh, qmsg->qtag, qmsg->qtaghash, qmsg->parsed->status_code,
+			    qmsg->parsed->reason_phrase)) {
 		// No message in queue.
 		LOG(NOTICE) << "Couldn't find message for response tag '"
 		     << qmsg->qtag << "'; response is:" << endl
 		     << qmsg->text;
 		// no big problem, just ignore it.
-		unlockSortedList();
-		return;
 	}
 
+//Unlock
+	sh->unlock();
+
+	// On exit, we delete the response message we've been examining
+	// when resplist goes out of scope.
+} // handle_response
+
+/*
+ * Do what a response with status code status (and reason phrase
+ * reason) says to the message on shard sh whose qtag is qtag.  Called
+ * on sh's worker.  Result is false if there's no such message.
+ */
+bool
+SMq::apply_response(SmqShard *sh, const char *qtag, uint64_t taghash, int status,
+		    const char *reason)
+{
+	short_msg_p_list::iterator sent_msg;
+	short_msg_p_list resplist;
+
 // Keep message locked so it won't get deleted while being modified
+	sh->lock();
+
+	// figure out what message we're responding to.
+	if (!find_queued_msg_by_tag(sent_msg, qtag, taghash)) {
+		sh->unlock();
+		return false;
+	}
 
 	// Check what kind of response we got, based on its status code.
 	// FIXME, logfile output would be useful here.
-	LOG(NOTICE) << "Got " << qmsg->parsed->status_code
+	LOG(NOTICE) << "Got " << status
 	     << " response for sent msg '" << sent_msg->qtag << "' in state "
 	     << sent_msg->state;
 
@@ -330,12 +368,31 @@ SMq::handle_response(short_msg_p_list::iterator qmsgit)
 		// Just quietly keep going.
 	}
 
-	switch (qmsg->parsed->status_code / 100) {
+	// A final response ends the client transaction: no more
+	// retransmissions, whatever we do with the message next.
+	if (sent_msg->txn_start && status >= 200) {
+		sent_msg->txn_start = 0;
+		client_txns.answered();
+	}
+	// It may have been unparsed while it waited (balance_memory).
+	if (status >= 200)
+		sent_msg->parse();
+
+	switch (status / 100) {
 	case 1: // 1xx -- interim response
+		if (sent_msg->txn_start && sent_msg->state == ASKED_FOR_MSG_DELIVERY) {
+			// Proceeding: keep retransmitting, every T2,
+			// until a final response or timer F.
+			sent_msg->txn_proceeding = true;
+			set_state(sent_msg, ASKED_FOR_MSG_DELIVERY,
+				client_txns.next_action(sent_msg->txn_start,
+					sent_msg->txn_sends, true));
+			break;
+		}
 		//While a 100 doesn't mean anything really,
 		//we should increase the timeout because
 		//we know the network worked
-		increase_acked_msg_timeout(&(*sent_msg));
+		increase_acked_msg_timeout(*this, sent_msg, sent_msg->state);
 		break;
 
 	case 2:	// 2xx -- success.
@@ -349,10 +406,15 @@ SMq::handle_response(short_msg_p_list::iterator qmsgit)
 			// started the registration process.
 			short_msg_p_list::iterator oldsms;
 
+			// The handset's registry entry just changed.
+			if (sent_msg->parsed->to && sent_msg->parsed->to->url)
+				lookups.invalidate_subscriber(
+					sent_msg->parsed->to->url->username, NULL);
+
 			if (!get_link(oldsms, sent_msg)) {
 				LOG(NOTICE) << "Can't find SMS message for newly "
 					"registered handset, linktag '"
-				     << qmsg->linktag << "'.";
+				     << sent_msg->linktag << "'.";
 				// Assume this was a dup after a retry of
 				// the REGISTER message -- thus this is a
 				// second REGISTER response, after we already
@@ -366,7 +428,7 @@ SMq::handle_response(short_msg_p_list::iterator qmsgit)
 				// Special code in registration processing
 				// will notice it's a re-reg and just reply
 				// with a welcome message.
-				oldsms->set_state(INITIAL_STATE);
+				set_state(oldsms, INITIAL_STATE);
 			} else {
 				// Orig SMS exists, but not in a normal state.
 				// Assume that the original SMS is in a
@@ -377,18 +439,19 @@ SMq::handle_response(short_msg_p_list::iterator qmsgit)
 		if (sent_msg->parsed &&
 		    sent_msg->parsed->sip_method &&
 		    0 == strcmp("MESSAGE", sent_msg->parsed->sip_method)) {
-			sent_msg->write_cdr(my_hlr);
+			sent_msg->write_cdr(lookups);
+			// The handset is reachable; don't make the rest of
+			// its messages wait for their retry timers.
+			if (sent_msg->parsed->req_uri)
+				release_messages_for(sent_msg->parsed->req_uri->username);
 		}
 
 		// Whether a response to a REGISTER or a MESSAGE, delete
 		// the datagram that we sent, which has been responded to.
 		LOG(INFO) << "Deleting sent message.";
-		resplist.splice(resplist.begin(),
-				time_sorted_list, sent_msg);
+		extract_message(sent_msg, resplist);
 		resplist.pop_front();	// pop and delete the sent_msg.
 
-		// FIXME, consider breaking loose any other messages for
-		// the same destination now.
 		break;
 
 	case 4: // 4xx -- failure by client
@@ -397,15 +460,17 @@ SMq::handle_response(short_msg_p_list::iterator qmsgit)
 		// Most likely this means that a subscriber left network coverage
 		// without unregistering from the network. Try again later.
 		// Eventually we should have a hook for their return
-		if (qmsg->parsed->status_code == 480 || qmsg->parsed->status_code == 486){
-			increase_acked_msg_timeout(&(*sent_msg));
+		// Park it in AWAITING_TRY_MSG_DELIVERY so that hearing from
+		// the handset again releases it early.
+		if (status == 480 || status == 486){
+			increase_acked_msg_timeout(*this, sent_msg, AWAITING_TRY_MSG_DELIVERY);
 		}
 		// Other 4xx codes mean the original message was bad.  Bounce it.
 		else {
 			ostringstream errmsg;
-			errmsg << qmsg->parsed->status_code << " "
-			       << qmsg->parsed->reason_phrase;
-			sent_msg->set_state(
+			errmsg << status << " "
+			       << (reason ? reason : "");
+			set_state(sent_msg,
 			    bounce_message((&*sent_msg), errmsg.str().c_str()));
 		}
 		break;
@@ -414,13 +479,18 @@ SMq::handle_response(short_msg_p_list::iterator qmsgit)
 		// FIXME, perhaps we should change its timeout value??  Shorter
 		// or longer???
 		LOG(WARNING) << "CONGESTION at OpenBTS\?\?!";
-		increase_acked_msg_timeout(&(*sent_msg));
+		increase_acked_msg_timeout(*this, sent_msg, sent_msg->state);
 		break;
 
 	case 3: // 3xx -- message ngConfigeeds redirection
 	case 6: // 6xx -- message rejected (by this destination).
-		// Try going back through looking up the destination again.
-		sent_msg->set_state(REQUEST_DESTINATION_IMSI);
+		// Try going back through looking up the destination again,
+		// without trusting what's cached about it.
+		sent_msg->parse();
+		if (sent_msg->parsed && sent_msg->parsed->req_uri)
+			lookups.invalidate_subscriber(
+				sent_msg->parsed->req_uri->username, NULL);
+		set_state(sent_msg, REQUEST_DESTINATION_IMSI);
 		break;
 
 	default:
@@ -428,32 +498,58 @@ SMq::handle_response(short_msg_p_list::iterator qmsgit)
 		break;
 	}
 
-//Unlock
-	unlockSortedList();
+	sh->unlock();
 
-	// On exit, we delete the response message we've been examining
-	// when resplist goes out of scope.
-} // handle_response
+	// On exit, the sent message is deleted if it was extracted into
+	// resplist.
+	return true;
+} // apply_response
 
 /*
  * Find a queued message, based on its tag value.  Return an iterator
  * that can be used to remove it from the list if desired.
+ * A shard worker only finds messages on its own shard, since it can't
+ * lock the others; with the whole queue locked, any message will do.
  */
 bool
 SMq::find_queued_msg_by_tag(short_msg_p_list::iterator &mymsg,
-			    const char *tag, int taghash)
+			    const char *tag, uint64_t taghash)
 {
-	lockSortedList();
-	short_msg_p_list::iterator x;
-	for (x = time_sorted_list.begin(); x != time_sorted_list.end(); x++) {
-		if (taghash == x->qtaghash && !strcmp (tag, x->qtag)) {
-			mymsg = x;
-			unlockSortedList();
-		    return true;
+	SmqShard *cur = SmqShard::current();
+	bool found = false;
+
+	pthread_mutex_lock(&qtagIndexMutex);
+	std::pair<qtag_index_map::iterator, qtag_index_map::iterator> range =
+		qtag_index.equal_range(taghash);
+	for (qtag_index_map::iterator x = range.first; x != range.second; ++x) {
+		if (cur && !worldLockDepth && x->second->shard != cur->number)
+			continue;
+		if (!strcmp (tag, x->second->qtag)) {
+			mymsg = x->second;
+			found = true;
+			break;
 		}
 	}
-	unlockSortedList();
-	return false;
+	pthread_mutex_unlock(&qtagIndexMutex);
+	return found;
+}
+
+int
+SMq::shard_of_tag(const char *tag, uint64_t taghash)
+{
+	int n = -1;
+
+	pthread_mutex_lock(&qtagIndexMutex);
+	std::pair<qtag_index_map::iterator, qtag_index_map::iterator> range =
+		qtag_index.equal_range(taghash);
+	for (qtag_index_map::iterator x = range.first; x != range.second; ++x) {
+		if (!strcmp (tag, x->second->qtag)) {
+			n = x->second->shard;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&qtagIndexMutex);
+	return n;
 }
 
 // Same, but figure out the taghash manually.
@@ -461,7 +557,180 @@ bool
 SMq::find_queued_msg_by_tag(short_msg_p_list::iterator &mymsg,
 			    const char *tag)
 {
-	return find_queued_msg_by_tag(mymsg, tag, mymsg->taghash_of(tag));
+	return find_queued_msg_by_tag(mymsg, tag, short_msg_pending::taghash_of(tag));
+}
+
+/*
+ * Maintain the qtag index.  A message is indexed under the qtaghash it
+ * had when it went in, so anything that changes the qtag of a queued
+ * message must go through retag_message().
+ */
+void
+SMq::index_qtag(short_msg_p_list::iterator sm)
+{
+	if (!sm->qtag)
+		return;
+	pthread_mutex_lock(&qtagIndexMutex);
+	std::pair<qtag_index_map::iterator, qtag_index_map::iterator> range =
+		qtag_index.equal_range(sm->qtaghash);
+	qtag_index_map::iterator x = range.first;
+	while (x != range.second && x->second != sm)
+		++x;
+	// Already in it if move_home() brought it from another shard.
+	if (x == range.second)
+		qtag_index.insert(qtag_index_map::value_type(sm->qtaghash, sm));
+	pthread_mutex_unlock(&qtagIndexMutex);
+}
+
+void
+SMq::unindex_qtag(short_msg_p_list::iterator sm)
+{
+	if (!sm->qtag)
+		return;
+	pthread_mutex_lock(&qtagIndexMutex);
+	std::pair<qtag_index_map::iterator, qtag_index_map::iterator> range =
+		qtag_index.equal_range(sm->qtaghash);
+	for (qtag_index_map::iterator x = range.first; x != range.second; ++x) {
+		if (x->second == sm) {
+			qtag_index.erase(x);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&qtagIndexMutex);
+}
+
+void
+SMq::retag_message(short_msg_p_list::iterator sm)
+{
+	SmqShard *sh = shards[sm->shard];
+
+	// Out of the index while the qtag changes, so nobody looking it
+	// up compares against a half-changed tag.
+	sh->lock();
+	unindex_qtag(sm);
+	sm->set_qtag();
+	index_qtag(sm);
+	sh->unlock();
+}
+
+/*
+ * The digits of an IMSI-style username ("IMSI001010000000001"), or NULL
+ * if it's something else, such as a phone number.
+ */
+static const char *
+imsi_digits(const char *username)
+{
+	if (!username || (0 != strncmp("imsi", username, 4)
+		       && 0 != strncmp("IMSI", username, 4)))
+		return NULL;
+	return username + 4;
+}
+
+/*
+ * Maintain the destination index.  Once lookup_uri_imsi has put an IMSI
+ * in the request URI, the message is filed under it until it leaves the
+ * queue or is routed somewhere else.
+ */
+void
+SMq::index_destination(short_msg_p_list::iterator sm)
+{
+	const char *digits = NULL;
+	std::string user;
+	SmqShard *sh = shards[sm->shard];
+
+	sh->lock();
+	bool routed = sm->state >= AWAITING_TRY_DESTINATION_SIPURL
+		   && sm->state <= ASKED_FOR_MSG_DELIVERY;
+	// Don't parse for it: that would undo the parse budget's work.
+	if (routed && sm->parsed_is_valid) {
+		if (sm->parsed->req_uri)
+			digits = imsi_digits(sm->parsed->req_uri->username);
+	} else if (routed && sm->spill_key) {
+		sh->unlock();
+		return;		// Not changed since it was filed.
+	} else if (routed) {
+		SmqSipView view;
+		if (sm->text && view.scan(sm->text, sm->text_length)) {
+			SmqSipView::span u = view.uri_user(view.request_uri());
+			if (u.found()) {
+				user = view.str(u);
+				digits = imsi_digits(user.c_str());
+			}
+		}
+	}
+
+	if (sm->dest_imsi && digits && !strcmp(sm->dest_imsi, digits)) {
+		sh->unlock();
+		return;		// Already filed there.
+	}
+	unindex_destination(sh, sm);
+	if (digits) {
+		sm->dest_imsi = new_strdup(digits);
+		sh->imsi_index.insert(imsi_index_map::value_type(digits, sm));
+	}
+	sh->unlock();
+}
+
+void
+SMq::unindex_destination(SmqShard *sh, short_msg_p_list::iterator sm)
+{
+	if (!sm->dest_imsi)
+		return;
+	std::pair<imsi_index_map::iterator, imsi_index_map::iterator> range =
+		sh->imsi_index.equal_range(sm->dest_imsi);
+	for (imsi_index_map::iterator x = range.first; x != range.second; ++x) {
+		if (x->second == sm) {
+			sh->imsi_index.erase(x);
+			break;
+		}
+	}
+	delete [] sm->dest_imsi;
+	sm->dest_imsi = NULL;
+}
+
+/*
+ * The handset's messages may be on any shard, and we can't lock the
+ * others from a shard worker, so post the news to them.
+ */
+void
+SMq::release_messages_for(const char *imsi)
+{
+	const char *digits = imsi_digits(imsi);
+	SmqShard *cur = SmqShard::current();
+
+	if (!digits)
+		return;
+
+	for (size_t i = 0; i < shards.size(); i++) {
+		if (shards[i] == cur)
+			release_in_shard(cur, digits);
+		else
+			shards[i]->post_release(digits);
+	}
+}
+
+int
+SMq::release_in_shard(SmqShard *sh, const char *digits)
+{
+	int released = 0;
+
+	sh->lock();
+	std::pair<imsi_index_map::iterator, imsi_index_map::iterator> range =
+		sh->imsi_index.equal_range(digits);
+	for (imsi_index_map::iterator x = range.first; x != range.second; ++x) {
+		// Only messages sitting out a retry delay; anything else
+		// is either still being routed or already on its way.
+		if (x->second->state == AWAITING_TRY_MSG_DELIVERY) {
+			set_state(x->second, REQUEST_MSG_DELIVERY);
+			released++;
+		}
+	}
+	sh->unlock();
+
+	if (released)
+		LOG(INFO) << "Heard from IMSI" << digits << ", retrying "
+			<< released << " queued messages now";
+	return released;
 }
 
 
@@ -488,6 +757,190 @@ static bool relaxed_verify_relay(osip_list_t *vias, const char *host, const char
 	return from_relay;
 }
 
+SmqSpillStore *short_msg::spill_store = NULL;
+unsigned long short_msg::reparses = 0;
+
+bool
+short_msg::spill()
+{
+	if (!spill_store || spill_key)
+		return false;
+	make_text_valid();
+	if (!text)
+		return false;
+	uint64_t key = spill_store->put(text, text_length);
+	if (!key)
+		return false;
+	unparse();
+	delete [] text;
+	text = NULL;
+	text_length = 0;
+	spill_key = key;
+	memory_changed();
+	return true;
+}
+
+bool
+short_msg::page_in()
+{
+	std::string saved;
+
+	// On failure the key stays, so the store keeps the only copy of
+	// the text and the caller can try again later.
+	if (!spill_store || !spill_store->get(spill_key, saved)) {
+		LOG(ALERT) << "Can't read the text of a message back from the spill store";
+		return false;
+	}
+	spill_store->release(spill_key);
+	spill_key = 0;
+	delete [] text;
+	text_length = saved.size();
+	text = new char [text_length+1];
+	memcpy(text, saved.data(), text_length);
+	text[text_length] = '\0';
+	memory_changed();
+	return true;
+}
+
+size_t
+short_msg_pending::footprint() const
+{
+	size_t n = sizeof(*this) + text_length + parsed_bytes();
+	if (qtag)
+		n += strlen(qtag) + 1;
+	return n;
+}
+
+void
+short_msg_pending::memory_changed()
+{
+	if (owner)
+		owner->account(this);
+}
+
+size_t
+short_msg_pending::parsed_bytes() const
+{
+	size_t n = 0;
+	// A parse tree takes at least its arena's first chunk, or
+	// about four times the text if it's on the heap.
+	if (parsed && arena)
+		n += arena->bytes() > SmqArena::CHUNK ? arena->bytes() : SmqArena::CHUNK;
+	else if (parsed)
+		n += 4 * text_length;
+	if (rp_data || tl_message)
+		n += text_length;
+	return n;
+}
+
+/*
+ * Replace the text at where with with, in place if it fits.
+ * Return false, and change nothing, if the result would be too long.
+ */
+bool
+short_msg::replace_text(SmqSipView::span where, const std::string &with)
+{
+	size_t newlen = text_length - where.len + with.size();
+	if (newlen >= SmqSipView::NOWHERE)
+		return false;
+
+	if (with.size() <= where.len) {
+		// Shrinking, or the same size: slide the tail down.
+		memcpy(text + where.off, with.data(), with.size());
+		memmove(text + where.off + with.size(), text + where.off + where.len,
+			text_length - (where.off + where.len) + 1);
+	} else {
+		char *newtext = new char [newlen+1];
+		memcpy(newtext, text, where.off);
+		memcpy(newtext + where.off, with.data(), with.size());
+		memcpy(newtext + where.off + with.size(), text + where.off + where.len,
+			text_length - (where.off + where.len) + 1);
+		delete [] text;
+		text = newtext;
+	}
+	text_length = newlen;
+	text_edits++;
+	return true;
+}
+
+/*
+ * Copy the given parts of the parsed tree, which the caller has just
+ * changed, into the text string.  Each part is found afresh with a
+ * view of the text, since the previous edit moved things.  Returns
+ * false if the text isn't up to date or a part can't be found; then
+ * the text may have been partly edited, and the caller must regenerate
+ * it from the parsed tree.
+ */
+bool
+short_msg::rewrite_text(unsigned parts)
+{
+	if (parsed_is_better || !parsed_is_valid || !parsed || !text)
+		return false;
+
+	SmqSipView view;
+	if (parts & REQUEST_URI_USER) {
+		if (!parsed->req_uri || !parsed->req_uri->username
+		 || !view.scan(text, text_length))
+			return false;
+		SmqSipView::span user = view.uri_user(view.request_uri());
+		if (!user.found() || !replace_text(user, parsed->req_uri->username))
+			return false;
+	}
+
+	if (parts & REQUEST_URI_HOSTPORT) {
+		if (!parsed->req_uri || !parsed->req_uri->host
+		 || !view.scan(text, text_length))
+			return false;
+		string hostport = parsed->req_uri->host;
+		if (parsed->req_uri->port) {
+			hostport += ":";
+			hostport += parsed->req_uri->port;
+		}
+		SmqSipView::span hp = view.uri_hostport(view.request_uri());
+		if (!hp.found() || !replace_text(hp, hostport))
+			return false;
+	}
+
+	if (parts & TO_HEADER) {
+		if (!parsed->to || !parsed->to->url || !parsed->to->url->username
+		 || !view.scan(text, text_length))
+			return false;
+		SmqSipView::span to = view.header("To", 't');
+		SmqSipView::span uri = view.addr_uri(to);
+		SmqSipView::span user = view.uri_user(uri);
+		SmqSipView::span display = view.addr_display(to);
+		const char *newdisplay = parsed->to->displayname;
+		// Adding or removing a display name changes the <> around
+		// the URI; leave that to osip.
+		if (!user.found() || display.found() != (newdisplay != NULL))
+			return false;
+		// The user follows the display name; do it first so the
+		// display name doesn't move.
+		if (!replace_text(user, parsed->to->url->username))
+			return false;
+		if (newdisplay && !replace_text(display, newdisplay))
+			return false;
+	}
+
+	if (parts & CALL_ID) {
+		if (!parsed->call_id || !parsed->call_id->number
+		 || !view.scan(text, text_length))
+			return false;
+		string callid = parsed->call_id->number;
+		if (parsed->call_id->host) {
+			callid += "@";
+			callid += parsed->call_id->host;
+		}
+		SmqSipView::span cid = view.header("Call-ID", 'i');
+		if (!cid.found() || !replace_text(cid, callid))
+			return false;
+	}
+
+	// The text is current, but osip's own copy of it isn't.
+	osip_message_force_update(parsed);
+	return true;
+}
+
 /*
  * Validate a short_msg by parsing it and then checking the parse
  * to make sure it has *everything* we need to process and forward it.
@@ -878,9 +1331,6 @@ short_msg_pending::set_qtag()
 	}
 
 	// Set the taghash too.
-	// FIXME, if we set this with a good hash function,
-	// our linear searches will run much faster, avoiding
-	// almost all strcmp's.  For now, punt easy.
 	qtaghash = taghash_of(qtag);
 
 	return 0;
@@ -888,14 +1338,19 @@ short_msg_pending::set_qtag()
 
 /*
  * Hash a tag value for fast searches.
+ * 64-bit FNV-1a; tags share long common prefixes (CSeq numbers, our own
+ * host name) so every byte has to count.
  */
-// FIXME, if we set this with a good hash function,
-// our linear searches will run much faster, avoiding
-// almost all strcmp's.  For now, punt easy.
-int
-short_msg_pending::taghash_of (const char *fromtag)
+uint64_t
+short_msg_pending::taghash_of (const char *tag)
 {
-	return fromtag[0];
+	uint64_t hash = 14695981039346656037ULL;
+
+	for (const unsigned char *p = (const unsigned char *)tag; *p; p++) {
+		hash ^= *p;
+		hash *= 1099511628211ULL;
+	}
+	return hash;
 }
 
 /* Check the host and port number specified.
@@ -934,17 +1389,15 @@ short_msg_pending::check_host_port (char *host, char *port)
 	return true;
 }
 
-void short_msg_pending::write_cdr(SubscriberRegistry& hlr) const
+void short_msg_pending::write_cdr(SmqLookup &lookups) const
 {
 	char * from = parsed->from->url->username;
 	char * dest = parsed->to->url->username;
-	time_t now = time(NULL);  // Need real time for CDR
 
 	if (gCDRFile) {
-		char * user = hlr.getIMSI2(from); // I am not a fan of this hlr call here. Probably a decent performance hit...
-		// source, sourceIMSI, dest, date
-		fprintf(gCDRFile,"%s,%s,%s,%s", from, user, dest, ctime(&now));
-		fflush(gCDRFile);
+		// The sender's IMSI is looked up, and the line written,
+		// on a lookup thread rather than here.
+		lookups.queue_cdr(from, dest);
 	} else {
 		LOG(ALERT) << "CDR file at " << gConfig.getStr("CDRFile").c_str() << " could not be created or opened!";
 	}
@@ -963,99 +1416,408 @@ check_to_user (char *user)
 }
 
 /*
-	Main state machine for Short Message processing
-	Called from SmqWriter on a periodic basis
-	Processes message from the queue
+	A shard's worker thread.  Sleeps until the shard's next message
+	is due or another thread posts or wakes it, then takes in whatever
+	was posted and processes what is due.
 */
+void SMq::run_shard(SmqShard *sh)
+{
+	bool backlog = false;	// process_timeout left messages due
+
+	while (!stop_main_loop) {
+		if (!backlog) {
+			// Sleep until the earliest message is due, or forever
+			// if there are none, unless it's due already.
+			time_t when;
+			time_t deadline = SmqReactor::NEVER;
+			sh->lock();
+			if (sh->scheduler->earliestTime(when))
+				deadline = when;
+			sh->unlock();
+			if (deadline == SmqReactor::NEVER || deadline > msgettime())
+				sh->wait_for_work(deadline);
+		}
+		// Deliveries and acks from one pass go out together.
+		my_network.begin_sends();
+		adopt_inbox(sh);
+		backlog = process_timeout(sh);
+		my_network.flush_sends();
+		// The queue only grows when messages come in, which wakes us,
+		// so checking when we're awake is enough.
+		if (memory_budget > 0 || parse_budget > 0) {
+			time_t now = msgettime();
+			if (now >= sh->next_balance) {
+				balance_memory(sh);
+				sh->next_balance = now + 1000;
+			}
+		}
+	}
+}
 
-
-void SMq::process_timeout()
+void SMq::balance_memory(SmqShard *sh)
 {
+	if (memory_budget <= 0 && parse_budget <= 0)
+		return;
+	size_t share = memory_budget / shards.size();
+	size_t parseShare = parse_budget / shards.size();
+	size_t target = share / 10 * 9;
+	size_t parseTarget = parseShare / 10 * 9;
 	time_t now = msgettime();
-	short_msg_p_list::iterator qmsg;
-	enum sm_state newstate;
-	int msSMSRateLimit;
-
-	lockSortedList();
-	//LOG(DEBUG) << "Begin process_timeout";
-	/* When we modify a timestamp below (in the set_state function),
-	   we re-queue the message within the queue, so we have to
-	   restart the iterator every time around the loop.   In effect,
-	   we're always looking at the top thing on the list (thus the
-	   earliest one in time).  */
-	
-		bool empty = false;
-		qmsg = time_sorted_list.begin();
-		if (qmsg == time_sorted_list.end())
-			empty = true;
-		if (empty) {
-			unlockSortedList();
-			//LOG(DEBUG) << "Message queue is empty";
-			return;			/* Empty queue */
+	unsigned long evicted = 0;
+	unsigned long count = 0;
+
+	sh->lock();
+	size_t before = sh->bytes_queued;
+	size_t parsedBefore = sh->bytes_parsed;
+	bool unparsing = parse_budget > 0 && sh->bytes_parsed > parseShare;
+	bool spilling = memory_budget > 0 && sh->bytes_queued > share;
+
+	// Down the idle list, least recently used first, till we're back
+	// under 90% of each share.  Parse trees are cheap to make again,
+	// so they go before the text does.
+	idle_link *next;
+	for (idle_link *l = sh->idle_head; l && (unparsing || spilling); l = next) {
+		next = l->next;
+		short_msg_p_list::iterator sm = l->msg;
+		time_t wait = sm->next_action_time - now;
+		if (unparsing && sm->parsed_is_valid && wait >= parse_idle_ms) {
+			sm->unparse();
+			sm->parse_evicted = true;
+			evicted++;
+			unparsing = sh->bytes_parsed > parseTarget;
+			spilling = spilling && sh->bytes_queued > target;
 		}
-
-		//LOG(DEBUG) << "Queue size " << time_sorted_list.size();
-		if (qmsg->next_action_time > now) {
-			unlockSortedList();
-			//LOG(DEBUG) << "Not time to processs message";
-			return;			/* Wait until later to do more */
+		if (spilling && sm->retrying() && wait >= spill_after_ms) {
+			if (!sm->spill()) {
+				spilling = false;	// The store has logged why
+				continue;
+			}
+			// Like one read back from a binary save file, it's parsed
+			// and validated again when it's due.
+			sm->unvalidated = true;
+			sh->scheduler->rescheduleAt(sm, prefetch_time(sm));
+			count++;
+			spilling = sh->bytes_queued > target;
 		}
+	}
+	size_t parsedTotal = sh->bytes_parsed;
+	size_t total = sh->bytes_queued;
+	sh->unlock();
+
+	if (evicted) {
+		__sync_fetch_and_add(&parse_counts.evicted, evicted);
+		LOG(DEBUG) << "Shard " << sh->number << " had " << parsedBefore
+			<< " bytes of parse trees, over its " << parseShare << " byte share of "
+			<< "Queue.Memory.ParseBudget; unparsed " << evicted << " messages, now "
+			<< parsedTotal;
+	}
+	if (count) {
+		__sync_fetch_and_add(&spill_counts.spilled, count);
+		LOG(INFO) << "Shard " << sh->number << " had " << before
+			<< " bytes queued, over its " << share << " byte share of "
+			<< "Queue.Memory.Budget; spilled " << count << " messages, now "
+			<< total;
+	} else if (memory_budget > 0 && total > share) {
+		LOG(DEBUG) << "Shard " << sh->number << " has " << total
+			<< " bytes queued, over its share of Queue.Memory.Budget, "
+			<< "with nothing to spill";
+	}
+}
 
-		// Got message to process from queue
-		LOG(DEBUG) << "Process message from SMS queue size: " << time_sorted_list.size();
-#undef DEBUG_Q
-#ifdef DEBUG_Q
-	LOG(DEBUG) << "===== Top of process timeout";
-	debug_dump();
-	LOG(DEBUG) << "===== End of queue =====";
-#else
-	char timebuf[26+/*slop*/4];	//
-	time_t now2 = time(NULL);  // Using actual time
-	ctime_r(&now2, timebuf);
-	timebuf[19] = '\0';	// Leave out space, year and newline
+void SMq::adopt_inbox(SmqShard *sh)
+{
+	short_msg_p_list msgs;
+	std::vector<std::string> releases;
+	std::vector<std::string> answered;
+	std::vector<posted_response> responses;
 
-	LOG(INFO) << "=== " << timebuf+4 << " "
-	 << time_sorted_list.size() << " queued; "
-		 << sm_state_string(qmsg->state)
-		 << " for " << qmsg->qtag;
+	sh->take_inbox(msgs, releases, answered, responses);
+	if (msgs.empty() && releases.empty() && answered.empty() && responses.empty())
+		return;
 
-#endif
-		LOG(DEBUG) << "Processing message in queue, state "  << sm_state_string(qmsg->state);
+	sh->lock();
+	while (!msgs.empty()) {
+		sh->message_list.splice(sh->message_list.begin(), msgs, msgs.begin());
+		index_new_message(sh, sh->message_list.begin());
+	}
+	for (size_t i = 0; i < releases.size(); i++)
+		release_in_shard(sh, releases[i].c_str());
+
+	// Messages whose registry lookups have finished go back to the
+	// state that asked, which will find the answer.
+	for (size_t i = 0; i < answered.size(); i++) {
+		short_msg_p_list::iterator qmsg;
+		if (!find_queued_msg_by_tag(qmsg, answered[i].c_str())) {
+			// Gone meanwhile, or moved to its IMSI's shard.
+			int n = shard_of_tag(answered[i].c_str(),
+					     short_msg_pending::taghash_of(answered[i].c_str()));
+			if (n >= 0 && n != sh->number)
+				shards[n]->post_lookup_done(answered[i]);
+			continue;
+		}
 		switch (qmsg->state) {
-		case INITIAL_STATE:
-			// This is the initial state in which a message
-			// enters the system.  Here, the message could be
-			// a SIP response as well as a SIP MESSAGE -- or
-			// something we can't process like a SIP REGISTER
-			// or garbage.  Well, actually, garbage was rejected
-			// earlier before queue insertion.
+		case ASKED_FOR_FROM_ADDRESS_LOOKUP:
+			set_state(qmsg, REQUEST_FROM_ADDRESS_LOOKUP);
+			break;
+		case ASKED_FOR_DESTINATION_IMSI:
+			set_state(qmsg, REQUEST_DESTINATION_IMSI);
+			break;
+		case ASKED_FOR_DESTINATION_SIPURL:
+			set_state(qmsg, REQUEST_DESTINATION_SIPURL);
+			break;
+		case AWAITING_REGISTER_HANDSET:
+			set_state(qmsg, AWAITING_REGISTER_HANDSET, msgettime());
+			break;
+		default:
+			break;		// Moved on already
+		}
+	}
 
-			// From this point onward, we're going to assume
-			// that the message has valid, reasonable headers
-			// and contents for our purposes.  Centralize all
-			// that checking in validate_short_msg().
+	for (size_t i = 0; i < responses.size(); i++) {
+		const posted_response &r = responses[i];
+		uint64_t taghash = short_msg_pending::taghash_of(r.qtag.c_str());
+		if (apply_response(sh, r.qtag.c_str(), taghash, r.status, r.reason.c_str()))
+			continue;
+		int n = shard_of_tag(r.qtag.c_str(), taghash);
+		if (n >= 0 && n != sh->number)
+			shards[n]->post_response(r);	// Moved there
+		else
+			LOG(NOTICE) << "Couldn't find message for " << r.status
+				<< " response tag '" << r.qtag << "'";
+	}
+	sh->unlock();
+}
 
-			if (MSG_IS_REQUEST(qmsg->parsed)) {
-				// It's a MESSAGE or invalid REGISTER.
-				// We support only MESSAGE here.
-				if (0 != strcmp(qmsg->parsed->sip_method, "MESSAGE")) {
-					LOG(WARNING) << "Invalid incoming SIP message, method is "
-					          << qmsg->parsed->sip_method;
-					newstate = NO_STATE;
-				} else {
-					// Real messages go here
-					// Check for short-code and handle it.
-					// If handle_short_code() returns true, it sets newstate
-					// on its own
-					if (!handle_short_code(short_code_map, qmsg, newstate)) {
-						// For non-special messages, look up who they're from.
-						newstate = REQUEST_FROM_ADDRESS_LOOKUP;
-						//newstate = verify_funds(qmsg);
-					}
-				}
-				LOG(DEBUG) << "State from handle_short_code " << sm_state_string(qmsg->state);
-				set_state(qmsg, newstate);
-				break;
+void SMq::lookup_done(int shard, const std::string &qtag)
+{
+	// It may have moved since it asked.
+	int n = shard_of_tag(qtag.c_str(), short_msg_pending::taghash_of(qtag.c_str()));
+	if (n >= 0)
+		shard = n;
+	if (shard >= 0 && shard < (int)shards.size())
+		shards[shard]->post_lookup_done(qtag);
+}
+
+bool SMq::hlr_lookup(SmqLookup::Kind kind, const char *key,
+		     short_msg_pending *qmsg, char *&result, int maxAgeMs)
+{
+	bool found;
+	std::string value;
+
+	result = NULL;
+	if (!lookups.lookup(kind, key, maxAgeMs, qmsg->shard, qmsg->qtag, found, value))
+		return false;
+	if (found)
+		result = strdup(value.c_str());
+	return true;
+}
+
+/*
+	Called from the shard's worker on a periodic basis, and whenever a
+	message has been queued.  Drains everything that is due, a message
+	at a time so that the lock is released in between, until the shard
+	has nothing due or the batch budget is used up.
+*/
+bool SMq::process_timeout(SmqShard *sh)
+{
+	time_t start = msgettime();
+	time_t now = start;
+	unsigned long count = 0;
+	bool more = false;
+
+	while (process_due_message(sh, now)) {
+		count++;
+		now = msgettime();
+		if ((int)count >= batch_max_msgs || now - start >= batch_max_ms) {
+			more = true;
+			break;
+		}
+	}
+	if (count == 0)
+		return false;
+
+	time_t elapsed = now - start;
+	batch_counters &stats = sh->batch_stats;
+	stats.batches++;
+	stats.messages += count;
+	stats.busy_ms += elapsed;
+	if (count > stats.largest)
+		stats.largest = count;
+	if (more) {
+		// We're catching up on a backlog; say how fast.
+		stats.budget_hits++;
+		LOG(INFO) << "Shard " << sh->number << " batch budget used: " << count
+			<< " messages in " << elapsed << " ms, "
+			<< sh->scheduler->size() << " queued";  // No lock okay
+	} else {
+		LOG(DEBUG) << "Shard " << sh->number << " batch: " << count
+			<< " messages in " << elapsed << " ms";
+	}
+	return more;
+}
+
+void SMq::report_batch_stats()
+{
+	for (size_t i = 0; i < shards.size(); i++) {
+		batch_counters &stats = shards[i]->batch_stats;
+		LOG(INFO) << "Shard " << i << " process_timeout batches: " << stats.batches
+			<< " messages: " << stats.messages
+			<< " largest: " << stats.largest
+			<< " budget hits: " << stats.budget_hits
+			<< " busy ms: " << stats.busy_ms
+			<< " queued: " << shards[i]->scheduler->size();  // No lock okay
+	}
+}
+
+/*
+	Processes one message from the shard
+*/
+bool SMq::process_due_message(SmqShard *sh, time_t now)
+{
+	short_msg_p_list::iterator qmsg;
+
+	sh->lock();
+	//LOG(DEBUG) << "Begin process_timeout";
+	/* Ask the scheduler for a message whose time has come.  Every
+	   case in run_state_machine must either reschedule it (set_state)
+	   or take it off the queue, otherwise it will keep coming back.  */
+	if (!sh->scheduler->nextDue(now, qmsg)) {
+		sh->unlock();
+		//LOG(DEBUG) << "Not time to processs message";
+		return false;		/* Wait until later to do more */
+	}
+
+	// A spilled message comes up prefetch_ms early, to be paged in
+	// before it's due (see balance_memory).
+	if (qmsg->next_action_time > now) {
+		if (qmsg->spill_key && qmsg->page_in())
+			__sync_fetch_and_add(&spill_counts.prefetched, 1);
+		sh->scheduler->reschedule(qmsg);
+		sh->unlock();
+		return true;
+	}
+	if (qmsg->spill_key) {
+		if (!qmsg->page_in()) {
+			// Still in the spill store; don't run it without
+			// its text, come back to it.
+			qmsg->next_action_time = now + prefetch_ms;
+			sh->scheduler->reschedule(qmsg);
+			sh->unlock();
+			return true;
+		}
+		__sync_fetch_and_add(&spill_counts.late, 1);
+	}
+	if (qmsg->parsed_is_valid)
+		__sync_fetch_and_add(&parse_counts.hits, 1);
+	else
+		__sync_fetch_and_add(&parse_counts.misses, 1);
+
+	/* Run to completion: while the message's next state is due right
+	   away (lookups that answered immediately), keep going with it
+	   here.  set_state() only notes the change for the running
+	   message, and we tell the scheduler once, when it has to wait.  */
+	// Read back from a binary save file, or spilled: it's time to
+	// look at it.
+	if (qmsg->unvalidated) {
+		if (!validate_restored(qmsg))
+			qmsg->state = DELETE_ME_STATE;
+	} else if (!qmsg->parse()) {
+		// It was unparsed to fit the parse budget, and won't parse now.
+		qmsg->state = DELETE_ME_STATE;
+	}
+
+	enum sm_state startState = qmsg->state;
+	sh->running_msg = qmsg;
+	sh->running = true;
+	sh->running_moved = false;
+	sh->running_gone = false;
+	for (int steps = 1; ; steps++) {
+		run_state_machine(qmsg);
+		if (sh->running_gone)
+			break;
+		if (!run_to_completion || steps >= RUNMAXSTEPS
+		 || qmsg->next_action_time > msgettime())
+			break;
+		LOG(DEBUG) << "Run to completion, step " << steps << ", now in "
+			<< sm_state_string(qmsg->state);
+	}
+	sh->running = false;
+	if (!sh->running_gone && sh->running_moved)
+		sh->scheduler->reschedule(qmsg);
+	// One record for wherever it got to.
+	if (!sh->running_gone && qmsg->state != startState)
+		journal_message(&*qmsg);
+	if (!sh->running_gone)
+		move_home(sh, qmsg);
+
+	sh->unlock();
+	return true;
+}
+
+/*
+	Main state machine for Short Message processing
+	Moves one message on from its current state.  Queue is locked.
+*/
+void SMq::run_state_machine(short_msg_p_list::iterator qmsg)
+{
+	enum sm_state newstate;
+	int msSMSRateLimit;
+
+		// Got message to process from queue
+		LOG(DEBUG) << "Process message from SMS queue size: " << queue_size();
+#undef DEBUG_Q
+#ifdef DEBUG_Q
+	LOG(DEBUG) << "===== Top of process timeout";
+	debug_dump();
+	LOG(DEBUG) << "===== End of queue =====";
+#else
+	char timebuf[26+/*slop*/4];	//
+	time_t now2 = time(NULL);  // Using actual time
+	ctime_r(&now2, timebuf);
+	timebuf[19] = '\0';	// Leave out space, year and newline
+
+	LOG(INFO) << "=== " << timebuf+4 << " "
+	 << queue_size() << " queued; "
+		 << sm_state_string(qmsg->state)
+		 << " for " << qmsg->qtag;
+
+#endif
+		LOG(DEBUG) << "Processing message in queue, state "  << sm_state_string(qmsg->state);
+		switch (qmsg->state) {
+		case INITIAL_STATE:
+			// This is the initial state in which a message
+			// enters the system.  Here, the message could be
+			// a SIP response as well as a SIP MESSAGE -- or
+			// something we can't process like a SIP REGISTER
+			// or garbage.  Well, actually, garbage was rejected
+			// earlier before queue insertion.
+
+			// From this point onward, we're going to assume
+			// that the message has valid, reasonable headers
+			// and contents for our purposes.  Centralize all
+			// that checking in validate_short_msg().
+
+			if (MSG_IS_REQUEST(qmsg->parsed)) {
+				// It's a MESSAGE or invalid REGISTER.
+				// We support only MESSAGE here.
+				if (0 != strcmp(qmsg->parsed->sip_method, "MESSAGE")) {
+					LOG(WARNING) << "Invalid incoming SIP message, method is "
+					          << qmsg->parsed->sip_method;
+					newstate = NO_STATE;
+				} else {
+					// Real messages go here
+					// Check for short-code and handle it.
+					// If handle_short_code() returns true, it sets newstate
+					// on its own
+					if (!handle_short_code(short_code_map, qmsg, newstate)) {
+						// For non-special messages, look up who they're from.
+						newstate = REQUEST_FROM_ADDRESS_LOOKUP;
+						//newstate = verify_funds(qmsg);
+					}
+				}
+				LOG(DEBUG) << "State from handle_short_code " << sm_state_string(qmsg->state);
+				set_state(qmsg, newstate);
+				break;
 
 			} else { // It's a RESPONSE.
 
@@ -1078,9 +1840,9 @@ void SMq::process_timeout()
 			// This message should quietly go away.
 
 			short_msg_p_list temp;
-			// Extract the current sm from the time_sorted_list
+			// Extract the current sm from the message_list
 
-			temp.splice(temp.begin(), time_sorted_list, qmsg);  // queue is already locked
+			extract_message(qmsg, temp);  // queue is already locked
 			// When we remove it from the new "temp" list,
 			// this entry will be deallocated.  qmsg still
 			// points to its (dead) storage, so be careful
@@ -1099,21 +1861,22 @@ void SMq::process_timeout()
 		case REQUEST_FROM_ADDRESS_LOOKUP:
 			/* Ask to translate the IMSI in the From field
 			   into the phone number.  */
-			newstate = lookup_from_address (&*qmsg);  // Reads from the database
+			newstate = lookup_from_address (&*qmsg);  // Asks the lookup threads
 			set_state(qmsg, newstate);
 			break;
 
 		case REQUEST_DESTINATION_IMSI:
 			/* Ask to translate the destination phone
 			   number in the Request URI into an IMSI.  */
-			newstate = lookup_uri_imsi(&*qmsg); // Reads from the database
+			newstate = lookup_uri_imsi(&*qmsg); // Asks the lookup threads
 			set_state(qmsg, newstate);
+			index_destination(qmsg);
 			break;
 
 		case REQUEST_DESTINATION_SIPURL:
 			/* Ask to translate the IMSI in the Request URI
 			   into the host/port combo to send it to.  */
-			newstate = lookup_uri_hostport(&*qmsg); // Reads from the database
+			newstate = lookup_uri_hostport(qmsg); // Asks the lookup threads
 			set_state(qmsg, newstate);
 			break;
 
@@ -1153,14 +1916,27 @@ void SMq::process_timeout()
 			// limit messages to once-per-timeout if enabled
 			msSMSRateLimit = gConfig.getNum("SMS.RateLimit") * 1000;
 			if (msSMSRateLimit > 0) {
+				// One limit for all shards.
+				pthread_mutex_lock(&spacingTimerMutex);
 				if (msSMSRateLimit >= spacingTimer.elapsed()) {
+					pthread_mutex_unlock(&spacingTimerMutex);
 					LOG(INFO) << "RateLimit: trying too soon, not sending yet";
-					qmsg->next_action_time += msSMSRateLimit; // Should this be set timeout svgfix
+					set_state(qmsg, qmsg->state, qmsg->next_action_time + msSMSRateLimit);
 					break; // Delay the message
 				}
-				// Go ahead and process message
-				LOG(INFO) << "RateLimit: enough time has elapsed, proceeding. Remaining queue size: " << time_sorted_list.size();  // No lock okay
 				spacingTimer.now();
+				pthread_mutex_unlock(&spacingTimerMutex);
+				// Go ahead and process message
+				LOG(INFO) << "RateLimit: enough time has elapsed, proceeding. Remaining queue size: " << queue_size();  // No lock okay
+			}
+
+			// The first delivery goes with the branch and CSeq
+			// the message was made with; later ones are new
+			// transactions, not retransmissions of the old one.
+			if (qmsg->deliveries++ && !new_transaction(qmsg)) {
+				LOG(ERR) << "Can't parse '" << qmsg->qtag << "' to deliver it again";
+				set_state(qmsg, DELETE_ME_STATE);
+				break;
 			}
 
 			// debug_dump();
@@ -1176,22 +1952,67 @@ void SMq::process_timeout()
 
 			// FIXME, if we can't deliver the datagram we
 			// just do the same thing regardless of the result.
+			// Either way the retransmissions will try again.
 			LOG(DEBUG) << "Before deliver set state action time " << qmsg->next_action_time;
 			// Try and send datagram
-			if (my_network.deliver_msg_datagram(&*qmsg))
-				set_state(qmsg, ASKED_FOR_MSG_DELIVERY);   // Message sent okay
-			else
-				set_state(qmsg, ASKED_FOR_MSG_DELIVERY); // This makes more sense than back to REQUEST_DESTINATION_SIPURL
+			if (!my_network.deliver_msg_datagram(&*qmsg))
+				LOG(DEBUG) << "First send of '" << qmsg->qtag << "' failed";
+			if (client_txns.enabled()) {
+				qmsg->txn_start = msgettime();
+				qmsg->txn_sends = 1;
+				qmsg->txn_proceeding = false;
+				client_txns.started();
+				set_state(qmsg, ASKED_FOR_MSG_DELIVERY,
+					client_txns.next_action(qmsg->txn_start, 1, false));
+			} else {
+				set_state(qmsg, ASKED_FOR_MSG_DELIVERY);
+			}
 			LOG(DEBUG) << "After deliver set state action time " << qmsg->next_action_time;
 			break;
 
 		case ASKED_FOR_MSG_DELIVERY:
-			/* We sent the message to the handset, but never
-			   got back an ack.  Must wait awhile to avoid
-			   flooding the network or the user with dups. */
+			/* Timer E: no final response yet, so send the very
+			   same request again, same branch and all, so the
+			   BTS can tell it's a retransmission.  */
+			if (qmsg->txn_start
+			 && !client_txns.timed_out(qmsg->txn_start, msgettime())) {
+				my_network.deliver_msg_datagram(&*qmsg);
+				qmsg->txn_sends++;
+				client_txns.resent();
+				set_state(qmsg, ASKED_FOR_MSG_DELIVERY,
+					client_txns.next_action(qmsg->txn_start,
+						qmsg->txn_sends, qmsg->txn_proceeding));
+				break;
+			}
+			/* Timer F, or we weren't retransmitting: we sent the
+			   message to the handset, but never got back an ack.
+			   Must wait awhile to avoid flooding the network or
+			   the user with dups. */
+			if (qmsg->txn_start) {
+				LOG(INFO) << "Timer F for '" << qmsg->qtag << "' after "
+					<< qmsg->txn_sends << " sends";
+				client_txns.timer_f();
+				qmsg->txn_start = 0;
+			}
 			set_state(qmsg, AWAITING_TRY_MSG_DELIVERY);
 			break;
 
+		/* The registry lookup threads haven't answered in time
+		   (they're backed up).  Go back and ask again; that joins
+		   the lookup that's already queued.  */
+		case ASKED_FOR_FROM_ADDRESS_LOOKUP:
+			LOG(NOTICE) << "Registry lookup slow for " << qmsg->qtag;
+			set_state(qmsg, REQUEST_FROM_ADDRESS_LOOKUP);
+			break;
+		case ASKED_FOR_DESTINATION_IMSI:
+			LOG(NOTICE) << "Registry lookup slow for " << qmsg->qtag;
+			set_state(qmsg, REQUEST_DESTINATION_IMSI);
+			break;
+		case ASKED_FOR_DESTINATION_SIPURL:
+			LOG(NOTICE) << "Registry lookup slow for " << qmsg->qtag;
+			set_state(qmsg, REQUEST_DESTINATION_SIPURL);
+			break;
+
 		case AWAITING_REGISTER_HANDSET:
 			/* We got a shortcode SMS which succeeded in
 			   associating a phone number with this IMSI.
@@ -1225,11 +2046,9 @@ void SMq::process_timeout()
 			break;
 		} // switch
 
-		unlockSortedList();
-
 		//LOG(DEBUG) << "End process_timeout";
 
-} // SMq::process_timeout on reader thread
+} // SMq::run_state_machine on writer thread
 
 
 
@@ -1244,7 +2063,7 @@ SMq::set_linktag(short_msg_p_list::iterator newmsg,
 		 short_msg_p_list::iterator oldmsg)
 {
 	if (!oldmsg->qtag) {
-		oldmsg->set_qtag();
+		retag_message(oldmsg);
 	}
 
 	size_t len = strlen(oldmsg->qtag);
@@ -1349,8 +2168,8 @@ SMq::originate_half_sm(string method)
 	osip_message_set_method (response->parsed, osip_strdup(method.c_str()));
 
 	ostringstream newvia;
-	newvia << "SIP/2.0/UDP " << my_ipaddress.c_str() << ":" << my_udp_port.c_str() << ";branch=1;received="
-				<< "smqueue@Range.com";
+	newvia << "SIP/2.0/UDP " << my_ipaddress.c_str() << ":" << my_udp_port.c_str() << ";branch=" << new_branch()
+				<< ";received=smqueue@Range.com";
 	osip_message_append_via(response->parsed, newvia.str().c_str());
 	// We've altered the text, and the parsed version controls.
 	response->parsed_was_changed();
@@ -1360,6 +2179,88 @@ SMq::originate_half_sm(string method)
 }
 
 
+/* The slots in the template for MESSAGEs that originate_sm makes. */
+enum { MSG_FROM, MSG_TO, MSG_HOST, MSG_BTS_PORT, MSG_VIA_PORT, MSG_BRANCH,
+	MSG_CALL_ID, MSG_CSEQ, MSG_BODY, MSG_LENGTH, MSG_SLOTS };
+
+/*
+ * Build the MESSAGE with values in m, with osip.  This is how
+ * originate_half_sm and originate_sm did it, and what the message
+ * template is learned from.
+ */
+static void
+osip_originate(osip_message_t *m, const string *values)
+{
+	const string &host = values[MSG_HOST];
+
+	osip_call_id_init(&m->call_id);
+	osip_call_id_set_host(m->call_id, osip_strdup(host.c_str()));
+	osip_call_id_set_number(m->call_id, osip_strdup(values[MSG_CALL_ID].c_str()));
+	osip_message_set_cseq(m, (values[MSG_CSEQ] + " MESSAGE").c_str());
+	osip_message_set_method(m, osip_strdup("MESSAGE"));
+
+	ostringstream newvia;
+	newvia << "SIP/2.0/UDP " << host << ":" << values[MSG_VIA_PORT]
+		<< ";branch=" << values[MSG_BRANCH] << ";received=smqueue@Range.com";
+	osip_message_append_via(m, newvia.str().c_str());
+
+	// For the tag, we cheat and reuse the cseq number.
+	// I don't see any reason not to...why do we have three different
+	// tag fields scattered around?
+	ostringstream fromline;
+	fromline << values[MSG_FROM] << "<sip:" << values[MSG_FROM] << "@" << host
+		<< ">;tag=" << values[MSG_CSEQ];
+	osip_message_set_from(m, fromline.str().c_str());
+
+	ostringstream toline;
+	toline << "<sip:" << values[MSG_TO] << "@" << host << ">";
+	osip_message_set_to(m, toline.str().c_str());
+
+	ostringstream uriline;
+	uriline << "sip:" << values[MSG_TO] << "@" << host << ":" << values[MSG_BTS_PORT];
+	osip_uri_init(&m->req_uri);
+	osip_uri_parse(m->req_uri, uriline.str().c_str());
+
+	osip_message_set_content_type(m, "text/plain");
+	osip_message_set_body(m, values[MSG_BODY].data(), values[MSG_BODY].size());
+}
+
+/*
+ * Are these values ones that osip writes as they are?  osip escapes
+ * some characters in URIs, and quotes some display names; anything
+ * but the plainest gets a message made by osip.
+ */
+static bool
+plain_message_values(const string *values)
+{
+	static const char *allowed[MSG_BODY] = {
+		"+-_.", "+-_.", "-.", "", "", "-_.", "-_.", ""
+	};
+
+	// osip leaves out an empty body's Content-Type.
+	if (values[MSG_BODY].empty())
+		return false;
+	for (int i = 0; i < MSG_BODY; i++) {
+		const string &v = values[i];
+		if (v.empty())
+			return false;
+		for (size_t j = 0; j < v.size(); j++)
+			if (!isalnum(v[j]) && !strchr(allowed[i], v[j]))
+				return false;
+	}
+	return true;
+}
+
+/* This thread's buffer for making messages from templates. */
+static SmqSipBuffer &
+sip_buffer()
+{
+	static __thread SmqSipBuffer *buffer;
+	if (!buffer)
+		buffer = new SmqSipBuffer();
+	return *buffer;
+}
+
 /*
  * Originate a short message
  * Put it in the queue and start handling it.
@@ -1381,51 +2282,53 @@ SMq::originate_sm(const char *from, const char *to, const char *msgtext,
 	short_msg_p_list *smpl;
 	short_msg_pending *response;
 	int errcode;
+	string values[MSG_SLOTS];
+
+	values[MSG_FROM] = from;
+	values[MSG_TO] = to;
+	values[MSG_HOST] = my_ipaddress;
+	values[MSG_BTS_PORT] = gConfig.getStr("SIP.Default.BTSPort");
+	values[MSG_VIA_PORT] = my_udp_port;
+	values[MSG_BRANCH] = new_branch();
+	values[MSG_CALL_ID] = my_network.new_call_number();
+	ostringstream cseq;
+	cseq << (my_network.new_random_number() & 0xFFFF);	// for short readable numbers
+	values[MSG_CSEQ] = cseq.str();
+    size_t len = strlen(msgtext);
+    if (len > SMS_MESSAGE_MAX_LENGTH)
+        len = SMS_MESSAGE_MAX_LENGTH;
+	values[MSG_BODY].assign(msgtext, len);
+	ostringstream length;
+	length << len;
+	values[MSG_LENGTH] = length.str();
 
-	smpl = originate_half_sm("MESSAGE");
-	if (smpl == NULL) {
-		return -1;  // Returning -1 for error
-	}
-
+	smpl = new short_msg_p_list (1);
 	response = &*smpl->begin();	// Here's our short_msg_pending!
 
-	// Plain text SIP MESSAGE should be repacked before delivery
-	response->need_repack = true;
-
-	// For the tag, we cheat and reuse the cseq number.  
-	// I don't see any reason not to...why do we have three different
-	// tag fields scattered around?
-	ostringstream fromline;
-	fromline << from << "<sip:" << from << "@" << my_ipaddress << ">;tag=" 
-		 << response->parsed->cseq->number;
-	osip_message_set_from(response->parsed, fromline.str().c_str());
+	if (message_template.ready() && plain_message_values(values)) {
+		// Splice the values into the text osip would have made.
+		SmqSipBuffer &out = sip_buffer();
+		message_template.expand(values, out);
+		response->initialize (out.size(), (char *) out.data(), false);
+	} else {
+		response->initialize (0, NULL, true);
+		osip_message_init(&response->parsed);
+		response->parsed_is_valid = true;
+		osip_originate(response->parsed, values);
 
-	ostringstream toline;
-	toline << "<sip:" << to << "@" << my_ipaddress << ">";
-	osip_message_set_to(response->parsed, toline.str().c_str());
+		// We've altered the text and the parsed version controls.
+		response->parsed_was_changed();
 
-	ostringstream uriline;
-	uriline << "sip:" << to << "@" << my_ipaddress << ":" << gConfig.getStr("SIP.Default.BTSPort").c_str();
-	osip_uri_init(&response->parsed->req_uri);
-	osip_uri_parse(response->parsed->req_uri, uriline.str().c_str());
+		// Now turn it into a text and then parse it for validity
+		response->make_text_valid();
+		response->unparse();
+	}
 
-	osip_message_set_content_type(response->parsed, "text/plain");
+	// Plain text SIP MESSAGE should be repacked before delivery
+	response->need_repack = true;
 	response->content_type = short_msg::TEXT_PLAIN;
-    size_t len = strlen(msgtext);
-    if (len > SMS_MESSAGE_MAX_LENGTH)
-        len = SMS_MESSAGE_MAX_LENGTH;
-	osip_message_set_body(response->parsed, msgtext, len);
-
-	// We've altered the text and the parsed version controls.
-	response->parsed_was_changed();
 
-	// Now that we set the From tag, we have to create the queue tag.
-	response->set_qtag();
-
-	// Now turn it into a text and then parse it for validity
-	response->make_text_valid();
-	response->unparse();
-	
+	// Validating parses it and sets the queue tag.
 	errcode = response->validate_short_msg(this, false);
 	if (errcode == 0) {
 		insert_new_message (*smpl, firststate); // originate_sm
@@ -1462,6 +2365,57 @@ void SMq::InitInsideReaderLoop() {
     // Debug -- print all msgs in log
     print_as_we_validate = gConfig.getBool("Debug.print_as_we_validate");
 
+    // How much process_timeout does per wakeup.
+    if (gConfig.defines("Queue.Batch.MaxMessages"))
+        batch_max_msgs = gConfig.getNum("Queue.Batch.MaxMessages");
+    if (gConfig.defines("Queue.Batch.MaxTime"))
+        batch_max_ms = gConfig.getNum("Queue.Batch.MaxTime");
+    if (batch_max_msgs < 1)
+        batch_max_msgs = 1;
+    if (gConfig.defines("Queue.RunToCompletion"))
+        run_to_completion = gConfig.getBool("Queue.RunToCompletion");
+
+    // How much journal makes it worth a checkpoint.
+    if (gConfig.defines("Queue.Journal.CompactBytes"))
+        journal_compact_bytes = gConfig.getNum("Queue.Journal.CompactBytes");
+
+    // Memory budget for the queue, in bytes; 0 for none.
+    if (gConfig.defines("Queue.Memory.Budget"))
+        memory_budget = gConfig.getNum("Queue.Memory.Budget");
+    if (gConfig.defines("Queue.Memory.SpillAfterMs"))
+        spill_after_ms = gConfig.getNum("Queue.Memory.SpillAfterMs");
+    if (gConfig.defines("Queue.Memory.PrefetchMs"))
+        prefetch_ms = gConfig.getNum("Queue.Memory.PrefetchMs");
+    if (prefetch_ms >= spill_after_ms)
+        prefetch_ms = spill_after_ms / 2;
+    if (gConfig.defines("Queue.Memory.ParseBudget"))
+        parse_budget = gConfig.getNum("Queue.Memory.ParseBudget");
+    if (gConfig.defines("Queue.Memory.ParseIdleMs"))
+        parse_idle_ms = gConfig.getNum("Queue.Memory.ParseIdleMs");
+
+    // Registry answer cache; sizes in entries, TTLs in seconds.
+    lookups.set_cache_limits(
+        gConfig.defines("Queue.Cache.Size") ? gConfig.getNum("Queue.Cache.Size") : 100000,
+        1000 * (gConfig.defines("Queue.Cache.TTL") ? gConfig.getNum("Queue.Cache.TTL") : 300),
+        1000 * (gConfig.defines("Queue.Cache.NegativeTTL") ? gConfig.getNum("Queue.Cache.NegativeTTL") : 30));
+
+    // How long answered requests are remembered, in ms.
+    server_txns.set_timer_j(gConfig.defines("Queue.Transaction.TimerJ")
+        ? gConfig.getNum("Queue.Transaction.TimerJ") : 64 * SmqServerTransactions::T1);
+
+    // Retransmission of the requests we send, in ms.
+    client_txns.set_timers(
+        gConfig.defines("Queue.Transaction.T1") ? gConfig.getNum("Queue.Transaction.T1") : SmqClientTransactions::T1,
+        gConfig.defines("Queue.Transaction.T2") ? gConfig.getNum("Queue.Transaction.T2") : SmqClientTransactions::T2,
+        gConfig.defines("Queue.Transaction.TimerF") ? gConfig.getNum("Queue.Transaction.TimerF") : 64 * SmqClientTransactions::T1);
+
+    // Delivery address cache; TTLs in seconds.
+    my_network.routes.set_limits(
+        gConfig.defines("Queue.Route.Size") ? gConfig.getNum("Queue.Route.Size") : 1024,
+        1000 * (gConfig.defines("Queue.Route.TTL") ? gConfig.getNum("Queue.Route.TTL") : 60),
+        1000 * (gConfig.defines("Queue.Route.NegativeTTL") ? gConfig.getNum("Queue.Route.NegativeTTL") : 5),
+        gConfig.defines("Queue.Route.Connect") ? gConfig.getBool("Queue.Route.Connect") : false);
+
     // system() calls in back grounded jobs hang if stdin is still open on tty.
     // So, close it.
     close(0);     // Shut off stdin in case we're in background
@@ -1481,12 +2435,16 @@ void SMq::InitInsideReaderLoop() {
 
 void SMq::CleaupAfterMainreaderLoop() {
     // Main loop has exited program has been terminated
+    finish_recovery();
+    stop_receivers();
+    stop_shards();
+    lookups.stop();
 
     // The rest of this code never gets run (unless main_loop exits
     // based upon getting a "reboot" sms or signal or something).
     if (smq.reexec_smqueue) {
     	LOG(WARNING) << "====== Re-Execing! ======";
-		if (!smq.save_queue_to_file(savefile)) {  //Save file on shutdown
+		if (!smq.checkpoint_queue()) {  //Save file on shutdown
 		  LOG(ERR) << "OUCH!  Could not save queue to file " << savefile;
 		}
 		please_re_exec = true;
@@ -1494,12 +2452,14 @@ void SMq::CleaupAfterMainreaderLoop() {
     } else {
 		please_re_exec = false;
 		LOG(NOTICE) << "====== Quitting! ======";
-		if (!smq.save_queue_to_file(savefile)) {  //Save file on shutdown
+		if (!smq.checkpoint_queue()) {  //Save file on shutdown
 			LOG(ERR) << "OUCH!  Could not save queue to file " << savefile;
 		}
 		// smq.debug_dump();
 	}
 
+    journal.close();
+
     // Free up any OSIP stuff, to make valgrind squeaky clean.
     osip_mem_release();
 
@@ -1554,60 +2514,547 @@ SMq::bounce_message(short_msg_pending *sent_msg, const char *errstr)
 	}
 }
 
-void SMq::InitBeforeMainLoop() {
-    // Initialize
-	// TODO : post WebUI NG MVP
-	gNodeManager.start(45063);//, 31338);
+/*
+ * Split the queue into shards.  Only done at startup, before the queue
+ * file is read, so there is nothing to move across.
+ */
+bool SMq::set_shards(int count, const std::string &name)
+{
+	shard_vector newshards;
 
-	please_re_exec = false;
-    stop_main_loop = false;
-    reexec_smqueue = false;
+	if (count < 1 || count > MAXSHARDS)
+		return false;
+	if (name != "wheel" && name != "list")
+		return false;
 
-	// Open the CDR file for appending.
-	std::string CDRFilePath = gConfig.getStr("CDRFile");
-	if (CDRFilePath.length()) {
-		gCDRFile = fopen(CDRFilePath.c_str(),"a");
-		if (!gCDRFile) {
-		  LOG(ALERT) << "CDR file at " << CDRFilePath.c_str() << " could not be created or opened! errno " << errno << strerror(errno) << endl;
-		}
+	for (int i = 0; i < count; i++) {
+		short_msg_scheduler *sched;
+		if (name == "wheel")
+			sched = new SmqTimerWheel<short_msg_p_list::iterator>();
+		else
+			sched = new SmqListScheduler<short_msg_p_list::iterator>();
+		newshards.push_back(new SmqShard(i, sched));
 	}
 
-	// Set up short-code commands users can type
-	init_smcommands(&short_code_map);
+	if (queue_size() != 0) {
+		LOG(ERR) << "Can't change shards with " << queue_size() << " messages queued";
+		for (size_t i = 0; i < newshards.size(); i++)
+			delete newshards[i];
+		return false;
+	}
+	for (size_t i = 0; i < shards.size(); i++)
+		delete shards[i];
+	shards.swap(newshards);
+	LOG(INFO) << "Using " << shards.size() << " queue shards with "
+		<< shards[0]->scheduler->name() << " message scheduler";
+	return true;
+}
 
-	if (gConfig.defines("SIP.Timeout.MessageResend")) {
-    	int int1 = gConfig.getNum("SIP.Timeout.MessageResend");
-    	LOG(DEBUG) << "Set SIP.Timeout.MessageResend value " <<  int1;
-    	// timeouts_REQUEST_MSG_DELIVERY[REQUEST_DESTINATION_SIPURL] = int1;  // svgfix
-    }
+void SMq::start_shards()
+{
+	for (size_t i = 0; i < shards.size(); i++)
+		shards[i]->start();
+}
 
-   if (gConfig.defines("SIP.Timeout.MessageBounce")) {
-	  int int2 = gConfig.getNum("SIP.Timeout.MessageBounce");
-	  LOG(DEBUG) << "Set SIP.Timeout.MessageBounce value " <<  int2;
-	  timeouts_REQUEST_DESTINATION_IMSI[DELETE_ME_STATE] = int2;
-   }
+void SMq::wake_shards()
+{
+	for (size_t i = 0; i < shards.size(); i++)
+		shards[i]->wake();
+}
 
-   //LOG(DEBUG) << "REQUEST_DESTINATION_SIPURL value " << REQUEST_DESTINATION_SIPURL;
-   //LOG(DEBUG) << "Timeout from 8 to 11 " << *SMqueue::timeouts[REQUEST_MSG_DELIVERY][REQUEST_DESTINATION_SIPURL];
-   //LOG(DEBUG) << "Timeout from 11 to 8 " << *SMqueue::timeouts[REQUEST_DESTINATION_SIPURL][REQUEST_MSG_DELIVERY];
+void SMq::stop_shards()
+{
+	for (size_t i = 0; i < shards.size(); i++)
+		shards[i]->join();
+}
 
+void SMq::request_stop()
+{
+	stop_main_loop = true;
+	my_network.wake();	// The reader
+	for (size_t i = 0; i < receivers.size(); i++)
+		receivers[i]->wake();
+	wake_shards();
+	WakeWriterThread();
+}
 
-   // Port number that we (smqueue) listen on.
-   if (smq.init_listener(gConfig.getStr("SIP.myPort").c_str())) {
-       LOG(INFO) << "Got VALID port for smqueue to listen on";
-   } else {
-       LOG(INFO) << "Failed to get port for smqueue to listen on";
-   }
+bool SMq::start_receivers(int nreceivers, bool steer)
+{
+	for (int i = 1; i < nreceivers; i++) {
+		SMnet *net = new SMnet();
+		net->set_batching(my_network.rx_alloc, my_network.use_gso);
+		if (!net->listen_on_port(my_udp_port, true)) {
+			LOG(ERR) << "Can't open receiver " << i << " on port " << my_udp_port;
+			delete net;
+			break;
+		}
+		receivers.push_back(net);
+	}
+	if (steer && !receivers.empty())
+		my_network.attach_steering(receivers.size() + 1);
+
+	for (size_t i = 0; i < receivers.size(); i++) {
+		pthread_t thread;
+		int status = pthread_create(&thread, NULL, receiver_thread, receivers[i]);
+		if (status != 0) {
+			LOG(ALERT) << "Can't start receiver thread, error " << status;
+			return false;
+		}
+		receiver_threads.push_back(thread);
+	}
+	LOG(INFO) << "Receiving on " << receivers.size() + 1 << " sockets"
+		<< (steer ? ", steered by source address" : "");
+	return (int) receivers.size() + 1 == nreceivers;
+}
 
-   // Restore message queue
-   savefile = gConfig.getStr("savefile").c_str();
-	// Load queue on start up
-   if (!smq.read_queue_from_file(smq.savefile)) {  // Load queue file on startup
-	   LOG(WARNING) << "Failed to read queue on startup from file " << smq.savefile;
-   }
+void *SMq::receiver_thread(void *arg)
+{
+	SMnet *net = (SMnet *) arg;
 
-    // Set up Posix message queue limit
-    FILE * gTempFile = NULL;
+	while (!smq.stop_main_loop)
+		smq.receive_on(*net, -1);	// request_stop() wakes us
+	return NULL;
+}
+
+void SMq::stop_receivers()
+{
+	for (size_t i = 0; i < receivers.size(); i++)
+		receivers[i]->wake();
+	for (size_t i = 0; i < receiver_threads.size(); i++)
+		pthread_join(receiver_threads[i], NULL);
+	receiver_threads.clear();
+	for (size_t i = 0; i < receivers.size(); i++)
+		delete receivers[i];
+	receivers.clear();
+}
+
+void SMq::report_io_stats()
+{
+	my_network.report_io_stats("Network");
+	my_network.report_route_stats();
+	for (size_t i = 0; i < receivers.size(); i++) {
+		ostringstream name;
+		name << "Network receiver " << i + 1;
+		receivers[i]->report_io_stats(name.str().c_str());
+	}
+}
+
+void SMq::report_transaction_stats()
+{
+	SmqServerTransactions::counters c = server_txns.stats();
+	LOG(INFO) << "Server transactions: " << c.transactions << " requests, "
+		<< c.retransmissions << " retransmissions absorbed (" << c.answered
+		<< " answered again), " << c.expired << " expired, " << c.entries
+		<< " open";
+	SmqClientTransactions::counters cc = client_txns.stats();
+	LOG(INFO) << "Client transactions: " << cc.transactions << " requests sent, "
+		<< cc.retransmissions << " retransmissions, " << cc.answered
+		<< " answered, " << cc.timeouts << " timed out";
+	LOG(INFO) << "Responses: " << early_responses << " taken without queueing, "
+		<< unmatched_responses << " for no queued message";
+}
+
+void SMq::report_memory_stats()
+{
+	SmqArena::counters c = SmqArena::stats();
+	if (c.released) {
+		LOG(INFO) << "Arenas: " << c.released << " parses, "
+			<< c.allocations / c.released << " allocations and "
+			<< c.bytes / c.released << " bytes each, "
+			<< c.walks_skipped << " freed without a walk; "
+			<< c.arenas << " arenas made, " << c.reused << " reused, "
+			<< c.chunks << " extra chunks; "
+			<< c.heap_allocations << " allocations outside arenas";
+	}
+
+	SmqSpillStore::counters sc = spill.stats();
+	if (sc.puts) {
+		LOG(INFO) << "Spill: " << sc.live << " messages out ("
+			<< sc.live_bytes << " bytes in " << sc.segments << " segments, "
+			<< sc.dead_bytes << " bytes of them dead; " << sc.compacted
+			<< " segments compacted, moving " << sc.moved << " messages); "
+			<< spill_counts.spilled << " spilled, "
+			<< spill_counts.prefetched << " paged in ahead of time, "
+			<< spill_counts.late << " when already due; "
+			<< sc.errors << " errors";
+	}
+
+	// How much the parse trees take, to tune Queue.Memory.ParseBudget.
+	size_t parsedBytes = 0;
+	unsigned long parsedMsgs = 0;
+	for (size_t i = 0; i < shards.size(); i++) {
+		SmqShard *sh = shards[i];
+		sh->lock();
+		parsedBytes += sh->bytes_parsed;
+		parsedMsgs += sh->msgs_parsed;
+		sh->unlock();
+	}
+	parse_counters pc = parse_counts;
+	unsigned long due = pc.hits + pc.misses;
+	LOG(INFO) << "Parse cache: " << parsedMsgs << " messages parsed, "
+		<< parsedBytes << " bytes; " << pc.evicted << " unparsed to fit "
+		<< parse_budget << " bytes, " << short_msg::reparses << " parsed again; "
+		<< "due messages found parsed " << pc.hits << " times of " << due
+		<< " (" << (due ? 100 * pc.hits / due : 100) << "%)";
+
+	// Resident size, to see it's flat over a long run.
+	long pages = 0, resident = 0;
+	FILE *statm = fopen("/proc/self/statm", "r");
+	if (statm) {
+		if (2 == fscanf(statm, "%ld %ld", &pages, &resident))
+			LOG(INFO) << "Memory: " << resident * (sysconf(_SC_PAGESIZE) / 1024)
+				<< " kB resident, " << queue_size() << " messages queued";
+		fclose(statm);
+	}
+}
+
+uint64_t SMq::journal_message(short_msg_pending *smp)
+{
+	if (!journal.is_open())
+		return 0;
+	if (!smp->journal_id)
+		smp->journal_id = journal.new_id();
+	else if (!smp->parsed_is_better && smp->journaled_edits == smp->text_edits)
+		// The journal has its text; only where it's got to is news.
+		return journal.put_state(smp->journal_id, smp->state, smp->next_action_time);
+	smp->make_text_valid();
+	smp->journaled_edits = smp->text_edits;
+	return journal.put(smp->journal_id, smp->state, smp->next_action_time,
+		smp->ms_to_sc, smp->need_repack,
+		my_network.string_addr((struct sockaddr *)smp->srcaddr, smp->srcaddrlen, true),
+		smp->text ? smp->text : "", smp->text ? smp->text_length : 0);
+}
+
+/*
+ * Start a new journal segment, save the queue, and then the segments
+ * before the new one aren't needed.  Runs on the writer thread, and
+ * locks one shard at a time, so the queue goes on meanwhile; what
+ * changes while it's being saved is in the new segment too.
+ */
+bool SMq::checkpoint_queue()
+{
+	if (!journal.is_open())
+		return save_queue_to_file(savefile);
+
+	time_t start = msgettime();
+	unsigned segment = journal.rotate();
+	if (!segment)
+		return false;
+	if (!save_queue_to_file(journal.save_file(), segment))
+		return false;
+	SmqJournal::drop_before(journal.save_file(), segment);
+	LOG(INFO) << "Checkpoint of the queue took " << (msgettime() - start) << " ms";
+	return true;
+}
+
+void SMq::report_journal_stats()
+{
+	if (!journal.is_open())
+		return;
+	SmqJournal::counters c = journal.stats();
+	LOG(INFO) << "Journal: " << c.records << " records, " << c.bytes << " bytes, "
+		<< c.syncs << " syncs (" << (c.syncs ? c.records / c.syncs : 0)
+		<< " records each), " << c.waits << " waits for the disk, "
+		<< c.segments << " segments, " << c.errors << " errors; "
+		<< journal.segment_bytes() << " bytes since the checkpoint";
+}
+
+std::string SMq::new_branch()
+{
+	// The magic cookie says it's unique, per RFC 3261.
+	std::string branch("z9hG4bK");
+	branch += my_network.new_call_number();
+	branch += my_network.new_call_number();
+	return branch;
+}
+
+/*
+ * A message that's delivered again, after timer F or a failure response,
+ * is a new request (RFC 3261 8.1.3.5, 17.1.1.3): give our Via a new
+ * branch and the CSeq the next number, so the BTS doesn't take it for
+ * a retransmission of the transaction that ended.  The CSeq is in the
+ * qtag, so the message is re-indexed under the new one.  Result is
+ * false if the message won't parse (it may have been unparsed to fit
+ * the parse budget since it was last sent).
+ */
+bool SMq::new_transaction(short_msg_p_list::iterator qmsg)
+{
+	if (!qmsg->parse())
+		return false;
+	osip_message_t *p = qmsg->parsed;
+	int nvias = osip_list_size(&p->vias);
+	for (int i = 0; i < nvias; i++) {
+		osip_via_t *via = (osip_via_t *) osip_list_get(&p->vias, i);
+		if (!via || !via->host || my_ipaddress != via->host)
+			continue;	// Not ours
+		int nparams = osip_list_size(&via->via_params);
+		for (int j = 0; j < nparams; j++) {
+			osip_generic_param_t *param =
+				(osip_generic_param_t *) osip_list_get(&via->via_params, j);
+			if (param && param->gname && !strcmp(param->gname, "branch")) {
+				osip_free(param->gvalue);
+				param->gvalue = osip_strdup(new_branch().c_str());
+			}
+		}
+	}
+	if (p->cseq && p->cseq->number) {
+		ostringstream cseq;
+		cseq << strtoul(p->cseq->number, NULL, 10) + 1;
+		osip_free(p->cseq->number);
+		p->cseq->number = osip_strdup(cseq.str().c_str());
+	}
+	qmsg->parsed_was_changed();
+	retag_message(qmsg);
+	LOG(DEBUG) << "Delivery " << qmsg->deliveries << " is a new transaction, now '"
+		<< qmsg->qtag << "'";
+	return true;
+}
+
+size_t SMq::queue_size()
+{
+	size_t n = 0;
+	for (size_t i = 0; i < shards.size(); i++)
+		n += shards[i]->scheduler->size();
+	return n;
+}
+
+/*
+ * Locking every shard in ascending order can't deadlock with the shard
+ * workers, which only ever hold their own shard's lock -- except that a
+ * worker for a shard other than 0 would be holding a lock out of order.
+ */
+void SMq::lockSortedList()
+{
+	SmqShard *cur = SmqShard::current();
+
+	if (cur && cur->number != 0 && worldLockDepth == 0)
+		LOG(ALERT) << "Queue shard " << cur->number << " locking the whole queue";
+	for (size_t i = 0; i < shards.size(); i++)
+		shards[i]->lock();
+	worldLockDepth++;
+}
+
+void SMq::unlockSortedList()
+{
+	worldLockDepth--;
+	for (size_t i = shards.size(); i > 0; i--)
+		shards[i-1]->unlock();
+}
+
+/*
+ * Route a new message to a shard.  Everything to do with one message
+ * has to stay on one shard, since a worker can't lock the others:
+ *  - A response goes where the message it answers is (by qtag).
+ *  - A message linked to another (the REGISTER sent on behalf of a
+ *    registration shortcode) goes where that message is, so the
+ *    REGISTER's response can find it.
+ *  - Shortcodes all go to shard 0, which may lock the whole queue.
+ *  - Anything else goes by the hash of its destination IMSI, so
+ *    messages for one subscriber are handled in order.  One addressed
+ *    to a phone number goes by the number till the lookup finds the
+ *    IMSI, and then move_home() takes it to the IMSI's shard.
+ */
+int SMq::shard_for(short_msg_pending *smp)
+{
+	int n;
+
+	if (shards.size() == 1 || !smp->parse())
+		return 0;
+
+	if (MSG_IS_RESPONSE(smp->parsed)) {
+		if (!smp->qtag)
+			return 0;
+		n = shard_of_tag(smp->qtag, smp->qtaghash);
+		return n < 0 ? 0 : n;
+	}
+	if (smp->linktag) {
+		n = shard_of_tag(smp->linktag, short_msg_pending::taghash_of(smp->linktag));
+		if (n >= 0)
+			return n;
+	}
+
+	if (smp->dest_imsi)
+		return short_msg_pending::taghash_of(smp->dest_imsi) % shards.size();
+	const char *user = smp->parsed->req_uri ? smp->parsed->req_uri->username : NULL;
+	if (!user || short_code_map.find(user) != short_code_map.end())
+		return 0;
+	const char *digits = imsi_digits(user);
+	return short_msg_pending::taghash_of(digits ? digits : user) % shards.size();
+}
+
+/*
+ * The qtag index still has it, pointing at the new shard, while it's
+ * in the inbox there; what comes for it meanwhile (a response, a
+ * finished lookup) is posted behind it, so it's there to be found.
+ * A message linked to another stays with that one (see shard_for).
+ */
+void SMq::move_home(SmqShard *sh, short_msg_p_list::iterator sm)
+{
+	if (shards.size() == 1 || !sm->dest_imsi || sm->linktag)
+		return;
+	int n = short_msg_pending::taghash_of(sm->dest_imsi) % shards.size();
+	if (n == sh->number)
+		return;
+
+	short_msg_p_list moving;
+	sh->scheduler->remove(sm);
+	unindex_destination(sh, sm);
+	sh->disown(&*sm);
+	moving.splice(moving.begin(), sh->message_list, sm);
+	LOG(DEBUG) << "Moving " << sm->qtag << " from shard " << sh->number
+		<< " to " << n;
+
+	pthread_mutex_lock(&qtagIndexMutex);
+	sm->shard = n;
+	shards[n]->post(moving);
+	pthread_mutex_unlock(&qtagIndexMutex);
+}
+
+void SMq::enqueue_message(short_msg_p_list &smp)
+{
+	SmqShard *sh = shards[shard_for(&*smp.begin())];
+	SmqShard *cur = SmqShard::current();
+
+	smp.begin()->shard = sh->number;
+	// Journal it while it's still ours.
+	journal_message(&*smp.begin());
+	if (!cur || cur == sh || worldLockDepth) {
+		sh->lock();
+		sh->message_list.splice (sh->message_list.begin(), smp);
+		index_new_message(sh, sh->message_list.begin());
+		sh->unlock();
+		sh->wake();
+	} else {
+		// Holding another shard's lock; let its worker queue it.
+		sh->post(smp);
+	}
+}
+
+/*
+ * What the node manager can ask us.  "queue" gets how many messages
+ * are queued in each state, counted from a snapshot.
+ */
+static JsonBox::Object
+nmHandler(JsonBox::Object &request)
+{
+	JsonBox::Object response;
+	std::string command = request["command"].getString();
+
+	if (command == "queue") {
+		SmqSnapshot snap;
+		smq.snapshot(snap, false);
+		std::map<int, int> counts;
+		for (size_t i = 0; i < snap.size(); i++)
+			counts[snap.at(i).state]++;
+		JsonBox::Object states;
+		for (std::map<int, int>::iterator x = counts.begin(); x != counts.end(); ++x)
+			states[sm_state_string((sm_state) x->first)] = JsonBox::Value(x->second);
+		JsonBox::Object data;
+		data["messages"] = JsonBox::Value((int) snap.size());
+		data["states"] = JsonBox::Value(states);
+		data["snapshot"] = JsonBox::Value((int) snap.epoch);
+		response["code"] = JsonBox::Value(200);
+		response["data"] = JsonBox::Value(data);
+	} else {
+		response["code"] = JsonBox::Value(501);
+	}
+	return response;
+}
+
+void SMq::InitBeforeMainLoop() {
+    // Initialize
+	// TODO : post WebUI NG MVP
+	gNodeManager.setAppLogicHandler(&nmHandler);
+	gNodeManager.start(45063);//, 31338);
+
+	please_re_exec = false;
+    stop_main_loop = false;
+    reexec_smqueue = false;
+    recovery.started = msgettime();
+
+	// Open the CDR file for appending.
+	std::string CDRFilePath = gConfig.getStr("CDRFile");
+	if (CDRFilePath.length()) {
+		gCDRFile = fopen(CDRFilePath.c_str(),"a");
+		if (!gCDRFile) {
+		  LOG(ALERT) << "CDR file at " << CDRFilePath.c_str() << " could not be created or opened! errno " << errno << strerror(errno) << endl;
+		}
+	}
+
+	// Set up short-code commands users can type
+	init_smcommands(&short_code_map);
+
+	if (gConfig.defines("SIP.Timeout.MessageResend")) {
+    	int int1 = gConfig.getNum("SIP.Timeout.MessageResend");
+    	LOG(DEBUG) << "Set SIP.Timeout.MessageResend value " <<  int1;
+    	// timeouts_REQUEST_MSG_DELIVERY[REQUEST_DESTINATION_SIPURL] = int1;  // svgfix
+    }
+
+   if (gConfig.defines("SIP.Timeout.MessageBounce")) {
+	  int int2 = gConfig.getNum("SIP.Timeout.MessageBounce");
+	  LOG(DEBUG) << "Set SIP.Timeout.MessageBounce value " <<  int2;
+	  timeouts_REQUEST_DESTINATION_IMSI[DELETE_ME_STATE] = int2;
+   }
+
+   //LOG(DEBUG) << "REQUEST_DESTINATION_SIPURL value " << REQUEST_DESTINATION_SIPURL;
+   //LOG(DEBUG) << "Timeout from 8 to 11 " << *SMqueue::timeouts[REQUEST_MSG_DELIVERY][REQUEST_DESTINATION_SIPURL];
+   //LOG(DEBUG) << "Timeout from 11 to 8 " << *SMqueue::timeouts[REQUEST_DESTINATION_SIPURL][REQUEST_MSG_DELIVERY];
+
+
+   // How many datagrams to read, and write, per system call.
+   my_network.set_batching(
+	   gConfig.defines("Queue.IO.Batch") ? gConfig.getNum("Queue.IO.Batch") : 32,
+	   gConfig.defines("Queue.IO.GSO") ? gConfig.getBool("Queue.IO.GSO") : true);
+
+   // Port number that we (smqueue) listen on.
+   int nreceivers = gConfig.defines("Queue.IO.Receivers") ? gConfig.getNum("Queue.IO.Receivers") : 1;
+   if (smq.init_listener(gConfig.getStr("SIP.myPort").c_str(), nreceivers > 1)) {
+       LOG(INFO) << "Got VALID port for smqueue to listen on";
+   } else {
+       LOG(INFO) << "Failed to get port for smqueue to listen on";
+   }
+
+   {
+	   int nshards = gConfig.defines("Queue.Shards") ? gConfig.getNum("Queue.Shards") : 1;
+	   std::string sched = gConfig.defines("Queue.Scheduler") ? gConfig.getStr("Queue.Scheduler") : "wheel";
+	   if (!set_shards(nshards, sched)) {
+		   LOG(WARNING) << "Bad Queue.Shards " << nshards << " or Queue.Scheduler '" << sched
+			   << "', using " << shards.size() << " with " << shards[0]->scheduler->name();
+	   }
+   }
+
+   // Messages are parsed on many threads from here on.
+   if (!osip_initialized && osip_init(&osipptr) == 0)
+	   osip_initialized = true;
+
+   // Restore message queue
+   savefile = gConfig.getStr("savefile").c_str();
+   binary_checkpoint = !gConfig.defines("Queue.Checkpoint.Format")
+	   || gConfig.getStr("Queue.Checkpoint.Format") != "text";
+	// Load queue on start up
+   if (!smq.read_queue_from_file(smq.savefile)) {  // Load queue file on startup
+	   LOG(WARNING) << "Failed to read queue on startup from file " << smq.savefile;
+   }
+   // Then journal from here on; what was read is checkpointed once
+   // recovery has queued it.
+   if (gConfig.defines("Queue.Journal") ? gConfig.getBool("Queue.Journal") : true) {
+	   journal_acks = gConfig.defines("Queue.Journal.SyncAcks") ? gConfig.getBool("Queue.Journal.SyncAcks") : false;
+	   if (!journal.open(savefile, journal_next_id,
+			     gConfig.defines("Queue.Journal.SyncMs") ? gConfig.getNum("Queue.Journal.SyncMs") : 10))
+		   LOG(ALERT) << "No journal; the queue is only saved to " << savefile << " once a minute";
+   }
+   spill.open(savefile);
+   short_msg::spill_store = &spill;
+   lookups.start(gConfig.defines("Queue.Lookup.Threads") ? gConfig.getNum("Queue.Lookup.Threads") : 2);
+   compile_sip_templates();
+   start_shards();
+   if (nreceivers > 1)
+	   start_receivers(nreceivers,
+		   gConfig.defines("Queue.IO.Steering") ? gConfig.getBool("Queue.IO.Steering") : true);
+   start_recovery(gConfig.defines("Queue.Recovery.Threads") ? gConfig.getNum("Queue.Recovery.Threads") : 4);
+
+    // Set up Posix message queue limit
+    FILE * gTempFile = NULL;
     int xTemp;
     gTempFile = fopen("/proc/sys/fs/mqueue/msg_max","w");
     if (!gTempFile) {
@@ -1644,8 +3091,14 @@ SMq::ready_to_register (short_msg_p_list::iterator qmsg)
 	    !qmsg->parsed->from->url)
 		return false;
 	imsi = qmsg->parsed->from->url->username;
-	callerid = my_hlr.getCLIDLocal(imsi);
-	return (callerid != NULL);
+	// Wait for an answer no older than our retry time, since we're
+	// waiting for the registry to change.  The lookup threads
+	// poke us when there is one.
+	if (!hlr_lookup(SmqLookup::CLID_LOCAL, imsi, &*qmsg, callerid, 1000))
+		return false;
+	bool found = (callerid != NULL);
+	free(callerid);
+	return found;
 }
 
 
@@ -1809,12 +3262,12 @@ bool SMq::handle_short_code(const short_code_map_t &short_code_map,
 
 	case SCA_EXEC_SMQUEUE:
 		reexec_smqueue = true;
-		stop_main_loop = true;
+		request_stop();
 		next_state = DELETE_ME_STATE;
 		return true;
 			
 	case SCA_QUIT_SMQUEUE:
-		stop_main_loop = true;
+		request_stop();
 		next_state = DELETE_ME_STATE;
 		return true;
 
@@ -1874,48 +3327,56 @@ SMq::lookup_from_address (short_msg_pending *qmsg)
 	
 	if (!host) { LOG(ERR) << "no hostname"; return NO_STATE; }
 
+	/* Username can be in various formats.  Check for formats that
+	   we know about.  Anything else we punt.
+	   This can be phone number or IMSI */
+	/* TODO: Check for tel BM2011 */
+	bool is_phone = got_phone || fromusername[0] == '+' || isdigit(fromusername[0]);
+	char *newfrom = NULL;
+
+	if (!is_phone) {
+		/* If we have "imsi" on the front, strip it.  */
+		char *tryuser = fromusername;
+		if ((fromusername[0] == 'i'||fromusername[0]=='I')
+		 && (fromusername[1] == 'm'||fromusername[1]=='M')
+		 && (fromusername[2] == 's'||fromusername[2]=='S')
+		 && (fromusername[3] == 'i'||fromusername[3]=='I')) {
+			tryuser += 4;
+		}
+
+		/* http://en.wikipedia.org/wiki/International_Mobile_Subscriber_Identity */
+		/* IMSI length check */
+		size_t len = strlen (tryuser);
+		if (len != 15 && len != 14) {
+			LOG(ERR) << "Message does not have a valid IMSI!";
+			/* This is not an IMSI.   Punt.  */
+			return NO_STATE;
+		}
+
+		/* Look up the IMSI in the Home Location Register.  Until
+		   the lookup threads answer, don't touch the message; we'll
+		   be back here when they do.  */
+		if (!hlr_lookup(SmqLookup::CLID_LOCAL, fromusername, qmsg, newfrom))
+			return ASKED_FOR_FROM_ADDRESS_LOOKUP;
+	}
+
 	// Insert a Via: line describing us, this makes us easier to trace,
 	// and also allows a remote SIP agent to reply to us.  (Maybe?)
 
 	ostringstream newvia;
-	newvia << "SIP/2.0/UDP " << my_ipaddress.c_str() << ":" << my_udp_port.c_str() << ";branch=1;received="
-				<< "smqueue@Range.com";
+	newvia << "SIP/2.0/UDP " << my_ipaddress.c_str() << ":" << my_udp_port.c_str() << ";branch=" << new_branch()
+				<< ";received=smqueue@Range.com";
 	osip_message_append_via(qmsg->parsed, newvia.str().c_str());
+	// The text doesn't have it yet, so the tree controls.
+	qmsg->parsed_was_changed();
 
-
-	/* Username can be in various formats.  Check for formats that
-	   we know about.  Anything else we punt.
-	   This can be phone number or IMSI */
-	/* TODO: Check for tel BM2011 */
-	if (got_phone || fromusername[0] == '+' || isdigit(fromusername[0])) {
+	if (is_phone) {
 		/* We have a phone number.  This is what we want.
 		   So we're done, and can move on to the next part
 		   of processing the short_msg. */
 		return REQUEST_DESTINATION_IMSI;
 	}
 
-	/* If we have "imsi" on the front, strip it.  */
-	char *tryuser = fromusername;
-	if ((fromusername[0] == 'i'||fromusername[0]=='I')
-         && (fromusername[1] == 'm'||fromusername[1]=='M')
-	 && (fromusername[2] == 's'||fromusername[2]=='S')
-	 && (fromusername[3] == 'i'||fromusername[3]=='I')) {
-		tryuser += 4;
-	}
-
-	/* http://en.wikipedia.org/wiki/International_Mobile_Subscriber_Identity */
-	/* IMSI length check */
-	size_t len = strlen (tryuser);
-        if (len != 15 && len != 14) {
-		LOG(ERR) << "Message does not have a valid IMSI!";
-		/* This is not an IMSI.   Punt.  */
-		return NO_STATE;
-	}
-
-	/* Look up the IMSI in the Home Location Register. */
-	char *newfrom;
-
-	newfrom = my_hlr.getCLIDLocal(fromusername);
 	if (!newfrom) {
 		/* ==================FIXME KLUDGE====================
 		 * Here is our fake table of IMSIs and phone numbers
@@ -2047,7 +3508,9 @@ SMq::lookup_uri_imsi (short_msg_pending *qmsg)
 				   && 0 != strncmp("IMSI", username, 4))) {
 		// We have a phone number.  It needs translation.
 
-		char *newdest = my_hlr.getIMSI2(username);  // Get IMSI from phone number
+		char *newdest;
+		if (!hlr_lookup(SmqLookup::IMSI_OF_NUMBER, username, qmsg, newdest))  // Get IMSI from phone number
+			return ASKED_FOR_DESTINATION_IMSI;
 		if (!newdest) {
 			/* ==================FIXME KLUDGE====================
 `				 * Here is our fake table of IMSIs and phone numbers
@@ -2094,12 +3557,15 @@ SMq::lookup_uri_imsi (short_msg_pending *qmsg)
 			// sender's local ph#.  Map it to the global ph#.
 			LOG(INFO) << "using global SIP relay " << global_relay << " to route message to " << username;
 			char *newfrom;
-			newfrom = my_hlr.mapCLIDGlobal(
-					qmsg->parsed->from->url->username);
+			if (!hlr_lookup(SmqLookup::CLID_GLOBAL,
+					qmsg->parsed->from->url->username, qmsg, newfrom))
+				return ASKED_FOR_DESTINATION_IMSI;
 			if (newfrom) {
 				osip_free(qmsg->parsed->from->url->username);
 				qmsg->parsed->from->url->username = 
 					osip_strdup (newfrom);
+				qmsg->parsed_in_arena = false;
+				free(newfrom);
 			}
 			convert_content_type(qmsg, global_relay_contenttype);
 			// TODO do cost checks here for out-of-network, probably instead of in smsc shortcode or INITIAL_STATE
@@ -2167,122 +3633,316 @@ osip_via_clone2 (void *via, void **dest)
 }
 
 
-/*
- * After we received a datagram, send a SIP response message
- * telling the sender what we did with it.  (Unless the datagram we
- * received was already a SIP response message...)
- * svgfix return error on failure
- * Called in writer thread
- * Calls my_network.send_dgram
- */
-void
-SMq::respond_sip_ack(int errcode, SMqueue::short_msg_pending *smp,
-		char *netaddr, size_t netaddrlen)
+/* The reason phrase we send with each status code. */
+static const char *
+ack_phrase(int errcode)
 {
-	string phrase;
-	short_msg response;
-	bool okay;
-
-	LOG(DEBUG) << "Send SIP ACK message";
-
-	if (!smp->parse()) {
-		LOG(DEBUG) << "Short message parse failed";
-		return;		// Don't ack invalid SIP messages
+	switch (errcode) {
+	case 100:	return "Trying...";
+	case 200:	return "Okay!";
+	case 202:	return "Queued";
+	case 400:	return "Bad Request";
+	case 401:	return "Unauthorized";
+	case 403:	return "Forbidden - first register, by texting your 10-digit phone number to 101.";
+	case 404:	return "Phone Number Not Registered";  // Not Found
+	case 405:	return "Method Not Allowed";
+	case 413:	return "Message Body Size Error";
+	case 415:	return "Unsupported Content Type";
+	case 416:	return "Unsupported URI scheme (not SIP)";
+	case 480:	return "Recipient Temporarily Unavailable";
+	case 484:	return "Address Incomplete";
+	default:	return "Error Message Table Needs Updating";
 	}
+}
 
-	LOG(DEBUG) << "Short message parse returned success";
-	if (MSG_IS_RESPONSE(smp->parsed)) {
-		LOG(DEBUG) << "Ignore response message";
-		return;		// Don't ack a response message, or we loop!
-	}
+/*
+ * Make the response to request in response, with osip.  This is how
+ * it was always done, and what the ack templates are learned from.
+ */
+static void
+osip_ack(int errcode, osip_message_t *request, short_msg &response)
+{
 	osip_message_init(&response.parsed);
 	response.parsed_is_valid = true;
 
 	// Copy over the CSeq, From, To, Call-ID, Via, etc.
-	osip_to_clone(smp->parsed->to,     &response.parsed->to);
-	osip_from_clone(smp->parsed->from, &response.parsed->from);
-	osip_cseq_clone(smp->parsed->cseq, &response.parsed->cseq);
-	osip_call_id_clone(smp->parsed->call_id, &response.parsed->call_id);
-	osip_list_clone(&smp->parsed->vias, &response.parsed->vias,
+	osip_to_clone(request->to,     &response.parsed->to);
+	osip_from_clone(request->from, &response.parsed->from);
+	osip_cseq_clone(request->cseq, &response.parsed->cseq);
+	osip_call_id_clone(request->call_id, &response.parsed->call_id);
+	osip_list_clone(&request->vias, &response.parsed->vias,
 			&osip_via_clone2);
 
 	//don't add a new via header to a response! -kurtis
 	//RFC 3261 8.2.6.2
 
 	// Make a nice message.
-	switch (errcode) {
-	case 100:	phrase="Trying..."; break;
-	case 200:	phrase="Okay!"; break;
-	case 202:	phrase="Queued"; break;
-	case 400:	phrase="Bad Request"; break;
-	case 401:	phrase="Unauthorized"; break;
-	case 403:	phrase="Forbidden - first register, by texting your 10-digit phone number to 101."; break;
-	case 404:	phrase="Phone Number Not Registered"; break;  // Not Found
-	case 405:	phrase="Method Not Allowed";
-			osip_message_set_allow(response.parsed, "MESSAGE");
-			break;
-	case 413:	phrase="Message Body Size Error"; break;
-	case 415:	phrase="Unsupported Content Type";
-			osip_message_set_accept(response.parsed, "text/plain, application/vnd.3gpp.sms");
-			break;
-	case 416:	phrase="Unsupported URI scheme (not SIP)"; break;
-	case 480:	phrase="Recipient Temporarily Unavailable"; break;
-	case 484:	phrase="Address Incomplete"; break;
-	default:	phrase="Error Message Table Needs Updating"; break;
-	}
+	if (errcode == 405)
+		osip_message_set_allow(response.parsed, "MESSAGE");
+	if (errcode == 415)
+		osip_message_set_accept(response.parsed, "text/plain, application/vnd.3gpp.sms");
 
 	osip_message_set_status_code (response.parsed, errcode);
 	osip_message_set_reason_phrase (response.parsed,
-				        osip_strdup((char *)phrase.c_str()));
+				        osip_strdup((char *)ack_phrase(errcode)));
 
 	// We've altered the text and the parsed version controls.
 	response.parsed_was_changed();
-
-	// Now turn it into a datagram and hustle it home.
 	response.make_text_valid();
-	LOG(INFO) << "Responding with \"" << errcode << " " << phrase << "\".";
+}
 
-	okay = my_network.send_dgram(response.text, strlen(response.text),
-				     netaddr, netaddrlen);
-	if (!okay)
-		LOG(ERR) << "send_dgram had trouble sending the response err " << okay << " size " << strlen(response.text);
+/* The slots in an ack template. */
+enum { ACK_VIAS, ACK_FROM, ACK_TO, ACK_CALL_ID, ACK_CSEQ, ACK_SLOTS };
+
+/* Keep a string osip made with xxx_to_str, and free it. */
+static bool
+take_osip_str(int err, char **str, string &dest)
+{
+	if (err != 0 || !*str)
+		return false;
+	dest = *str;
+	osip_free(*str);
+	return true;
 }
 
-//
-// The main loop that listens for incoming datagrams, handles them
-// through the queue, and moves them toward transmission.
-// Called by reader thread
-// Main job
-//
-enum sm_state
-SMq::lookup_uri_hostport (short_msg_pending *qmsg)
+/*
+ * The values for the ack template slots, from request: each header the
+ * way osip writes it, with the Vias one to a line.  Result is false if
+ * one is missing, which osip would leave out and a template can't.
+ */
+static bool
+ack_values(osip_message_t *request, string *values)
 {
+	char *str = NULL;
+	int nvias = osip_list_size(&request->vias);
 
-	qmsg->parse();
+	if (nvias <= 0 || !request->from || !request->to
+	 || !request->call_id || !request->cseq)
+		return false;
 
-	char *imsi = qmsg->parsed->req_uri->username;
-	char *p, *mycallnum;
-	char *newhost, *newport;
-	const char *myhost;
+	values[ACK_VIAS].clear();
+	for (int i = 0; i < nvias; i++) {
+		string via;
+		osip_via_t *v = (osip_via_t *) osip_list_get(&request->vias, i);
+		if (!take_osip_str(osip_via_to_str(v, &str), &str, via))
+			return false;
+		if (i)
+			values[ACK_VIAS] += "\r\nVia: ";
+		values[ACK_VIAS] += via;
+	}
+	return take_osip_str(osip_from_to_str(request->from, &str), &str, values[ACK_FROM])
+	    && take_osip_str(osip_to_to_str(request->to, &str), &str, values[ACK_TO])
+	    && take_osip_str(osip_call_id_to_str(request->call_id, &str), &str, values[ACK_CALL_ID])
+	    && take_osip_str(osip_cseq_to_str(request->cseq, &str), &str, values[ACK_CSEQ]);
+}
 
-	if (!imsi) { LOG(ERR) << "No IMSI"; return NO_STATE; }
+/*
+ * Compile a template twice, from messages made with two sets of
+ * samples.  The samples differ in length (and in the number of Vias),
+ * so if osip lays things out differently for different values, the
+ * two won't match and we don't use the template.
+ */
+static bool
+compile_checked(SmqSipTemplate &tmpl, const short_msg &a, const string *samplesA,
+		const short_msg &b, const string *samplesB, int nslots)
+{
+	SmqSipTemplate other;
 
-	/* Username can be in various formats.  Check for formats that
-	   we know about.  Anything else we punt.  */
-	if (imsi[0] == '+' || (0 != strncmp("imsi", imsi, 4)
-			    && 0 != strncmp("IMSI", imsi, 4))) {
-		LOG(DEBUG) << "We have a number: " << imsi;
+	if (!a.text || !b.text
+	 || !tmpl.compile(a.text, a.text_length, vector<string>(samplesA, samplesA + nslots))
+	 || !other.compile(b.text, b.text_length, vector<string>(samplesB, samplesB + nslots))
+	 || !tmpl.same_as(other)) {
+		tmpl.clear();
+		return false;
+	}
+	return true;
+}
 
-		// We have a phone number.  It needs translation.
-		newport = strdup(global_relay_port.c_str());
-		newhost = strdup(global_relay.c_str());
-		convert_content_type(qmsg, global_relay_contenttype);
-		//qmsg->from_relay = true;
-	} else {
+void
+SMq::compile_sip_templates()
+{
+	static const int codes[] = {
+		100, 200, 202, 400, 401, 403, 404, 405, 413, 415, 416, 480, 484
+	};
+	static const char *requestA =
+		"MESSAGE sip:smqtoa@smqhosta.example SIP/2.0\r\n"
+		"Via: SIP/2.0/UDP smqviaa.example:5555;branch=z9hG4bKsmqa\r\n"
+		"From: smqfroma <sip:smqfroma@smqhosta.example>;tag=smqtaga\r\n"
+		"To: <sip:smqtoa@smqhosta.example>\r\n"
+		"Call-ID: smqcalla@smqhosta.example\r\n"
+		"CSeq: 7 MESSAGE\r\n"
+		"Content-Length: 0\r\n"
+		"\r\n";
+	static const char *requestB =
+		"MESSAGE sip:smqtobbbb@smqhostbbbb.example.net SIP/2.0\r\n"
+		"Via: SIP/2.0/UDP smqviabbbb.example.net:15555;branch=z9hG4bKsmqbbbbbbbb\r\n"
+		"Via: SIP/2.0/UDP smqviacccc.example.net:16666;branch=z9hG4bKsmqcccccccc\r\n"
+		"From: \"smq from\" <sip:smqfrombbbb@smqhostbbbb.example.net>;tag=smqtagbbbb\r\n"
+		"To: smqtobbbb <sip:smqtobbbb@smqhostbbbb.example.net>\r\n"
+		"Call-ID: smqcallbbbb\r\n"
+		"CSeq: 65535 MESSAGE\r\n"
+		"Content-Length: 0\r\n"
+		"\r\n";
+
+	ack_templates.clear();
+	message_template.clear();
+
+	short_msg reqA, reqB;
+	string valuesA[ACK_SLOTS], valuesB[ACK_SLOTS];
+	reqA.initialize(strlen(requestA), (char *) requestA, false);
+	reqB.initialize(strlen(requestB), (char *) requestB, false);
+	if (!reqA.parse() || !reqB.parse()
+	 || !ack_values(reqA.parsed, valuesA) || !ack_values(reqB.parsed, valuesB)) {
+		LOG(WARNING) << "Can't parse the sample requests; osip will make all responses";
+	} else {
+		for (size_t i = 0; i < sizeof(codes) / sizeof(codes[0]); i++) {
+			short_msg ackA, ackB;
+			osip_ack(codes[i], reqA.parsed, ackA);
+			osip_ack(codes[i], reqB.parsed, ackB);
+			SmqSipTemplate tmpl;
+			if (compile_checked(tmpl, ackA, valuesA, ackB, valuesB, ACK_SLOTS))
+				ack_templates[codes[i]] = tmpl;
+			else
+				LOG(WARNING) << "Can't make a template for " << codes[i]
+					<< " responses; osip will make them";
+		}
+	}
+
+	string msgA[MSG_SLOTS], msgB[MSG_SLOTS];
+	msgA[MSG_FROM] = "smqfroma";
+	msgA[MSG_TO] = "smqtoa";
+	msgA[MSG_HOST] = "smqhosta.example";
+	msgA[MSG_BTS_PORT] = "5555";
+	msgA[MSG_VIA_PORT] = "6666";
+	msgA[MSG_BRANCH] = "z9hG4bKsmqa";
+	msgA[MSG_CALL_ID] = "smqcalla";
+	msgA[MSG_CSEQ] = "88";
+	msgA[MSG_BODY] = "smqbodyaaaaaaaaaa";	// 17
+	msgA[MSG_LENGTH] = "17";
+	msgB[MSG_FROM] = "smqfrombbbb";
+	msgB[MSG_TO] = "smqtobbbb";
+	msgB[MSG_HOST] = "smqhostbbbb.example.net";
+	msgB[MSG_BTS_PORT] = "15555";
+	msgB[MSG_VIA_PORT] = "16666";
+	msgB[MSG_BRANCH] = "z9hG4bKsmqbbbbbbbb";
+	msgB[MSG_CALL_ID] = "smqcallbbbb";
+	msgB[MSG_CSEQ] = "65535";
+	msgB[MSG_BODY] = "smqbody" + string(4321 - 7, 'b');
+	msgB[MSG_LENGTH] = "4321";
+
+	short_msg protoA, protoB;
+	protoA.initialize(0, NULL, true);
+	protoB.initialize(0, NULL, true);
+	osip_message_init(&protoA.parsed);
+	osip_message_init(&protoB.parsed);
+	protoA.parsed_is_valid = protoB.parsed_is_valid = true;
+	osip_originate(protoA.parsed, msgA);
+	osip_originate(protoB.parsed, msgB);
+	protoA.parsed_was_changed();
+	protoB.parsed_was_changed();
+	protoA.make_text_valid();
+	protoB.make_text_valid();
+	if (!compile_checked(message_template, protoA, msgA, protoB, msgB, MSG_SLOTS))
+		LOG(WARNING) << "Can't make a template for MESSAGEs; osip will make them";
+
+	LOG(INFO) << "SIP templates for " << ack_templates.size() << " responses"
+		<< (message_template.ready() ? " and MESSAGEs" : "");
+}
+
+/*
+ * After we received a datagram, send a SIP response message
+ * telling the sender what we did with it.  (Unless the datagram we
+ * received was already a SIP response message...)
+ * svgfix return error on failure
+ * Called in writer thread
+ * Calls my_network.send_dgram
+ */
+void
+SMq::respond_sip_ack(int errcode, SMqueue::short_msg_pending *smp,
+		char *netaddr, size_t netaddrlen, std::string *sent)
+{
+	short_msg response;
+	const char *text;
+	size_t length;
+	bool okay;
+
+	LOG(DEBUG) << "Send SIP ACK message";
+
+	if (!smp->parse()) {
+		LOG(DEBUG) << "Short message parse failed";
+		return;		// Don't ack invalid SIP messages
+	}
+
+	LOG(DEBUG) << "Short message parse returned success";
+	if (MSG_IS_RESPONSE(smp->parsed)) {
+		LOG(DEBUG) << "Ignore response message";
+		return;		// Don't ack a response message, or we loop!
+	}
+
+	// Splice the request's headers into the response's template,
+	// if there is one; otherwise have osip build it.
+	std::map<int, SmqSipTemplate>::const_iterator tmpl = ack_templates.find(errcode);
+	string values[ACK_SLOTS];
+	if (tmpl != ack_templates.end() && ack_values(smp->parsed, values)) {
+		SmqSipBuffer &out = sip_buffer();
+		tmpl->second.expand(values, out);
+		text = out.data();
+		length = out.size();
+	} else {
+		osip_ack(errcode, smp->parsed, response);
+		if (!response.text) {
+			LOG(ERR) << "Can't make the " << errcode << " response";
+			return;
+		}
+		text = response.text;
+		length = response.text_length;
+	}
+	LOG(INFO) << "Responding with \"" << errcode << " " << ack_phrase(errcode) << "\".";
+
+	okay = my_network.send_dgram((char *) text, length, netaddr, netaddrlen);
+	if (!okay)
+		LOG(ERR) << "send_dgram had trouble sending the response err " << okay << " size " << length;
+	if (sent)
+		sent->assign(text, length);
+}
+
+//
+// The main loop that listens for incoming datagrams, handles them
+// through the queue, and moves them toward transmission.
+// Called by reader thread
+// Main job
+//
+enum sm_state
+SMq::lookup_uri_hostport (short_msg_p_list::iterator qmsg)
+{
+
+	qmsg->parse();
+
+	char *imsi = qmsg->parsed->req_uri->username;
+	char *p, *mycallnum;
+	char *newhost, *newport;
+	const char *myhost;
+	unsigned changed = 0;
+
+	if (!imsi) { LOG(ERR) << "No IMSI"; return NO_STATE; }
+
+	/* Username can be in various formats.  Check for formats that
+	   we know about.  Anything else we punt.  */
+	if (imsi[0] == '+' || (0 != strncmp("imsi", imsi, 4)
+			    && 0 != strncmp("IMSI", imsi, 4))) {
+		LOG(DEBUG) << "We have a number: " << imsi;
+
+		// We have a phone number.  It needs translation.
+		newport = strdup(global_relay_port.c_str());
+		newhost = strdup(global_relay.c_str());
+		convert_content_type(&*qmsg, global_relay_contenttype);
+		//qmsg->from_relay = true;
+	} else {
 		/* imsi is an IMSI at this point.  */
 		LOG(DEBUG) << "We have an IMSI: " << imsi;
 		newport = NULL;
-		newhost = my_hlr.getRegistrationIP (imsi);
+		if (!hlr_lookup(SmqLookup::REGISTRATION_IP, imsi, &*qmsg, newhost))
+			return ASKED_FOR_DESTINATION_SIPURL;
 	}
 
 	LOG(DEBUG) << "We are going to try to send to " << newhost << " on " << newport;
@@ -2317,7 +3977,7 @@ SMq::lookup_uri_hostport (short_msg_pending *qmsg)
 		p = (char *)osip_malloc (strlen(newhost)+1);
 		strcpy(p, newhost);
 		qmsg->parsed->req_uri->host = p;
-		qmsg->parsed_was_changed();
+		changed |= short_msg::REQUEST_URI_HOSTPORT;
 	}
 
 	if (qmsg->parsed->req_uri->port != newport)
@@ -2329,7 +3989,7 @@ SMq::lookup_uri_hostport (short_msg_pending *qmsg)
 			strcpy(p, newport);
 		}
 		qmsg->parsed->req_uri->port = p;
-		qmsg->parsed_was_changed();
+		changed |= short_msg::REQUEST_URI_HOSTPORT;
 	}
 
 	// We've altered the message, it's a new message, and it needs
@@ -2349,7 +4009,7 @@ SMq::lookup_uri_hostport (short_msg_pending *qmsg)
 			p = (char *)osip_malloc (strlen(myhost)+1);
 			strcpy(p, myhost);
 			osip_call_id_set_host (qmsg->parsed->call_id, p);
-			qmsg->parsed_was_changed();
+			changed |= short_msg::CALL_ID;
 		}
  	}
 
@@ -2359,11 +4019,15 @@ SMq::lookup_uri_hostport (short_msg_pending *qmsg)
 		p = (char *)osip_malloc (strlen(mycallnum)+1);
 		strcpy(p, mycallnum);
 		osip_call_id_set_number (qmsg->parsed->call_id, p);
-		qmsg->parsed_was_changed();
+		changed |= short_msg::CALL_ID;
 	}
 
+	// Patch just those into the text, rather than remaking all of it.
+	if (changed)
+		qmsg->parts_were_changed(changed);
+
 	// Now that we changed the Call-ID, we have to update the queue tag.
-	qmsg->set_qtag();
+	retag_message(qmsg);
 
 	// Both of these were dynamic storage; don't leak them.
 	// (They were allocated by malloc() so we free with free().
@@ -2377,346 +4041,942 @@ SMq::lookup_uri_hostport (short_msg_pending *qmsg)
 }
 
 /*
- * The main loop get datagram from the network an put them into the queue for processing
- *
+ * Is the request with transaction key txnkey one we've had before?
+ * If so, answer it again as we did the first time (if we have), and
+ * result is true.  Otherwise its transaction is started.
  */
-void SMq::main_loop(int msTMO)
+bool SMq::absorb_retransmission(const string &txnkey, char *addr, socklen_t addrlen)
+{
+	string response;
+
+	if (!server_txns.receive(txnkey, response))
+		return false;
+	LOG(INFO) << "Retransmitted request, transaction '" << txnkey << "'"
+		<< (response.empty() ? ", not answered yet" : ", answering again");
+	if (!response.empty())
+		my_network.send_dgram(&response[0], response.size(), addr, addrlen);
+	return true;
+}
+
+/*
+ * A response, seen only through view.  All we need from it is its
+ * status, and the qtag of the message it answers, which set_qtag makes
+ * from the CSeq number and From tag (the Call-ID too, with
+ * USE_CALL_ID_TAG).  Post those to the shard the message is on, which
+ * applies them as handle_response would have.  Result is false if the
+ * response lacks any of them; it's queued and parsed as before then,
+ * and that path decides what to make of it.
+ */
+bool SMq::take_response(const SmqSipView &view)
+{
+	SmqSipView::span cseq = view.header("CSeq");
+	SmqSipView::span fromtag = view.param(view.header("From", 'f'), "tag");
+	if (!cseq.found() || !fromtag.found() || !fromtag.len)
+		return false;
+
+	posted_response r;
+	string cseqstr = view.str(cseq);
+	r.qtag = cseqstr.substr(0, cseqstr.find_first_of(" \t"));
+	if (r.qtag.empty())
+		return false;
+	r.qtag += "--";
+#ifdef USE_CALL_ID_TAG
+	SmqSipView::span callid = view.header("Call-ID", 'i');
+	if (!callid.found() || !callid.len)
+		return false;
+	r.qtag += view.str(callid);
+	r.qtag += "--";
+#endif
+	r.qtag += view.str(fromtag);
+	r.status = view.status_code();
+	r.reason = view.str(view.reason_phrase());
+
+	int shard = shard_of_tag(r.qtag.c_str(), short_msg_pending::taghash_of(r.qtag.c_str()));
+	if (shard < 0) {
+		LOG(NOTICE) << "Couldn't find message for " << r.status
+			<< " response tag '" << r.qtag << "'";
+		__sync_fetch_and_add(&unmatched_responses, 1);
+		return true;	// Nothing to do; no big problem.
+	}
+	LOG(INFO) << "Got SMS " << r.status << " Response qtag '" << r.qtag << "'";
+	__sync_fetch_and_add(&early_responses, 1);
+	shards[shard]->post_response(r);
+	return true;
+}
+
+/*
+ * Take in one datagram from the network: ack it, and queue it if it's
+ * good.
+ */
+void SMq::handle_datagram(char *buffer, int len, char *addr, socklen_t addrlen)
 {
-	int len;	// MUST be signed -- not size_t!
-				// else we can't see -1 for errors...
-	int timeout;
 	short_msg_p_list *smpl;
 	short_msg_pending *smp;
-	char buffer[5000];
-	//short_msg_p_list::iterator qmsg;
-	//time_t now;
 	int errcode;
 
+	LOG(DEBUG) << "Got incoming datagram length " << len;
+	// We got a datagram.  Dump it into the queue, copying it.
+	//
+	// Here we do a bit of tricky memory allocation.  Rather
+	// than make a short_msg_pending and then have to COPY it
+	// into a short_msg_p_list (including malloc-ing all the
+	// possible pointed-to stuff and then freeing all the original
+	// strings and things), we make a short_msg_p_list
+	// and create in it a single default element.  Then we fill
+	// in that element as our new short_msg_pending.  This lets
+	// us (soon) link it into the main message queue list, 
+	// without ever copying it.
+	// 
+	// HOWEVER!  The implementation of std::list in GNU C++
+	// (ver. 4.3.3) has a bug: it does not PERMIT a class to be
+	// made into
+	// a list UNLESS it allows copy-construction of its instances.
+	// You get an extremely inscrutable error message deep
+	// in the templated bowels of stl_list.h , referencing
+	// the next non-comment line of this file.
+	// THUS, we can't check at compile time to prevent the
+	// making of copies of short_msg_pending's -- instead, we
+	// have to do that check at runtime (allowing the default
+	// newly-initialized one to be copied, but aborting with
+	// any depth of stuff in it).
+
+	// A request we've already seen is the sender retransmitting
+	// because it didn't hear our response.  Send that again, and
+	// go no further: it's already queued.  A quick look at the
+	// text is enough to tell, so we needn't copy or parse it.
+	string txnkey;
+	SmqSipView view;
+	bool viewed = view.scan(buffer, len);
+	if (viewed && view.is_request()) {
+		txnkey = view.transaction_key();
+		if (absorb_retransmission(txnkey, addr, addrlen))
+			return;
+	}
+
+	// A response only tells us what became of a message we sent;
+	// pass that on to the message without queueing the response.
+	if (viewed && !view.is_request() && take_response(view))
+		return;
+
+	smpl = new short_msg_p_list(1);
+	smp = &*smpl->begin();	// Here's our short_msg_pending!
+	smp->initialize (len, buffer, false);  // Just makes a copy
+	smp->ms_to_sc = true;
+	//LOG(DEBUG) << "Before insert new message smpl size " << smpl->size();
+
+	if (addrlen <= sizeof (smp->srcaddr)) {
+		smp->srcaddrlen = addrlen;
+		memcpy(smp->srcaddr, addr, addrlen);
+	}
+
+	// If the view couldn't make sense of it, see what osip thinks.
+	if (!viewed && smp->parse() && MSG_IS_REQUEST(smp->parsed)) {
+		txnkey = SmqServerTransactions::key_of(smp->parsed);
+		if (absorb_retransmission(txnkey, addr, addrlen)) {
+			delete smpl;
+			return;
+		}
+	}
+
+	errcode = smp->validate_short_msg(this, true);
+	if (errcode == 0) {
+		// Message good
+		if (MSG_IS_REQUEST(smp->parsed)) {
+			LOG(NOTICE) << "Got SMS rqst qtag '"
+			     << smp->qtag << "' from "
+			     << smp->parsed->from->url->username 
+			     << " for "
+			     << (smp->parsed->req_uri ? smp->parsed->req_uri->username : "");  // just shows smsc
+		} else {
+			LOG(INFO) << "Got SMS "
+			     << smp->parsed->status_code
+			     << " Response qtag '"
+			     << smp->qtag <<  " for "
+			     << (smp->parsed->req_uri ? smp->parsed->req_uri->username : "");  // Name that was sent to smqueue
+		}
+
+		// A handset that can send a MESSAGE can receive one;
+		// retry anything that was waiting for it.  (Do this
+		// before queueing, after which smp belongs to a
+		// shard's worker thread.)
+		if (MSG_IS_REQUEST(smp->parsed)
+		 && smp->parsed->sip_method
+		 && 0 == strcmp("MESSAGE", smp->parsed->sip_method)
+		 && smp->parsed->from && smp->parsed->from->url) {
+			release_messages_for(smp->parsed->from->url->username);
+		}
+
+// **********************************************************************
+// ****************** Insert a message in the queue *********************
+		// Ack it here, while smp is still ours: once it is
+		// queued a shard worker may change or delete it.
+		errcode = 202;
+		string sent;
+		respond_sip_ack(errcode, smp, smp->srcaddr, smp->srcaddrlen, &sent);
+		server_txns.respond(txnkey, sent);
+		note_first_ack();
+		insert_new_message(*smpl); // Reader thread main_loop
+	} else {
+		// Message is bad not inserted in queue
+		LOG(WARNING) << "Received bad message, error " << errcode;
+		// smpl is deleted below, so this can't wait for the writer thread either.
+		string sent;
+		respond_sip_ack(errcode, smp, smp->srcaddr, smp->srcaddrlen, &sent);
+		server_txns.respond(txnkey, sent);
+		// Don't log message data it's invalid and should not be accessed
+	}
+
+	// We won't leak memory if we didn't queue it up, since
+	// the delete of smpl will delete anything still
+	// in its list.
+	delete smpl;  // List entry that got added
+}
+
+/*
+ * The main loop get datagram from the network an put them into the queue for processing
+ *
+ */
+void SMq::main_loop(int msTMO)
+{
+	receive_on(my_network, msTMO);
+}
+
+/*
+ * Read a batch of datagrams from one of our sets of sockets, and take
+ * them in.  Run by the reader thread for my_network, and by a receiver
+ * thread for each of the others.
+ */
+void SMq::receive_on(SMnet &net, int msTMO)
+{
+	int count;
+
 	//LOG(DEBUG) << "Start SMq::main_loop (get SIP messages tmo:" << msTMO << ")";
 
 	// No message at this point
 	// READ
-	// Read an entry from the network
+	// Read a batch of datagrams from the network
 	// This could wait a very long time for a message
-	len = my_network.get_next_dgram((char *) buffer, (int) sizeof(buffer), msTMO);
+	count = net.recv_batch(msTMO);
 
-	if (len < 0) {
+	if (count < 0) {
 		// Error.
-		LOG(DEBUG) << "Error from get_next_dgram: " << strerror(errno);
+		LOG(DEBUG) << "Error from recv_batch: " << strerror(errno);
 		// Just continue...
 		return;
-	} else if (len == 0) {
+	} else if (count == 0) {
 		// Timeout.  Just push things along.
 		LOG(DEBUG) << "Timeout wait for datagram";
 		return;
-	} else {
-		LOG(DEBUG) << "Got incoming datagram length " << len;
-		// We got a datagram.  Dump it into the queue, copying it.
-		//
-		// Here we do a bit of tricky memory allocation.  Rather
-		// than make a short_msg_pending and then have to COPY it
-		// into a short_msg_p_list (including malloc-ing all the
-		// possible pointed-to stuff and then freeing all the original
-		// strings and things), we make a short_msg_p_list
-		// and create in it a single default element.  Then we fill
-		// in that element as our new short_msg_pending.  This lets
-		// us (soon) link it into the main message queue list, 
-		// without ever copying it.
-		// 
-		// HOWEVER!  The implementation of std::list in GNU C++
-		// (ver. 4.3.3) has a bug: it does not PERMIT a class to be
-		// made into
-		// a list UNLESS it allows copy-construction of its instances.
-		// You get an extremely inscrutable error message deep
-		// in the templated bowels of stl_list.h , referencing
-		// the next non-comment line of this file.
-		// THUS, we can't check at compile time to prevent the
-		// making of copies of short_msg_pending's -- instead, we
-		// have to do that check at runtime (allowing the default
-		// newly-initialized one to be copied, but aborting with
-		// any depth of stuff in it).
-
-		smpl = new short_msg_p_list(1);
-		smp = &*smpl->begin();	// Here's our short_msg_pending!
-		smp->initialize (len, buffer, false);  // Just makes a copy
-		smp->ms_to_sc = true;
-		//LOG(DEBUG) << "Before insert new message smpl size " << smpl->size();
-
-		if (my_network.recvaddrlen <= sizeof (smp->srcaddr)) {
-			smp->srcaddrlen = my_network.recvaddrlen;
-			memcpy(smp->srcaddr, my_network.src_addr, 
-			       my_network.recvaddrlen);
-		}
-
-		errcode = smp->validate_short_msg(this, true);
-		if (errcode == 0) {
-			// Message good
-			if (MSG_IS_REQUEST(smp->parsed)) {
-				LOG(NOTICE) << "Got SMS rqst qtag '"
-				     << smp->qtag << "' from "
-				     << smp->parsed->from->url->username 
-				     << " for "
-				     << (smp->parsed->req_uri ? smp->parsed->req_uri->username : "");  // just shows smsc
-			} else {
-				LOG(INFO) << "Got SMS "
-				     << smp->parsed->status_code
-				     << " Response qtag '"
-				     << smp->qtag <<  " for "
-				     << (smp->parsed->req_uri ? smp->parsed->req_uri->username : "");  // Name that was sent to smqueue
-			}
-
-// **********************************************************************
-// ****************** Insert a message in the queue *********************
-			insert_new_message(*smpl); // Reader thread main_loop
-			errcode = 202;
-			// It's OK to reference "smp" here, whether it's in the
-			// smpl list, or has been moved into the main time_sorted_list.
-			queue_respond_sip_ack(errcode, smp, smp->srcaddr, smp->srcaddrlen); // Send respond_sip_ack message to writer thread
-		} else {
-			// Message is bad not inserted in queue
-			LOG(WARNING) << "Received bad message, error " << errcode;
-			queue_respond_sip_ack(errcode, smp, smp->srcaddr, smp->srcaddrlen); // SVG This might need to be removed for failed messages  Investigate
-			// Don't log message data it's invalid and should not be accessed
-		}
-
-		// We won't leak memory if we didn't queue it up, since
-		// the delete of smpl will delete anything still
-		// in its list.
-		delete smpl;  // List entry that got added
-	} // got datagram
+	}
 
-} // SMq::main_loop
+	// The acks for the whole batch go out together.
+	my_network.begin_sends();
+	for (int i = 0; i < count; i++) {
+		SMnet::dgram *d = &net.rx[i];
+		handle_datagram(d->data, d->len, (char *) &d->addr, d->addrlen);
+	}
+	// Hold the 202s till what they acknowledge is on disk; one wait
+	// for the whole batch.  If it didn't get there, send none, and
+	// let the senders try again.
+	if (journal_acks && journal.is_open()
+	    && !journal.wait_durable(SmqJournal::last_appended())) {
+		LOG(ERR) << "Journal write failed; withholding acks for " << count << " datagrams";
+		my_network.discard_sends();
+	}
+	my_network.flush_sends();
+} // SMq::receive_on
 
 
 /* Debug dump of SMq and mainly the queue. */
 void SMq::debug_dump() {
 
-	time_t now = msgettime();
-	LOG(DEBUG) << "Dump message queue";
-	lockSortedList();
-	short_msg_p_list::iterator x = time_sorted_list.begin();
-	for (; x != time_sorted_list.end(); ++x) {
-		x->make_text_valid();
-		LOG(DEBUG) << "=== State: " << sm_state_string(x->state) << "\t"
-		     << (x->next_action_time - now) << endl << "MSG = "
-		     << x->text;
+	SmqSnapshot snap;
+	snapshot(snap, true);
+	LOG(DEBUG) << "Dump message queue, snapshot " << snap.epoch;
+	std::string spilled;
+	for (size_t i = 0; i < snap.size(); i++) {
+		const SmqSnapshot::entry &e = snap.at(i);
+		size_t length;
+		const char *text = snap.text(e, spilled, length);
+		LOG(DEBUG) << "=== Shard " << e.shard << " State: " << sm_state_string((sm_state) e.state) << "\t"
+		     << (e.next_action_time - snap.taken) << endl << "MSG = "
+		     << (text ? text : "");
+	}
+}
+
+/*
+ * Copy the queue, one shard at a time.  New messages go on the front
+ * of their shard's list, so each shard is copied back to front, to
+ * get them oldest first.
+ */
+void SMq::snapshot(SmqSnapshot &snap, bool withText)
+{
+	snap.clear();
+	snap.epoch = __sync_add_and_fetch(&snapshot_epoch, 1);
+	snap.taken = msgettime();
+	for (size_t i = 0; i < shards.size(); i++) {
+	    SmqShard *sh = shards[i];
+	    sh->lock();
+	    short_msg_p_list::reverse_iterator x = sh->message_list.rbegin();
+	    for (; x != sh->message_list.rend(); ++x) {
+		SmqSnapshot::entry e;
+		memset(&e, 0, sizeof(e));
+		e.journal_id = x->journal_id;
+		e.qtaghash = x->qtaghash;
+		e.next_action_time = x->next_action_time;
+		e.state = x->state;
+		e.shard = x->shard;
+		e.ms_to_sc = x->ms_to_sc;
+		e.need_repack = x->need_repack;
+		e.response = x->parsed_is_valid && MSG_IS_RESPONSE(x->parsed);
+		e.unvalidated = x->unvalidated;
+		e.srcaddrlen = x->srcaddrlen <= sizeof(e.srcaddr) ? x->srcaddrlen : 0;
+		memcpy(e.srcaddr, x->srcaddr, e.srcaddrlen);
+		if (withText && x->spill_key) {
+			// Leave it spilled; the snapshot reads it from there.
+			if (!snap.add_spilled(e, &spill, x->spill_key, x->qtag, x->dest_imsi))
+				LOG(ERR) << "Spilled text of " << x->qtag << " is gone";
+			continue;
+		}
+		if (withText)
+			x->make_text_valid();
+		snap.add(e, withText ? x->text : NULL, x->text_length,
+			 x->qtag, x->dest_imsi);
+	    }
+	    sh->unlock();
 	}
-	unlockSortedList();
 }
 
 
 /*
  * Save queue to file.
  * 
- * We save in reverse timestamp order, to make it very fast to insert when
- * re-read.
+ * What's saved is a snapshot, so no shard is locked while the file is
+ * written; it's written beside qfile and renamed over it, so a crash
+ * leaves the old one.
  */
 bool
-SMq::save_queue_to_file(std::string qfile)
+SMq::save_queue_to_file(std::string qfile, unsigned journalSegment)
 {
 	ofstream ofile;
 	unsigned howmany = 0;
+	std::string tmpfile = qfile + ".tmp";
 	LOG(DEBUG) << "save_queue_to_file:" << qfile;
 
-	ofile.open(qfile.c_str(), ios::out | ios::binary | ios::trunc);
+	SmqSnapshot snap;
+	snapshot(snap, true);
+	if (binary_checkpoint)
+		return save_binary(snap, qfile, journalSegment);
+
+	ofile.open(tmpfile.c_str(), ios::out | ios::binary | ios::trunc);
 	if (!ofile.is_open())
 		return false;
 
-	lockSortedList(); // Lock file during the write.  Check the time on this.
 	// Example of what should be in the file
-	// === 10 -506057005 127.0.0.1:5062 640 0 0
-	// === state  next_action_time  network_address  length  ms_to_sc  need_repack  message_text
-
-	short_msg_p_list::reverse_iterator x = time_sorted_list.rbegin();
-	for (; x != time_sorted_list.rend(); ++x) {
-		x->make_text_valid();
+	// # journal 12
+	// === 10 1414141414141 127.0.0.1:5062 640 0 0 1234
+	// === state  next_action_time  network_address  length  ms_to_sc  need_repack  journal_id  message_text
+	if (journalSegment)
+		ofile << "# journal " << journalSegment << endl;
+
+	bool result = true;
+	std::string spilled;
+	for (size_t i = 0; i < snap.size() && result; i++) {
+		const SmqSnapshot::entry &e = snap.at(i);
+		size_t length;
+		const char *text = snap.text(e, spilled, length);
+		if (!text) {
+			// A spilled message we can't read back would be lost
+			// once the journal is dropped.
+			result = !e.spilled;
+			continue;
+		}
 		ofile << "=== "
-			<< (int) x->state << " "
-		      << x->next_action_time << " "
-		      << my_network.string_addr((struct sockaddr *)x->srcaddr, x->srcaddrlen, true) << " "
-		      << strlen(x->text) << " "
-		      << x->ms_to_sc << " "
-		      << x->need_repack << endl
-		      << x->text << endl << endl;
+			<< e.state << " "
+		      << e.next_action_time << " "
+		      << my_network.string_addr((struct sockaddr *)e.srcaddr, e.srcaddrlen, true) << " "
+		      << length << " "
+		      << e.ms_to_sc << " "
+		      << e.need_repack << " "
+		      << e.journal_id << endl
+		      << text << endl << endl;
 		howmany++;
-		LOG(DEBUG) << "Write entry:" << howmany << " Len:" << strlen(x->text) << " MSG:" << x->text;
+		LOG(DEBUG) << "Write entry:" << howmany << " Len:" << strlen(text) << " MSG:" << text;
 	}
-	unlockSortedList();
 
-	bool result = !ofile.fail();
+	ofile.flush();
+	result = result && !ofile.fail();
 	ofile.close();
 	if (result) {
-		LOG(INFO) << "Saved " << howmany << " queued messages to " << qfile;
+		int fd = open(tmpfile.c_str(), O_RDONLY);
+		result = fd >= 0 && fsync(fd) == 0;
+		if (fd >= 0)
+			close(fd);
+	}
+	if (result)
+		result = rename(tmpfile.c_str(), qfile.c_str()) == 0
+			&& SmqCheckpoint::sync_dir(qfile);
+	if (result) {
+		LOG(INFO) << "Saved " << howmany << " queued messages to " << qfile
+			<< " from snapshot " << snap.epoch;
 	} else {
 		LOG(ERR) << "FAILED to save " << howmany << " queued messages to " << qfile;
+		unlink(tmpfile.c_str());
 	}
 	return result;
 } //save_queue_to_file
 
 
 /*
- * Read a new queue from file.
+ * Save a snapshot of the queue in the binary format; see SmqCheckpoint.h.
  */
 bool
-SMq::read_queue_from_file(std::string qfile)
+SMq::save_binary(const SmqSnapshot &snap, const std::string &qfile, unsigned journalSegment)
 {
-	ifstream ifile;
-	std::string equals;
-	unsigned astate, atime, alength;
-	unsigned ms_to_sc, need_repack;
-	std::string short_code;
-	std::string netaddrstr;
-	sm_state mystate;
-	time_t mytime;
-	char *msgtext;
-	unsigned howmany = 0, howmanyerrs = 0;
-	char ignoreme;
-	short_msg_p_list *smpl;
-	short_msg_pending *smp;
-	int errcode;
-	LOG(DEBUG) << "read_queue_from_file:" << qfile;
+	SmqCheckpoint out;
+	unsigned howmany = 0;
 
-	ifile.open(qfile.c_str(), ios::in | ios::binary);
-	if (!ifile.is_open())
+	if (!out.begin(qfile, journalSegment, shards.size()))
 		return false;
-
-	// === state  next_action_time  network_address  length  ms_to_sc  need_repack  message_text	// === state   next_action_time   network_address    length message_text  ms_to_sc    need_repack
-	while (!ifile.eof()) {
-		ifile >> equals >> astate >> atime;
-		if ((equals != "===") || (ifile.eof())) {  // === is the beginning of a record
-			LOG(DEBUG) << "End of smqueue file";
-			break;  // End of file
-		}
-		// LOG(DEBUG) << "Get next entry";
-		ifile >> netaddrstr;
-		ifile >> alength;
-		ifile >> ms_to_sc;
-		ifile >> need_repack;
-		//LOG(DEBUG) << "netaddrstr=" << netaddrstr << " length=" << alength << " ms_to_sc="
-		//		<< ms_to_sc << " need_repack=" << need_repack;
-
-		while (ifile.peek() == '\n')
-			ignoreme = ifile.get();  // Skip over blank lines
-		msgtext = new char[alength+2];
-		// Get alength chars (or until null char, hope there are none)
-		ifile.get(msgtext, alength+1, '\0');  // read the next record
-		while (ifile.peek() == '\n')
-			ignoreme = ifile.get();  // Skip blanks
-		howmany++;
-		mystate = (SMqueue::sm_state)astate;
-		mytime = atime;
-		
-		smpl = new short_msg_p_list (1);
-		smp = &*smpl->begin();	// Here's our short_msg_pending!
-		smp->initialize (alength, msgtext, true);
-		// We use the just-allocated msgtext; it gets freed after
-		// delivery of message.
-
-		// Restore saved state
-		smp->ms_to_sc = ms_to_sc;
-		smp->need_repack = need_repack;
-
-		smp->srcaddrlen = 0;
-		if (!my_network.parse_addr(netaddrstr.c_str(), smp->srcaddr, sizeof(smp->srcaddr), &smp->srcaddrlen)) {
-			LOG(DEBUG) << "Parse Network address failed";
+	bool ok = true;
+	std::string spilled;		// One spilled text at a time
+	for (size_t i = 0; i < snap.size() && ok; i++) {
+		const SmqSnapshot::entry &s = snap.at(i);
+		// Responses aren't read back from a save file.
+		if (s.response)
+			continue;
+		size_t length;
+		const char *text = snap.text(s, spilled, length);
+		if (!text) {
+			// A spilled message we can't read back would be lost
+			// once the journal is dropped.
+			ok = !s.spilled;
 			continue;
 		}
-		errcode = smp->validate_short_msg(this, false);
-		if (errcode == 0) {
-			if (MSG_IS_REQUEST(smp->parsed)) {
-				LOG(INFO) << "Read SMS '"
-				     << smp->qtag << "' from "
-				     << smp->parsed->from->url->username 
-				     << " for "
-				     << smp->parsed->req_uri->username
-					  << " direction=" << (smp->ms_to_sc?"MS->SC":"SC->MS")
-					  << " need_repack=" << (smp->need_repack?"true":"false");
-				// Fixed error where invalid messages were getting put in the queue
-				insert_new_message (*smpl, mystate, mytime); // In read_queue_from_file
-			} else {
-				LOG(DEBUG) << "Read bad SMS "
-				     << smp->parsed->status_code
-				     << " Response '"
-				     << smp->qtag << "':" << msgtext;
-				howmanyerrs++;
-			}
-		} else {
-			LOG(WARNING) << "Received bad message, error " << errcode;
-			// Don't log message data it's invalid and should not be accessed
-			howmanyerrs++;
-			// Continue to next message
-		}
-		delete smpl;
-	}  // Message loop
-	LOG(INFO) << "=== Read " << howmany << " messages total, " << howmanyerrs
-	     << " bad ones.";
-
-	// If errors clear file so we don't process again if a restart happens because the file is bad
-	if (howmanyerrs != 0) ifile.clear();
-
-	ifile.close();
+		SmqCheckpoint::entry e;
+		memset(&e, 0, sizeof(e));
+		e.journal_id = s.journal_id;
+		e.qtaghash = s.qtaghash;
+		e.next_action_time = s.next_action_time;
+		e.text_length = length;
+		e.state = s.state;
+		e.shard = s.shard;
+		e.flags = (s.ms_to_sc ? SmqCheckpoint::MS_TO_SC : 0)
+			| (s.need_repack ? SmqCheckpoint::NEED_REPACK : 0);
+		e.srcaddrlen = s.srcaddrlen;
+		memcpy(e.srcaddr, s.srcaddr, e.srcaddrlen);
+		ok = out.add(e, text, snap.qtag(s), snap.imsi(s));
+		howmany++;
+	}
+	if (ok)
+		ok = out.finish();
+	if (ok) {
+		LOG(INFO) << "Saved " << howmany << " queued messages to " << qfile
+			<< " from snapshot " << snap.epoch;
+	} else {
+		LOG(ERR) << "FAILED to save " << howmany << " queued messages to " << qfile;
+	}
+	return ok;
+}
 
-	return true;
-} // read_queue_from_file
+/*
+ * Make a message from a binary save file without parsing it: its
+ * shard, qtag and destination come from the index.  It's parsed and
+ * validated when it comes due, by validate_restored().
+ */
+short_msg_p_list *
+SMq::prepare_saved(const SmqCheckpoint &saved, const SmqCheckpoint::entry &e)
+{
+	if (!saved.intact(e)) {
+		LOG(ERR) << "Saved message " << e.journal_id << " is damaged";
+		return NULL;
+	}
 
+	short_msg_p_list *smpl = new short_msg_p_list (1);
+	short_msg_pending *smp = &*smpl->begin();	// Here's our short_msg_pending!
+
+	char *msgtext = new char[e.text_length + 1];
+	memcpy(msgtext, saved.bytes(e.text_offset), e.text_length);
+	msgtext[e.text_length] = '\0';
+	smp->initialize (e.text_length, msgtext, true);
+
+	smp->ms_to_sc = e.flags & SmqCheckpoint::MS_TO_SC;
+	smp->need_repack = e.flags & SmqCheckpoint::NEED_REPACK;
+	smp->journal_id = e.journal_id;
+	smp->srcaddrlen = e.srcaddrlen;
+	memcpy(smp->srcaddr, e.srcaddr, e.srcaddrlen);
+	smp->set_state((SMqueue::sm_state) e.state, e.next_action_time);
+	if (e.qtag_length) {
+		smp->qtag = new char[e.qtag_length + 1];
+		memcpy(smp->qtag, saved.bytes(e.qtag_offset), e.qtag_length);
+		smp->qtag[e.qtag_length] = '\0';
+		smp->qtaghash = e.qtaghash;
+	}
+	smp->unvalidated = true;
+	// If there are more or fewer shards now, queue_saved has to
+	// parse it to find one; do that here, off the merge.
+	if (saved.shards() != shards.size())
+		smp->parse();
+	return smpl;
+}
 
-/* Print net addr in hex.  Returns a static buffer.  */
-char *
-netaddr_fmt(char *srcaddr, unsigned len)
+void
+SMq::queue_saved(short_msg_p_list &smpl, const SmqCheckpoint &saved,
+		 const SmqCheckpoint::entry &e)
 {
-	static char buffer[999];
-	char *bufp = buffer;
+	short_msg_pending *smp = &*smpl.begin();
 
-	buffer[0] = 0;
-	*bufp++ = '=';
-	while (len > 0) {
-		snprintf(bufp, 3, "%02x", *(unsigned char *)srcaddr);
-		bufp+= 2;
-		len--;
+	// The same shard as before, unless there are more or fewer now.
+	if (saved.shards() == shards.size() && e.shard >= 0 && e.shard < (int) shards.size())
+		smp->shard = e.shard;
+	else
+		smp->shard = shard_for(smp);
+
+	SmqShard *sh = shards[smp->shard];
+	sh->lock();
+	sh->message_list.splice (sh->message_list.begin(), smpl);
+	short_msg_p_list::iterator sm = sh->message_list.begin();
+	sh->adopt(sm);
+	sh->scheduler->insert(sm);
+	index_qtag(sm);
+	if (e.imsi_length) {
+		std::string digits(saved.bytes(e.imsi_offset), e.imsi_length);
+		sm->dest_imsi = new_strdup(digits.c_str());
+		sh->imsi_index.insert(imsi_index_map::value_type(digits, sm));
 	}
-	return buffer;
+	sh->unlock();
+	sh->wake();
 }
 
-
-/* Parse a string of hex into a net address and length */
 bool
-netaddr_parse(const char *str, char *addr, unsigned int *len)
+SMq::validate_restored(short_msg_p_list::iterator sm)
 {
-	if (str[0] != '=')
+	sm->unvalidated = false;
+	// validate_short_msg remakes the qtag.
+	unindex_qtag(sm);
+	int errcode = sm->validate_short_msg(this, false);
+	index_qtag(sm);
+	if (errcode != 0) {
+		LOG(WARNING) << "Saved message is bad, error " << errcode;
 		return false;
-	str++;
-	int xlen = strlen(str);
-	int retlen = xlen/2;
-	if (xlen != retlen*2)
+	}
+	if (!MSG_IS_REQUEST(sm->parsed)) {
+		LOG(DEBUG) << "Saved message is a response: " << sm->text;
 		return false;
-	*len = retlen;
-	char *myaddr = addr;
-	const char *strp = str;
-	while (retlen > 0) {
-		char blah[3];
-		unsigned int mybyte;
-		blah[0] = strp[0]; blah[1] = strp[1]; blah[2] = '\0';
-		sscanf(blah, "%x", &mybyte);
-		*myaddr++ = mybyte;
-		strp+= 2;
-		retlen--;
 	}
 	return true;
 }
 
-
-
-#if 0
 /*
- * Read in a message from a file.  Return malloc'd char block of the whole
- * thing.
+ * Read the messages in a text save file, in order.
  */
-char *
-read_msg_text_from_file(char *fname, size_t *lptr)
+static bool
+read_text_save_file(const std::string &qfile, std::vector<SmqJournal::record> &records,
+		    unsigned &firstSegment)
 {
-	ifstream ifs;
-	size_t length, got;
-	char *mess;
+	ifstream ifile;
+	std::string line;
+	char ignoreme;
+
+	ifile.open(qfile.c_str(), ios::in | ios::binary);
+	if (!ifile.is_open())
+		return false;
+
+	// === state  next_action_time  network_address  length  ms_to_sc  need_repack  [journal_id]  message_text
+	while (getline(ifile, line)) {
+		if (line.empty())
+			continue;
+		if (line[0] == '#') {
+			istringstream comment(line);
+			std::string hash, word;
+			comment >> hash >> word;
+			if (word == "journal")
+				comment >> firstSegment;
+			continue;
+		}
+		istringstream header(line);
+		std::string equals;
+		int astate;
+		long long atime;
+		unsigned alength, ms_to_sc, need_repack;
+		SmqJournal::record r;
+		header >> equals >> astate >> atime >> r.addr >> alength >> ms_to_sc >> need_repack;
+		if (equals != "===" || header.fail()) {  // === is the beginning of a record
+			LOG(DEBUG) << "End of smqueue file";
+			break;
+		}
+		if (!(header >> r.id))
+			r.id = 0;
+		r.state = astate;
+		r.next_action_time = atime;
+		r.ms_to_sc = ms_to_sc;
+		r.need_repack = need_repack;
+
+		while (ifile.peek() == '\n')
+			ignoreme = ifile.get();  // Skip over blank lines
+		// Get alength chars (or until null char, hope there are none)
+		std::vector<char> msgtext(alength + 2);
+		ifile.get(&msgtext[0], alength+1, '\0');  // read the next record
+		r.text.assign(&msgtext[0], ifile.gcount());
+		while (ifile.peek() == '\n')
+			ignoreme = ifile.get();  // Skip blanks
+		records.push_back(r);
+	}
+	ifile.close();
+	return true;
+}
+
+/*
+ * Read the messages in a saved queue file, of either format, into
+ * msgs by journal id.  Files from before the journal have no ids;
+ * their messages get ids above any in msgs, in the order they're
+ * read.  A binary file is left mapped in saved, and only the ids go
+ * in msgs.
+ */
+bool
+SMq::read_checkpoint(const std::string &qfile, SmqJournal::record_map &msgs,
+		     unsigned &firstSegment, SmqCheckpoint &saved)
+{
+	std::vector<SmqJournal::record> records;
+
+	firstSegment = 0;
+	if (SmqCheckpoint::is_binary(qfile)) {
+		// Just the ids; the rest stays in the file till it's needed.
+		if (!saved.open(qfile))
+			return false;
+		firstSegment = saved.journal_segment();
+		records.resize(saved.size());
+		for (size_t i = 0; i < saved.size(); i++) {
+			records[i].id = saved.at(i).journal_id;
+			records[i].saved = i;
+		}
+	} else if (!read_text_save_file(qfile, records, firstSegment))
+		return false;
+
+	uint64_t id = 1;
+	for (size_t i = 0; i < records.size(); i++) {
+		if (records[i].id >= id)
+			id = records[i].id + 1;
+	}
+	for (size_t i = 0; i < records.size(); i++) {
+		if (!records[i].id)
+			records[i].id = id++;
+		msgs[records[i].id] = records[i];
+	}
+	return true;
+}
+
+/*
+ * Make a message read back from a text save file or the journal, if
+ * it's still good.  Runs on a recovery worker, so it touches nothing
+ * but the message.
+ */
+short_msg_p_list *
+SMq::prepare_message(const SmqJournal::record &r)
+{
+	short_msg_p_list *smpl;
+	short_msg_pending *smp;
+	int errcode;
+
+	char *msgtext = new char[r.text.size() + 1];
+	memcpy(msgtext, r.text.data(), r.text.size());
+	msgtext[r.text.size()] = '\0';
+
+	smpl = new short_msg_p_list (1);
+	smp = &*smpl->begin();	// Here's our short_msg_pending!
+	smp->initialize (r.text.size(), msgtext, true);
+	// We use the just-allocated msgtext; it gets freed after
+	// delivery of message.
+
+	// Restore saved state
+	smp->ms_to_sc = r.ms_to_sc;
+	smp->need_repack = r.need_repack;
+	smp->journal_id = r.id;
+
+	smp->srcaddrlen = 0;
+	if (!my_network.parse_addr(r.addr.c_str(), smp->srcaddr, sizeof(smp->srcaddr), &smp->srcaddrlen)) {
+		LOG(DEBUG) << "Parse Network address failed";
+		delete smpl;
+		return NULL;
+	}
+	errcode = smp->validate_short_msg(this, false);
+	if (errcode == 0) {
+		if (MSG_IS_REQUEST(smp->parsed)) {
+			LOG(INFO) << "Read SMS '"
+			     << smp->qtag << "' from "
+			     << smp->parsed->from->url->username 
+			     << " for "
+			     << smp->parsed->req_uri->username
+				  << " direction=" << (smp->ms_to_sc?"MS->SC":"SC->MS")
+				  << " need_repack=" << (smp->need_repack?"true":"false");
+			// Fixed error where invalid messages were getting put in the queue
+			return smpl;
+		} else {
+			LOG(DEBUG) << "Read bad SMS "
+			     << smp->parsed->status_code
+			     << " Response '"
+			     << smp->qtag << "':" << msgtext;
+		}
+	} else {
+		LOG(WARNING) << "Received bad message, error " << errcode;
+		// Don't log message data it's invalid and should not be accessed
+		// Continue to next message
+	}
+	delete smpl;
+	return NULL;
+}
+
+/*
+ * Queue a message from prepare_message.  Like insert_new_message, but
+ * it isn't journaled again: it's in the journal or the save file
+ * already, under its id.
+ */
+void
+SMq::queue_restored(short_msg_p_list &smpl, const SmqJournal::record &r)
+{
+	short_msg_pending *smp = &*smpl.begin();
+
+	smp->set_state((SMqueue::sm_state) r.state, r.next_action_time);
+	SmqShard *sh = shards[shard_for(smp)];
+	smp->shard = sh->number;
+	sh->lock();
+	sh->message_list.splice (sh->message_list.begin(), smpl);
+	index_new_message(sh, sh->message_list.begin());
+	sh->unlock();
+	sh->wake();
+}
+
+/*
+ * Read a new queue from file, and replay the journal written since,
+ * into recovery.records.
+ */
+bool
+SMq::read_queue_from_file(std::string qfile)
+{
+	SmqJournal::record_map msgs;
+	unsigned firstSegment = 0;
+	LOG(DEBUG) << "read_queue_from_file:" << qfile;
+
+	bool found = read_checkpoint(qfile, msgs, firstSegment, recovery.saved);
+	recovery.fromFile = msgs.size();
+	uint64_t maxId = SmqJournal::replay(qfile, firstSegment, msgs);
+	if (!msgs.empty() && msgs.rbegin()->first > maxId)
+		maxId = msgs.rbegin()->first;
+	// New messages are numbered after these.
+	journal_next_id = maxId + 1;
+	if (!found && msgs.empty())
+		return false;
+
+	recovery.records.reserve(msgs.size());
+	for (SmqJournal::record_map::iterator x = msgs.begin(); x != msgs.end(); ++x)
+		recovery.records.push_back(x->second);
+	return true;
+} // read_queue_from_file
+
+static void *
+run_recovery(void *)
+{
+	smq.recover_queue();
+	SmqArena::drop_spares();
+	return NULL;
+}
+
+static void *
+run_recovery_worker(void *)
+{
+	smq.recovery_worker();
+	SmqArena::drop_spares();
+	return NULL;
+}
+
+void
+SMq::start_recovery(int nthreads)
+{
+	recovery.threads = nthreads < 1 ? 1 : nthreads;
+	recovery.running = true;
+	if (pthread_create(&recovery.thread, NULL, run_recovery, NULL) == 0) {
+		recovery.joinable = true;
+	} else {
+		LOG(ERR) << "Can't start the recovery thread; recovering the queue here";
+		recover_queue();
+	}
+}
+
+void
+SMq::finish_recovery()
+{
+	if (recovery.joinable) {
+		pthread_join(recovery.thread, NULL);
+		recovery.joinable = false;
+	}
+}
+
+/*
+ * Make the records from recovery.next on, a chunk at a time, till
+ * there are no more.
+ */
+void
+SMq::recovery_worker()
+{
+	const size_t CHUNK = 256;
+	size_t n = recovery.records.size();
+
+	for (;;) {
+		size_t first = __sync_fetch_and_add(&recovery.next, CHUNK);
+		if (first >= n)
+			break;
+		size_t last = first + CHUNK < n ? first + CHUNK : n;
+		for (size_t i = first; i < last; i++) {
+			const SmqJournal::record &r = recovery.records[i];
+			if (r.saved < 0) {
+				recovery.ready[i] = prepare_message(r);
+				continue;
+			}
+			short_msg_p_list *smpl = prepare_saved(recovery.saved, recovery.saved.at(r.saved));
+			// The journal may have moved it on since it was saved.
+			if (smpl && r.restated)
+				smpl->begin()->set_state((sm_state) r.state, r.next_action_time);
+			recovery.ready[i] = smpl;
+		}
+		// One that was out for delivery when we stopped needs a new
+		// transaction the next time.
+		for (size_t i = first; i < last; i++) {
+			short_msg_pending *smp = recovery.ready[i] ? &*recovery.ready[i]->begin() : NULL;
+			if (smp && (smp->state == ASKED_FOR_MSG_DELIVERY
+				 || smp->state == AWAITING_TRY_MSG_DELIVERY))
+				smp->deliveries = 1;
+		}
+	}
+}
+
+void
+SMq::recover_queue()
+{
+	size_t howmany = recovery.records.size();
+	size_t howmanyerrs = 0;
+	time_t start = msgettime();
+
+	// Make them all on the worker pool...
+	recovery.ready.assign(howmany, NULL);
+	recovery.next = 0;
+	std::vector<pthread_t> workers;
+	for (int i = 1; i < recovery.threads; i++) {
+		pthread_t t;
+		if (pthread_create(&t, NULL, run_recovery_worker, NULL) == 0)
+			workers.push_back(t);
+	}
+	recovery_worker();	// Which this thread joins
+	for (size_t i = 0; i < workers.size(); i++)
+		pthread_join(workers[i], NULL);
+	time_t made = msgettime();
+
+	// ...then queue them here, in order.
+	for (size_t i = 0; i < howmany; i++) {
+		const SmqJournal::record &r = recovery.records[i];
+		short_msg_p_list *smpl = recovery.ready[i];
+		if (!smpl)
+			howmanyerrs++;
+		else if (r.saved >= 0)
+			queue_saved(*smpl, recovery.saved, recovery.saved.at(r.saved));
+		else
+			queue_restored(*smpl, r);
+		delete smpl;
+	}
+	time_t merged = msgettime();
+
+	LOG(INFO) << "=== Read " << howmany << " messages total (" << recovery.fromFile
+	     << " from " << savefile << ", then the journal), " << howmanyerrs
+	     << " bad ones.";
+	time_t took = merged - recovery.started;
+	LOG(NOTICE) << "Recovered " << howmany << " messages in " << took << " ms ("
+		<< (took > 0 ? howmany * 1000 / took : howmany) << " per second): read in "
+		<< (start - recovery.started) << " ms, made on " << workers.size() + 1
+		<< " threads in " << (made - start) << " ms, queued in " << (merged - made) << " ms";
+
+	std::vector<SmqJournal::record>().swap(recovery.records);
+	std::vector<short_msg_p_list *>().swap(recovery.ready);
+	recovery.saved.close();
+
+	// Now the queue has them all, it can be saved; the writer
+	// thread doesn't save it till we're done.
+	if (!checkpoint_queue())
+		LOG(WARNING) << "Failed to save queue to file " << savefile;
+	if (!journal.is_open())
+		SmqJournal::drop_before(savefile, UINT_MAX);	// Replayed and saved
+	__sync_synchronize();
+	recovery.running = false;
+}
+
+/* A 202 has gone out; say how long after startup, the first time. */
+void
+SMq::note_first_ack()
+{
+	if (first_ack)
+		return;
+	time_t now = msgettime();
+	if (__sync_bool_compare_and_swap(&first_ack, 0, now))
+		LOG(NOTICE) << "First message acknowledged " << (now - recovery.started)
+			<< " ms after startup" << (recovery.running ? ", while recovering the queue" : "");
+}
+
+
+/* Print net addr in hex.  Returns a static buffer.  */
+char *
+netaddr_fmt(char *srcaddr, unsigned len)
+{
+	static char buffer[999];
+	char *bufp = buffer;
+
+	buffer[0] = 0;
+	*bufp++ = '=';
+	while (len > 0) {
+		snprintf(bufp, 3, "%02x", *(unsigned char *)srcaddr);
+		bufp+= 2;
+		len--;
+	}
+	return buffer;
+}
+
+
+/* Parse a string of hex into a net address and length */
+bool
+netaddr_parse(const char *str, char *addr, unsigned int *len)
+{
+	if (str[0] != '=')
+		return false;
+	str++;
+	int xlen = strlen(str);
+	int retlen = xlen/2;
+	if (xlen != retlen*2)
+		return false;
+	*len = retlen;
+	char *myaddr = addr;
+	const char *strp = str;
+	while (retlen > 0) {
+		char blah[3];
+		unsigned int mybyte;
+		blah[0] = strp[0]; blah[1] = strp[1]; blah[2] = '\0';
+		sscanf(blah, "%x", &mybyte);
+		*myaddr++ = mybyte;
+		strp+= 2;
+		retlen--;
+	}
+	return true;
+}
+
+
+
+#if 0
+/*
+ * Read in a message from a file.  Return malloc'd char block of the whole
+ * thing.
+ */
+char *
+read_msg_text_from_file(char *fname, size_t *lptr)
+{
+	ifstream ifs;
+	size_t length, got;
+	char *mess;
 	int i;
 
 	ifs.open (fname, ios::in | ios::binary | ios::ate);
@@ -2798,16 +5058,18 @@ main(int argc, char **argv)
 	LOG(ALERT) << "smqueue (re)starting";
 	cout << "smqueue logs to syslogd facility LOCAL7, so there's not much to see here" << endl;
 
+	// Before osip allocates anything.
+	if (gConfig.defines("Queue.Arena") ? gConfig.getBool("Queue.Arena") : true)
+		SmqArena::install();
+
 	// Start the reader and writer threads
 	SmqMessageHandler::StartThreads();
 
 	// Start tester threads
 	StartTestThreads();  // Disabled in in function StartTestThreads
 
-	// Don't let thread exit
-	while (!smq.stop_main_loop) {
-		msSleep(2000);
-	}
+	// Don't let thread exit until the reader has cleaned up
+	SmqMessageHandler::WaitForThreads();
 
 	return 0;
 }
@@ -2886,6 +5148,418 @@ ConfigurationKeyMap getConfigurationKeys()
 	map[tmp->getName()] = *tmp;
 	delete tmp;
 
+	tmp = new ConfigurationKey("Queue.Batch.MaxMessages","100",
+		"messages",
+		ConfigurationKey::DEVELOPER,
+		ConfigurationKey::VALRANGE,
+		"1:100000",
+		false,
+		"The most queued messages processed per wakeup of the queue thread before it checks for new work.  "
+		"1 processes one message per wakeup."
+	);
+	map[tmp->getName()] = *tmp;
+	delete tmp;
+
+	tmp = new ConfigurationKey("Queue.Batch.MaxTime","50",
+		"milliseconds",
+		ConfigurationKey::DEVELOPER,
+		ConfigurationKey::VALRANGE,
+		"1:10000",
+		false,
+		"The most time spent processing queued messages per wakeup of the queue thread."
+	);
+	map[tmp->getName()] = *tmp;
+	delete tmp;
+
+	tmp = new ConfigurationKey("Queue.RunToCompletion","1",
+		"",
+		ConfigurationKey::DEVELOPER,
+		ConfigurationKey::BOOLEAN,
+		"",
+		false,
+		"Keep moving a message through its states in one go for as long as the next state is due immediately, "
+		"rather than putting it back in the queue after every step."
+	);
+	map[tmp->getName()] = *tmp;
+	delete tmp;
+
+	tmp = new ConfigurationKey("Queue.Scheduler","wheel",
+		"",
+		ConfigurationKey::DEVELOPER,
+		ConfigurationKey::CHOICE,
+		"wheel,"
+			"list",
+		true,
+		"How the queue finds the next message that is due.  "
+		"The timer wheel reschedules in constant time; the sorted list is the original linear-time algorithm."
+	);
+	map[tmp->getName()] = *tmp;
+	delete tmp;
+
+	tmp = new ConfigurationKey("Queue.Shards","1",
+		"",
+		ConfigurationKey::DEVELOPER,
+		ConfigurationKey::VALRANGE,
+		"1:64",
+		true,
+		"How many parts to split the queue into, each with its own thread.  "
+		"Messages are shared out by destination, so each subscriber's messages are still handled in order.  "
+		"Set to the number of cores to spare for smqueue."
+	);
+	map[tmp->getName()] = *tmp;
+	delete tmp;
+
+	tmp = new ConfigurationKey("Queue.Lookup.Threads","2",
+		"",
+		ConfigurationKey::DEVELOPER,
+		ConfigurationKey::VALRANGE,
+		"1:32",
+		true,
+		"How many threads look up subscribers in the registry for queued messages.  "
+		"Messages wait for an answer without holding up the rest of the queue."
+	);
+	map[tmp->getName()] = *tmp;
+	delete tmp;
+
+	tmp = new ConfigurationKey("Queue.Cache.Size","100000",
+		"entries",
+		ConfigurationKey::DEVELOPER,
+		ConfigurationKey::VALRANGE,
+		"0:10000000",
+		false,
+		"How many subscriber registry answers to keep, so that every retry of every message doesn't ask again.  "
+		"0 turns the cache off."
+	);
+	map[tmp->getName()] = *tmp;
+	delete tmp;
+
+	tmp = new ConfigurationKey("Queue.Cache.TTL","300",
+		"seconds",
+		ConfigurationKey::DEVELOPER,
+		ConfigurationKey::VALRANGE,
+		"1:86400",
+		false,
+		"How long a cached registry answer is used before asking again.  "
+		"A handset's cell is never cached for more than 30 seconds."
+	);
+	map[tmp->getName()] = *tmp;
+	delete tmp;
+
+	tmp = new ConfigurationKey("Queue.Cache.NegativeTTL","30",
+		"seconds",
+		ConfigurationKey::DEVELOPER,
+		ConfigurationKey::VALRANGE,
+		"0:3600",
+		false,
+		"How long a cached \"not in the registry\" answer is used before asking again.  "
+		"0 means these answers aren't cached."
+	);
+	map[tmp->getName()] = *tmp;
+	delete tmp;
+
+	tmp = new ConfigurationKey("Queue.Route.Size","1024",
+		"entries",
+		ConfigurationKey::DEVELOPER,
+		ConfigurationKey::VALRANGE,
+		"0:100000",
+		false,
+		"How many message destinations (host and port) to keep the addresses of, so that delivering a message doesn't look its host up each time.  "
+		"0 turns the cache off."
+	);
+	map[tmp->getName()] = *tmp;
+	delete tmp;
+
+	tmp = new ConfigurationKey("Queue.Route.TTL","60",
+		"seconds",
+		ConfigurationKey::DEVELOPER,
+		ConfigurationKey::VALRANGE,
+		"1:86400",
+		false,
+		"How long a destination's address is used before looking it up again."
+	);
+	map[tmp->getName()] = *tmp;
+	delete tmp;
+
+	tmp = new ConfigurationKey("Queue.Route.NegativeTTL","5",
+		"seconds",
+		ConfigurationKey::DEVELOPER,
+		ConfigurationKey::VALRANGE,
+		"0:3600",
+		false,
+		"How long a destination that can't be looked up is remembered before trying again.  "
+		"0 means it is tried every time."
+	);
+	map[tmp->getName()] = *tmp;
+	delete tmp;
+
+	tmp = new ConfigurationKey("Queue.Route.Connect","0",
+		"",
+		ConfigurationKey::DEVELOPER,
+		ConfigurationKey::BOOLEAN,
+		"",
+		false,
+		"Send to each destination on a UDP socket of its own, connected to it, so the kernel doesn't look up its route for every message.  "
+		"Responses still come back to SIP.myPort."
+	);
+	map[tmp->getName()] = *tmp;
+	delete tmp;
+
+	tmp = new ConfigurationKey("Queue.Transaction.TimerJ","32000",
+		"milliseconds",
+		ConfigurationKey::DEVELOPER,
+		ConfigurationKey::VALRANGE,
+		"0:300000",
+		false,
+		"How long to remember a request after answering it (RFC 3261 timer J), "
+		"so a copy the sender retransmits is answered again instead of being queued twice.  "
+		"0 turns this off."
+	);
+	map[tmp->getName()] = *tmp;
+	delete tmp;
+
+	tmp = new ConfigurationKey("Queue.Transaction.T1","500",
+		"milliseconds",
+		ConfigurationKey::DEVELOPER,
+		ConfigurationKey::VALRANGE,
+		"50:10000",
+		false,
+		"Round trip time estimate (RFC 3261 T1).  A message we deliver is sent again after T1, then 2*T1, and so on, "
+		"until it is answered."
+	);
+	map[tmp->getName()] = *tmp;
+	delete tmp;
+
+	tmp = new ConfigurationKey("Queue.Transaction.T2","4000",
+		"milliseconds",
+		ConfigurationKey::DEVELOPER,
+		ConfigurationKey::VALRANGE,
+		"100:60000",
+		false,
+		"Longest wait between sends of a message we deliver (RFC 3261 T2)."
+	);
+	map[tmp->getName()] = *tmp;
+	delete tmp;
+
+	tmp = new ConfigurationKey("Queue.Transaction.TimerF","32000",
+		"milliseconds",
+		ConfigurationKey::DEVELOPER,
+		ConfigurationKey::VALRANGE,
+		"0:300000",
+		false,
+		"How long to keep sending a message we deliver before the attempt has failed (RFC 3261 timer F).  "
+		"0 sends it once and waits, as smqueue used to."
+	);
+	map[tmp->getName()] = *tmp;
+	delete tmp;
+
+	tmp = new ConfigurationKey("Queue.Handoff","ring",
+		"",
+		ConfigurationKey::DEVELOPER,
+		ConfigurationKey::CHOICE,
+		"ring,"
+			"mqueue",
+		true,
+		"How smqueue's threads pass messages to each other.  "
+		"The ring stays in memory and doesn't block until 4096 messages are waiting; "
+		"mqueue is the original POSIX message queue, which blocks at 100."
+	);
+	map[tmp->getName()] = *tmp;
+	delete tmp;
+
+	tmp = new ConfigurationKey("Queue.IO.Batch","32",
+		"datagrams",
+		ConfigurationKey::DEVELOPER,
+		ConfigurationKey::VALRANGE,
+		"1:256",
+		true,
+		"How many datagrams to read with one system call when several are waiting.  "
+		"Acks and deliveries made while handling them are sent together too."
+	);
+	map[tmp->getName()] = *tmp;
+	delete tmp;
+
+	tmp = new ConfigurationKey("Queue.IO.GSO","1",
+		"",
+		ConfigurationKey::DEVELOPER,
+		ConfigurationKey::BOOLEAN,
+		"",
+		true,
+		"Send runs of same-sized datagrams to one address as one UDP_SEGMENT send, which the kernel splits up.  "
+		"Turned off automatically if the kernel doesn't support it."
+	);
+	map[tmp->getName()] = *tmp;
+	delete tmp;
+
+	tmp = new ConfigurationKey("Queue.IO.Receivers","1",
+		"",
+		ConfigurationKey::DEVELOPER,
+		ConfigurationKey::VALRANGE,
+		"1:32",
+		true,
+		"How many sockets to open on SIP.myPort with SO_REUSEPORT, each with its own thread receiving and parsing messages.  "
+		"More than one spreads the work of taking in bursts of messages across cores."
+	);
+	map[tmp->getName()] = *tmp;
+	delete tmp;
+
+	tmp = new ConfigurationKey("Queue.IO.Steering","1",
+		"",
+		ConfigurationKey::DEVELOPER,
+		ConfigurationKey::BOOLEAN,
+		"",
+		true,
+		"With several receivers, pick the receiver by a hash of the sender's IP address, "
+		"so that each BTS's messages are taken in by one thread, in order.  "
+		"Otherwise the kernel picks by address and port."
+	);
+	map[tmp->getName()] = *tmp;
+	delete tmp;
+
+	tmp = new ConfigurationKey("Queue.Checkpoint.Format","binary",
+		"",
+		ConfigurationKey::DEVELOPER,
+		ConfigurationKey::CHOICE,
+		"binary,"
+			"text",
+		true,
+		"How the queue is written to the save file.  "
+		"A binary save file is read back at startup without parsing the messages, which are parsed as they come due.  "
+		"Either kind is read."
+	);
+	map[tmp->getName()] = *tmp;
+	delete tmp;
+
+	tmp = new ConfigurationKey("Queue.Recovery.Threads","4",
+		"",
+		ConfigurationKey::DEVELOPER,
+		ConfigurationKey::VALRANGE,
+		"1:32",
+		true,
+		"How many threads parse and check the messages read back from the save file and journal at startup.  "
+		"New messages are taken in while that goes on."
+	);
+	map[tmp->getName()] = *tmp;
+	delete tmp;
+
+	tmp = new ConfigurationKey("Queue.Journal","1",
+		"",
+		ConfigurationKey::DEVELOPER,
+		ConfigurationKey::BOOLEAN,
+		"",
+		true,
+		"Append every change to the queue to a journal next to the save file, written out every Queue.Journal.SyncMs, "
+		"so that a restart loses nothing that was queued before then.  "
+		"Otherwise the queue is only saved once a minute."
+	);
+	map[tmp->getName()] = *tmp;
+	delete tmp;
+
+	tmp = new ConfigurationKey("Queue.Journal.SyncMs","10",
+		"milliseconds",
+		ConfigurationKey::DEVELOPER,
+		ConfigurationKey::VALRANGE,
+		"0:1000",
+		true,
+		"How long journal records gather before they are written out and synced to disk together.  "
+		"0 syncs as soon as anything is waiting."
+	);
+	map[tmp->getName()] = *tmp;
+	delete tmp;
+
+	tmp = new ConfigurationKey("Queue.Journal.SyncAcks","0",
+		"",
+		ConfigurationKey::DEVELOPER,
+		ConfigurationKey::BOOLEAN,
+		"",
+		true,
+		"Send 202 Queued only once the message is in the journal on disk.  "
+		"Adds up to Queue.Journal.SyncMs and a disk sync to each ack."
+	);
+	map[tmp->getName()] = *tmp;
+	delete tmp;
+
+	tmp = new ConfigurationKey("Queue.Journal.CompactBytes","4194304",
+		"bytes",
+		ConfigurationKey::DEVELOPER,
+		ConfigurationKey::VALRANGE,
+		"65536:1073741824",
+		false,
+		"Once the journal has grown by this much, the queue is saved to the save file and the old journal removed."
+	);
+	map[tmp->getName()] = *tmp;
+	delete tmp;
+
+	tmp = new ConfigurationKey("Queue.Memory.Budget","0",
+		"bytes",
+		ConfigurationKey::DEVELOPER,
+		ConfigurationKey::VALRANGE,
+		"0:17179869184",
+		false,
+		"About how much memory the queued messages may take; 0 for no limit.  Over it, the text of messages "
+			"that won't be retried for a while is moved to files beside the save file, and read back shortly "
+			"before they're due."
+	);
+	map[tmp->getName()] = *tmp;
+	delete tmp;
+
+	tmp = new ConfigurationKey("Queue.Memory.SpillAfterMs","60000",
+		"milliseconds",
+		ConfigurationKey::DEVELOPER,
+		ConfigurationKey::VALRANGE,
+		"1000:86400000",
+		false,
+		"With Queue.Memory.Budget, only messages that won't be due for at least this long are moved out of memory."
+	);
+	map[tmp->getName()] = *tmp;
+	delete tmp;
+
+	tmp = new ConfigurationKey("Queue.Memory.PrefetchMs","2000",
+		"milliseconds",
+		ConfigurationKey::DEVELOPER,
+		ConfigurationKey::VALRANGE,
+		"0:60000",
+		false,
+		"How long before it's due a message moved out of memory is read back in."
+	);
+	map[tmp->getName()] = *tmp;
+	delete tmp;
+
+	tmp = new ConfigurationKey("Queue.Memory.ParseBudget","0",
+		"bytes",
+		ConfigurationKey::DEVELOPER,
+		ConfigurationKey::VALRANGE,
+		"0:17179869184",
+		false,
+		"About how much memory the parsed forms of queued messages may take; 0 for no limit.  Over it, "
+			"messages that won't be due for Queue.Memory.ParseIdleMs are kept only as text, least recently "
+			"used first, and parsed again when they're next needed."
+	);
+	map[tmp->getName()] = *tmp;
+	delete tmp;
+
+	tmp = new ConfigurationKey("Queue.Memory.ParseIdleMs","10000",
+		"milliseconds",
+		ConfigurationKey::DEVELOPER,
+		ConfigurationKey::VALRANGE,
+		"1000:86400000",
+		false,
+		"With Queue.Memory.ParseBudget, only messages that won't be due for at least this long are unparsed."
+	);
+	map[tmp->getName()] = *tmp;
+	delete tmp;
+
+	tmp = new ConfigurationKey("Queue.Arena","1",
+		"",
+		ConfigurationKey::DEVELOPER,
+		ConfigurationKey::BOOLEAN,
+		"",
+		true,
+		"Parse each message into an arena of its own, which is freed all at once, "
+		"instead of making and freeing each part of the parse with malloc."
+	);
+	map[tmp->getName()] = *tmp;
+	delete tmp;
+
 	tmp = new ConfigurationKey("savefile","/tmp/save",
 		"",
 		ConfigurationKey::CUSTOMER,
@@ -30,17 +30,34 @@
 #include <stdlib.h>			/* for osipparser2 */
 #include <sys/time.h>			/* for osip_init */
 #include <osip2/osip.h>			/* for osip_init */
+#include <stdint.h>
+#include <pthread.h>
 #include <list>
 #include <map>
+#include <vector>
+#include <tr1/unordered_map>
 #include <string>
 #include <iostream>
 #include <stdio.h>
 
 #include "smnet.h"			// My network support
+#include "SmqScheduler.h"		// Which message is due next
+#include "SmqLookup.h"			// Registry lookups off the queue
+#include "SmqTransaction.h"		// Retransmitted requests
+#include "SmqSipView.h"			// Looking at text without osip
+#include "SmqSipTemplate.h"		// Making text without osip
+#include "SmqArena.h"			// Where parse trees go
+#include "SmqJournal.h"			// Queue changes on disk
+#include "SmqCheckpoint.h"		// The queue on disk
+#include "SmqSnapshot.h"			// Copies of the queue
+#include "SmqSpill.h"			// Messages out of memory
+#include "SmqReactor.h"			// What threads sleep on
+#include "SmqMpscQueue.h"		// Shard inboxes
 #include <SubscriberRegistry.h>			// My home location register
 
 #include <Logger.h>
 void ProcessReceivedMsg();
+void WakeWriterThread();
 
 // That's awful OSIP has a CR define.
 // It clashes with our innocent L2Address::CR().
@@ -112,7 +129,9 @@ extern struct osip *osipptr;
 /* In-memory object representing a Short Message.  These are kept as
    text strings (as we received them) and only parsed when we need to
    process them.  This keeps memory usage way down for medium to long
-   term storage in the queue.  */
+   term storage in the queue.  (Once parsed, a message stays parsed
+   unless Queue.Memory.ParseBudget says otherwise; see SMq::
+   balance_memory.)  */
 class short_msg {
   public:
 
@@ -125,6 +144,9 @@ class short_msg {
 	/* First just the text string.   A SIP message including body. */
 	unsigned short text_length;
 	char *text /* [text_length] */;  // C++ doesn't make it simple
+	/* Times the text has been remade or edited since it was made,
+	   so a copy of it can be told to be stale.  */
+	unsigned text_edits;
 
 	/* Now a flag for whether it's been parsed, and a parsed copy. */
 	bool parsed_is_valid;
@@ -132,6 +154,19 @@ class short_msg {
 	   copy is no longer valid, this will be true.  */
 	bool parsed_is_better;
 	osip_message_t *parsed;
+	/* Where parse() put the tree, and whether all of it is still
+	   there: if so it's freed with the arena, without walking it.  */
+	SmqArena *arena;
+	bool parsed_in_arena;
+	/* If the text is in the spill store instead (see SmqSpill.h),
+	   its key there; 0 if not.  parse() and make_text_valid() page
+	   it back in.  */
+	uint64_t spill_key;
+	static SmqSpillStore *spill_store;
+	/* Unparsed by SMq::balance_memory to stay within the parse
+	   budget; the next parse() counts in reparses.  */
+	bool parse_evicted;
+	static unsigned long reparses;
 	// from;
 	// to;
 	// time_t date;
@@ -156,9 +191,14 @@ class short_msg {
 	short_msg () :
 		text_length (0),
 		text (NULL),
+		text_edits (0),
 		parsed_is_valid (false),
 		parsed_is_better (false),
 		parsed (NULL),
+		arena (NULL),
+		parsed_in_arena (false),
+		spill_key (0),
+		parse_evicted (false),
 		content_type(UNSUPPORTED_CONTENT),
 		convert_content_type(UNSUPPORTED_CONTENT),
 		rp_data(NULL),
@@ -173,9 +213,14 @@ class short_msg {
   	short_msg (int len, char * const cstr, bool use_my_memory) :
 		text_length (len),
 		text (cstr),
+		text_edits (0),
 		parsed_is_valid (false),
 		parsed_is_better (false),
 		parsed (NULL),
+		arena (NULL),
+		parsed_in_arena (false),
+		spill_key (0),
+		parse_evicted (false),
 		content_type(UNSUPPORTED_CONTENT),
 		convert_content_type(UNSUPPORTED_CONTENT),
 		rp_data(NULL),
@@ -200,9 +245,14 @@ class short_msg {
   	short_msg (const short_msg &sm) :
 		text_length (sm.text_length),
 		text (0),
+		text_edits (0),
 		parsed_is_valid (false),
 		parsed_is_better (false),
 		parsed (NULL),
+		arena (NULL),
+		parsed_in_arena (false),
+		spill_key (0),
+		parse_evicted (false),
 		content_type(UNSUPPORTED_CONTENT),
 		convert_content_type(UNSUPPORTED_CONTENT),
 		rp_data(NULL),
@@ -211,7 +261,13 @@ class short_msg {
 		need_repack(true),
 		from_relay(sm.from_relay)
 	{
-		if (text_length) {
+		std::string spilled;
+		if (sm.spill_key && spill_store && spill_store->get(sm.spill_key, spilled)) {
+			text_length = spilled.size();
+			text = new char [text_length+1];
+			memcpy(text, spilled.data(), text_length);
+			text[text_length] = '\0';
+		} else if (text_length) {
 			text = new char [text_length+1];
 			strncpy(text, sm.text, text_length);
 			text[text_length] = '\0';
@@ -222,9 +278,14 @@ class short_msg {
 	short_msg (std::string str) :
 		text_length (str.length()),
 		text (0),
+		text_edits (0),
 		parsed_is_valid (false),
 		parsed_is_better (false),
 		parsed (NULL),
+		arena (NULL),
+		parsed_in_arena (false),
+		spill_key (0),
+		parse_evicted (false),
 		content_type(UNSUPPORTED_CONTENT),
 		convert_content_type(UNSUPPORTED_CONTENT),
 		rp_data(NULL),
@@ -246,11 +307,12 @@ class short_msg {
 	/* Destructor */
 	virtual ~short_msg ()
 	{
-		if (parsed)
-			osip_message_free(parsed);
+		free_parsed();
 		delete [] text;
 		delete rp_data;
 		delete tl_message;
+		if (spill_key && spill_store)
+			spill_store->release(spill_key);
 	}
 
 	// Pseudo-constructor due to inability to run constructors on
@@ -283,11 +345,24 @@ class short_msg {
 	 * 	False if failed
 	*/
 	bool parse() {
+		if (parsed_is_valid)
+			return true;
+		bool ok = parse_text();
+		memory_changed();
+		return ok;
+	}
+
+	/* Called when the text or parse tree is made, remade or freed,
+	   for whoever keeps count of them (short_msg_pending does).  */
+	virtual void memory_changed() {}
+
+	private:
+	bool parse_text() {
 		int i;
 		osip_message_t *sip;
 
-		if (parsed_is_valid)
-			return true;
+		if (spill_key && !page_in())
+			return false;
 
 		if (!osip_initialized) {
 			//LOG(DEBUG) << "Calling osip_init";
@@ -301,24 +376,41 @@ class short_msg {
 			
 		unparse();	// Free any previous one.
 
-		// Parse SIP message
-		//LOG(DEBUG) << "Calling osip_message_init";
-		i = osip_message_init(&sip);
-		if (i != 0)  {
-			LOG(DEBUG) << "osip_message_init failed error " << i;
-			return false;
-		}
+		// Parse SIP message, into an arena of its own if we can.
+		if (SmqArena::installed() && !arena)
+			arena = SmqArena::get();
+		{
+			SmqArenaScope scope(arena);
 
-		//LOG(DEBUG) << "Calling osip_message_parse";
-		i = osip_message_parse(sip, text, text_length);
-		if (i != 0) {
-			LOG(DEBUG) << "osip_message_parse failed error " << i;
-			return false;
+			//LOG(DEBUG) << "Calling osip_message_init";
+			i = osip_message_init(&sip);
+			if (i != 0)  {
+				LOG(DEBUG) << "osip_message_init failed error " << i;
+				return false;
+			}
+
+			//LOG(DEBUG) << "Calling osip_message_parse";
+			i = osip_message_parse(sip, text, text_length);
+			if (i != 0) {
+				LOG(DEBUG) << "osip_message_parse failed error " << i;
+				if (arena) {
+					// All of it is in the arena.
+					SmqArena::put(arena);
+					arena = NULL;
+				} else
+					osip_message_free(sip);
+				return false;
+			}
 		}
 
 		parsed = sip;
+		parsed_in_arena = (arena != NULL);
 		parsed_is_valid = true;
 		parsed_is_better = false;
+		if (parse_evicted) {
+			parse_evicted = false;
+			__sync_fetch_and_add(&reparses, 1);
+		}
 
 		// Now parse SMS if needed
 		if (parsed->content_type == NULL)
@@ -346,17 +438,27 @@ class short_msg {
 			// Unfortunately this SIP library does not have any obvious way to get that information out, so just
 			// grunge though the text of the SIP message.  This sucks.
 			string encoding = "hex";	// (pat) Use hex if other encoding not explicitly specified for backward compatibility.
-			static const char *cteHeader = "\r\nContent-Transfer-Encoding";
-			char *contentTransferEncoding = strcasestr(this->text,cteHeader);
-			if (contentTransferEncoding) {
-				char *cp = contentTransferEncoding + strlen(cteHeader);
-				while (isspace(*cp) || *cp == ':') { cp++; }
-				encoding = scanWord(cp);
-			}
+			char *bodyp;
+			SmqSipView view;
+			if (view.scan(text, text_length)) {
+				SmqSipView::span cte = view.header("Content-Transfer-Encoding");
+				if (cte.found())
+					encoding = scanWord(text + cte.off);
+				bodyp = text + view.body().off;
+			} else {
+				static const char *cteHeader = "\r\nContent-Transfer-Encoding";
+				char *contentTransferEncoding = strcasestr(this->text,cteHeader);
+				if (contentTransferEncoding) {
+					char *cp = contentTransferEncoding + strlen(cteHeader);
+					while (isspace(*cp) || *cp == ':') { cp++; }
+					encoding = scanWord(cp);
+				}
 
-			char *endp = strstr(this->text,"\r\n\r\n");	// Find the beginning of the message body.
+				char *endp = strstr(this->text,"\r\n\r\n");	// Find the beginning of the message body.
+				bodyp = endp ? endp + 4 : text + text_length;
+			}
 			int content_len = parsed->content_length && parsed->content_length->value ? atoi(parsed->content_length->value) : 0;
-			rp_data = decodeRPData(endp + 4, content_len, encoding);
+			rp_data = decodeRPData(bodyp, content_len, encoding);
 #else
 				// (pat 10-2014) This is the original code for hex encoded message body.
 				// Decode it RP-DATA
@@ -388,7 +490,8 @@ class short_msg {
 		}
 
 		return true;
-	} // parse
+	} // parse_text
+	public:
 
 	/* Anytime a caller CHANGES the values in the parsed tree of the
 	   message, they MUST call this, to let the caching system
@@ -399,14 +502,41 @@ class short_msg {
 	parsed_was_changed() {
 		//LOG(DEBUG) << "Calling osip_message_force_update";
 		parsed_is_better = true;
+		parsed_in_arena = false;	// Whatever changed is on the heap
 		osip_message_force_update(parsed);   // Tell osip library too
 	}
 
+	/* Parts of the message that parts_were_changed() can fix up. */
+	enum text_part {
+		REQUEST_URI_USER = 1,
+		REQUEST_URI_HOSTPORT = 2,
+		TO_HEADER = 4,
+		CALL_ID = 8
+	};
+
+	/* Instead of parsed_was_changed(), when only the parts (text_part's
+	   or'd together) of the parsed tree were changed: make the same
+	   changes to the text string in place, so it needn't be remade
+	   from the whole tree.  Falls back on parsed_was_changed() if the
+	   text can't be edited.  */
+	void
+	parts_were_changed(unsigned parts) {
+		parsed_in_arena = false;
+		if (!rewrite_text(parts))
+			parsed_was_changed();
+		memory_changed();
+	}
+
+	bool rewrite_text(unsigned parts);
+	bool replace_text(SmqSipView::span where, const std::string &with);
+
 	/* Make the text string valid, if the parsed copy is better.
 	   (It gets "better" by being modified, and parsed_was_changed()
 	   got called, but we deferred fixing up the text string till now.) */
 	void
 	make_text_valid() {
+		if (spill_key)
+			page_in();
 		if (parsed_is_better) {
 			/* Make or remake text string from parsed version. */
 			char *dest = NULL;
@@ -432,6 +562,8 @@ class short_msg {
 			osip_free(dest);
 			parsed_is_valid = true;
 			parsed_is_better = false;
+			text_edits++;
+			memory_changed();
 		}
 		if (text == NULL) {
 			LOG(DEBUG) << "text is null";
@@ -452,13 +584,36 @@ class short_msg {
 		// Now unparse SIP
 		if (parsed_is_better)
 			make_text_valid();
-		if (parsed)
-			osip_message_free(parsed);
-		parsed = NULL;
+		free_parsed();
 		parsed_is_valid = false;
 		parsed_is_better = false;
+		memory_changed();
 	} //unparse
 
+	/* Put the text in the spill store, and free it and everything
+	   made from it.  False if it couldn't be, and nothing's changed.  */
+	bool spill();
+	/* Get the text back from the spill store. */
+	bool page_in();
+
+	/* Free the parse tree and give back its arena.  A tree that's
+	   all in the arena goes with it; one that's been changed has
+	   heap blocks hung on it too, so has to be walked.  */
+	void free_parsed() {
+		if (parsed) {
+			if (parsed_in_arena)
+				SmqArena::walk_skipped();
+			else
+				osip_message_free(parsed);
+		}
+		parsed = NULL;
+		parsed_in_arena = false;
+		if (arena) {
+			SmqArena::put(arena);
+			arena = NULL;
+		}
+	}
+
 
 	// Get text for short message
 	std::string get_text() const
@@ -541,6 +696,8 @@ class short_msg {
 extern /*static*/ int (*timeouts[STATE_MAX_PLUS_ONE])[STATE_MAX_PLUS_ONE];
 
 class SMq;
+class SmqShard;
+struct idle_link;
 
 class short_msg_pending: public short_msg {
 	public:
@@ -548,12 +705,33 @@ class short_msg_pending: public short_msg {
 	time_t next_action_time;	// When to do something different
 	int retries;			// How many times we've retried
 					// this message.
+	time_t txn_start;		// When we first sent it, for the
+					// client transaction timers; 0 if
+					// we aren't waiting for an answer.
+	int txn_sends;			// Times sent in that transaction.
+	bool txn_proceeding;		// Had a 1xx in that transaction.
+	int deliveries;			// Delivery transactions started.
 	char srcaddr[16];		// Source address (ipv4 or 6 or ...)
 	socklen_t srcaddrlen;		// Valid length of src address.
 	char *qtag;			// Tag that identifies this msg
 					// uniquely in the queue.
 					// (It is set 1st time msg is parsed.)
-	int qtaghash;			// Simple hash of the qtag.
+	uint64_t qtaghash;		// 64-bit hash of the qtag.
+	int sched_slot;			// Owned by SMq's scheduler.
+	int shard;			// Which SmqShard it is queued on.
+	uint64_t journal_id;		// Its records in SMq's journal,
+					// or 0 if it has none yet.
+	unsigned journaled_edits;	// text_edits when its text was
+					// last journaled.
+	bool unvalidated;		// Read back from a binary save file,
+					// and not parsed or validated yet.
+	time_t last_used;		// ms, when its state last changed
+	SmqShard *owner;		// Shard counting its memory, if queued
+	idle_link *idle;		// Its place on owner's idle list
+	size_t charged_bytes;		// What it last added to owner's
+	size_t charged_parsed;		// byte counts (SmqShard::account)
+	char *dest_imsi;		// Destination IMSI (digits only) this
+					// msg is indexed under, if any.
 	char *linktag;			// Tag of a message that this message
 					// is related to.  (We use this in
 					// handset register messages, to find
@@ -572,10 +750,25 @@ class short_msg_pending: public short_msg {
 		state (NO_STATE),
 		next_action_time (0),
 		retries (0),
+		txn_start (0),
+		txn_sends (0),
+		txn_proceeding (false),
+		deliveries (0),
 		// srcaddr({0}),  // can't seem to initialize an array?
 		srcaddrlen(0),
 		qtag (NULL),
 		qtaghash (0),
+		sched_slot (-1),
+		shard (0),
+		journal_id (0),
+		journaled_edits (0),
+		unvalidated (false),
+		last_used (0),
+		owner (NULL),
+		idle (NULL),
+		charged_bytes (0),
+		charged_parsed (0),
+		dest_imsi (NULL),
 		linktag (NULL)
 	{ 
 	}
@@ -587,10 +780,25 @@ class short_msg_pending: public short_msg {
 		state (NO_STATE),
 		next_action_time (0),
 		retries (0),
+		txn_start (0),
+		txn_sends (0),
+		txn_proceeding (false),
+		deliveries (0),
 		// srcaddr({0}),  // can't seem to initialize an array?
 		srcaddrlen(0),
 		qtag (NULL),
 		qtaghash (0),
+		sched_slot (-1),
+		shard (0),
+		journal_id (0),
+		journaled_edits (0),
+		unvalidated (false),
+		last_used (0),
+		owner (NULL),
+		idle (NULL),
+		charged_bytes (0),
+		charged_parsed (0),
+		dest_imsi (NULL),
 		linktag (NULL)
 	{
 	}
@@ -601,10 +809,25 @@ class short_msg_pending: public short_msg {
 		state (NO_STATE),
 		next_action_time (0),
 		retries (0),
+		txn_start (0),
+		txn_sends (0),
+		txn_proceeding (false),
+		deliveries (0),
 		// srcaddr({0}),  // can't seem to initialize an array?
 		srcaddrlen(0),
 		qtag (NULL),
 		qtaghash (0),
+		sched_slot (-1),
+		shard (0),
+		journal_id (0),
+		journaled_edits (0),
+		unvalidated (false),
+		last_used (0),
+		owner (NULL),
+		idle (NULL),
+		charged_bytes (0),
+		charged_parsed (0),
+		dest_imsi (NULL),
 		linktag (NULL)
 	{
 	}
@@ -622,10 +845,25 @@ class short_msg_pending: public short_msg {
 		state (smp.state),
 		next_action_time (smp.next_action_time),
 		retries (smp.retries),
+		txn_start (smp.txn_start),
+		txn_sends (smp.txn_sends),
+		txn_proceeding (smp.txn_proceeding),
+		deliveries (0),
 		// srcaddr({0}),  // can't seem to initialize an array?
 		srcaddrlen(smp.srcaddrlen),
 		qtag (NULL),
 		qtaghash (smp.qtaghash),
+		sched_slot (-1),
+		shard (0),
+		journal_id (0),
+		journaled_edits (0),
+		unvalidated (false),
+		last_used (0),
+		owner (NULL),
+		idle (NULL),
+		charged_bytes (0),
+		charged_parsed (0),
+		dest_imsi (NULL),
 		linktag (NULL)
 	{
 		if (smp.srcaddrlen) {
@@ -660,7 +898,9 @@ class short_msg_pending: public short_msg {
 	/* Destructor */
 	virtual ~short_msg_pending () {
 		delete [] qtag;
+		delete [] dest_imsi;
 		delete [] linktag;
+		delete idle;
 	}
 
 	/* Methods */
@@ -692,10 +932,25 @@ class short_msg_pending: public short_msg {
 		state (NO_STATE),
 		next_action_time (0),
 		retries (0),
+		txn_start (0),
+		txn_sends (0),
+		txn_proceeding (false),
+		deliveries (0),
 		// srcaddr({0}),  // can't seem to initialize an array?
 		srcaddrlen(0),
 		qtag (NULL),
 		qtaghash (0),
+		sched_slot (-1),
+		shard (0),
+		journal_id (0),
+		journaled_edits (0),
+		unvalidated (false),
+		last_used (0),
+		owner (NULL),
+		idle (NULL),
+		charged_bytes (0),
+		charged_parsed (0),
+		dest_imsi (NULL),
 		linktag (NULL)
 	{
 	}
@@ -714,7 +969,8 @@ class short_msg_pending: public short_msg {
 	/* Reset the message's state and timeout.  Timeout is set based
 	   on the current state and the new state.  */
 	void set_state(enum sm_state newstate) {
-		next_action_time = msgettime() +
+		last_used = msgettime();
+		next_action_time = last_used +
 			(*SMqueue::timeouts[state])[newstate];
 		LOG(DEBUG) << "Set state Current: " << sm_state_string(state) << " Newstate: " << sm_state_string(newstate)
 				<< " Timeout value " << *SMqueue::timeouts[state][newstate];
@@ -725,6 +981,7 @@ class short_msg_pending: public short_msg {
 
 	/* Reset the message's state and timeout.  Timeout is argument.  */
 	void set_state(enum sm_state newstate, time_t timeout) {
+		last_used = msgettime();
 		next_action_time = timeout;
 		state = newstate;
 		/* If we're in a queue, some code in another class is now going
@@ -736,6 +993,26 @@ class short_msg_pending: public short_msg {
 	   SIP response error code (e.g. 405).  */
 	int validate_short_msg(SMq *manager, bool should_early_check);
 
+	/* About how many bytes of memory the message takes up, and how
+	   many of those are its parse tree and decoded TPDU.  */
+	size_t footprint() const;
+	size_t parsed_bytes() const;
+
+	/* Tell the owner when those change.  */
+	virtual void memory_changed();
+
+	/* Waiting, for a retry or for the answer to a MESSAGE we sent,
+	   with its text in memory: what SMq::balance_memory may unparse
+	   or spill.  */
+	bool retrying() const {
+		return state == AWAITING_TRY_DESTINATION_IMSI
+			|| state == AWAITING_TRY_DESTINATION_SIPURL
+			|| state == AWAITING_TRY_MSG_DELIVERY;
+	}
+	bool is_idle() const {
+		return !spill_key && (retrying() || state == ASKED_FOR_MSG_DELIVERY);
+	}
+
 	// Set the qtag and qtaghash from the parsed fields.
 	// Whenever we change any of these fields, we have to recalculate
 	// the qtag.  
@@ -745,20 +1022,178 @@ class short_msg_pending: public short_msg {
 	// Result is 0 for success, or 3-digit integer error code if error.
 	int set_qtag();
 
-	// Hash the tag to an int, for speedier searching.
-	int taghash_of(const char *tag);
+	// Hash a tag, for indexing the queue by qtag.
+	static uint64_t taghash_of(const char *tag);
 
 	/* Check host and port for validity.  */
 	bool
 	check_host_port(char *host, char *port);
 
-	/* Generate a billing record. */
-	void write_cdr(SubscriberRegistry& hlr) const;
+	/* Generate a billing record (on a lookup thread). */
+	void write_cdr(SmqLookup &lookups) const;
 
 };
 
 typedef std::list<short_msg_pending> short_msg_p_list;
 
+/* A message's link on its shard's idle list (SmqShard::idle_head). */
+struct idle_link {
+	short_msg_p_list::iterator msg;
+	idle_link *prev;
+	idle_link *next;
+	bool linked;
+
+	idle_link(short_msg_p_list::iterator m) :
+		msg(m), prev(NULL), next(NULL), linked(false) {}
+};
+
+/* Orders the queued messages by next_action_time. */
+typedef SmqScheduler<short_msg_p_list::iterator> short_msg_scheduler;
+
+/* Finds queued messages by the hash of their qtag.  Several messages
+   can share a qtag (a response and the message it answers, for one). */
+typedef std::tr1::unordered_multimap<uint64_t, short_msg_p_list::iterator> qtag_index_map;
+
+/* Finds queued MT messages by the IMSI they are going to. */
+typedef std::tr1::unordered_multimap<std::string, short_msg_p_list::iterator> imsi_index_map;
+
+/* Counters for process_timeout's batches. */
+struct batch_counters {
+	unsigned long batches;		// Wakeups that found work due
+	unsigned long messages;		// Messages processed in them
+	unsigned long budget_hits;	// Batches cut short by the budget
+	unsigned long largest;		// Most messages in one batch
+	time_t busy_ms;			// Time spent in batches
+
+	batch_counters() : batches(0), messages(0), budget_hits(0),
+		largest(0), busy_ms(0) {}
+};
+
+/* A response to one of a shard's messages, taken in without queueing
+   it (see SMq::take_response).  */
+struct posted_response {
+	std::string qtag;
+	int status;
+	std::string reason;
+};
+
+/*
+ * One partition of the queue.  SMq::shard_for() decides which shard a
+ * message lives on, mostly by its destination, and it stays there until
+ * it leaves the queue, or its destination turns out to be an IMSI that
+ * belongs on another shard (SMq::move_home).  Each shard has its own lock, scheduler and worker
+ * thread, so messages for different subscribers are processed in parallel
+ * while each subscriber's messages are still handled one at a time.
+ *
+ * A thread that holds one shard's lock must not take another's; to give
+ * a message to another shard it posts it to that shard's inbox instead.
+ * The inbox is an SmqMpscQueue of posted_work, so posting takes no lock
+ * and no syscall unless the worker is asleep.  If it fills up, posts go
+ * to an overflow list under a lock till the worker has emptied both, so
+ * each poster's work is still taken in the order it was posted.
+ */
+class SmqShard {
+	public:
+	int number;
+
+	/* The messages on this shard, their schedule, and the ones that
+	   are headed for an IMSI (see SMq::index_destination).  All
+	   guarded by lock().  */
+	short_msg_p_list message_list;
+	short_msg_scheduler *scheduler;
+	imsi_index_map imsi_index;
+
+	/* The message process_due_message is running, if any. */
+	bool running;
+	bool running_moved;		// set_state was called on it
+	bool running_gone;		// It was taken off the queue
+	short_msg_p_list::iterator running_msg;
+
+	batch_counters batch_stats;
+	time_t next_balance;		// ms, for SMq::balance_memory
+
+	/* What the messages take (short_msg_pending::footprint), and how
+	   much of it, in how many messages, is parse trees; kept up as
+	   they change, so SMq::balance_memory needn't walk the queue.
+	   And the messages it may unparse or spill (is_idle()), least
+	   recently used first.  Guarded by lock().  */
+	size_t bytes_queued;
+	size_t bytes_parsed;
+	unsigned long msgs_parsed;
+	idle_link *idle_head;
+	idle_link *idle_tail;
+
+	/* Start counting a message just put on message_list, stop
+	   counting one that's leaving it, and count one again after it's
+	   changed.  touch() also puts it last on the idle list.  */
+	void adopt(short_msg_p_list::iterator sm);
+	void disown(short_msg_pending *smp);
+	void account(short_msg_pending *smp);
+	void touch(short_msg_pending *smp);
+
+	SmqShard(int n, short_msg_scheduler *sched);
+	~SmqShard();
+
+	void lock() { pthread_mutex_lock(&mutex); }
+	void unlock() { pthread_mutex_unlock(&mutex); }
+
+	/* Hand work to the shard from another thread; the worker picks it
+	   up when it next wakes.  post() empties smp.  */
+	void post(short_msg_p_list &smp);
+	void post_release(const char *imsi);
+	void post_lookup_done(const std::string &qtag);
+	void post_response(const posted_response &response);
+	void take_inbox(short_msg_p_list &msgs, std::vector<std::string> &releases,
+			std::vector<std::string> &lookups,
+			std::vector<posted_response> &responses);
+
+	/* Wake the worker early, or sleep until someone does or the
+	   deadline (msgettime() ms, or SmqReactor::NEVER) passes.  */
+	void wake();
+	void wait_for_work(time_t deadline);
+
+	/* Start the worker thread, and wait for it to finish. */
+	bool start();
+	void join();
+
+	/* The shard whose worker is the calling thread, or NULL. */
+	static SmqShard *current();
+
+	private:
+	pthread_mutex_t mutex;		// Recursive
+	void unlink_idle(idle_link *l);
+	/* One post().  Reused through spare_work.  */
+	struct posted_work {
+		enum { MESSAGES, RELEASE, LOOKUP_DONE, RESPONSE } kind;
+		short_msg_p_list msgs;
+		std::string key;		// IMSI digits, or qtag
+		posted_response response;
+	};
+	const static size_t INBOX_SIZE = 4096;
+
+	void push_work(posted_work *w);
+
+	SmqMpscQueue<posted_work *> inbox;
+	SmqFreeList<posted_work> spare_work;
+	pthread_mutex_t overflowMutex;
+	std::vector<posted_work *> overflow;
+	volatile bool overflowing;	// Posts go to overflow for now
+	volatile int woken;
+	volatile int sleeping;		// Worker is in, or going into, wait()
+	SmqReactor reactor;
+	std::vector<struct epoll_event> no_events;	// Nothing is watched
+	bool started;
+	pthread_t thread;
+
+	static void *worker_thread(void *arg);
+
+	// No copying.
+	SmqShard(const SmqShard &);
+	SmqShard & operator= (const SmqShard &);
+};
+
+typedef std::vector<SmqShard *> shard_vector;
+
 /*
  * Function parameters and return value for short-code "command" functions that
  * process SMS messages internally rather than sending the SMS message
@@ -835,41 +1270,90 @@ class SMq {
 	const static int SMSRATELIMITMS = 1000;
 	const static int LONGDELETMS = 5000000;   // 83 minutes  Used by SC.ZapQueued.Password
 	const static int INCREASEACKEDMSGTMOMS = 60000;  // 5 minutes
+	const static int BATCHMAXMSGS = 100;	// Default per-wakeup budget
+	const static int BATCHMAXMS = 50;	// for process_timeout.
+	const static int RUNMAXSTEPS = 8;	// States per run to completion
+	const static int MAXSHARDS = 64;
+	const static long JOURNALCOMPACTBYTES = 4 << 20;	// Checkpoint after
+	const static int SPILLAFTERMS = 60000;	// Spill if not due for this
+	const static int PREFETCHMS = 2000;	// Page in this long before due
+	const static int PARSEIDLEMS = 10000;	// Unparse if not due for this
 
 	void InitBeforeMainLoop();
 	void CleaupAfterMainreaderLoop();
 	void InitInsideReaderLoop();
 
-	/* A list of all messages we know about, sorted by time of next
-	   action (assuming nothing arrives to change our mind before that
-	   time). */
-	short_msg_p_list time_sorted_list;
+	/* All the messages we know about, split into shards.  Within a
+	   shard the list is in no particular order; the shard's scheduler
+	   keeps track of which message has the earliest next action time
+	   (assuming nothing arrives to change our mind before that time).
+	   Anything that changes a queued message's next_action_time must
+	   go through set_state() below so the scheduler hears about it.  */
+	shard_vector shards;
+
+	/* Every queued message that has a qtag, by qtaghash, whatever its
+	   shard.  Kept up to date by insert_new_message, extract_message
+	   and retag_message.  qtagIndexMutex may be taken while holding a
+	   shard lock, but not the other way round.  */
+	qtag_index_map qtag_index;
+	pthread_mutex_t qtagIndexMutex;
 
 	std::string savefile; //SMq
 	bool please_re_exec;
 
-	pthread_mutexattr_t mutexSLAttr;
-	pthread_mutex_t sortedListMutex;
+	/* Lock the whole queue: every shard, in order.  Only for things
+	   that really need to see all of it (the 411 and zap shortcodes,
+	   saving the queue), and only from a thread holding no shard lock
+	   or shard 0's, which is where shortcodes run.  */
+	void lockSortedList();
+	void unlockSortedList();
 
-	void unlockSortedList() {
-		// LOG(DEBUG) << "UNLOCK";  // debug opnly
-		pthread_mutex_unlock(&sortedListMutex);
-	}
+	/* Split the queue into count shards, each with the named scheduler
+	   ("wheel" or "list").  Must be called while the queue is empty and
+	   before start_shards().  */
+	bool set_shards(int count, const std::string &scheduler);
 
-	void lockSortedList() {
-		// LOG(DEBUG) << "LOCK"; // debug only
-		pthread_mutex_lock(&sortedListMutex);
-	}
+	/* Start, wake, and wait for the shard worker threads. */
+	void start_shards();
+	void wake_shards();
+	void stop_shards();
 
-	/* We may later want other accessors for faster access to various
-	   messages when things DO arrive.  For now, linear search!  */
+	/* Messages queued across all shards.  No lock needed for a
+	   rough count.  */
+	size_t queue_size();
 
 	/* The network sockets that we're using for I/O */
 	SMnet my_network;
 
+	/* More sockets on the same port, and the threads reading them. */
+	std::vector<SMnet *> receivers;
+	std::vector<pthread_t> receiver_threads;
+	static void *receiver_thread(void *arg);
+
 	/* The interface to the Host Location Register for routing
-	   messages and looking up their return and destination addresses.  */
+	   messages and looking up their return and destination addresses.
+	   Queued messages go through lookups instead, which asks it from
+	   other threads; my_hlr is for the shortcodes.  */
 	SubscriberRegistry my_hlr;
+	SmqLookup lookups;
+
+	/* The requests we've answered lately, so that a copy the sender
+	   retransmits gets the same answer and isn't queued again.  */
+	SmqServerTransactions server_txns;
+
+	/* The retransmission timers for the requests we send. */
+	SmqClientTransactions client_txns;
+
+	/* Responses that take_response handed straight to a shard, and
+	   ones whose message wasn't in the queue.  */
+	unsigned long early_responses;
+	unsigned long unmatched_responses;
+
+	/* The responses we send, by status code, and the MESSAGE that
+	   originate_sm sends, as osip would make them.  Compiled once by
+	   compile_sip_templates() before any thread uses them.  */
+	std::map<int, SmqSipTemplate> ack_templates;
+	SmqSipTemplate message_template;
 
 	/* Where to send SMS's that we can't route locally. */
 	std::string global_relay;
@@ -893,8 +1377,20 @@ class SMq {
 	int register_call_seq;
 	bool have_register_call_id;
 
-	/* Set this to true when you want main loop to stop.  */
+	/* How much process_timeout may do in one go before it lets go of
+	   the lock and returns.  From Queue.Batch.*; 1 message gives the
+	   old one-message-per-wakeup behaviour.  */
+	int batch_max_msgs;
+	int batch_max_ms;
+
+	/* Whether process_due_message keeps a message going through its
+	   states while they are due immediately (Queue.RunToCompletion).  */
+	bool run_to_completion;
+
+	/* Set this to true when you want main loop to stop; request_stop()
+	   also wakes the threads that are sleeping.  */
 	bool stop_main_loop;
+	void request_stop();
 
 	/* Set this to true when you want the program to re-exec itself
 	   instead of terminating after the main loop stops.  */
@@ -906,9 +1402,19 @@ class SMq {
 
 	/* Constructor */
 	SMq () : 
-		time_sorted_list (),
+		shards (),
+		qtag_index (),
 		my_network (),
+		receivers (),
+		receiver_threads (),
 		my_hlr(),
+		lookups(),
+		server_txns(),
+		client_txns(),
+		early_responses(0),
+		unmatched_responses(0),
+		ack_templates(),
+		message_template(),
 		global_relay(""),
 		my_ipaddress(""),
 		my_2nd_ipaddress(""),
@@ -917,17 +1423,32 @@ class SMq {
 		register_call_id(""),
 		register_call_seq(0),
 		have_register_call_id(false),
+		batch_max_msgs (BATCHMAXMSGS),
+		batch_max_ms (BATCHMAXMS),
+		run_to_completion (true),
 		stop_main_loop (false),
-		reexec_smqueue (false)
+		reexec_smqueue (false),
+		snapshot_epoch (0),
+		recovery (),
+		first_ack (0),
+		journal (),
+		journal_acks (false),
+		journal_compact_bytes (JOURNALCOMPACTBYTES),
+		journal_next_id (1),
+		binary_checkpoint (true),
+		spill (),
+		memory_budget (0),
+		spill_after_ms (SPILLAFTERMS),
+		prefetch_ms (PREFETCHMS),
+		spill_counts (),
+		parse_budget (0),
+		parse_idle_ms (PARSEIDLEMS),
+		parse_counts ()
 	{
-		// We need recursive attribute set
-		int mStatus;
-		mStatus = pthread_mutexattr_init(&mutexSLAttr);
-		if (mStatus != 0) { LOG(DEBUG) << "Mutex pthread_mutexattr_init error " << mStatus; }
-		pthread_mutexattr_settype(&mutexSLAttr, PTHREAD_MUTEX_RECURSIVE);
-		if (mStatus != 0) { LOG(DEBUG) << "Mutex pthread_mutexattr_settype error " << mStatus; }
-		pthread_mutex_init(&sortedListMutex, &mutexSLAttr);
-		if (mStatus != 0) { LOG(DEBUG) << "Mutex pthread_mutex_init error " << mStatus; }
+		// One shard until InitBeforeMainLoop reads Queue.Shards.
+		shards.push_back(new SmqShard(0,
+			new SmqTimerWheel<short_msg_p_list::iterator>()));
+		pthread_mutex_init(&qtagIndexMutex, NULL);
 
 		my_hlr.init();
 	}
@@ -935,7 +1456,9 @@ class SMq {
 
 	/* Destructor */
 	~SMq() {
-		pthread_mutex_destroy(&sortedListMutex);
+		for (size_t i = 0; i < shards.size(); i++)
+			delete shards[i];
+		pthread_mutex_destroy(&qtagIndexMutex);
 	}
 
 
@@ -981,12 +1504,36 @@ class SMq {
 		my_register_hostport = hp;
 	}
 
-	/* Initialize the listener -- sets up and opens my_network. */
-	bool init_listener (std::string port) {
+	/* Initialize the listener -- sets up and opens my_network.
+	   reuseport lets start_receivers() open more sockets on it.  */
+	bool init_listener (std::string port, bool reuseport = false) {
 		my_udp_port = port;
-		return my_network.listen_on_port (port);
+		return my_network.listen_on_port (port, reuseport);
 	}
 
+	/* Open nreceivers-1 more sockets on my_udp_port, each with a
+	   thread receiving and parsing what arrives on it, alongside the
+	   reader thread on my_network.  steer keeps each BTS on one of
+	   them.  */
+	bool start_receivers(int nreceivers, bool steer);
+	void stop_receivers();
+	void report_io_stats();
+
+	/* Log the server and client transaction counters. */
+	void report_transaction_stats();
+
+	/* Log how parses used their arenas, the parse cache, the spill
+	   store, and the resident size.  */
+	void report_memory_stats();
+
+	/* A new Via branch (RFC 3261 8.1.1.7) for a request we send. */
+	std::string new_branch();
+	/* Make a message we're delivering again a new transaction. */
+	bool new_transaction(short_msg_p_list::iterator qmsg);
+
+	/* Learn ack_templates and message_template from osip. */
+	void compile_sip_templates();
+
 	bool to_is_deliverable(const char *username);
 	bool from_is_deliverable(const char *from);
 
@@ -997,12 +1544,46 @@ class SMq {
 
 	// Main loop listening for dgrams and processing them.
 	void main_loop(int tmo);
+	void receive_on(SMnet &net, int tmo);
+	void handle_datagram(char *buffer, int len, char *addr, socklen_t addrlen);
+	bool absorb_retransmission(const std::string &txnkey, char *addr, socklen_t addrlen);
+	bool take_response(const SmqSipView &view);
+
+	/* The body of a shard's worker thread. */
+	void run_shard(SmqShard *sh);
+
+	/* Queue what other threads have posted to a shard. */
+	void adopt_inbox(SmqShard *sh);
+
+	/* Called by the lookup threads when a lookup that the message
+	   with this qtag was waiting for has finished.  */
+	void lookup_done(int shard, const std::string &qtag);
+
+	/* Look key up for qmsg.  Result is false if qmsg has to wait
+	   (in an ASKED_FOR_* state) for the lookup threads; else result
+	   is set to a malloc'd answer, or NULL if there isn't one.  */
+	bool hlr_lookup(SmqLookup::Kind kind, const char *key,
+			short_msg_pending *qmsg, char *&result, int maxAgeMs = -1);
 
-	/* If nothing happens for a while, handle that.  */
-	void process_timeout();
+	/* If nothing happens for a while, handle that: process every
+	   message on the shard that has come due, within the batch budget.
+	   Result is true if the budget ran out with messages still due.  */
+	bool process_timeout(SmqShard *sh);
 
-	/* Send a SIP response to acknowledge reciept of a short msg. */
-	void respond_sip_ack(int errcode, short_msg_pending *smp, char *netaddr, size_t netaddrlen);
+	/* Process the single message on the shard that is most due, if
+	   any.  Result is false if nothing was due.  */
+	bool process_due_message(SmqShard *sh, time_t now);
+
+	/* Move a message on from its current state. */
+	void run_state_machine(short_msg_p_list::iterator qmsg);
+
+	/* Log the batch counters. */
+	void report_batch_stats();
+
+	/* Send a SIP response to acknowledge reciept of a short msg.
+	   If sent isn't NULL, the response's text is left in it.  */
+	void respond_sip_ack(int errcode, short_msg_pending *smp, char *netaddr, size_t netaddrlen,
+			     std::string *sent = NULL);
 
 	/*
 	 * Originate a short message
@@ -1072,10 +1653,16 @@ class SMq {
 	void
 	handle_response(short_msg_p_list::iterator qmsg);
 
-	/* Search the message queue to find a message whose tag matches.  */
+	/* The part of that which applies the response's status to the
+	   message it answers, whether or not the response was queued.  */
+	bool
+	apply_response(SmqShard *sh, const char *qtag, uint64_t taghash,
+		       int status, const char *reason);
+
+	/* Find a queued message whose tag matches, via the qtag index.  */
 	bool
 	find_queued_msg_by_tag(short_msg_p_list::iterator &mymsg,
-				    const char *tag, int taghash);
+				    const char *tag, uint64_t taghash);
 	/* Same, but without a known taghash. */
 	bool
 	find_queued_msg_by_tag(short_msg_p_list::iterator &mymsg,
@@ -1090,7 +1677,7 @@ class SMq {
 	 * recipient's location again) will use a new one.
 	 */
 	enum sm_state
-	lookup_uri_hostport (short_msg_pending *qmsg);
+	lookup_uri_hostport (short_msg_p_list::iterator qmsg);
 
 	/* 
 	 * Change the From address username to a valid phone number in format:
@@ -1109,42 +1696,117 @@ class SMq {
 	// entry itself off the original list (which can then be discarded).
 	// Push_front only does a copy so use splice ??
 	void insert_new_message(short_msg_p_list &smp) {
-		lockSortedList();
-		time_sorted_list.splice (time_sorted_list.begin(), smp);
-		time_sorted_list.begin()->set_state (INITIAL_STATE);  // Note set state can move the entries in the queue
-		// time_sorted_list.begin()->timeout = 0;  // it is already
-		// Low timeout will cause this msg to be at front of queue.
-		unlockSortedList();
-		debug_dump(); //svgfix
-		ProcessReceivedMsg();
+		smp.begin()->set_state (INITIAL_STATE);
+		enqueue_message(smp);
 	}
 
 	// This version lets the initial state be set.
 	void insert_new_message(short_msg_p_list &smp, enum sm_state s) {
 		LOG(DEBUG) << "Insert message into queue 2";
-		lockSortedList();
-		time_sorted_list.splice (time_sorted_list.begin(), smp);
-		time_sorted_list.begin()->set_state (s);
-		// time_sorted_list.begin()->timeout = 0;  // it is already
-		// Low timeout will cause this msg to be at front of queue.
-		unlockSortedList();
-		debug_dump(); //svgfix
-		ProcessReceivedMsg();
+		smp.begin()->set_state (s);
+		enqueue_message(smp);
 	}
 	// This version lets the state and timeout be set.
 	void insert_new_message(short_msg_p_list &smp, enum sm_state s, time_t t) {
 		LOG(DEBUG) << "Insert message into queue 3";
-		lockSortedList();
-		time_sorted_list.splice (time_sorted_list.begin(), smp);
-		time_sorted_list.begin()->set_state (s, t);
-		unlockSortedList();
-		debug_dump(); //svgfix
-		ProcessReceivedMsg();
+		smp.begin()->set_state (s, t);
+		enqueue_message(smp);
+	}
+
+	// Which shard a new message belongs on.  Responses and messages
+	// linked to another go where that message is; shortcodes go to
+	// shard 0; anything else by the hash of its destination.
+	int shard_for(short_msg_pending *smp);
+
+	// Which shard has the message with this qtag, or -1.
+	int shard_of_tag(const char *tag, uint64_t taghash);
+
+	// Take a message off the queue (and out of the scheduler and
+	// indexes), moving it onto the front of "dest".  The caller
+	// usually lets dest go out of scope to delete it.
+	void extract_message(short_msg_p_list::iterator sm, short_msg_p_list &dest) {
+		SmqShard *sh = shards[sm->shard];
+		sh->lock();
+		if (sh->running && sm == sh->running_msg)
+			sh->running_gone = true;
+		if (sm->journal_id)
+			journal.remove(sm->journal_id);
+		sh->scheduler->remove(sm);
+		unindex_qtag(sm);
+		unindex_destination(sh, sm);
+		sh->disown(&*sm);
+		dest.splice(dest.begin(), sh->message_list, sm);
+		sh->unlock();
 	}
 
-	/* Debug dump of the queue and the SMq class in general. */
+	// Recalculate the qtag of a queued message (after changing its
+	// Call-ID, say), keeping the qtag index straight.
+	void retag_message(short_msg_p_list::iterator sm);
+
+	// (Re)file a queued message in its shard's imsi_index, after its
+	// destination has been looked up.  Only messages headed for an
+	// IMSI are kept.
+	void index_destination(short_msg_p_list::iterator sm);
+
+	// We just heard from this handset (it took a message, or sent us
+	// one), so stop waiting and retry everything queued for it, on
+	// whichever shards it is.
+	void release_messages_for(const char *imsi);
+
+	private:
+	// Put a new message (the only one on smp) on its shard: directly
+	// if we can take the shard's lock, else via the shard's inbox.
+	void enqueue_message(short_msg_p_list &smp);
+	// Once a message's destination has resolved to an IMSI, move it
+	// to that IMSI's shard if it isn't there already.  Caller holds
+	// sh's lock.
+	void move_home(SmqShard *sh, short_msg_p_list::iterator sm);
+	// Tell the scheduler and indexes about a message just put on
+	// sh->message_list.  Caller holds the shard lock.
+	void index_new_message(SmqShard *sh, short_msg_p_list::iterator sm) {
+		sh->adopt(sm);
+		sh->scheduler->insert(sm);
+		index_qtag(sm);
+		index_destination(sm);
+	}
+	// Tell the scheduler a message's time changed, unless it's the
+	// one process_due_message is running, which does it at the end.
+	void requeue(SmqShard *sh, short_msg_p_list::iterator sm) {
+		if (sh->running && sm == sh->running_msg)
+			sh->running_moved = true;
+		else if (sm->spill_key)
+			sh->scheduler->rescheduleAt(sm, prefetch_time(sm));
+		else
+			sh->scheduler->reschedule(sm);
+		// With the whole queue locked, another shard's worker may be
+		// asleep until a later deadline than this.
+		if (sh != SmqShard::current())
+			sh->wake();
+	}
+	// Retry the messages on one shard for an IMSI (digits only).
+	int release_in_shard(SmqShard *sh, const char *digits);
+	void index_qtag(short_msg_p_list::iterator sm);
+	void unindex_qtag(short_msg_p_list::iterator sm);
+	// Journal a message that changed state, unless it's the one
+	// process_due_message is running, which does it at the end.
+	void journal_state(SmqShard *sh, short_msg_p_list::iterator sm,
+			   enum sm_state oldstate) {
+		if (sm->state != oldstate && !(sh->running && sm == sh->running_msg))
+			journal_message(&*sm);
+	}
+	void unindex_destination(SmqShard *sh, short_msg_p_list::iterator sm);
+	public:
+
+	/* Debug dump of the queue and the SMq class in general.  Only
+	   done when asked for (SC.DebugDump.Code).  */
 	void debug_dump();
 
+	/* Copy the queue into snap, with the messages' strings if
+	   withText; see SmqSnapshot.h.  Locks each shard in turn, so
+	   of the shard workers only shard 0's may call it.  */
+	void snapshot(SmqSnapshot &snap, bool withText);
+	uint64_t snapshot_epoch;
+
 	// Set the linktag of "newmsg" to point to oldmsg.
 	void set_linktag(short_msg_p_list::iterator newmsg,
 			 short_msg_p_list::iterator oldmsg);
@@ -1154,72 +1816,164 @@ class SMq {
 		      short_msg_p_list::iterator qmsg);
 
 	/*
- 	 * When we reset the state and timestamp of a message,
-	 * we need to reinsert it into the queue.  C++ doesn't seem
-	 * to have a standard container that lets one do this cleanly.
-	 * Even with lists it's a kludge -- we have to do our own search.
-	 * With multisets you can't splice an element out while keeping the
-	 * element... etc.
+	 * When we reset the state and timestamp of a message,
+	 * the scheduler has to move it.
 	 */
 	void set_state(short_msg_p_list::iterator sm, enum sm_state newstate) {
-		short_msg_p_list temp;
-		lockSortedList();
-		/* Extract the current sm from the time_sorted_list */
-		temp.splice(temp.begin(), time_sorted_list, sm);
+		SmqShard *sh = shards[sm->shard];
+		sh->lock();
+		enum sm_state oldstate = sm->state;
 		sm->set_state(newstate);
-		// Insert it according to the new timestamp.
-		// One would think that "multisets" could do this simply,
-		// but they don't appear to have this capability.
-		// Note: if list is empty, or all are too early, insert at end.
-		for (short_msg_p_list::iterator x = time_sorted_list.begin(); 
-		     true; x++) {
-			if (x == time_sorted_list.end() 
-			    || x->next_action_time >= sm->next_action_time) {
-				time_sorted_list.splice(x, temp);
-				break;
-			}
-		}
-		unlockSortedList();
+		sh->touch(&*sm);
+		requeue(sh, sm);
+		journal_state(sh, sm, oldstate);
+		sh->unlock();
 	} // set_state
 
-	/*
- 	 * When we reset the state and timestamp of a message,
-	 * we need to reinsert it into the queue.  C++ doesn't seem
-	 * to have a standard container that lets one do this cleanly.
-	 * Even with lists it's a kludge -- we have to do our own search.
-	 * With multisets you can't splice an element out while keeping the
-	 * element... etc.
-	 */
 	void set_state(short_msg_p_list::iterator sm, enum sm_state newstate, time_t timestamp) {
-		lockSortedList();
-		short_msg_p_list temp;
-		/* Extract the current sm from the time_sorted_list */
-		temp.splice(temp.begin(), time_sorted_list, sm);
+		SmqShard *sh = shards[sm->shard];
+		sh->lock();
+		enum sm_state oldstate = sm->state;
 		sm->set_state(newstate, timestamp);
-		// Insert it according to the new timestamp.
-		// One would think that "multisets" could do this simply,
-		// but they don't appear to have this capability.
-		// Note: if list is empty, or all are too early, insert at end.
-		for (short_msg_p_list::iterator x = time_sorted_list.begin(); 
-		     true; x++) {
-			if (x == time_sorted_list.end() 
-			    || x->next_action_time >= sm->next_action_time) {
-				time_sorted_list.splice(x, temp);
-				break;
-			}
-		}
-		unlockSortedList();
+		sh->touch(&*sm);
+		requeue(sh, sm);
+		journal_state(sh, sm, oldstate);
+		sh->unlock();
 	} // set_state
 
 	/* Save the queue to a file; read it back from a file.
 	   Reading a queue file doesn't delete things that might already
  	   be in the queue; if you want a clean queue, delete anything
-	   already in the queue first.  */
+	   already in the queue first.  Reading also replays the journal
+	   segments that go with the file.  A journalSegment says which
+	   segment is the first not in the saved queue.
+	   read_queue_from_file only reads the messages back, into
+	   recovery; recover_queue() puts them on the queue.  */
 	bool
-	save_queue_to_file(std::string qfile);
+	save_queue_to_file(std::string qfile, unsigned journalSegment = 0);
 	bool
 	read_queue_from_file(std::string qfile);
 
+	/*
+	 * Putting the messages read back on the queue, at startup.  A
+	 * pool of Queue.Recovery.Threads threads parses and validates
+	 * them, a chunk at a time; then they're queued one by one, in
+	 * id order, which builds the schedulers and indexes.  It all
+	 * happens on a thread of its own, started once the shards and
+	 * receivers are, so new messages are taken in meanwhile.
+	 * Nothing is checkpointed till it's done: till then, the save
+	 * file and journal segments we read are all there is of the
+	 * messages not yet queued.
+	 */
+	struct Recovery {
+		std::vector<SmqJournal::record> records;	// In id order
+		std::vector<short_msg_p_list *> ready;	// NULL if no good
+		SmqCheckpoint saved;		// If the save file was binary
+		size_t fromFile;		// Records that weren't in the journal
+		size_t next;			// The next record for a worker
+		int threads;			// Including recover_queue's own
+		pthread_t thread;
+		bool joinable;
+		volatile bool running;		// Till it's checkpointed
+		time_t started;			// ms, when we began reading
+
+		Recovery() : records(), ready(), saved(), fromFile(0), next(0),
+			threads(1), thread(), joinable(false), running(false), started(0) {}
+	};
+	Recovery recovery;
+	volatile time_t first_ack;	// ms, when the first 202 went
+
+	void start_recovery(int nthreads);
+	void recover_queue();		// Run by start_recovery's thread
+	void recovery_worker();		// Run by recover_queue's threads
+	void finish_recovery();		// Wait for it to be done
+	void note_first_ack();
+
+	/* Every change to a queued message, on disk.  With journal_acks,
+	   a 202 isn't sent till its message's PUT record is durable.  */
+	SmqJournal journal;
+	bool journal_acks;
+	long journal_compact_bytes;
+	uint64_t journal_next_id;	// After the ones read back
+
+	/* Append a PUT record for a message (giving it an id if it
+	   hasn't one), if the journal is open.  */
+	uint64_t journal_message(short_msg_pending *smp);
+
+	/* Save the queue to the save file and drop the journal segments
+	   it covers, or just save it if there's no journal.  */
+	bool checkpoint_queue();
+	void report_journal_stats();
+
+	/* Write save files in the binary format (Queue.Checkpoint.Format). */
+	bool binary_checkpoint;
+
+	/*
+	 * Keeping the queue within Queue.Memory.Budget bytes (0: no
+	 * limit).  Each shard gets an equal share.  When a shard's
+	 * messages take more than that, balance_memory spills the text of
+	 * the least recently used of those waiting out a retry for at
+	 * least spill_after_ms to the spill store, and drops their parse.  They're rescheduled prefetch_ms early, so that
+	 * process_due_message pages them back in before they're due.
+	 * Anything else that wants a spilled message's text gets it paged
+	 * in on the spot (short_msg::page_in).
+	 */
+	SmqSpillStore spill;
+	long memory_budget;
+	int spill_after_ms;
+	int prefetch_ms;
+	struct spill_counters {
+		unsigned long spilled;
+		unsigned long prefetched;	// Paged in ahead of time
+		unsigned long late;		// Paged in when already due
+
+		spill_counters() : spilled(0), prefetched(0), late(0) {}
+	};
+	spill_counters spill_counts;
+
+	/* Keeping the parse trees of the queue within Queue.Memory.
+	   ParseBudget bytes (0: no limit), again shared equally by the
+	   shards.  Over it, balance_memory unparses the messages that
+	   won't be due for at least parse_idle_ms, least recently used
+	   first: ones waiting out a retry, or for the answer to a MESSAGE
+	   we sent.  They're parsed again when they're next wanted.  */
+	long parse_budget;
+	int parse_idle_ms;
+	struct parse_counters {
+		unsigned long evicted;
+		unsigned long hits;		// Due, and still parsed
+		unsigned long misses;		// Due, and had to be parsed
+
+		parse_counters() : evicted(0), hits(0), misses(0) {}
+	};
+	parse_counters parse_counts;
+
+	/* Called by the shard's worker, about once a second, for both
+	   budgets.  Goes by the shard's running byte counts, and down its
+	   idle list only as far as it has to.  */
+	void balance_memory(SmqShard *sh);
+	time_t prefetch_time(short_msg_p_list::iterator sm) const {
+		return sm->next_action_time - prefetch_ms;
+	}
+
+	private:
+	bool read_checkpoint(const std::string &qfile, SmqJournal::record_map &msgs,
+			     unsigned &firstSegment, SmqCheckpoint &saved);
+	/* Make a message read back from a text save file or the journal,
+	   parsed and validated; NULL if it's no good.  Then queue it.  */
+	short_msg_p_list *prepare_message(const SmqJournal::record &r);
+	void queue_restored(short_msg_p_list &smpl, const SmqJournal::record &r);
+	bool save_binary(const SmqSnapshot &snap, const std::string &qfile, unsigned journalSegment);
+	/* Make a message straight from a binary save file's index (NULL
+	   if its strings are damaged), then queue it.  */
+	short_msg_p_list *prepare_saved(const SmqCheckpoint &saved, const SmqCheckpoint::entry &e);
+	void queue_saved(short_msg_p_list &smpl, const SmqCheckpoint &saved,
+			 const SmqCheckpoint::entry &e);
+	public:
+	/* Parse and validate a message restored by restore_saved, now
+	   that it's due.  False if it's no good.  Shard lock held.  */
+	bool validate_restored(short_msg_p_list::iterator sm);
+
 
 }; // SMq class
 } // namespace SMqueue
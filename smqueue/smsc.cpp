@@ -134,7 +134,7 @@ short_code_action sendSIP_init(const char *imsi, const TLSubmit& submit,
 	set_to_for_smsc(address, scp->scp_qmsg_it);
 
 	// Let them know that parsed part has been changed.
-	scp->scp_qmsg_it->parsed_was_changed();
+	scp->scp_qmsg_it->parts_were_changed(short_msg::REQUEST_URI_USER);
 
 	/*if (ISLOGGING(DEBUG)) {
 		// Call make_text_valid() is needed for debug only.
@@ -169,7 +169,7 @@ short_code_action sendSIP_init_text(const char *imsi,
 	set_to_for_smsc(address, scp->scp_qmsg_it);
 
 	// Let them know that parsed part has been changed.
-	scp->scp_qmsg_it->parsed_was_changed();
+	scp->scp_qmsg_it->parts_were_changed(short_msg::REQUEST_URI_USER);
 
 	/*if (ISLOGGING(DEBUG)) {
 		// Call make_text_valid() is needed for debug only.
@@ -282,7 +282,7 @@ void set_to_for_smsc(const char *address, short_msg_p_list::iterator &smsg)
 	strcpy(omsg->to->displayname, omsg->req_uri->username);
 
 	// Let them know that parsed part has been changed.
-	smsg->parsed_was_changed();
+	smsg->parts_were_changed(short_msg::TO_HEADER);
 }
 
 //@}
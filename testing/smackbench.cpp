@@ -0,0 +1,222 @@
+/*
+* Copyright 2014 Range Networks, Inc.
+*
+* This software is distributed under the terms of the GNU Affero Public License.
+* See the COPYING file in the main directory for details.
+*
+* This use of this software may be subject to additional restrictions.
+* See the LEGAL file in the main directory for details.
+
+        This program is free software: you can redistribute it and/or modify
+        it under the terms of the GNU Affero General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        This program is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU Affero General Public License for more details.
+
+        You should have received a copy of the GNU Affero General Public License
+        along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+ * smackbench -- what it costs smqueue to make the 202 it answers each
+ * MESSAGE with.
+ *
+ * "osip" is how respond_sip_ack used to do it: a new osip message, the
+ * request's Via, From, To, Call-ID and CSeq cloned into it, and the
+ * whole thing serialized.  "template" is SmqSipTemplate: the same
+ * headers serialized one at a time, spliced into text learned from
+ * osip.  The two must come out byte for byte the same.
+ * Results are in responses per second, and ns per response.
+ *
+ * Usage: smackbench [iterations]
+ */
+
+#include <SmqSipTemplate.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <string>
+#include <vector>
+
+#include <osipparser2/osip_parser.h>
+
+using namespace SMqueue;
+
+enum { ACK_VIAS, ACK_FROM, ACK_TO, ACK_CALL_ID, ACK_CSEQ, ACK_SLOTS };
+
+static const char *sampleA =
+	"MESSAGE sip:smqtoa@smqhosta.example SIP/2.0\r\n"
+	"Via: SIP/2.0/UDP smqviaa.example:5555;branch=z9hG4bKsmqa\r\n"
+	"From: smqfroma <sip:smqfroma@smqhosta.example>;tag=smqtaga\r\n"
+	"To: <sip:smqtoa@smqhosta.example>\r\n"
+	"Call-ID: smqcalla@smqhosta.example\r\n"
+	"CSeq: 7 MESSAGE\r\n"
+	"Content-Length: 0\r\n"
+	"\r\n";
+
+static const char *sampleB =
+	"MESSAGE sip:smqtobbbb@smqhostbbbb.example.net SIP/2.0\r\n"
+	"Via: SIP/2.0/UDP smqviabbbb.example.net:15555;branch=z9hG4bKsmqbbbbbbbb\r\n"
+	"Via: SIP/2.0/UDP smqviacccc.example.net:16666;branch=z9hG4bKsmqcccccccc\r\n"
+	"From: \"smq from\" <sip:smqfrombbbb@smqhostbbbb.example.net>;tag=smqtagbbbb\r\n"
+	"To: smqtobbbb <sip:smqtobbbb@smqhostbbbb.example.net>\r\n"
+	"Call-ID: smqcallbbbb\r\n"
+	"CSeq: 65535 MESSAGE\r\n"
+	"Content-Length: 0\r\n"
+	"\r\n";
+
+/* A MESSAGE as a BTS sends it. */
+static const char *benchMessage =
+	"MESSAGE sip:smsc@127.0.0.1:5063 SIP/2.0\r\n"
+	"Via: SIP/2.0/UDP 127.0.0.1:5062;branch=z9hG4bK1234567890abcdef\r\n"
+	"Max-Forwards: 70\r\n"
+	"From: IMSI001010000000001 <sip:IMSI001010000000001@127.0.0.1>;tag=3141592653\r\n"
+	"To: smsc <sip:smsc@127.0.0.1>\r\n"
+	"Call-ID: 1234567890@127.0.0.1\r\n"
+	"CSeq: 1 MESSAGE\r\n"
+	"Content-Type: application/vnd.3gpp.sms\r\n"
+	"Content-Transfer-Encoding: base64\r\n"
+	"Content-Length: 34\r\n"
+	"\r\n"
+	"AAMNAAuRIVNVVQAAAAnIMpqNBpnQZRw=\r\n";
+
+static double nowNs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static osip_message_t *parse(const char *text)
+{
+	osip_message_t *sip;
+	osip_message_init(&sip);
+	if (osip_message_parse(sip, text, strlen(text)) != 0) {
+		fprintf(stderr, "osip can't parse:\n%s", text);
+		exit(1);
+	}
+	return sip;
+}
+
+static int viaClone(void *via, void **dest)
+{
+	return osip_via_clone((const osip_via_t *) via, (osip_via_t **) dest);
+}
+
+/* As smqueue's osip_ack, for a 202. */
+static std::string osipAck(osip_message_t *request)
+{
+	osip_message_t *response;
+	osip_message_init(&response);
+	osip_to_clone(request->to, &response->to);
+	osip_from_clone(request->from, &response->from);
+	osip_cseq_clone(request->cseq, &response->cseq);
+	osip_call_id_clone(request->call_id, &response->call_id);
+	osip_list_clone(&request->vias, &response->vias, &viaClone);
+	osip_message_set_status_code(response, 202);
+	osip_message_set_reason_phrase(response, osip_strdup("Queued"));
+	osip_message_force_update(response);
+
+	char *dest = NULL;
+	size_t length = 0;
+	osip_message_to_str(response, &dest, &length);
+	std::string text(dest, length);
+	osip_free(dest);
+	osip_message_free(response);
+	return text;
+}
+
+static void take(int err, char **str, std::string &dest)
+{
+	if (err != 0 || !*str) {
+		fprintf(stderr, "osip can't write a header\n");
+		exit(1);
+	}
+	dest = *str;
+	osip_free(*str);
+}
+
+/* As smqueue's ack_values. */
+static void ackValues(osip_message_t *request, std::string *values)
+{
+	char *str = NULL;
+	values[ACK_VIAS].clear();
+	for (int i = 0; i < osip_list_size(&request->vias); i++) {
+		std::string via;
+		take(osip_via_to_str((osip_via_t *) osip_list_get(&request->vias, i), &str), &str, via);
+		if (i)
+			values[ACK_VIAS] += "\r\nVia: ";
+		values[ACK_VIAS] += via;
+	}
+	take(osip_from_to_str(request->from, &str), &str, values[ACK_FROM]);
+	take(osip_to_to_str(request->to, &str), &str, values[ACK_TO]);
+	take(osip_call_id_to_str(request->call_id, &str), &str, values[ACK_CALL_ID]);
+	take(osip_cseq_to_str(request->cseq, &str), &str, values[ACK_CSEQ]);
+}
+
+static void compile(SmqSipTemplate &tmpl, const char *sample)
+{
+	osip_message_t *request = parse(sample);
+	std::string values[ACK_SLOTS];
+	ackValues(request, values);
+	std::string ack = osipAck(request);
+	if (!tmpl.compile(ack.data(), ack.size(),
+			  std::vector<std::string>(values, values + ACK_SLOTS))) {
+		fprintf(stderr, "can't compile a template from:\n%s", ack.c_str());
+		exit(1);
+	}
+	osip_message_free(request);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long n = argc > 1 ? strtoul(argv[1], NULL, 10) : 200000;
+
+	parser_init();
+
+	SmqSipTemplate tmpl, other;
+	compile(tmpl, sampleA);
+	compile(other, sampleB);
+	if (!tmpl.same_as(other)) {
+		fprintf(stderr, "the two samples give different templates\n");
+		return 1;
+	}
+
+	osip_message_t *request = parse(benchMessage);
+	SmqSipBuffer out;
+	std::string values[ACK_SLOTS];
+	ackValues(request, values);
+	tmpl.expand(values, out);
+	std::string expected = osipAck(request);
+	if (expected != std::string(out.data(), out.size())) {
+		fprintf(stderr, "osip made:\n%s\nthe template made:\n%.*s\n",
+			expected.c_str(), (int) out.size(), out.data());
+		return 1;
+	}
+
+	double start = nowNs();
+	for (unsigned long i = 0; i < n; i++)
+		osipAck(request);
+	double osipNs = (nowNs() - start) / n;
+
+	start = nowNs();
+	for (unsigned long i = 0; i < n; i++) {
+		ackValues(request, values);
+		tmpl.expand(values, out);
+	}
+	double tmplNs = (nowNs() - start) / n;
+
+	osip_message_free(request);
+
+	printf("%9s %14s %10s\n", "", "acks/s", "ns/ack");
+	printf("%9s %14.0f %10.0f\n", "osip", 1e9 / osipNs, osipNs);
+	printf("%9s %14.0f %10.0f\n", "template", 1e9 / tmplNs, tmplNs);
+	return 0;
+}
@@ -0,0 +1,193 @@
+/*
+* Copyright 2014 Range Networks, Inc.
+*
+* This software is distributed under the terms of the GNU Affero Public License.
+* See the COPYING file in the main directory for details.
+*
+* This use of this software may be subject to additional restrictions.
+* See the LEGAL file in the main directory for details.
+
+        This program is free software: you can redistribute it and/or modify
+        it under the terms of the GNU Affero General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        This program is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU Affero General Public License for more details.
+
+        You should have received a copy of the GNU Affero General Public License
+        along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+ * smhandoffbench -- compare the ways smqueue's threads pass messages.
+ *
+ * One to eight producer threads each send a fixed number of pointers to
+ * one consumer thread, first through a POSIX message queue set up the
+ * way SmqMessageHandler sets it up (a new'ed message per send, as
+ * smqueue used to do), then through SmqMpscQueue with pooled messages.
+ * Results are in messages per second.
+ *
+ * Usage: smhandoffbench [messages-per-producer]
+ */
+
+#include <SmqMpscQueue.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <mqueue.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+using namespace SMqueue;
+
+/* Stand-in for a QueuedMsgHdrs. */
+struct BenchMsg {
+	int producer;
+	unsigned long seq;
+	BenchMsg() : producer(0), seq(0) {}
+};
+
+static unsigned long perProducer;
+static mqd_t benchMq;
+static SmqMpscQueue<BenchMsg*> *benchRing;
+static SmqFreeList<BenchMsg> *benchPool;
+static const char *benchMqName = "/SmqHandoffBench";
+
+static double nowNs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void *mqProducer(void *arg)
+{
+	for (unsigned long i = 0; i < perProducer; i++) {
+		BenchMsg *msg = new BenchMsg();
+		msg->producer = (int)(long) arg;
+		msg->seq = i;
+		while (mq_send(benchMq, (char *) &msg, sizeof(msg), 0) != 0 && errno == EINTR)
+			;
+	}
+	return NULL;
+}
+
+static void *ringProducer(void *arg)
+{
+	for (unsigned long i = 0; i < perProducer; i++) {
+		BenchMsg *msg = benchPool->get();
+		msg->producer = (int)(long) arg;
+		msg->seq = i;
+		benchRing->push(msg);
+	}
+	return NULL;
+}
+
+static double runMqueue(int producers)
+{
+	struct mq_attr attr;
+	attr.mq_flags = 0;
+	attr.mq_maxmsg = 100;		// MQ_MAX_NUM_OF_MESSAGES
+	attr.mq_msgsize = 1100;		// MQ_MESSAGE_MAX_SIZE
+	attr.mq_curmsgs = 0;
+	mq_unlink(benchMqName);
+	benchMq = mq_open(benchMqName, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR, &attr);
+	if (benchMq == (mqd_t) -1) {
+		// Usually /proc/sys/fs/mqueue/msg_max is below 100.
+		attr.mq_maxmsg = 10;
+		benchMq = mq_open(benchMqName, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR, &attr);
+		if (benchMq == (mqd_t) -1) {
+			perror("mq_open");
+			return 0;
+		}
+	}
+
+	pthread_t threads[64];
+	unsigned long total = perProducer * producers;
+	char buf[1100 + 10];
+	double start = nowNs();
+	for (int i = 0; i < producers; i++)
+		pthread_create(&threads[i], NULL, mqProducer, (void *)(long) i);
+	for (unsigned long got = 0; got < total; ) {
+		unsigned prio;
+		struct timespec abs;
+		clock_gettime(CLOCK_REALTIME, &abs);
+		abs.tv_nsec += 200 * 1000000;
+		if (abs.tv_nsec >= 1000000000) {
+			abs.tv_sec++;
+			abs.tv_nsec -= 1000000000;
+		}
+		if (mq_timedreceive(benchMq, buf, sizeof(buf), &prio, &abs) > 0) {
+			BenchMsg *msg;
+			memcpy(&msg, buf, sizeof(msg));
+			delete msg;
+			got++;
+		}
+	}
+	double secs = (nowNs() - start) / 1e9;
+	for (int i = 0; i < producers; i++)
+		pthread_join(threads[i], NULL);
+	mq_close(benchMq);
+	mq_unlink(benchMqName);
+	return total / secs;
+}
+
+static double runRing(int producers, unsigned long &fullWaits)
+{
+	benchRing = new SmqMpscQueue<BenchMsg*>(4096);	// RING_NUM_OF_MESSAGES
+	benchPool = new SmqFreeList<BenchMsg>();
+
+	pthread_t threads[64];
+	unsigned long total = perProducer * producers;
+	std::vector<unsigned long> next(producers, 0);
+	double start = nowNs();
+	for (int i = 0; i < producers; i++)
+		pthread_create(&threads[i], NULL, ringProducer, (void *)(long) i);
+	for (unsigned long got = 0; got < total; ) {
+		BenchMsg *msg;
+		if (!benchRing->pop(msg)) {
+			benchRing->wait(200);
+			continue;
+		}
+		// Each producer's messages must come out in order.
+		if (msg->seq != next[msg->producer]++) {
+			fprintf(stderr, "producer %d: got %lu, expected %lu\n",
+				msg->producer, msg->seq, next[msg->producer] - 1);
+			exit(1);
+		}
+		benchPool->put(msg);
+		got++;
+	}
+	double secs = (nowNs() - start) / 1e9;
+	for (int i = 0; i < producers; i++)
+		pthread_join(threads[i], NULL);
+	fullWaits = benchRing->full_waits();
+	delete benchRing;
+	delete benchPool;
+	return total / secs;
+}
+
+int main(int argc, char **argv)
+{
+	perProducer = argc > 1 ? strtoul(argv[1], NULL, 10) : 200000;
+
+	printf("%9s %14s %14s %12s\n", "producers", "mqueue msg/s",
+		"ring msg/s", "ring full");
+	for (int producers = 1; producers <= 8; producers *= 2) {
+		unsigned long fullWaits = 0;
+		double mq = runMqueue(producers);
+		double ring = runRing(producers, fullWaits);
+		printf("%9d %14.0f %14.0f %12lu\n", producers, mq, ring, fullWaits);
+		fflush(stdout);
+	}
+	return 0;
+}
@@ -0,0 +1,153 @@
+/*
+* Copyright 2014 Range Networks, Inc.
+*
+* This software is distributed under the terms of the GNU Affero Public License.
+* See the COPYING file in the main directory for details.
+*
+* This use of this software may be subject to additional restrictions.
+* See the LEGAL file in the main directory for details.
+
+        This program is free software: you can redistribute it and/or modify
+        it under the terms of the GNU Affero General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        This program is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU Affero General Public License for more details.
+
+        You should have received a copy of the GNU Affero General Public License
+        along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+ * smschedbench -- compare the smqueue schedulers.
+ *
+ * For queue sizes from 10^3 to 10^6 messages, fill the queue with timeouts
+ * spread like smqueue's (mostly seconds to minutes, a few up to an hour),
+ * then time rescheduling random messages and draining everything that
+ * comes due.  Results are in nanoseconds per operation.
+ *
+ * Usage: smschedbench [max-queue-size]
+ */
+
+#include <SmqScheduler.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <list>
+#include <vector>
+#include <algorithm>
+
+using namespace SMqueue;
+
+/* Stand-in for short_msg_pending; only the scheduler fields matter. */
+struct BenchMsg {
+	time_t next_action_time;
+	int sched_slot;
+	BenchMsg() : next_action_time(0), sched_slot(-1) {}
+};
+
+typedef std::list<BenchMsg> BenchList;
+typedef BenchList::iterator BenchIter;
+
+static double nowNs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* A timeout like the ones in smqueue's state tables. */
+static time_t randomTimeout()
+{
+	switch (rand() % 10) {
+	case 0:
+		return rand() % 3000000;	// Bounce / resend, up to ~50 min
+	case 1:
+	case 2:
+		return rand() % 60000;		// Acked message resend
+	default:
+		return 1 + rand() % 5000;	// TIMEOUTMS-ish
+	}
+}
+
+static bool laterFirst(const BenchIter &a, const BenchIter &b)
+{
+	return a->next_action_time > b->next_action_time;
+}
+
+static void runOne(SmqScheduler<BenchIter> &sched, size_t size, size_t ops)
+{
+	BenchList msgs;
+	std::vector<BenchIter> index;
+	time_t now = 1400000000000LL;
+
+	srand(1);
+	for (size_t i = 0; i < size; i++) {
+		msgs.push_front(BenchMsg());
+		msgs.begin()->next_action_time = now + randomTimeout();
+		index.push_back(msgs.begin());
+	}
+
+	// Insert latest-first, which is the best case for the sorted list,
+	// so filling a big queue doesn't dominate the run time.
+	std::vector<BenchIter> fill(index);
+	std::sort(fill.begin(), fill.end(), laterFirst);
+	// The wheel starts turning at its first nextDue(); before that it
+	// puts everything in its overflow heap, which isn't what we want
+	// to time.  Nothing is queued yet, so nothing comes out.
+	BenchIter none;
+	sched.nextDue(now, none);
+	double start = nowNs();
+	for (size_t i = 0; i < fill.size(); i++)
+		sched.insert(fill[i]);
+	double fillNs = (nowNs() - start) / size;
+
+	// Reschedule random messages, as the state machine does.
+	start = nowNs();
+	for (size_t i = 0; i < ops; i++) {
+		BenchIter it = index[rand() % size];
+		it->next_action_time = now + randomTimeout();
+		sched.reschedule(it);
+	}
+	double reschedNs = (nowNs() - start) / ops;
+
+	// Advance the clock and handle whatever is due.
+	size_t drained = 0;
+	start = nowNs();
+	while (drained < ops) {
+		BenchIter it;
+		now += 10;
+		while (drained < ops && sched.nextDue(now, it)) {
+			it->next_action_time = now + randomTimeout();
+			sched.reschedule(it);
+			drained++;
+		}
+	}
+	double drainNs = (nowNs() - start) / ops;
+
+	printf("%-6s %8lu %12.0f %12.0f %12.0f\n", sched.name(),
+		(unsigned long)size, fillNs, reschedNs, drainNs);
+	fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+	size_t maxSize = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+
+	printf("%-6s %8s %12s %12s %12s\n", "sched", "queued",
+		"insert ns", "resched ns", "due ns");
+	for (size_t size = 1000; size <= maxSize; size *= 10) {
+		// The sorted list is O(n) per op; keep its run time sane.
+		size_t listOps = size >= 100000 ? 2000 : 20000;
+		SmqListScheduler<BenchIter> list;
+		runOne(list, size, listOps);
+		SmqTimerWheel<BenchIter> wheel;
+		runOne(wheel, size, 200000);
+	}
+	return 0;
+}
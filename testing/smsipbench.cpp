@@ -0,0 +1,187 @@
+/*
+* Copyright 2014 Range Networks, Inc.
+*
+* This software is distributed under the terms of the GNU Affero Public License.
+* See the COPYING file in the main directory for details.
+*
+* This use of this software may be subject to additional restrictions.
+* See the LEGAL file in the main directory for details.
+
+        This program is free software: you can redistribute it and/or modify
+        it under the terms of the GNU Affero General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        This program is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU Affero General Public License for more details.
+
+        You should have received a copy of the GNU Affero General Public License
+        along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+ * smsipbench -- compare osip with SmqSipView on what smqueue does to
+ * each MESSAGE it receives.
+ *
+ * "key" is finding the transaction key of a MESSAGE: osip_message_parse
+ * and SmqServerTransactions' fields, against SmqSipView::scan and
+ * transaction_key.  "rewrite" is changing the Request-URI host and
+ * getting the text to send: osip_message_to_str of the parsed tree,
+ * against editing the text where a view says the host is.
+ * Results are in messages per second.
+ *
+ * Usage: smsipbench [iterations]
+ */
+
+#include <SmqSipView.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <string>
+
+#include <osipparser2/osip_parser.h>
+
+using namespace SMqueue;
+
+static const char *benchMessage =
+	"MESSAGE sip:smsc@127.0.0.1:5063 SIP/2.0\r\n"
+	"Via: SIP/2.0/UDP 127.0.0.1:5062;branch=z9hG4bK1234567890abcdef\r\n"
+	"Max-Forwards: 70\r\n"
+	"From: IMSI001010000000001 <sip:IMSI001010000000001@127.0.0.1>;tag=3141592653\r\n"
+	"To: smsc <sip:smsc@127.0.0.1>\r\n"
+	"Call-ID: 1234567890@127.0.0.1\r\n"
+	"CSeq: 1 MESSAGE\r\n"
+	"Content-Type: application/vnd.3gpp.sms\r\n"
+	"Content-Transfer-Encoding: base64\r\n"
+	"Content-Length: 34\r\n"
+	"\r\n"
+	"AAMNAAuRIVNVVQAAAAnIMpqNBpnQZRw=\r\n";
+
+static double nowNs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* What SmqServerTransactions::key_of makes, without linking it in. */
+static std::string osipKey(osip_message_t *sip)
+{
+	std::string key;
+	osip_via_t *via = (osip_via_t *) osip_list_get(&sip->vias, 0);
+	osip_generic_param_t *branch = NULL;
+	if (via)
+		osip_via_param_get_byname(via, (char *) "branch", &branch);
+	if (branch && branch->gvalue)
+		key += branch->gvalue;
+	key += '|';
+	key += sip->call_id->number;
+	if (sip->call_id->host) {
+		key += '@';
+		key += sip->call_id->host;
+	}
+	key += '|';
+	key += sip->cseq->number;
+	key += ' ';
+	key += sip->cseq->method;
+	key += '|';
+	osip_generic_param_t *tag = NULL;
+	osip_from_get_tag(sip->from, &tag);
+	if (tag && tag->gvalue)
+		key += tag->gvalue;
+	return key;
+}
+
+static double runOsipKey(unsigned long n, size_t len, std::string &key)
+{
+	double start = nowNs();
+	for (unsigned long i = 0; i < n; i++) {
+		osip_message_t *sip;
+		osip_message_init(&sip);
+		if (osip_message_parse(sip, benchMessage, len) != 0) {
+			fprintf(stderr, "osip can't parse the message\n");
+			exit(1);
+		}
+		key = osipKey(sip);
+		osip_message_free(sip);
+	}
+	return n / ((nowNs() - start) / 1e9);
+}
+
+static double runViewKey(unsigned long n, size_t len, std::string &key)
+{
+	double start = nowNs();
+	for (unsigned long i = 0; i < n; i++) {
+		SmqSipView view;
+		if (!view.scan(benchMessage, len)) {
+			fprintf(stderr, "SmqSipView can't scan the message\n");
+			exit(1);
+		}
+		key = view.transaction_key();
+	}
+	return n / ((nowNs() - start) / 1e9);
+}
+
+static double runOsipRewrite(unsigned long n, size_t len)
+{
+	osip_message_t *sip;
+	osip_message_init(&sip);
+	osip_message_parse(sip, benchMessage, len);
+
+	double start = nowNs();
+	for (unsigned long i = 0; i < n; i++) {
+		osip_free(sip->req_uri->host);
+		sip->req_uri->host = osip_strdup(i & 1 ? "192.168.0.1" : "127.0.0.1");
+		osip_message_force_update(sip);
+		char *dest = NULL;
+		size_t length = 0;
+		osip_message_to_str(sip, &dest, &length);
+		osip_free(dest);
+	}
+	double rate = n / ((nowNs() - start) / 1e9);
+	osip_message_free(sip);
+	return rate;
+}
+
+static double runViewRewrite(unsigned long n, size_t len)
+{
+	std::string text(benchMessage, len);
+
+	double start = nowNs();
+	for (unsigned long i = 0; i < n; i++) {
+		SmqSipView view;
+		view.scan(text.data(), text.size());
+		SmqSipView::span hp = view.uri_hostport(view.request_uri());
+		text.replace(hp.off, hp.len, i & 1 ? "192.168.0.1:5063" : "127.0.0.1:5063");
+	}
+	return n / ((nowNs() - start) / 1e9);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long n = argc > 1 ? strtoul(argv[1], NULL, 10) : 200000;
+	size_t len = strlen(benchMessage);
+
+	parser_init();
+
+	std::string osipK, viewK;
+	double osipKeyRate = runOsipKey(n, len, osipK);
+	double viewKeyRate = runViewKey(n, len, viewK);
+	if (osipK != viewK) {
+		fprintf(stderr, "keys differ: osip '%s', view '%s'\n",
+			osipK.c_str(), viewK.c_str());
+		return 1;
+	}
+	double osipRewriteRate = runOsipRewrite(n, len);
+	double viewRewriteRate = runViewRewrite(n, len);
+
+	printf("%8s %14s %14s\n", "", "osip msg/s", "view msg/s");
+	printf("%8s %14.0f %14.0f\n", "key", osipKeyRate, viewKeyRate);
+	printf("%8s %14.0f %14.0f\n", "rewrite", osipRewriteRate, viewRewriteRate);
+	return 0;
+}